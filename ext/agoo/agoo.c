@@ -48,6 +48,8 @@ ragoo_shutdown(VALUE self) {
  *
  * Publish a message on the given subject. A subject is normally a String but
  * Symbols can also be used as can any other object that responds to #to_s.
+ * When the server has forked workers the message is delivered to the
+ * subscribers of every worker.
  */
 VALUE
 ragoo_publish(VALUE self, VALUE subject, VALUE message) {
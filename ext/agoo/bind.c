@@ -1,5 +1,6 @@
 // Copyright (c) 2018, Peter Ohler, All rights reserved.
 
+#include <fcntl.h>
 #include <netdb.h>
 #include <netinet/tcp.h>
 #include <stdlib.h>
@@ -12,6 +13,7 @@
 #include "bind.h"
 #include "debug.h"
 #include "log.h"
+#include "tls.h"
 
 agooBind
 agoo_bind_port(agooErr err, int port) {
@@ -169,10 +171,90 @@ url_named(agooErr err, const char *url) {
     return NULL;
 }
 
+// Sets a file option of a TLS bind from the query part of the URL.
+static int
+ssl_opt(agooErr err, char **fieldp, const char *name, const char *value, int len) {
+    if (0 == len) {
+	return agoo_err_set(err, AGOO_ERR_ARG, "TLS bind %s must not be empty.", name);
+    }
+    AGOO_FREE(*fieldp);
+    if (NULL == (*fieldp = AGOO_MALLOC(len + 1))) {
+	return agoo_err_set(err, AGOO_ERR_MEMORY, "Failed to allocate memory for a TLS bind %s.", name);
+    }
+    memcpy(*fieldp, value, len);
+    (*fieldp)[len] = '\0';
+
+    return AGOO_ERR_OK;
+}
+
+// An https:// or ssl:// URL is the same as an http:// one with the
+// certificate, key and optional client CA files given as query parameters
+// as in https://:443?cert=cert.pem&key=key.pem&ca=ca.pem.
 static agooBind
-url_ssl(agooErr err, const char *url) {
-    // TBD
-    return NULL;
+url_ssl(agooErr err, const char *url, const char *scheme) {
+    const char	*query = index(url, '?');
+    char	addr[256];
+    int		alen = (NULL == query) ? (int)strlen(url) : (int)(query - url);
+    const char	*host;
+    agooBind	b;
+
+    if ((int)sizeof(addr) - 5 <= alen) {
+	agoo_err_set(err, AGOO_ERR_ARG, "%s bind address is not valid, too long. (%s)", scheme, url);
+	return NULL;
+    }
+    memcpy(addr, url, alen);
+    addr[alen] = '\0';
+    // The port defaults to 443 instead of 80.
+    host = ('[' == *addr) ? index(addr, ']') : addr;
+    if (NULL != host && NULL == index(host, ':')) {
+	strcat(addr, ":443");
+    }
+    if ('[' == *addr) {
+	b = url_tcp6(err, addr, scheme);
+    } else {
+	b = url_tcp(err, addr, scheme);
+    }
+    if (NULL == b) {
+	return NULL;
+    }
+    while (NULL != query && '\0' != *query) {
+	const char	*key = query + 1;
+	const char	*eq = index(key, '=');
+	const char	*value;
+	int		klen;
+	int		vlen;
+
+	if (NULL == (query = index(key, '&'))) {
+	    query = key + strlen(key);
+	}
+	if (NULL == eq || query < eq) {
+	    agoo_err_set(err, AGOO_ERR_ARG, "%s bind option is not valid. (%s)", scheme, url);
+	    agoo_bind_destroy(b);
+	    return NULL;
+	}
+	klen = (int)(eq - key);
+	value = eq + 1;
+	vlen = (int)(query - value);
+	if (4 == klen && 0 == strncmp("cert", key, 4)) {
+	    ssl_opt(err, &b->cert, "cert", value, vlen);
+	} else if (3 == klen && 0 == strncmp("key", key, 3)) {
+	    ssl_opt(err, &b->key, "key", value, vlen);
+	} else if (2 == klen && 0 == strncmp("ca", key, 2)) {
+	    ssl_opt(err, &b->ca, "ca", value, vlen);
+	} else {
+	    agoo_err_set(err, AGOO_ERR_ARG, "%s bind option %.*s is not supported. (%s)", scheme, klen, key, url);
+	}
+	if (AGOO_ERR_OK != err->code) {
+	    agoo_bind_destroy(b);
+	    return NULL;
+	}
+    }
+    if (NULL == b->cert) {
+	agoo_err_set(err, AGOO_ERR_ARG, "%s bind requires a cert. (%s)", scheme, url);
+	agoo_bind_destroy(b);
+	return NULL;
+    }
+    return b;
 }
 
 agooBind
@@ -193,10 +275,10 @@ agoo_bind_url(agooErr err, const char *url) {
 	return url_named(err, url + 7);
     }
     if (0 == strncmp("https://", url, 8)) {
-	return url_ssl(err, url + 8);
+	return url_ssl(err, url + 8, "https");
     }
     if (0 == strncmp("ssl://", url, 6)) {
-	return url_ssl(err, url + 6);
+	return url_ssl(err, url + 6, "ssl");
     }
     // All others assume
     {
@@ -219,6 +301,7 @@ agoo_bind_url(agooErr err, const char *url) {
 
 void
 agoo_bind_destroy(agooBind b) {
+    agoo_tls_cleanup(b);
     AGOO_FREE(b->id);
     AGOO_FREE(b->name);
     AGOO_FREE(b->key);
@@ -227,24 +310,28 @@ agoo_bind_destroy(agooBind b) {
     AGOO_FREE(b);
 }
 
+// Opens and binds a TCP socket for the bind address. Returns the socket or -1
+// on error.
 static int
-usual_listen(agooErr err, agooBind b) {
+tcp_socket(agooErr err, agooBind b) {
     int		optval = 1;
-    int	domain = PF_INET;
+    int		domain = PF_INET;
+    int		fd;
 
     if (AF_INET6 == b->family) {
 	domain = PF_INET6;
     }
-    if (0 >= (b->fd = socket(domain, SOCK_STREAM, IPPROTO_TCP))) {
+    if (0 >= (fd = socket(domain, SOCK_STREAM, IPPROTO_TCP))) {
 	agoo_log_cat(&agoo_error_cat, "Server failed to open server socket on port %d. %s.", b->port, strerror(errno));
+	agoo_err_set(err, errno, "Server failed to open server socket. %s.", strerror(errno));
 
-	return agoo_err_set(err, errno, "Server failed to open server socket. %s.", strerror(errno));
+	return -1;
     }
 #ifdef OSX_OS 
-    setsockopt(b->fd, SOL_SOCKET, SO_NOSIGPIPE, &optval, sizeof(optval));
+    setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &optval, sizeof(optval));
 #endif    
-    setsockopt(b->fd, SOL_SOCKET, SO_REUSEPORT, &optval, sizeof(optval));
-    setsockopt(b->fd, IPPROTO_TCP, TCP_NODELAY, &optval, sizeof(optval));
+    setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &optval, sizeof(optval));
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &optval, sizeof(optval));
     if (AF_INET6 == b->family) {
 	struct sockaddr_in6	addr;
 
@@ -253,10 +340,12 @@ usual_listen(agooErr err, agooBind b) {
 	addr.sin6_family = b->family;
 	addr.sin6_addr = b->addr6;
 	addr.sin6_port = htons(b->port);
-	if (0 > bind(b->fd, (struct sockaddr*)&addr, sizeof(addr))) {
+	if (0 > bind(fd, (struct sockaddr*)&addr, sizeof(addr))) {
 	    agoo_log_cat(&agoo_error_cat, "Server failed to bind server socket. %s.", strerror(errno));
+	    agoo_err_set(err, errno, "Server failed to bind server socket. %s.", strerror(errno));
+	    close(fd);
 
-	    return agoo_err_set(err, errno, "Server failed to bind server socket. %s.", strerror(errno));
+	    return -1;
 	}
     } else {
 	struct sockaddr_in	addr;
@@ -265,17 +354,58 @@ usual_listen(agooErr err, agooBind b) {
 	addr.sin_family = b->family;
 	addr.sin_addr = b->addr4;
 	addr.sin_port = htons(b->port);
-	if (0 > bind(b->fd, (struct sockaddr*)&addr, sizeof(addr))) {
+	if (0 > bind(fd, (struct sockaddr*)&addr, sizeof(addr))) {
 	    agoo_log_cat(&agoo_error_cat, "Server failed to bind server socket. %s.", strerror(errno));
+	    agoo_err_set(err, errno, "Server failed to bind server socket. %s.", strerror(errno));
+	    close(fd);
 
-	    return agoo_err_set(err, errno, "Server failed to bind server socket. %s.", strerror(errno));
+	    return -1;
 	}
     }
-    listen(b->fd, 1000);
+    return fd;
+}
 
+static int
+usual_listen(agooErr err, agooBind b) {
+    if (0 > (b->fd = tcp_socket(err, b))) {
+	b->fd = 0;
+	return err->code;
+    }
+    // When each connection loop has its own listener the shared socket only
+    // reserves the port. If it listened it would get a share of the
+    // connections that no one accepts.
+    if (!b->per_loop) {
+	listen(b->fd, 1000);
+    }
     return AGOO_ERR_OK;
 }
 
+// Opens an additional non-blocking listener on the same port as the bind. The
+// kernel spreads connections across all the listeners. If cpu is not
+// negative the listener is preferred for connections that arrive on that
+// CPU. Returns the socket or -1 on error.
+int
+agoo_bind_listen_loop(agooErr err, agooBind b, int cpu) {
+    int	fd;
+
+    if (0 > (fd = tcp_socket(err, b))) {
+	return -1;
+    }
+#ifdef SO_INCOMING_CPU
+    if (0 <= cpu) {
+	setsockopt(fd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, sizeof(cpu));
+    }
+#endif
+    fcntl(fd, F_SETFL, O_NONBLOCK);
+    if (0 > listen(fd, 1000)) {
+	agoo_err_set(err, errno, "Server failed to listen on port %d. %s.", b->port, strerror(errno));
+	close(fd);
+
+	return -1;
+    }
+    return fd;
+}
+
 static int
 named_listen(agooErr err, agooBind b) {
     struct sockaddr_un	addr;
@@ -301,8 +431,10 @@ named_listen(agooErr err, agooBind b) {
 
 static int
 ssl_listen(agooErr err, agooBind b) {
-    // TBD
-    return AGOO_ERR_OK;
+    if (AGOO_ERR_OK != agoo_tls_listen(err, b)) {
+	return err->code;
+    }
+    return usual_listen(err, b);
 }
 
 int
@@ -310,7 +442,7 @@ agoo_bind_listen(agooErr err, agooBind b) {
     if (NULL != b->name) {
 	return named_listen(err, b);
     }
-    if (NULL != b->key) {
+    if (NULL != b->cert) {
 	return ssl_listen(err, b);
     }
     return usual_listen(err, b);
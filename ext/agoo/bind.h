@@ -5,6 +5,7 @@
 
 #include <stdbool.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 
@@ -12,6 +13,8 @@
 #include "kinds.h"
 
 struct _agooCon;
+struct _agooText;
+struct ssl_ctx_st;
 
 typedef struct _agooBind {
     struct _agooBind	*next;
@@ -23,15 +26,25 @@ typedef struct _agooBind {
 	struct in6_addr	addr6;
     };
     agooConKind		kind;
+    bool		per_loop; // each con loop listens on its own socket
     bool		(*read)(struct _agooCon *c);
     bool		(*write)(struct _agooCon *c);
     short		(*events)(struct _agooCon *c);
+    // Completion style I/O, optional. The caller does the recv or send into
+    // or from the connection buffers and then reports the count.
+    bool		(*received)(struct _agooCon *c, ssize_t cnt);
+    struct _agooText	*(*prep)(struct _agooCon *c);
+    // Fills iov with what is ready to write, possibly from several
+    // responses. Returns 0 if prep should be used instead.
+    int			(*gather)(struct _agooCon *c, struct iovec *iov, int max);
+    bool		(*sent)(struct _agooCon *c, ssize_t cnt);
     char		scheme[8];
     char		*name; // if set then Unix file
-    char		*key;  // if set then SSL
-    char		*cert;
-    char		*ca;
+    char		*key;  // key file, the cert file is used if not set
+    char		*cert; // if set then TLS
+    char		*ca;   // client certificates are checked against this if set
     char		*id;
+    struct ssl_ctx_st	*tls;
 } *agooBind;
 
 extern agooBind	agoo_bind_url(agooErr err, const char *url);
@@ -39,6 +52,7 @@ extern agooBind	agoo_bind_port(agooErr err, int port);
 extern void	agoo_bind_destroy(agooBind b);
 
 extern int	agoo_bind_listen(agooErr err, agooBind b);
+extern int	agoo_bind_listen_loop(agooErr err, agooBind b, int cpu);
 extern void	agoo_bind_close(agooBind b);
 
 #endif // AGOO_BIND_H
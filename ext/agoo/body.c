@@ -0,0 +1,283 @@
+// Copyright (c) 2019, Peter Ohler, All rights reserved.
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "body.h"
+#include "debug.h"
+
+#define MIN_CAP		4096
+#define TRAILER_MAX	8192
+
+// States of the chunked decoder. Any of them can be left at the end of one
+// read and picked up with the next.
+typedef enum {
+    SIZE_START	= 0,
+    SIZE,
+    EXT,
+    SIZE_LF,
+    DATA,
+    DATA_CR,
+    DATA_LF,
+    TRAILER,
+    TRAILER_LINE,
+    END_LF,
+} BodyState;
+
+static int
+body_file(agooErr err, agooBody b) {
+    const char	*dir = getenv("TMPDIR");
+    char	path[1024];
+
+    if (NULL == dir || '\0' == *dir) {
+	dir = "/tmp";
+    }
+    snprintf(path, sizeof(path), "%s/agoo-body-XXXXXX", dir);
+    if (0 > (b->fd = mkstemp(path))) {
+	return agoo_err_no(err, "Failed to create a temp file for a request body in %s.", dir);
+    }
+    // Nothing else needs the name and the file goes away when closed.
+    unlink(path);
+    fcntl(b->fd, F_SETFD, FD_CLOEXEC);
+
+    return AGOO_ERR_OK;
+}
+
+static int
+body_write(agooErr err, agooBody b, const char *data, size_t len) {
+    ssize_t	cnt;
+
+    if (0 > b->fd) {
+	if (0 < b->file_min && b->file_min <= (long)(b->len + len)) {
+	    if (AGOO_ERR_OK != body_file(err, b)) {
+		return err->code;
+	    }
+	    if (0 < b->len) {
+		size_t	blen = b->len;
+
+		b->len = 0;
+		if (AGOO_ERR_OK != body_write(err, b, b->buf, blen)) {
+		    return err->code;
+		}
+	    }
+	    AGOO_FREE(b->buf);
+	    b->buf = NULL;
+	    b->cap = 0;
+	} else {
+	    if (b->cap < b->len + len + 1) {
+		size_t	cap = (0 == b->cap) ? MIN_CAP : b->cap;
+		char	*buf;
+
+		for (; cap < b->len + len + 1; cap *= 2) {
+		}
+		if (NULL == (buf = (char*)AGOO_REALLOC(b->buf, cap))) {
+		    return agoo_err_set(err, AGOO_ERR_MEMORY, "Failed to allocate memory for a request body.");
+		}
+		b->buf = buf;
+		b->cap = cap;
+	    }
+	    memcpy(b->buf + b->len, data, len);
+	    b->len += len;
+	    b->buf[b->len] = '\0';
+
+	    return AGOO_ERR_OK;
+	}
+    }
+    while (0 < len) {
+	if (0 > (cnt = write(b->fd, data, len))) {
+	    if (EINTR == errno) {
+		continue;
+	    }
+	    return agoo_err_no(err, "Failed to write a request body to a temp file.");
+	}
+	data += cnt;
+	len -= cnt;
+	b->len += cnt;
+    }
+    return AGOO_ERR_OK;
+}
+
+agooBody
+agoo_body_create(agooErr err, bool chunked, size_t clen, long file_min) {
+    agooBody	b = (agooBody)AGOO_MALLOC(sizeof(struct _agooBody));
+
+    if (NULL == b) {
+	agoo_err_set(err, AGOO_ERR_MEMORY, "Failed to allocate memory for a request body.");
+	return NULL;
+    }
+    memset(b, 0, sizeof(struct _agooBody));
+    b->fd = -1;
+    b->file_min = file_min;
+    b->chunked = chunked;
+    b->state = SIZE_START;
+    if (!chunked) {
+	b->left = clen;
+	if (0 < file_min && file_min <= (long)clen && AGOO_ERR_OK != body_file(err, b)) {
+	    AGOO_FREE(b);
+	    return NULL;
+	}
+	b->done = (0 == clen);
+    }
+    return b;
+}
+
+void
+agoo_body_destroy(agooBody b) {
+    if (NULL == b) {
+	return;
+    }
+    if (0 <= b->fd) {
+	close(b->fd);
+    }
+    AGOO_FREE(b->buf);
+    AGOO_FREE(b);
+}
+
+static int
+hex_val(char c) {
+    if ('0' <= c && c <= '9') {
+	return c - '0';
+    }
+    if ('a' <= c && c <= 'f') {
+	return c - 'a' + 10;
+    }
+    if ('A' <= c && c <= 'F') {
+	return c - 'A' + 10;
+    }
+    return -1;
+}
+
+// Adds bytes that are not framed by the body itself, as with the DATA
+// frames of an HTTP/2 stream. The caller decides when the body is done.
+int
+agoo_body_append(agooErr err, agooBody b, const char *data, size_t len) {
+    return body_write(err, b, data, len);
+}
+
+// Adds what was read to the body and returns how many bytes of data were
+// used, which is less than len only if the body ended. A chunked body is
+// decoded as it goes. Returns -1 on error with AGOO_ERR_PARSE for a bad
+// chunked body.
+long
+agoo_body_add(agooErr err, agooBody b, const char *data, size_t len) {
+    const char	*p = data;
+    const char	*end = data + len;
+    size_t	cnt;
+    int		h;
+
+    if (!b->chunked) {
+	if (b->left < len) {
+	    len = b->left;
+	}
+	if (AGOO_ERR_OK != body_write(err, b, data, len)) {
+	    return -1;
+	}
+	b->left -= len;
+	b->done = (0 == b->left);
+
+	return (long)len;
+    }
+    while (p < end && !b->done) {
+	switch (b->state) {
+	case SIZE_START:
+	case SIZE:
+	    if (0 <= (h = hex_val(*p))) {
+		if ((size_t)0x0FFFFFFFFFFFFFFF < b->left) {
+		    agoo_err_set(err, AGOO_ERR_PARSE, "Request body chunk size too large.");
+		    return -1;
+		}
+		b->left = (b->left << 4) | h;
+		b->state = SIZE;
+	    } else if (SIZE_START == b->state) {
+		agoo_err_set(err, AGOO_ERR_PARSE, "Invalid request body chunk size.");
+		return -1;
+	    } else if ('\r' == *p) {
+		b->state = SIZE_LF;
+	    } else if (';' == *p || ' ' == *p || '\t' == *p) {
+		b->state = EXT;
+	    } else {
+		agoo_err_set(err, AGOO_ERR_PARSE, "Invalid request body chunk size.");
+		return -1;
+	    }
+	    p++;
+	    break;
+	case EXT:
+	    // Chunk extensions are ignored.
+	    if (NULL == (p = memchr(p, '\r', end - p))) {
+		return (long)len;
+	    }
+	    b->state = SIZE_LF;
+	    p++;
+	    break;
+	case SIZE_LF:
+	    if ('\n' != *p++) {
+		agoo_err_set(err, AGOO_ERR_PARSE, "Invalid request body chunk size line.");
+		return -1;
+	    }
+	    b->state = (0 == b->left) ? TRAILER : DATA;
+	    break;
+	case DATA:
+	    cnt = (size_t)(end - p);
+	    if (b->left < cnt) {
+		cnt = b->left;
+	    }
+	    if (AGOO_ERR_OK != body_write(err, b, p, cnt)) {
+		return -1;
+	    }
+	    p += cnt;
+	    if (0 == (b->left -= cnt)) {
+		b->state = DATA_CR;
+	    }
+	    break;
+	case DATA_CR:
+	case DATA_LF:
+	    if ((DATA_CR == b->state ? '\r' : '\n') != *p++) {
+		agoo_err_set(err, AGOO_ERR_PARSE, "Request body chunk not terminated.");
+		return -1;
+	    }
+	    b->state = (DATA_CR == b->state) ? DATA_LF : SIZE_START;
+	    break;
+	case TRAILER:
+	    if ('\r' == *p) {
+		b->state = END_LF;
+	    } else {
+		b->state = TRAILER_LINE;
+	    }
+	    p++;
+	    b->left++;
+	    break;
+	case TRAILER_LINE: {
+	    // Trailer fields are dropped.
+	    const char	*nl = memchr(p, '\n', end - p);
+
+	    cnt = (NULL == nl) ? (size_t)(end - p) : (size_t)(nl - p + 1);
+	    if (TRAILER_MAX < (b->left += cnt)) {
+		agoo_err_set(err, AGOO_ERR_PARSE, "Request body trailer too large.");
+		return -1;
+	    }
+	    if (NULL == nl) {
+		return (long)len;
+	    }
+	    b->state = TRAILER;
+	    p = nl + 1;
+	    break;
+	}
+	case END_LF:
+	    if ('\n' != *p++) {
+		agoo_err_set(err, AGOO_ERR_PARSE, "Invalid request body trailer.");
+		return -1;
+	    }
+	    b->left = 0;
+	    b->done = true;
+	    break;
+	default:
+	    agoo_err_set(err, AGOO_ERR_PARSE, "Invalid request body state.");
+	    return -1;
+	}
+    }
+    return (long)(p - data);
+}
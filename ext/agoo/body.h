@@ -0,0 +1,32 @@
+// Copyright (c) 2019, Peter Ohler, All rights reserved.
+
+#ifndef AGOO_BODY_H
+#define AGOO_BODY_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "err.h"
+
+// A request body that is not read in place in the connection read
+// buffer. That is a chunked body, which is decoded as it arrives, an HTTP/2
+// body, or one big enough to be written to a temp file instead of being held
+// in memory.
+typedef struct _agooBody {
+    char	*buf;	  // decoded body when not in a file
+    size_t	len;	  // of the body so far
+    size_t	cap;	  // of buf
+    int		fd;	  // unlinked temp file or -1
+    long	file_min; // a body this size or larger goes to a file, 0 for never
+    size_t	left;	  // in the current chunk or the whole body if not chunked
+    int		state;
+    bool	chunked;
+    bool	done;
+} *agooBody;
+
+extern agooBody	agoo_body_create(agooErr err, bool chunked, size_t clen, long file_min);
+extern void	agoo_body_destroy(agooBody b);
+extern long	agoo_body_add(agooErr err, agooBody b, const char *data, size_t len);
+extern int	agoo_body_append(agooErr err, agooBody b, const char *data, size_t len);
+
+#endif // AGOO_BODY_H
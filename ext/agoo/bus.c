@@ -0,0 +1,425 @@
+// Copyright (c) 2019, Peter Ohler, All rights reserved.
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "bus.h"
+#include "debug.h"
+#include "log.h"
+#include "pub.h"
+#include "queue.h"
+#include "server.h"
+#include "subject.h"
+#include "text.h"
+
+// Messages taken off the queue are collected into a batch of about this size
+// before being handed to the peers.
+#define BATCH_SIZE	65536
+#define READ_SIZE	65536
+// Output for a peer that is not reading is dropped past this.
+#define MAX_PENDING	(64 * 1024 * 1024)
+#define WAIT_MSECS	100
+// Subject length, message length and a binary flag.
+#define REC_HEAD	9
+
+typedef struct _buf {
+    char	*data;
+    size_t	off; // start of what has not been used yet
+    size_t	len;
+    size_t	cap;
+} *Buf;
+
+// Each worker has a one way stream to every other worker so there is only
+// ever one writer on a socket, the bus thread of the sending worker.
+typedef struct _peer {
+    int			rfd;
+    int			wfd;
+    struct _buf		in;
+    struct _buf		out;
+    bool		dropping;
+} *Peer;
+
+static struct _bus {
+    int			cnt;
+    int			id;
+    int			*pairs; // a socket pair for each sender and receiver until opened
+    struct _peer	*peers; // indexed by worker
+    struct _agooQueue	queue;
+    struct _buf		batch;
+    pthread_t		thread;
+    volatile bool	active;
+} bus = { .cnt = 0 };
+
+static bool
+buf_room(Buf b, size_t need) {
+    if (b->cap < b->len + need) {
+	size_t	cap = b->cap + b->cap / 2;
+	char	*data;
+
+	if (cap < b->len + need) {
+	    cap = b->len + need;
+	}
+	if (NULL == (data = (char*)AGOO_REALLOC(b->data, cap))) {
+	    return false;
+	}
+	b->data = data;
+	b->cap = cap;
+    }
+    return true;
+}
+
+static void
+buf_shift(Buf b) {
+    if (b->off == b->len) {
+	b->off = 0;
+	b->len = 0;
+    } else if (0 < b->off) {
+	memmove(b->data, b->data + b->off, b->len - b->off);
+	b->len -= b->off;
+	b->off = 0;
+    }
+}
+
+static void
+buf_free(Buf b) {
+    AGOO_FREE(b->data);
+    memset(b, 0, sizeof(struct _buf));
+}
+
+// Creates the sockets for all the workers. Called before forking.
+int
+agoo_bus_create(agooErr err, int cnt) {
+    int	from;
+    int	to;
+    int	*fds;
+
+    if (NULL == (bus.pairs = (int*)AGOO_MALLOC(sizeof(int) * 2 * cnt * cnt))) {
+	return agoo_err_set(err, AGOO_ERR_MEMORY, "Failed to allocate memory for the worker bus.");
+    }
+    memset(bus.pairs, 0, sizeof(int) * 2 * cnt * cnt);
+    bus.cnt = cnt;
+    for (from = 0; from < cnt; from++) {
+	for (to = 0; to < cnt; to++) {
+	    if (from == to) {
+		continue;
+	    }
+	    fds = bus.pairs + 2 * (from * cnt + to);
+	    if (0 != socketpair(AF_UNIX, SOCK_STREAM, 0, fds)) {
+		agoo_err_no(err, "Failed to create a worker bus socket");
+		agoo_bus_open(-1);
+		bus.cnt = 0;
+		return err->code;
+	    }
+	    fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+	    fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+	}
+    }
+    return AGOO_ERR_OK;
+}
+
+// Keeps the sockets the worker with the id reads from and writes to and
+// closes the rest. Called in each worker after forking.
+void
+agoo_bus_open(int id) {
+    int	from;
+    int	to;
+    int	*fds;
+
+    if (NULL == bus.pairs) {
+	return;
+    }
+    if (0 <= id && NULL != (bus.peers = (Peer)AGOO_MALLOC(sizeof(struct _peer) * bus.cnt))) {
+	memset(bus.peers, 0, sizeof(struct _peer) * bus.cnt);
+	for (to = 0; to < bus.cnt; to++) {
+	    bus.peers[to].rfd = -1;
+	    bus.peers[to].wfd = -1;
+	}
+    } else {
+	id = -1;
+    }
+    bus.id = id;
+    for (from = 0; from < bus.cnt; from++) {
+	for (to = 0; to < bus.cnt; to++) {
+	    fds = bus.pairs + 2 * (from * bus.cnt + to);
+	    if (from == to || 0 == fds[0]) {
+		continue;
+	    }
+	    if (to == id) {
+		bus.peers[from].rfd = fds[0];
+		fcntl(fds[0], F_SETFL, O_NONBLOCK | fcntl(fds[0], F_GETFL, 0));
+	    } else {
+		close(fds[0]);
+	    }
+	    if (from == id) {
+		bus.peers[to].wfd = fds[1];
+		fcntl(fds[1], F_SETFL, O_NONBLOCK | fcntl(fds[1], F_GETFL, 0));
+	    } else {
+		close(fds[1]);
+	    }
+	}
+    }
+    AGOO_FREE(bus.pairs);
+    bus.pairs = NULL;
+}
+
+static void
+peer_close(Peer p, int *fdp) {
+    if (0 <= *fdp) {
+	close(*fdp);
+	*fdp = -1;
+    }
+    if (&p->wfd == fdp) {
+	buf_free(&p->out);
+    } else {
+	buf_free(&p->in);
+    }
+}
+
+static void
+peer_flush(Peer p) {
+    ssize_t	cnt;
+
+    while (p->out.off < p->out.len) {
+	if (0 > (cnt = send(p->wfd, p->out.data + p->out.off, p->out.len - p->out.off, MSG_DONTWAIT | MSG_NOSIGNAL))) {
+	    if (EINTR == errno) {
+		continue;
+	    }
+	    if (EAGAIN != errno && EWOULDBLOCK != errno) {
+		agoo_log_cat(&agoo_warn_cat, "Worker bus connection lost. %s", strerror(errno));
+		peer_close(p, &p->wfd);
+		return;
+	    }
+	    break;
+	}
+	p->out.off += cnt;
+    }
+    buf_shift(&p->out);
+    if (p->dropping && 0 == p->out.len) {
+	p->dropping = false;
+	agoo_log_cat(&agoo_warn_cat, "Worker bus peer caught up.");
+    }
+}
+
+// Hands the batch to each peer. A peer that falls too far behind misses
+// messages instead of growing without limit.
+static void
+batch_send() {
+    Peer	p;
+    int		i;
+
+    if (0 == bus.batch.len) {
+	return;
+    }
+    for (i = 0, p = bus.peers; i < bus.cnt; i++, p++) {
+	if (0 > p->wfd) {
+	    continue;
+	}
+	if (MAX_PENDING < p->out.len || !buf_room(&p->out, bus.batch.len)) {
+	    if (!p->dropping) {
+		p->dropping = true;
+		agoo_log_cat(&agoo_warn_cat, "Worker bus peer is not keeping up. Messages dropped.");
+	    }
+	    continue;
+	}
+	memcpy(p->out.data + p->out.len, bus.batch.data, bus.batch.len);
+	p->out.len += bus.batch.len;
+	peer_flush(p);
+    }
+    bus.batch.len = 0;
+}
+
+static void
+batch_add(agooPub pub) {
+    const char	*subject = pub->subject->pattern;
+    uint32_t	slen = (uint32_t)strlen(subject);
+    uint32_t	mlen = (uint32_t)pub->msg->len;
+    char	*b;
+
+    if (!buf_room(&bus.batch, REC_HEAD + slen + mlen)) {
+	agoo_log_cat(&agoo_error_cat, "Failed to allocate memory for a worker bus message.");
+	return;
+    }
+    b = bus.batch.data + bus.batch.len;
+    memcpy(b, &slen, sizeof(slen));
+    memcpy(b + 4, &mlen, sizeof(mlen));
+    b[8] = pub->msg->bin ? 1 : 0;
+    memcpy(b + REC_HEAD, subject, slen);
+    memcpy(b + REC_HEAD + slen, pub->msg->text, mlen);
+    bus.batch.len += REC_HEAD + slen + mlen;
+}
+
+// Messages from a peer are published to the con loops of this worker only.
+static void
+peer_read(Peer p) {
+    ssize_t	cnt;
+    uint32_t	slen;
+    uint32_t	mlen;
+
+    while (true) {
+	if (!buf_room(&p->in, READ_SIZE)) {
+	    agoo_log_cat(&agoo_error_cat, "Failed to allocate memory for a worker bus message.");
+	    peer_close(p, &p->rfd);
+	    return;
+	}
+	if (0 >= (cnt = read(p->rfd, p->in.data + p->in.len, p->in.cap - p->in.len))) {
+	    if (0 > cnt && EINTR == errno) {
+		continue;
+	    }
+	    if (0 == cnt || (EAGAIN != errno && EWOULDBLOCK != errno)) {
+		peer_close(p, &p->rfd);
+		return;
+	    }
+	    break;
+	}
+	p->in.len += cnt;
+	while (REC_HEAD <= p->in.len - p->in.off) {
+	    char	*b = p->in.data + p->in.off;
+	    agooPub	pub;
+
+	    memcpy(&slen, b, sizeof(slen));
+	    memcpy(&mlen, b + 4, sizeof(mlen));
+	    if (p->in.len - p->in.off < REC_HEAD + (size_t)slen + mlen) {
+		break;
+	    }
+	    if (NULL != (pub = agoo_pub_publish(b + REC_HEAD, (int)slen, b + REC_HEAD + slen, mlen))) {
+		pub->msg->bin = (1 == b[8]);
+		agoo_server_deliver(pub);
+	    }
+	    p->in.off += REC_HEAD + slen + mlen;
+	}
+	buf_shift(&p->in);
+    }
+}
+
+static void*
+bus_loop(void *x) {
+    struct pollfd	*pa = (struct pollfd*)x;
+    struct pollfd	*pp;
+    Peer		p;
+    agooPub		pub;
+    int			i;
+    int			qfd = agoo_queue_listen(&bus.queue);
+
+    while (bus.active) {
+	pp = pa;
+	pp->fd = qfd;
+	pp->events = POLLIN;
+	pp->revents = 0;
+	pp++;
+	for (i = 0, p = bus.peers; i < bus.cnt; i++, p++) {
+	    if (0 <= p->rfd) {
+		pp->fd = p->rfd;
+		pp->events = POLLIN;
+		pp->revents = 0;
+		pp++;
+	    }
+	    if (0 <= p->wfd && 0 < p->out.len) {
+		pp->fd = p->wfd;
+		pp->events = POLLOUT;
+		pp->revents = 0;
+		pp++;
+	    }
+	}
+	if (0 > poll(pa, (nfds_t)(pp - pa), WAIT_MSECS)) {
+	    if (EINTR == errno || EAGAIN == errno) {
+		continue;
+	    }
+	    agoo_log_cat(&agoo_error_cat, "Worker bus poll failed. %s", strerror(errno));
+	    break;
+	}
+	if (0 != (pa->revents & POLLIN)) {
+	    agoo_queue_release(&bus.queue);
+	}
+	// Everything queued since the last pass goes out together.
+	while (NULL != (pub = (agooPub)agoo_queue_pop(&bus.queue, 0.0))) {
+	    batch_add(pub);
+	    agoo_pub_destroy(pub);
+	    if (BATCH_SIZE <= bus.batch.len) {
+		batch_send();
+	    }
+	}
+	batch_send();
+	for (i = 0, p = bus.peers; i < bus.cnt; i++, p++) {
+	    if (0 <= p->wfd && 0 < p->out.len) {
+		peer_flush(p);
+	    }
+	    if (0 <= p->rfd) {
+		peer_read(p);
+	    }
+	}
+    }
+    AGOO_FREE(pa);
+
+    return NULL;
+}
+
+int
+agoo_bus_start(agooErr err) {
+    struct pollfd	*pa;
+    int			stat;
+
+    if (NULL == bus.peers) {
+	return AGOO_ERR_OK;
+    }
+    if (NULL == (pa = (struct pollfd*)AGOO_MALLOC(sizeof(struct pollfd) * (1 + 2 * bus.cnt)))) {
+	return agoo_err_set(err, AGOO_ERR_MEMORY, "Failed to allocate memory for the worker bus.");
+    }
+    agoo_queue_multi_init(&bus.queue, 1024, true, false);
+    bus.active = true;
+    if (0 != (stat = pthread_create(&bus.thread, NULL, bus_loop, pa))) {
+	bus.active = false;
+	AGOO_FREE(pa);
+	agoo_queue_cleanup(&bus.queue);
+	return agoo_err_set(err, stat, "Failed to create worker bus thread. %s", strerror(stat));
+    }
+    return AGOO_ERR_OK;
+}
+
+void
+agoo_bus_shutdown() {
+    agooPub	pub;
+    Peer	p;
+    int		i;
+
+    if (bus.active) {
+	bus.active = false;
+	pthread_join(bus.thread, NULL);
+	while (NULL != (pub = (agooPub)agoo_queue_pop(&bus.queue, 0.0))) {
+	    agoo_pub_destroy(pub);
+	}
+	agoo_queue_cleanup(&bus.queue);
+    }
+    if (NULL != bus.peers) {
+	for (i = 0, p = bus.peers; i < bus.cnt; i++, p++) {
+	    peer_close(p, &p->rfd);
+	    peer_close(p, &p->wfd);
+	}
+	AGOO_FREE(bus.peers);
+	bus.peers = NULL;
+    }
+    buf_free(&bus.batch);
+}
+
+// Queues a copy of a published message for the other workers. The message
+// text is shared and not copied.
+bool
+agoo_bus_relay(agooPub pub) {
+    agooPub	dup;
+
+    if (!bus.active || NULL == pub->subject || NULL == pub->msg) {
+	return false;
+    }
+    if (NULL == (dup = agoo_pub_dup(pub))) {
+	return false;
+    }
+    agoo_queue_push(&bus.queue, dup);
+
+    return true;
+}
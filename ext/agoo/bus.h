@@ -0,0 +1,21 @@
+// Copyright (c) 2019, Peter Ohler, All rights reserved.
+
+#ifndef AGOO_BUS_H
+#define AGOO_BUS_H
+
+#include <stdbool.h>
+
+#include "err.h"
+
+struct _agooPub;
+
+// The bus relays published messages between forked workers so a message
+// published in one worker reaches the subscribers connected to all of
+// them.
+extern int	agoo_bus_create(agooErr err, int cnt);
+extern void	agoo_bus_open(int id);
+extern int	agoo_bus_start(agooErr err);
+extern void	agoo_bus_shutdown(void);
+extern bool	agoo_bus_relay(struct _agooPub *pub);
+
+#endif // AGOO_BUS_H
@@ -1,19 +1,31 @@
 // Copyright (c) 2018, Peter Ohler, All rights reserved.
 
+#if HAVE_PTHREAD_SETAFFINITY_NP
+#define _GNU_SOURCE
+#endif
+
 #include <ctype.h>
 #include <netdb.h>
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
+#include <sys/socket.h>
+#if HAVE_SYS_SENDFILE_H
+#include <sys/sendfile.h>
+#endif
 
 #include "bind.h"
+#include "body.h"
 #include "con.h"
 #include "debug.h"
 #include "dtime.h"
+#include "head.h"
 #include "hook.h"
 #include "http.h"
+#include "http2.h"
 #include "log.h"
 #include "page.h"
+#include "pool.h"
 #include "pub.h"
 #include "ready.h"
 #include "res.h"
@@ -21,30 +33,43 @@
 #include "server.h"
 #include "sse.h"
 #include "subject.h"
+#include "tls.h"
 #include "upgraded.h"
 #include "websocket.h"
 
-#define CON_TIMEOUT		10.0
 #define INITIAL_POLL_SIZE	1024
+#define MAX_WRITE_IOV		64
+#define BODY_READ_MIN		4096
+#define WS_PART_MIN		65536
 
 typedef enum {
     HEAD_AGAIN		= 'A',
     HEAD_ERR		= 'E',
     HEAD_OK		= 'O',
     HEAD_HANDLED	= 'H',
+    HEAD_H2		= '2',
 } HeadReturn;
 
 static bool	con_ws_read(agooCon c);
+static bool	con_ws_received(agooCon c, ssize_t cnt);
 static bool	con_ws_write(agooCon c);
+static agooText	con_ws_prep(agooCon c);
+static bool	con_ws_sent(agooCon c, ssize_t cnt);
 static short	con_ws_events(agooCon c);
 static bool	con_sse_write(agooCon c);
+static agooText	con_sse_prep(agooCon c);
+static bool	con_sse_sent(agooCon c, ssize_t cnt);
 static short	con_sse_events(agooCon c);
+static bool	con_h2_read(agooCon c);
 
 static struct _agooBind	ws_bind = {
     .kind = AGOO_CON_WS,
     .read = con_ws_read,
     .write = con_ws_write,
     .events = con_ws_events,
+    .received = con_ws_received,
+    .prep = con_ws_prep,
+    .sent = con_ws_sent,
 };
 
 static struct _agooBind	sse_bind = {
@@ -52,13 +77,30 @@ static struct _agooBind	sse_bind = {
     .read = NULL,
     .write = con_sse_write,
     .events = con_sse_events,
+    .received = NULL,
+    .prep = con_sse_prep,
+    .sent = con_sse_sent,
+};
+
+static struct _agooBind	h2_bind = {
+    .kind = AGOO_CON_H2,
+    .read = con_h2_read,
+    .write = agoo_h2_write,
+    .events = agoo_h2_events,
+    .received = agoo_h2_received,
+    .prep = agoo_h2_prep,
+    .gather = NULL,
+    .sent = agoo_h2_sent,
 };
 
+static const char	h2_preface[] = "PRI * HTTP/2.0\r\n\r\n";
+static const char	h2_switch[] = "HTTP/1.1 101 Switching Protocols\r\nConnection: Upgrade\r\nUpgrade: h2c\r\n\r\n";
+
 agooCon
 agoo_con_create(agooErr err, int sock, uint64_t id, agooBind b) {
     agooCon	c;
 
-    if (NULL == (c = (agooCon)AGOO_MALLOC(sizeof(struct _agooCon)))) {
+    if (NULL == (c = (agooCon)agoo_pool_alloc(AGOO_POOL_CON, sizeof(struct _agooCon)))) {
 	agoo_err_set(err, AGOO_ERR_MEMORY, "Failed to allocate memory for a connection.");
     } else {
 	memset(c, 0, sizeof(struct _agooCon));
@@ -67,10 +109,69 @@ agoo_con_create(agooErr err, int sock, uint64_t id, agooBind b) {
 	c->timeout = dtime() + CON_TIMEOUT;
 	c->bind = b;
 	c->loop = NULL;
+	if (NULL != b->tls && NULL == (c->tls = agoo_tls_create(err, b, sock))) {
+	    agoo_pool_free(c);
+	    return NULL;
+	}
     }
     return c;
 }
 
+// The socket calls go through these so that TLS connections are encrypted.
+static ssize_t
+con_recv(agooCon c, char *buf, size_t size) {
+    if (NULL != c->tls) {
+	return agoo_tls_recv(c->tls, buf, size);
+    }
+    return recv(c->sock, buf, size, 0);
+}
+
+ssize_t
+agoo_con_send(agooCon c, const char *buf, size_t len) {
+    if (NULL != c->tls) {
+	return agoo_tls_send(c->tls, buf, len);
+    }
+    return send(c->sock, buf, len, MSG_DONTWAIT);
+}
+
+// Small messages are copied into one buffer for TLS so they go out in one
+// record instead of one record each. Like sendmsg() it keeps writing until
+// everything is written or the socket would block.
+static ssize_t
+con_sendmsg(agooCon c, struct msghdr *mh) {
+    char		buf[AGOO_TLS_RECORD];
+    struct iovec	*iov = mh->msg_iov;
+    struct iovec	*end = iov + mh->msg_iovlen;
+    ssize_t		sent = 0;
+    ssize_t		cnt;
+    size_t		len;
+
+    if (NULL == c->tls) {
+	return sendmsg(c->sock, mh, MSG_DONTWAIT);
+    }
+    while (iov < end) {
+	if (sizeof(buf) <= iov->iov_len || iov + 1 == end) {
+	    len = iov->iov_len;
+	    cnt = agoo_tls_send(c->tls, iov->iov_base, len);
+	    iov++;
+	} else {
+	    for (len = 0; iov < end && iov->iov_len <= sizeof(buf) - len; iov++) {
+		memcpy(buf + len, iov->iov_base, iov->iov_len);
+		len += iov->iov_len;
+	    }
+	    cnt = agoo_tls_send(c->tls, buf, len);
+	}
+	if (0 > cnt) {
+	    return (0 < sent) ? sent : cnt;
+	}
+	sent += cnt;
+	if ((size_t)cnt < len) {
+	    break;
+	}
+    }
+    return sent;
+}
+
 void
 agoo_con_destroy(agooCon c) {
     agooRes	res;
@@ -80,6 +181,7 @@ agoo_con_destroy(agooCon c) {
     if (AGOO_CON_WS == c->bind->kind || AGOO_CON_SSE == c->bind->kind) {
 	agoo_ws_req_close(c);
     }
+    agoo_tls_destroy(c->tls);
     if (0 < c->sock) {
 	close(c->sock);
 	c->sock = 0;
@@ -88,47 +190,26 @@ agoo_con_destroy(agooCon c) {
 	agoo_req_destroy(c->req);
     }
     if (NULL != c->up) {
+	agooSubject	s;
+
+	// The loop subscriptions are only touched by the loop thread so they
+	// are dropped here and not when the upgraded is destroyed.
+	for (s = c->up->subjects; NULL != s; s = s->next) {
+	    agoo_subtrie_remove(s);
+	}
 	agoo_upgraded_release_con(c->up);
 	c->up = NULL;
     }
+    agoo_h2_destroy(c->h2);
+    agoo_ws_read_destroy(c->ws);
     agoo_log_cat(&agoo_con_cat, "Connection %llu closed.", (unsigned long long)c->id);
 
     while (NULL != (res = c->res_head)) {
 	c->res_head = res->next;
-	AGOO_FREE(res);
-    }
-    AGOO_FREE(c);
-}
-
-const char*
-agoo_con_header_value(const char *header, int hlen, const char *key, int *vlen) {
-    // Search for \r then check for \n and then the key followed by a :. Keep
-    // trying until the end of the header.
-    const char	*h = header;
-    const char	*hend = header + hlen;
-    const char	*value;
-    int		klen = (int)strlen(key);
-    
-    while (h < hend) {
-	if (0 == strncmp(key, h, klen) && ':' == h[klen]) {
-	    h += klen + 1;
-	    for (; ' ' == *h; h++) {
-	    }
-	    value = h;
-	    for (; '\r' != *h && '\0' != *h; h++) {
-	    }
-	    *vlen = (int)(h - value);
- 
-	    return value;
-	}
-	for (; h < hend; h++) {
-	    if ('\r' == *h && '\n' == *(h + 1)) {
-		h += 2;
-		break;
-	    }
-	}
+	agoo_res_destroy(res);
     }
-    return NULL;
+    agoo_rbuf_release(c->rbuf);
+    agoo_pool_free(c);
 }
 
 static HeadReturn
@@ -158,22 +239,59 @@ bad_request(agooCon c, int status, int line) {
 }
 
 static bool
-should_close(const char *header, int hlen) {
+should_close(agooHead h) {
     const char	*v;
     int		vlen = 0;
-    
-    if (NULL != (v = agoo_con_header_value(header, hlen, "Connection", &vlen))) {
-	return (5 == vlen && 0 == strncasecmp("Close", v, 5));
+
+    if (NULL != (v = agoo_head_get(h, AGOO_HDR_CONNECTION, &vlen))) {
+	return agoo_head_has_token(v, vlen, "close", 5);
     }
     return false;
 }
 
+// Picks out what req_queue() needs while the parsed head is at hand.
+static void
+head_upgrade(agooCon c, agooHead h) {
+    const char	*v;
+    int		vlen = 0;
+
+    c->up_kind = AGOO_CON_ANY;
+    if (NULL != (v = agoo_head_get(h, AGOO_HDR_CONNECTION, &vlen)) &&
+	agoo_head_has_token(v, vlen, "upgrade", 7)) {
+	if (NULL != (v = agoo_head_get(h, AGOO_HDR_UPGRADE, &vlen))) {
+	    if (9 == vlen && 0 == strncasecmp("WebSocket", v, 9)) {
+		c->up_kind = AGOO_CON_WS;
+		return;
+	    }
+	    if (agoo_head_has_token(v, vlen, "h2c", 3) && NULL != agoo_head_value(h, "HTTP2-Settings", 14, &vlen)) {
+		c->up_kind = AGOO_CON_H2;
+		return;
+	    }
+	}
+    }
+    if (NULL != (v = agoo_head_get(h, AGOO_HDR_ACCEPT, &vlen)) &&
+	17 == vlen && 0 == strncasecmp("text/event-stream", v, 17)) {
+	c->up_kind = AGOO_CON_SSE;
+    }
+}
+
+// The reference to the page is released.
 static bool
-page_response(agooCon c, agooPage p, char *hend) {
+page_response(agooCon c, agooPage p, agooHead h) {
     agooRes 	res;
-    char	*b;
-    
+    agooText	message;
+
+    // The message may belong to the page so hold on to it before the page
+    // is released.
+    if (NULL != (message = agoo_page_response(p, h))) {
+	agoo_text_ref(message);
+    }
+    agoo_page_release(p);
+    if (NULL == message) {
+	return true;
+    }
     if (NULL == (res = agoo_res_create(c))) {
+	agoo_text_release(message);
 	return true;
     }
     if (NULL == c->res_tail) {
@@ -183,12 +301,12 @@ page_response(agooCon c, agooPage p, char *hend) {
     }
     c->res_tail = res;
 
-    b = strstr(c->buf, "\r\n");
-    res->close = should_close(b, (int)(hend - b));
+    res->close = should_close(h);
     if (res->close) {
 	c->closing = true;
     }
-    agoo_res_set_message(res, p->resp);
+    agoo_res_set_message(res, message);
+    agoo_text_release(message);
 
     return false;
 }
@@ -206,142 +324,108 @@ push_error(agooUpgraded up, const char *msg, int mlen) {
 	req->msg[mlen] = '\0';
 	req->up = up;
 	req->method = AGOO_ON_ERROR;
-	req->hook = agoo_hook_create(AGOO_NONE, NULL, up->ctx, PUSH_HOOK, &agoo_server.eval_queue);
+	req->hook = agoo_hook_push(up->ctx);
 	agoo_upgraded_ref(up);
 	agoo_queue_push(&agoo_server.eval_queue, (void*)req);
     }
 }
 
-static HeadReturn
-agoo_con_header_read(agooCon c, size_t *mlenp) {
-    char		*hend = strstr(c->buf, "\r\n\r\n");
-    agooMethod		method;
-    struct _agooSeg	path;
-    char		*query = NULL;
-    char		*qend;
-    char		*b;
-    size_t		clen = 0;
-    long		mlen;
-    agooHook		hook = NULL;
-    agooPage		p;
-    struct _agooErr	err = AGOO_ERR_INIT;
+// Makes sure there is room in the read buffer for size bytes and a
+// terminating '\0' from c->buf on. Only the bytes not used yet are moved if
+// a new buffer is needed. Returns false if out of memory.
+static bool
+con_reserve(agooCon c, size_t size) {
+    agooRBuf	rb = c->rbuf;
 
-    if (NULL == hend) {
-	if (sizeof(c->buf) - 1 <= c->bcnt) {
-	    return bad_request(c, 431, __LINE__);
+    if (NULL != rb) {
+	// If no request points into the buffer it can be reused from the start.
+	if (0 == c->bcnt && 1 == __atomic_load_n(&rb->ref, __ATOMIC_ACQUIRE)) {
+	    c->buf = rb->buf;
+	}
+	if (size < (size_t)(rb->buf + rb->size - c->buf)) {
+	    return true;
+	}
+	if (size < rb->size && 1 == __atomic_load_n(&rb->ref, __ATOMIC_ACQUIRE)) {
+	    memmove(rb->buf, c->buf, c->bcnt);
+	    c->buf = rb->buf;
+	    return true;
 	}
-	return HEAD_AGAIN;
     }
-    if (agoo_req_cat.on) {
-	*hend = '\0';
-	agoo_log_cat(&agoo_req_cat, "%llu: %s", (unsigned long long)c->id, c->buf);
-	*hend = '\r';
+    if (NULL == (rb = agoo_rbuf_create(size + 1))) {
+	return false;
     }
-    for (b = c->buf; ' ' != *b; b++) {
-	if ('\0' == *b) {
-	    return bad_request(c, 400, __LINE__);
-	}
+    if (0 < c->bcnt) {
+	memcpy(rb->buf, c->buf, c->bcnt);
     }
-    switch (toupper(*c->buf)) {
-    case 'G':
-	if (3 != b - c->buf || 0 != strncmp("GET", c->buf, 3)) {
-	    return bad_request(c, 400, __LINE__);
-	}
-	method = AGOO_GET;
-	break;
-    case 'P': {
-	const char	*v;
-	int		vlen = 0;
-	char		*vend;
-	
-	if (3 == b - c->buf && 0 == strncmp("PUT", c->buf, 3)) {
-	    method = AGOO_PUT;
-	} else if (4 == b - c->buf && 0 == strncmp("POST", c->buf, 4)) {
-	    method = AGOO_POST;
-	} else {
-	    return bad_request(c, 400, __LINE__);
-	}
-	if (NULL == (v = agoo_con_header_value(c->buf, (int)(hend - c->buf), "Content-Length", &vlen))) {
-	    return bad_request(c, 411, __LINE__);
+    agoo_rbuf_release(c->rbuf);
+    c->rbuf = rb;
+    c->buf = rb->buf;
+
+    return true;
+}
+
+static agooMethod
+head_method(agooHead head) {
+    switch (head->mlen) {
+    case 3:
+	if (0 == strncmp("GET", head->method, 3)) {
+	    return AGOO_GET;
 	}
-	clen = (size_t)strtoul(v, &vend, 10);
-	if (vend != v + vlen) {
-	    return bad_request(c, 411, __LINE__);
+	if (0 == strncmp("PUT", head->method, 3)) {
+	    return AGOO_PUT;
 	}
 	break;
-    }
-    case 'D':
-	if (6 != b - c->buf || 0 != strncmp("DELETE", c->buf, 6)) {
-	    return bad_request(c, 400, __LINE__);
+    case 4:
+	if (0 == strncmp("POST", head->method, 4)) {
+	    return AGOO_POST;
 	}
-	method = AGOO_DELETE;
-	break;
-    case 'H':
-	if (4 != b - c->buf || 0 != strncmp("HEAD", c->buf, 4)) {
-	    return bad_request(c, 400, __LINE__);
+	if (0 == strncmp("HEAD", head->method, 4)) {
+	    return AGOO_HEAD;
 	}
-	method = AGOO_HEAD;
 	break;
-    case 'O':
-	if (7 != b - c->buf || 0 != strncmp("OPTIONS", c->buf, 7)) {
-	    return bad_request(c, 400, __LINE__);
+    case 6:
+	if (0 == strncmp("DELETE", head->method, 6)) {
+	    return AGOO_DELETE;
 	}
-	method = AGOO_OPTIONS;
 	break;
-    case 'C':
-	if (7 != b - c->buf || 0 != strncmp("CONNECT", c->buf, 7)) {
-	    return bad_request(c, 400, __LINE__);
+    case 7:
+	if (0 == strncmp("OPTIONS", head->method, 7)) {
+	    return AGOO_OPTIONS;
+	}
+	if (0 == strncmp("CONNECT", head->method, 7)) {
+	    return AGOO_CONNECT;
 	}
-	method = AGOO_CONNECT;
 	break;
     default:
-	return bad_request(c, 400, __LINE__);
-    }
-    for (; ' ' == *b; b++) {
-	if ('\0' == *b) {
-	    return bad_request(c, 400, __LINE__);
-	}
-    }
-    path.start = b;
-    for (; ' ' != *b; b++) {
-	switch (*b) {
-	case '?':
-	    path.end = b;
-	    query = b + 1;
-	    break;
-	case '\0':
-	    return bad_request(c, 400, __LINE__);
-	default:
-	    break;
-	}
-    }
-    if (NULL == query) {
-	path.end = b;
-	query = b;
-	qend = b;
-    } else {
-	qend = b;
+	break;
     }
-    mlen = hend - c->buf + 4 + clen;
-    *mlenp = mlen;
+    return AGOO_NONE;
+}
+
+// Finds the hook for a request or answers it with a page or an error.
+static HeadReturn
+head_route(agooCon c, agooMethod method, agooHead head, agooSeg path, agooHook *hookp) {
+    struct _agooErr	err = AGOO_ERR_INIT;
+    agooHook		hook;
+    agooPage		p;
 
     if (AGOO_GET == method) {
-	if (NULL != (p = group_get(&err, path.start, (int)(path.end - path.start)))) {
-	    if (page_response(c, p, hend)) {
+	if (NULL != (p = group_get(&err, path->start, (int)(path->end - path->start)))) {
+	    if (page_response(c, p, head)) {
 		return bad_request(c, 500, __LINE__);
 	    }
 	    return HEAD_HANDLED;
 	}
 	if (agoo_server.root_first &&
-	    NULL != (p = agoo_page_get(&err, path.start, (int)(path.end - path.start)))) {
-	    if (page_response(c, p, hend)) {
+	    NULL != (p = agoo_page_get(&err, path->start, (int)(path->end - path->start)))) {
+	    if (page_response(c, p, head)) {
 		return bad_request(c, 500, __LINE__);
 	    }
 	    return HEAD_HANDLED;
 	}
-	if (NULL == (hook = agoo_hook_find(agoo_server.hooks, method, &path))) {
-	    if (NULL != (p = agoo_page_get(&err, path.start, (int)(path.end - path.start)))) {
-		if (page_response(c, p, hend)) {
+	if (NULL == (hook = agoo_hook_trie_find(agoo_server.hook_trie, agoo_server.hooks, method, path))) {
+	    if (NULL != (p = agoo_page_get(&err, path->start, (int)(path->end - path->start)))) {
+		if (page_response(c, p, head)) {
 		    return bad_request(c, 500, __LINE__);
 		}
 		return HEAD_HANDLED;
@@ -351,83 +435,422 @@ agoo_con_header_read(agooCon c, size_t *mlenp) {
 	    }
 	    hook = agoo_server.hook404;
 	}
-    } else if (NULL == (hook = agoo_hook_find(agoo_server.hooks, method, &path))) {
+    } else if (NULL == (hook = agoo_hook_trie_find(agoo_server.hook_trie, agoo_server.hooks, method, path))) {
  	return bad_request(c, 404, __LINE__);
     }
-    // Create request and populate.
-    if (NULL == (c->req = agoo_req_create(mlen))) {
-	return bad_request(c, 413, __LINE__);
-    }
-    if ((long)c->bcnt <= mlen) {
-	memcpy(c->req->msg, c->buf, c->bcnt);
-	if ((long)c->bcnt < mlen) {
-	    memset(c->req->msg + c->bcnt, 0, mlen - c->bcnt);
-	}
-    } else {
-	memcpy(c->req->msg, c->buf, mlen);
-    }
-    c->req->msg[mlen] = '\0';
-    c->req->method = method;
-    c->req->upgrade = AGOO_UP_NONE;
-    c->req->up = NULL;
-    c->req->path.start = c->req->msg + (path.start - c->buf);
-    c->req->path.len = (int)(path.end - path.start);
-    c->req->query.start = c->req->msg + (query - c->buf);
-    c->req->query.len = (int)(qend - query);
-    c->req->query.start[c->req->query.len] = '\0';
-    c->req->body.start = c->req->msg + (hend - c->buf + 4);
-    c->req->body.len = (unsigned int)clen;
-    b = strstr(b, "\r\n");
-    c->req->header.start = c->req->msg + (b + 2 - c->buf);
-    c->req->header.len = (unsigned int)(hend - b - 2);
-    c->req->res = NULL;
-    c->req->hook = hook;
+    *hookp = hook;
 
     return HEAD_OK;
 }
 
 static void
-check_upgrade(agooCon c) {
-    const char	*v;
-    int		vlen = 0;
+head_path(agooHead head, agooSeg path, char **queryp, char **qendp) {
+    char	*query;
+    char	*qend;
+
+    path->start = (char*)head->target;
+    qend = path->start + head->tlen;
+    if (NULL == (query = memchr(path->start, '?', head->tlen))) {
+	path->end = qend;
+	query = qend;
+    } else {
+	path->end = query;
+	query++;
+    }
+    *queryp = query;
+    *qendp = qend;
+}
 
-    if (NULL == c->req) {
-	return;
+// Creates a request from a head that is in place in rb starting at buf.
+static agooReq
+head_req(agooCon c, agooMethod method, agooHead head, agooRBuf rb, char *buf, size_t mlen, agooHook hook) {
+    struct _agooSeg	path;
+    char		*query;
+    char		*qend;
+    agooReq		req;
+
+    if (NULL == (req = agoo_req_create_head(mlen, head, rb, buf))) {
+	return NULL;
     }
-    if (NULL != (v = agoo_con_header_value(c->req->header.start, c->req->header.len, "Connection", &vlen))) {
-	if (NULL != strstr(v, "Upgrade")) {
-	    if (NULL != (v = agoo_con_header_value(c->req->header.start, c->req->header.len, "Upgrade", &vlen))) {
-		if (0 == strncasecmp("WebSocket", v, vlen)) {
-		    c->res_tail->close = false;
-		    c->res_tail->con_kind = AGOO_CON_WS;
-		    return;
-		}
+    head_path(head, &path, &query, &qend);
+    req->method = method;
+    req->upgrade = AGOO_UP_NONE;
+    req->up = NULL;
+    req->secure = (NULL != c->tls);
+    req->path.start = path.start;
+    req->path.len = (int)(path.end - path.start);
+    req->query.start = query;
+    req->query.len = (int)(qend - query);
+    *qend = '\0';
+    req->header.start = (char*)head->fields;
+    req->header.len = (unsigned int)head->flen;
+    req->res = NULL;
+    req->hook = hook;
+
+    return req;
+}
+
+static HeadReturn
+agoo_con_header_read(agooCon c, size_t *mlenp) {
+    struct _agooHead	head;
+    char		*hend;
+    long		hlen;
+    agooMethod		method;
+    struct _agooSeg	path;
+    char		*query;
+    char		*qend;
+    size_t		clen = 0;
+    long		mlen;
+    bool		chunked = false;
+    long		file_min = 0;
+    agooBody		body = NULL;
+    agooHook		hook = NULL;
+    struct _agooErr	err = AGOO_ERR_INIT;
+    HeadReturn		hr;
+    int			status;
+
+    if (0 > (hlen = agoo_head_end(c->buf, c->bcnt, &c->hscan))) {
+	if (agoo_server.max_header - 1 <= (long)c->bcnt) {
+	    return bad_request(c, 431, __LINE__);
+	}
+	return HEAD_AGAIN;
+    }
+    // The read buffer is bigger than the limit so the whole head can be in it.
+    if (agoo_server.max_header <= hlen) {
+	return bad_request(c, 431, __LINE__);
+    }
+    // Whatever happens next the buffer shifts so the next scan starts over.
+    c->hscan = 0;
+    // HTTP/2 with prior knowledge. The preface looks like a head on its own.
+    if ((long)sizeof(h2_preface) - 1 == hlen && 0 == memcmp(c->buf, h2_preface, hlen)) {
+	if (NULL != c->res_head) {
+	    return bad_request(c, 400, __LINE__);
+	}
+	return HEAD_H2;
+    }
+    hend = c->buf + hlen - 4;
+    if (agoo_req_cat.on) {
+	*hend = '\0';
+	agoo_log_cat(&agoo_req_cat, "%llu: %s", (unsigned long long)c->id, c->buf);
+	*hend = '\r';
+    }
+    if (0 != (status = agoo_head_parse(&head, c->buf, c->buf + hlen))) {
+	return bad_request(c, status, __LINE__);
+    }
+    if (AGOO_NONE == (method = head_method(&head))) {
+	return bad_request(c, 400, __LINE__);
+    }
+    if (AGOO_PUT == method || AGOO_POST == method) {
+	const char	*v;
+	int		vlen = 0;
+	char		*vend;
+
+	if (NULL != (v = agoo_head_get(&head, AGOO_HDR_TRANSFER_ENCODING, &vlen))) {
+	    // Only chunked is supported and a Content-Length as well is not
+	    // allowed as the two could disagree on where the body ends.
+	    if (7 != vlen || 0 != strncasecmp("chunked", v, 7)) {
+		return bad_request(c, 501, __LINE__);
+	    }
+	    if (0 != head.known[AGOO_HDR_CONTENT_LENGTH]) {
+		return bad_request(c, 400, __LINE__);
+	    }
+	    chunked = true;
+	} else {
+	    if (NULL == (v = agoo_head_get(&head, AGOO_HDR_CONTENT_LENGTH, &vlen)) || vlen < 1 || !isdigit(*v)) {
+		return bad_request(c, 411, __LINE__);
+	    }
+	    clen = (size_t)strtoul(v, &vend, 10);
+	    if (vend != v + vlen) {
+		return bad_request(c, 411, __LINE__);
 	    }
 	}
     }
-    if (NULL != (v = agoo_con_header_value(c->req->header.start, c->req->header.len, "Accept", &vlen))) {
-	if (0 == strncasecmp("text/event-stream", v, vlen)) {
-	    c->res_tail->close = false;
-	    c->res_tail->con_kind = AGOO_CON_SSE;
-	    return;
+    mlen = hend - c->buf + 4 + clen;
+    *mlenp = mlen;
+
+    head_path(&head, &path, &query, &qend);
+    if (HEAD_OK != (hr = head_route(c, method, &head, &path, &hook))) {
+	return hr;
+    }
+    // A chunked body or one big enough for a temp file is added to the
+    // request as it arrives instead of being read in place. Only handlers
+    // that read the body through Agoo::Request can take it from a file.
+    if (RACK_HOOK == hook->type || BASE_HOOK == hook->type || WAB_HOOK == hook->type) {
+	file_min = agoo_server.body_file_min;
+    }
+    if (chunked || (0 < file_min && file_min <= (long)clen)) {
+	mlen = hlen;
+	*mlenp = mlen;
+	if (NULL == (body = agoo_body_create(&err, chunked, clen, file_min))) {
+	    agoo_log_cat(&agoo_error_cat, "%s", err.msg);
+	    return bad_request(c, 500, __LINE__);
 	}
     }
+    // The request points into the read buffer so the whole message has to
+    // fit. A body that is not read in place needs some room to be read into
+    // after the head.
+    if (!con_reserve(c, (NULL == body) ? mlen : mlen + BODY_READ_MIN)) {
+	agoo_body_destroy(body);
+	return bad_request(c, 413, __LINE__);
+    }
+    if (head.method != c->buf) {
+	agoo_head_move(&head, c->buf);
+    }
+    if (NULL == (c->req = head_req(c, method, &head, c->rbuf, c->buf, mlen, hook))) {
+	agoo_body_destroy(body);
+	return bad_request(c, 413, __LINE__);
+    }
+    if (NULL == (c->req->stream = body)) {
+	c->req->body.start = c->buf + hlen;
+	c->req->body.len = (unsigned int)clen;
+    }
+    c->req_close = should_close(&head);
+    head_upgrade(c, &head);
+
+    return HEAD_OK;
+}
+
+// Creates a request for an HTTP/2 stream from an HTTP/1.1 head that was
+// built in a buffer of its own. Returns NULL if the request has already been
+// answered, with a page or an error, on the stream set in c->sid.
+agooReq
+agoo_con_stream_req(agooCon c, agooRBuf rb, long hlen) {
+    struct _agooHead	head;
+    agooMethod		method;
+    struct _agooSeg	path;
+    char		*query;
+    char		*qend;
+    agooHook		hook = NULL;
+    agooReq		req;
+    int			status;
+
+    if (agoo_req_cat.on) {
+	agoo_log_cat(&agoo_req_cat, "%llu/%u: %.*s", (unsigned long long)c->id, c->sid, (int)hlen - 4, rb->buf);
+    }
+    if (agoo_server.max_header <= hlen) {
+	bad_request(c, 431, __LINE__);
+	return NULL;
+    }
+    if (0 != (status = agoo_head_parse(&head, rb->buf, rb->buf + hlen))) {
+	bad_request(c, status, __LINE__);
+	return NULL;
+    }
+    if (AGOO_NONE == (method = head_method(&head))) {
+	bad_request(c, 400, __LINE__);
+	return NULL;
+    }
+    head_path(&head, &path, &query, &qend);
+    if (HEAD_OK != head_route(c, method, &head, &path, &hook)) {
+	return NULL;
+    }
+    if (NULL == (req = head_req(c, method, &head, rb, rb->buf, hlen, hook))) {
+	bad_request(c, 413, __LINE__);
+	return NULL;
+    }
+    req->body.start = rb->buf + hlen;
+    req->body.len = 0;
+
+    return req;
+}
+
+// Switches to HTTP/2 after the response to an h2c upgrade request. The
+// request has to have no body since the body would have to be read before
+// the switch.
+static void
+con_h2_upgrade(agooCon c, agooReq req) {
+    struct _agooErr	err = AGOO_ERR_INIT;
+    const char		*v;
+    int			vlen = 0;
+    agooRes		res;
+    agooText		message;
+
+    if (NULL != req->stream || 0 < req->body.len || NULL != c->h2 ||
+	NULL == (v = agoo_req_header_value(req, "HTTP2-Settings", &vlen))) {
+	return;
+    }
+    if (AGOO_ERR_OK != agoo_h2_upgrade(&err, c, v, vlen, AGOO_HEAD == req->method)) {
+	agoo_log_cat(&agoo_warn_cat, "%s on connection %llu.", err.msg, (unsigned long long)c->id);
+	return;
+    }
+    if (NULL == (res = agoo_res_create(c)) ||
+	NULL == (message = agoo_text_create(h2_switch, sizeof(h2_switch) - 1))) {
+	agoo_res_destroy(res);
+	agoo_h2_destroy(c->h2);
+	c->h2 = NULL;
+	return;
+    }
+    if (NULL == c->res_tail) {
+	c->res_head = res;
+    } else {
+	c->res_tail->next = res;
+    }
+    c->res_tail = res;
+    res->con_kind = AGOO_CON_H2;
+    agoo_res_set_message(res, message);
+    // The response to the request goes out on stream 1.
+    c->sid = 1;
+}
+
+// Creates the response for a request and hands the request to its
+// hook. Returns false if the response could not be created.
+static bool
+req_queue(agooCon c, agooReq req, bool close, agooConKind up_kind) {
+    agooRes	res;
+
+    if (AGOO_CON_H2 == up_kind) {
+	con_h2_upgrade(c, req);
+	up_kind = AGOO_CON_ANY;
+	close = false;
+    }
+    res = agoo_res_create(c);
+    c->sid = 0;
+    if (NULL == res) {
+	agoo_log_cat(&agoo_error_cat, "memory allocation of response failed on connection %llu.", (unsigned long long)c->id);
+	agoo_req_destroy(req);
+	bad_request(c, 500, __LINE__);
+
+	return false;
+    }
+    if (NULL == c->res_tail) {
+	c->res_head = res;
+    } else {
+	c->res_tail->next = res;
+    }
+    c->res_tail = res;
+    res->close = close;
+    if (res->close) {
+	c->closing = true;
+    }
+    if (AGOO_CON_ANY != up_kind) {
+	res->close = false;
+	res->con_kind = up_kind;
+    }
+    req->res = res;
+    if (req->hook->no_queue && FUNC_HOOK == req->hook->type) {
+	req->hook->func(req);
+	agoo_req_destroy(req);
+    } else {
+	agoo_queue_push(req->hook->queue, (void*)req);
+    }
+    return true;
+}
+
+// Queues a request for an HTTP/2 stream once it has ended. The response is
+// for the stream set in c->sid.
+bool
+agoo_con_stream_queue(agooCon c, agooReq req) {
+    uint32_t	sid = c->sid;
+    bool	ok = req_queue(c, req, false, AGOO_CON_ANY);
+
+    c->sid = sid;
+
+    return ok;
+}
+
+// Returns where the next read should go and how much room there is. Reads
+// go into the read buffer, which already has room for the rest of a request
+// or WebSocket frame that is in it. HTTP/2 needs room for a whole frame.
+// Zero is returned if the buffer could not be allocated.
+static size_t
+con_read_buf(agooCon c, char **bufp) {
+    size_t	size = (size_t)agoo_server.max_header;
+
+    if (AGOO_CON_H2 == c->bind->kind && size < AGOO_H2_READ_MIN) {
+	size = AGOO_H2_READ_MIN;
+    }
+    // A whole TLS record is decrypted at once so make room for one.
+    if (NULL != c->tls && size < c->bcnt + AGOO_TLS_RECORD) {
+	size = c->bcnt + AGOO_TLS_RECORD;
+    }
+    if (NULL == c->req && !con_reserve(c, size)) {
+	*bufp = NULL;
+	return 0;
+    }
+    *bufp = c->buf + c->bcnt;
+
+    return c->rbuf->buf + c->rbuf->size - *bufp - 1;
 }
 
 bool
 agoo_con_http_read(agooCon c) {
     ssize_t	cnt;
+    size_t	rsize;
+    char	*buf;
 
     if (c->dead || 0 == c->sock || c->closing) {
 	return true;
     }
-    if (NULL != c->req) {
-	cnt = recv(c->sock, c->req->msg + c->bcnt, c->req->mlen - c->bcnt, 0);
-    } else {
-	cnt = recv(c->sock, c->buf + c->bcnt, sizeof(c->buf) - c->bcnt - 1, 0);
+    if (0 == (rsize = con_read_buf(c, &buf))) {
+	agoo_log_cat(&agoo_error_cat, "Out of memory reading from connection %llu.", (unsigned long long)c->id);
+	return true;
+    }
+    cnt = con_recv(c, buf, rsize);
+    c->more = false;
+    if (0 > cnt && (EAGAIN == errno || EWOULDBLOCK == errno)) {
+	return false;
+    }
+    if (agoo_con_http_received(c, cnt)) {
+	return true;
+    }
+    c->more = ((size_t)cnt == rsize || NULL != c->tls);
+
+    return false;
+}
+
+// Adds what has been read after the head to a body that is not read in
+// place. The head stays at the front of the buffer and anything read after
+// the end of the body is moved up behind it. Returns false on error.
+static bool
+con_body_read(agooCon c) {
+    agooReq		req = c->req;
+    agooBody		body = req->stream;
+    char		*start = c->buf + req->mlen;
+    size_t		len = c->bcnt - req->mlen;
+    struct _agooErr	err = AGOO_ERR_INIT;
+    long		cnt;
+
+    if (0 > (cnt = agoo_body_add(&err, body, start, len))) {
+	agoo_log_cat(&agoo_warn_cat, "%s on connection %llu.", err.msg, (unsigned long long)c->id);
+	c->req = NULL;
+	agoo_req_destroy(req);
+	bad_request(c, (AGOO_ERR_PARSE == err.code) ? 400 : 500, __LINE__);
+	c->bcnt = 0;
+
+	return false;
+    }
+    if (body->done) {
+	if (0 <= body->fd) {
+	    req->body.start = NULL;
+	} else if (NULL == body->buf) {
+	    req->body.start = start; // empty
+	} else {
+	    req->body.start = body->buf;
+	}
+	req->body.len = (unsigned int)body->len;
+	if ((size_t)cnt < len) {
+	    memmove(start, start + cnt, len - cnt);
+	}
+    }
+    c->bcnt -= cnt;
+
+    return true;
+}
+
+// Called after cnt bytes have been read into the buffer returned by
+// con_read_buf(). Returns true if the connection should be closed.
+bool
+agoo_con_http_received(agooCon c, ssize_t cnt) {
+    if (c->dead || 0 == c->sock || c->closing) {
+	return true;
     }
     c->timeout = dtime() + CON_TIMEOUT;
     if (0 >= cnt) {
+	// A client that shuts down its side after sending pipelined requests
+	// still gets the responses that are pending.
+	if (0 == cnt && NULL != c->res_head) {
+	    c->closing = true;
+	    return false;
+	}
 	// If nothing read then no need to complain. Just close.
 	if (0 < c->bcnt) {
 	    if (0 == cnt) {
@@ -439,6 +862,9 @@ agoo_con_http_read(agooCon c) {
 	return true;
     }
     c->bcnt += cnt;
+    if (NULL == c->req) {
+	c->buf[c->bcnt] = '\0';
+    }
     while (true) {
 	if (NULL == c->req) {
 	    size_t	mlen;
@@ -451,18 +877,16 @@ agoo_con_http_read(agooCon c) {
 		// req was created
 		break;
 	    case HEAD_HANDLED:
-		if (mlen < c->bcnt) {
-		    memmove(c->buf, c->buf + mlen, c->bcnt - mlen);
-		    c->bcnt -= mlen;
+		c->buf += mlen;
+		c->bcnt -= mlen;
+		if (0 < c->bcnt) {
 		    // req is NULL so try to ready the header on the next request.
 		    continue;
-		} else {
-		    c->bcnt = 0;
-		    *c->buf = '\0';
-
-		    return false;
 		}
-		break;
+		return false;
+	    case HEAD_H2:
+		c->bind = &h2_bind;
+		return agoo_h2_start(c);
 	    case HEAD_ERR:
 	    default:
 		c->bcnt = 0;
@@ -471,48 +895,33 @@ agoo_con_http_read(agooCon c) {
 		return false;
 	    }
 	}
+	if (NULL != c->req && NULL != c->req->stream && !c->req->stream->done) {
+	    if (c->req->mlen < c->bcnt && !con_body_read(c)) {
+		return false;
+	    }
+	    if (!c->req->stream->done) {
+		return false;
+	    }
+	}
 	if (NULL != c->req) {
 	    if (c->req->mlen <= c->bcnt) {
-		agooReq	req;
-		agooRes	res;
-		long	mlen;
+		agooReq	req = c->req;
+		long	mlen = req->mlen;
 
-		if (agoo_debug_cat.on && NULL != c->req && NULL != c->req->body.start) {
-		    agoo_log_cat(&agoo_debug_cat, "request on %llu: %s", (unsigned long long)c->id, c->req->body.start);
-		}
-		if (NULL == (res = agoo_res_create(c))) {
-		    c->req = NULL;
-		    agoo_log_cat(&agoo_error_cat, "memory allocation of response failed on connection %llu.", (unsigned long long)c->id);
-		    return bad_request(c, 500, __LINE__);
-		} else {
-		    if (NULL == c->res_tail) {
-			c->res_head = res;
-		    } else {
-			c->res_tail->next = res;
-		    }
-		    c->res_tail = res;
-		    res->close = should_close(c->req->header.start, c->req->header.len);
-		    if (res->close) {
-			c->closing = true;
-		    }
+		if (agoo_debug_cat.on && NULL != req->body.start) {
+		    agoo_log_cat(&agoo_debug_cat, "request on %llu: %.*s",
+				 (unsigned long long)c->id, (int)req->body.len, req->body.start);
 		}
-		c->req->res = res;
-		mlen = c->req->mlen;
-		check_upgrade(c);
-		req = c->req;
 		c->req = NULL;
-		if (req->hook->no_queue && FUNC_HOOK == req->hook->type) {
-		    req->hook->func(req);
-		    agoo_req_destroy(req);
-		} else {
-		    agoo_queue_push(req->hook->queue, (void*)req);
+		if (!req_queue(c, req, c->req_close, c->up_kind)) {
+		    return true;
 		}
-		if (mlen < (long)c->bcnt) {
-		    memmove(c->buf, c->buf + mlen, c->bcnt - mlen);
-		    c->bcnt -= mlen;
-		} else {
-		    c->bcnt = 0;
-		    *c->buf = '\0';
+		// The request still points into the buffer so move past it.
+		c->buf += mlen;
+		c->bcnt -= mlen;
+		// After an h2c upgrade anything else is HTTP/2 and waits for
+		// the switch.
+		if (0 == c->bcnt || NULL != c->h2) {
 		    break;
 		}
 		continue;
@@ -523,18 +932,267 @@ agoo_con_http_read(agooCon c) {
     return false;
 }
 
+static bool
+con_h2_read(agooCon c) {
+    ssize_t	cnt;
+    size_t	rsize;
+    char	*buf;
+
+    if (c->dead || 0 == c->sock) {
+	return true;
+    }
+    if (0 == (rsize = con_read_buf(c, &buf))) {
+	agoo_log_cat(&agoo_error_cat, "Out of memory reading from connection %llu.", (unsigned long long)c->id);
+	return true;
+    }
+    cnt = con_recv(c, buf, rsize);
+    c->more = false;
+    if (0 > cnt && (EAGAIN == errno || EWOULDBLOCK == errno)) {
+	return false;
+    }
+    if (agoo_h2_received(c, cnt)) {
+	return true;
+    }
+    c->more = ((size_t)cnt == rsize || NULL != c->tls);
+
+    return false;
+}
+
 static bool
 con_ws_read(agooCon c) {
     ssize_t	cnt;
-    uint8_t	*b;
+    size_t	rsize;
+    char	*buf;
+
+    if (0 == (rsize = con_read_buf(c, &buf))) {
+	agoo_log_cat(&agoo_error_cat, "Out of memory reading from connection %llu.", (unsigned long long)c->id);
+	return true;
+    }
+    cnt = con_recv(c, buf, rsize);
+    c->more = false;
+    if (0 > cnt && (EAGAIN == errno || EWOULDBLOCK == errno)) {
+	return false;
+    }
+    if (con_ws_received(c, cnt)) {
+	return true;
+    }
+    c->more = ((size_t)cnt == rsize || NULL != c->tls);
+
+    return false;
+}
+
+// Tells the handler and logs why a WebSocket connection is being
+// closed. Always returns -1.
+static int
+ws_error(agooCon c, const char *msg) {
+    push_error(c->up, msg, (int)strlen(msg));
+    agoo_log_cat(&agoo_error_cat, "%s on connection %llu.", msg, (unsigned long long)c->id);
+
+    return -1;
+}
+
+// Reads the head of the next frame. A control frame is handled once all of
+// it has been read. Returns -1 to close, 0 if more has to be read, or 1 if
+// the frame was started or handled.
+static int
+ws_frame_start(agooCon c, agooWsRead ws) {
+    uint8_t	*b = (uint8_t*)c->buf;
+    uint64_t	plen = 0;
+    bool	masked = false;
+    size_t	hlen;
     uint8_t	op;
-    long	mlen;	
+    bool	fin;
+
+    if (0 == (hlen = agoo_ws_head(b, c->bcnt, &plen, &masked)) || (masked && c->bcnt < hlen + 4)) {
+	return 0;
+    }
+    op = 0x0F & *b;
+    fin = (0 != (0x80 & *b));
+    if (masked) {
+	memcpy(ws->mask, b + hlen, 4);
+	hlen += 4;
+    }
+    // Control frames can come between the frames of a message but can not
+    // be split themselves.
+    if (0 != (0x08 & op)) {
+	if (!fin || 125 < plen) {
+	    return ws_error(c, "Invalid WebSocket control frame");
+	}
+	if (c->bcnt < hlen + plen) {
+	    return 0;
+	}
+	switch (op) {
+	case AGOO_WS_OP_CLOSE:
+	    return -1;
+	case AGOO_WS_OP_PING:
+	    if (masked) {
+		agoo_ws_unmask(b + hlen, b + hlen, plen, ws->mask, 0);
+	    }
+	    agoo_ws_pong(c, (char*)b + hlen, plen);
+	    break;
+	case AGOO_WS_OP_PONG:
+	    // ignore
+	    break;
+	default:
+	    goto UNSUPPORTED;
+	}
+	c->buf += hlen + plen;
+	c->bcnt -= hlen + plen;
 
-    if (NULL != c->req) {
-	cnt = recv(c->sock, c->req->msg + c->bcnt, c->req->mlen - c->bcnt, 0);
+	return 1;
+    }
+    switch (op) {
+    case AGOO_WS_OP_TEXT:
+    case AGOO_WS_OP_BIN:
+	if (0 != ws->op) {
+	    return ws_error(c, "WebSocket message started before the last one was finished");
+	}
+	if (NULL == c->up || agoo_server.ctx_nil_value == c->up->ctx) {
+	    return -1;
+	}
+	ws->op = op;
+	ws->len = 0;
+	break;
+    case AGOO_WS_OP_CONT:
+	if (0 == ws->op) {
+	    return ws_error(c, "WebSocket continuation frame without a message");
+	}
+	break;
+    default:
+	goto UNSUPPORTED;
+    }
+    if (!ws->stream && c->up->on_part &&
+	0 < agoo_server.ws_stream_min && (uint64_t)agoo_server.ws_stream_min <= ws->len + plen) {
+	ws->stream = true;
+	// What has been put back together so far is the first part.
+	if (NULL != ws->req) {
+	    agoo_ws_push(c, ws->req, ws->len, true, false);
+	    ws->req = NULL;
+	    ws->cap = 0;
+	}
+    }
+    if (!ws->stream && 0 < agoo_server.ws_max_message && (uint64_t)agoo_server.ws_max_message < ws->len + plen) {
+	return ws_error(c, "WebSocket message too large");
+    }
+    ws->masked = masked;
+    ws->fin = fin;
+    ws->left = plen;
+    ws->moff = 0;
+    ws->in_frame = true;
+    c->buf += hlen;
+    c->bcnt -= hlen;
+
+    return 1;
+UNSUPPORTED:
+    {
+	char	msg[1024];
+
+	snprintf(msg, sizeof(msg), "WebSocket op 0x%02x not supported", op);
+
+	return ws_error(c, msg);
+    }
+}
+
+// Reads the payload of a frame once all of it is in the read buffer. A
+// message in one frame is unmasked in place and handed off without a
+// copy. The frames of a split message are unmasked into a buffer of its
+// own.
+static int
+ws_frame_read(agooCon c, agooWsRead ws) {
+    uint8_t	*payload = (uint8_t*)c->buf;
+    size_t	len = (size_t)ws->left;
+
+    if (c->bcnt < len) {
+	if (!con_reserve(c, len)) {
+	    return ws_error(c, "Out of memory reading a WebSocket message");
+	}
+	return 0;
+    }
+    if (ws->fin && NULL == ws->req) {
+	agooReq	req;
+
+	if (ws->masked) {
+	    agoo_ws_unmask(payload, payload, len, ws->mask, 0);
+	}
+	if (NULL == (req = agoo_req_create_rbuf(len, c->rbuf, c->buf))) {
+	    return ws_error(c, "Out of memory reading a WebSocket message");
+	}
+	agoo_ws_push(c, req, len, false, false);
     } else {
-	cnt = recv(c->sock, c->buf + c->bcnt, sizeof(c->buf) - c->bcnt - 1, 0);
+	if (!agoo_ws_reserve(ws, len)) {
+	    return ws_error(c, "Out of memory reading a WebSocket message");
+	}
+	if (ws->masked) {
+	    agoo_ws_unmask((uint8_t*)ws->req->msg + ws->len, payload, len, ws->mask, 0);
+	} else {
+	    memcpy(ws->req->msg + ws->len, payload, len);
+	}
+	ws->len += len;
+	if (ws->fin) {
+	    agoo_ws_push(c, ws->req, ws->len, false, false);
+	    ws->req = NULL;
+	    ws->cap = 0;
+	}
     }
+    c->buf += len;
+    c->bcnt -= len;
+    ws->in_frame = false;
+    if (ws->fin) {
+	ws->op = 0;
+    }
+    return 1;
+}
+
+// Hands the payload to the handler as it arrives. Parts are at least
+// WS_PART_MIN bytes unless the frame ends so the handler is not called for
+// every read.
+static int
+ws_frame_part(agooCon c, agooWsRead ws) {
+    size_t	len = (size_t)ws->left;
+    bool	last;
+
+    if (c->bcnt < len) {
+	if (c->bcnt < WS_PART_MIN) {
+	    if (!con_reserve(c, WS_PART_MIN)) {
+		return ws_error(c, "Out of memory reading a WebSocket message");
+	    }
+	    return 0;
+	}
+	len = c->bcnt;
+    }
+    if (ws->masked) {
+	agoo_ws_unmask((uint8_t*)c->buf, (uint8_t*)c->buf, len, ws->mask, ws->moff);
+    }
+    ws->moff = (ws->moff + len) & 0x03;
+    ws->left -= len;
+    ws->len += len;
+    last = ws->fin && 0 == ws->left;
+    if (0 < len || last) {
+	agooReq	req;
+
+	if (NULL == (req = agoo_req_create_rbuf(len, c->rbuf, c->buf))) {
+	    return ws_error(c, "Out of memory reading a WebSocket message");
+	}
+	agoo_ws_push(c, req, len, true, last);
+    }
+    c->buf += len;
+    c->bcnt -= len;
+    if (0 < ws->left) {
+	return 0;
+    }
+    ws->in_frame = false;
+    if (ws->fin) {
+	ws->op = 0;
+	ws->stream = false;
+    }
+    return 1;
+}
+
+static bool
+con_ws_received(agooCon c, ssize_t cnt) {
+    agooWsRead	ws;
+    int		r;
+
     c->timeout = dtime() + CON_TIMEOUT;
     if (0 >= cnt) {
 	// If nothing read then no need to complain. Just close.
@@ -552,130 +1210,224 @@ con_ws_read(agooCon c) {
 	return true;
     }
     c->bcnt += cnt;
-    while (true) {
-	if (NULL == c->req) {
-	    if (c->bcnt < 2) {
-		return false; // Try again.
-	    }
-	    b = (uint8_t*)c->buf;
-	    if (0 >= (mlen = agoo_ws_calc_len(c, b, c->bcnt))) {
-		return (mlen < 0);
-	    }
-	    op = 0x0F & *b;
-	    switch (op) {
-	    case AGOO_WS_OP_TEXT:
-	    case AGOO_WS_OP_BIN:
-		if (agoo_ws_create_req(c, mlen)) {
-		    return true;
-		}
-		break;
-	    case AGOO_WS_OP_CLOSE:
-		return true;
-	    case AGOO_WS_OP_PING:
-		if (mlen == (long)c->bcnt) {
-		    agoo_ws_pong(c);
-		    c->bcnt = 0;
-		}
-		break;
-	    case AGOO_WS_OP_PONG:
-		// ignore
-		if (mlen == (long)c->bcnt) {
-		    c->bcnt = 0;
-		}
-		break;
-	    case AGOO_WS_OP_CONT:
-	    default: {
-		char	msg[1024];
-		int	len = snprintf(msg, sizeof(msg) - 1, "WebSocket op 0x%02x not supported on %llu.",
-				       op, (unsigned long long)c->id);
+    if (NULL == (ws = c->ws) && NULL == (ws = c->ws = agoo_ws_read_create())) {
+	agoo_log_cat(&agoo_error_cat, "Out of memory attempting to allocate WebSocket state.");
+	return true;
+    }
+    do {
+	if (!ws->in_frame) {
+	    r = ws_frame_start(c, ws);
+	} else if (ws->stream) {
+	    r = ws_frame_part(c, ws);
+	} else {
+	    r = ws_frame_read(c, ws);
+	}
+    } while (0 < r);
 
-		push_error(c->up, msg, len);
-		agoo_log_cat(&agoo_error_cat, "WebSocket op 0x%02x not supported on %llu.", op, (unsigned long long)c->id);
-		return true;
-	    }
-	    }
+    return (0 > r);
+}
+
+static void
+log_response(agooCon c, agooText message) {
+    if (agoo_resp_cat.on) {
+	char	buf[4096];
+	char	*hend = strstr(message->text, "\r\n\r\n");
+
+	if (NULL == hend) {
+	    hend = message->text + message->len;
 	}
-	if (NULL != c->req) {
-	    mlen = c->req->mlen;
-	    c->req->mlen = agoo_ws_decode(c->req->msg, c->req->mlen);
-	    if (mlen <= (long)c->bcnt) {
-		if (agoo_debug_cat.on) {
-		    if (AGOO_ON_MSG == c->req->method) {
-			agoo_log_cat(&agoo_debug_cat, "WebSocket message on %llu: %s", (unsigned long long)c->id, c->req->msg);
-		    } else {
-			agoo_log_cat(&agoo_debug_cat, "WebSocket binary message on %llu", (unsigned long long)c->id);
-		    }
-		}
-	    }
-	    agoo_upgraded_ref(c->up);
-	    agoo_queue_push(&agoo_server.eval_queue, (void*)c->req);
-	    if (mlen < (long)c->bcnt) {
-		memmove(c->buf, c->buf + mlen, c->bcnt - mlen);
-		c->bcnt -= mlen;
-	    } else {
-		c->bcnt = 0;
-		*c->buf = '\0';
-		c->req = NULL;
-		break;
-	    }
-	    c->req = NULL;
-	    continue;
+	if ((long)sizeof(buf) <= hend - message->text) {
+	    hend = message->text + sizeof(buf) - 1;
 	}
-	break;
+	memcpy(buf, message->text, hend - message->text);
+	buf[hend - message->text] = '\0';
+	agoo_log_cat(&agoo_resp_cat, "%llu: %s", (unsigned long long)c->id, buf);
     }
-    return false;
+    if (agoo_debug_cat.on) {
+	agoo_log_cat(&agoo_debug_cat, "response on %llu: %s", (unsigned long long)c->id, message->text);
+    }
+}
+
+// Returns the message to write next or NULL if there is nothing to write.
+agooText
+agoo_con_http_prep(agooCon c) {
+    agooText	message = agoo_res_message(c->res_head);
+
+    if (NULL == message) {
+	return NULL;
+    }
+    c->timeout = dtime() + CON_TIMEOUT;
+    if (0 == c->wcnt) {
+	log_response(c, message);
+    }
+    return message;
+}
+
+// Writes some of the file part of a message. The file offset is the start
+// offset plus how far past the text the write count is.
+static ssize_t
+send_file_body(agooCon c, agooText message) {
+    off_t	sent = (off_t)(c->wcnt - message->len);
+    off_t	off = message->foff + sent;
+    size_t	size = (size_t)(message->flen - sent);
+
+    if (NULL != c->tls) {
+	return agoo_tls_sendfile(c->tls, message->fd, off, size);
+    }
+#if HAVE_SYS_SENDFILE_H
+    return sendfile(c->sock, message->fd, &off, size);
+#else
+    char	buf[65536];
+    ssize_t	cnt;
+
+    if (sizeof(buf) < size) {
+	size = sizeof(buf);
+    }
+    if (0 >= (cnt = pread(message->fd, buf, size, off))) {
+	return cnt;
+    }
+    // If not all is sent the rest is read again on the next write.
+    return send(c->sock, buf, cnt, MSG_DONTWAIT);
+#endif
+}
+
+// Fills iov with the unwritten part of the head message followed by the
+// messages of any responses behind it that are also ready. Pipelined requests
+// and responses finished together by the workers then go out in one system
+// call instead of one each. Responses with a file body or that change the
+// connection kind are left for when they reach the head.
+static int
+gather(agooCon c, agooText message, struct iovec *iov, int max) {
+    agooRes	res = c->res_head;
+    agooText	t;
+    int		cnt = 1;
+
+    iov->iov_base = message->text + c->wcnt;
+    iov->iov_len = message->len - c->wcnt;
+    if (AGOO_CON_HTTP != res->con_kind || res->close) {
+	return cnt;
+    }
+    for (res = res->next; NULL != res && cnt < max; res = res->next) {
+	if (NULL == (t = agoo_res_message(res)) || 0 != t->fd || AGOO_CON_HTTP != res->con_kind) {
+	    break;
+	}
+	iov[cnt].iov_base = t->text;
+	iov[cnt].iov_len = t->len;
+	cnt++;
+	if (res->close) {
+	    break;
+	}
+    }
+    return cnt;
+}
+
+// Returns 0 if there is nothing to write or the head has a file body.
+int
+agoo_con_http_gather(agooCon c, struct iovec *iov, int max) {
+    agooText	message = agoo_con_http_prep(c);
+
+    if (NULL == message || 0 != message->fd) {
+	return 0;
+    }
+    return gather(c, message, iov, max);
 }
 
 // return false to remove/close connection
 bool
 agoo_con_http_write(agooCon c) {
-    agooText	message = agoo_res_message(c->res_head);
+    agooText	message = agoo_con_http_prep(c);
     ssize_t	cnt;
 
     if (NULL == message) {
 	return true;
     }
-    c->timeout = dtime() + CON_TIMEOUT;
-    if (0 == c->wcnt) {
-	if (agoo_resp_cat.on) {
-	    char	buf[4096];
-	    char	*hend = strstr(message->text, "\r\n\r\n");
+    if (0 == message->fd) {
+	struct iovec	iov[MAX_WRITE_IOV];
+	struct msghdr	mh;
 
-	    if (NULL == hend) {
-		hend = message->text + message->len;
-	    }
-	    if ((long)sizeof(buf) <= hend - message->text) {
-		hend = message->text + sizeof(buf) - 1;
+	memset(&mh, 0, sizeof(mh));
+	mh.msg_iov = iov;
+	mh.msg_iovlen = gather(c, message, iov, MAX_WRITE_IOV);
+	if (0 > (cnt = con_sendmsg(c, &mh)) && EAGAIN == errno) {
+	    return true;
+	}
+	return agoo_con_http_sent(c, cnt);
+    }
+    // Keep going until the socket would block since edge triggered polling
+    // does not report the socket again if a partial write did not fill it.
+    while (true) {
+	if (c->wcnt < message->len) {
+	    int	flags = MSG_DONTWAIT;
+
+#ifdef MSG_MORE
+	    // Hold the header so it goes out with the start of the body.
+	    flags |= MSG_MORE;
+#endif
+	    if (NULL == c->tls) {
+		cnt = send(c->sock, message->text + c->wcnt, message->len - c->wcnt, flags);
+	    } else {
+		cnt = agoo_tls_send(c->tls, message->text + c->wcnt, message->len - c->wcnt);
 	    }
-	    memcpy(buf, message->text, hend - message->text);
-	    buf[hend - message->text] = '\0';
-	    agoo_log_cat(&agoo_resp_cat, "%llu: %s", (unsigned long long)c->id, buf);
+	} else if (0 == (cnt = send_file_body(c, message))) {
+	    agoo_log_cat(&agoo_error_cat, "File for response on %llu was truncated.", (unsigned long long)c->id);
+	    return false;
+	}
+	if (0 > cnt && EAGAIN == errno) {
+	    return true;
 	}
-	if (agoo_debug_cat.on) {
-	    agoo_log_cat(&agoo_debug_cat, "response on %llu: %s", (unsigned long long)c->id, message->text);
+	if (!agoo_con_http_sent(c, cnt)) {
+	    return false;
 	}
-    }
-    if (0 > (cnt = send(c->sock, message->text + c->wcnt, message->len - c->wcnt, MSG_DONTWAIT))) {
-	if (EAGAIN == errno) {
+	if (0 == c->wcnt) { // finished
 	    return true;
 	}
+    }
+}
+
+// Called after cnt bytes of the prepared or gathered messages have been
+// written. A gathered write can finish several responses so each is released
+// in turn and wcnt is left set for the one the write stopped in. Returns
+// false to remove/close the connection.
+bool
+agoo_con_http_sent(agooCon c, ssize_t cnt) {
+    agooRes	res;
+    agooText	message;
+    ssize_t	rest;
+    bool	done;
+    bool	first = true;
+
+    if (0 > cnt) {
 	agoo_log_cat(&agoo_error_cat, "Socket error @ %llu.", (unsigned long long)c->id);
 
 	return false;
     }
-    c->wcnt += cnt;
-    if (c->wcnt == message->len) { // finished
-	agooRes	res = c->res_head;
-	bool	done = res->close;
-	
+    while (NULL != (res = c->res_head) && NULL != (message = agoo_res_message(res))) {
+	// The head message was logged by the prep.
+	if (!first && 0 == c->wcnt) {
+	    log_response(c, message);
+	}
+	first = false;
+	rest = message->len + message->flen - c->wcnt;
+	if (cnt < rest) {
+	    c->wcnt += cnt;
+	    break;
+	}
+	cnt -= rest;
 	c->res_head = res->next;
 	if (res == c->res_tail) {
 	    c->res_tail = NULL;
 	}
 	c->wcnt = 0;
+	done = res->close;
 	agoo_res_destroy(res);
-
-	return !done;
+	// Once closing there is nothing more to read so the connection is
+	// done when the last pending response is written.
+	if (done || (c->closing && NULL == c->res_head)) {
+	    return false;
+	}
+	if (0 == cnt) {
+	    break;
+	}
     }
     return true;
 }
@@ -691,7 +1443,7 @@ con_ws_write(agooCon c) {
 
     if (NULL == message) {
 	if (res->ping) {
-	    if (0 > (cnt = send(c->sock, ping_msg, sizeof(ping_msg) - 1, 0))) {
+	    if (0 > (cnt = agoo_con_send(c, ping_msg, sizeof(ping_msg) - 1))) {
 		char	msg[1024];
 		int	len;
 
@@ -708,7 +1460,7 @@ con_ws_write(agooCon c) {
 		return false;
 	    }
 	} else if (res->pong) {
-	    if (0 > (cnt = send(c->sock, pong_msg, sizeof(pong_msg) - 1, 0))) {
+	    if (0 > (cnt = agoo_con_send(c, pong_msg, sizeof(pong_msg) - 1))) {
 		char	msg[1024];
 		int	len;
 
@@ -737,10 +1489,31 @@ con_ws_write(agooCon c) {
 	if (res == c->res_tail) {
 	    c->res_tail = NULL;
 	}
+	agoo_res_destroy(res);
+
+	return true;
+    }
+    message = con_ws_prep(c);
+    if (0 > (cnt = agoo_con_send(c, message->text + c->wcnt, message->len - c->wcnt)) && EAGAIN == errno) {
 	return true;
     }
+    return con_ws_sent(c, cnt);
+}
+
+// Returns the framed message to write next or NULL if the head response is
+// a control response.
+static agooText
+con_ws_prep(agooCon c) {
+    agooRes	res = c->res_head;
+    agooText	message = agoo_res_message(res);
+
+    if (NULL == message) {
+	return NULL;
+    }
     c->timeout = dtime() + CON_TIMEOUT;
-    if (0 == c->wcnt) {
+    // A write that would have blocked leaves wcnt at zero so the framing
+    // is only added the first time.
+    if (0 == c->wcnt && !res->framed) {
 	agooText	t;
 	
 	if (agoo_push_cat.on) {
@@ -755,14 +1528,19 @@ con_ws_write(agooCon c) {
 	    agoo_res_set_message(res, t);
 	    message = t;
 	}
+	res->framed = true;
     }
-    if (0 > (cnt = send(c->sock, message->text + c->wcnt, message->len - c->wcnt, 0))) {
+    return message;
+}
+
+static bool
+con_ws_sent(agooCon c, ssize_t cnt) {
+    agooText	message = agoo_res_message(c->res_head);
+
+    if (0 > cnt) {
 	char	msg[1024];
 	int	len;
 
-	if (EAGAIN == errno) {
-	    return true;
-	}
 	len = snprintf(msg, sizeof(msg) - 1, "Socket error @ %llu.", (unsigned long long)c->id);
 	push_error(c->up, msg, len);
 	agoo_log_cat(&agoo_error_cat, "Socket error @ %llu.", (unsigned long long)c->id);
@@ -790,7 +1568,7 @@ con_ws_write(agooCon c) {
 static bool
 con_sse_write(agooCon c) {
     agooRes	res = c->res_head;
-    agooText	message = agoo_res_message(res);
+    agooText	message = con_sse_prep(c);
     ssize_t	cnt;
 
     if (NULL == message) {
@@ -798,8 +1576,22 @@ con_sse_write(agooCon c) {
 
 	return false;
     }
+    if (0 > (cnt = agoo_con_send(c, message->text + c->wcnt, message->len - c->wcnt)) && EAGAIN == errno) {
+	return true;
+    }
+    return con_sse_sent(c, cnt);
+}
+
+static agooText
+con_sse_prep(agooCon c) {
+    agooRes	res = c->res_head;
+    agooText	message = agoo_res_message(res);
+
+    if (NULL == message) {
+	return NULL;
+    }
     c->timeout = dtime() + CON_TIMEOUT *2;
-    if (0 == c->wcnt) {
+    if (0 == c->wcnt && !res->framed) {
 	agooText	t;
 	
 	if (agoo_push_cat.on) {
@@ -810,14 +1602,19 @@ con_sse_write(agooCon c) {
 	    agoo_res_set_message(res, t);
 	    message = t;
 	}
+	res->framed = true;
     }
-    if (0 > (cnt = send(c->sock, message->text + c->wcnt, message->len - c->wcnt, 0))) {
+    return message;
+}
+
+static bool
+con_sse_sent(agooCon c, ssize_t cnt) {
+    agooText	message = agoo_res_message(c->res_head);
+
+    if (0 > cnt) {
 	char	msg[1024];
 	int	len;
 
-	if (EAGAIN == errno) {
-	    return true;
-	}
 	len = snprintf(msg, sizeof(msg) - 1, "Socket error @ %llu.", (unsigned long long)c->id);
 	push_error(c->up, msg, len);
 	agoo_log_cat(&agoo_error_cat, "Socket error @ %llu.", (unsigned long long)c->id);
@@ -841,38 +1638,121 @@ con_sse_write(agooCon c) {
     return true;
 }
 
-static void
-publish_pub(agooPub pub, agooConLoop loop) {
-    agooUpgraded	up;
-    const char		*sub = pub->subject->pattern;
-    int			cnt = 0;
+// Appends a response to the connection and wakes the connection link up so
+// only the connections that were given something are looked at.
+static agooRes
+pub_res(agooCon c, agooReady ready) {
+    agooRes	res = agoo_res_create(c);
+
+    if (NULL != res) {
+	if (NULL == c->res_tail) {
+	    c->res_head = res;
+	} else {
+	    c->res_tail->next = res;
+	}
+	c->res_tail = res;
+	if (NULL != c->link) {
+	    agoo_ready_activate(ready, c->link);
+	}
+    }
+    return res;
+}
 
-    for (up = agoo_server.up_list; NULL != up; up = up->next) {
-	if (NULL != up->con && up->con->loop == loop && agoo_upgraded_match(up, sub)) {
-	    agooRes	res = agoo_res_create(up->con);
+typedef struct _pubMatch {
+    agooPub	pub;
+    agooConLoop	loop;
+    agooReady	ready;
+    agooText	ws;  // framed once and shared by all WebSocket subscribers
+    agooText	sse; // framed once and shared by all SSE subscribers
+} *PubMatch;
+
+// Returns a framed copy of the message that is held until the publish is
+// done.
+static agooText
+pub_framed(agooText msg, agooText (*expand)(agooText t)) {
+    agooText	t = agoo_text_dup(msg);
+
+    if (NULL != t) {
+	t->bin = msg->bin;
+	if (NULL != (t = expand(t))) {
+	    agoo_text_ref(t);
+	}
+    }
+    return t;
+}
 
-	    if (NULL != res) {
-		if (NULL == up->con->res_tail) {
-		    up->con->res_head = res;
-		} else {
-		    up->con->res_tail->next = res;
-		}
-		up->con->res_tail = res;
-		res->con_kind = AGOO_CON_ANY;
-		agoo_res_set_message(res, agoo_text_dup(pub->msg));
-		cnt++;
+static void
+publish_match(agooSubject s, void *arg) {
+    PubMatch		pm = (PubMatch)arg;
+    agooUpgraded	up = (agooUpgraded)s->owner;
+    agooCon		c = up->con;
+    agooText		t;
+    agooRes		res;
+
+    // An upgraded with more than one matching subject only gets the
+    // message once.
+    if (pm->loop->pub_seq == up->mark || NULL == c) {
+	return;
+    }
+    up->mark = pm->loop->pub_seq;
+    switch (c->bind->kind) {
+    case AGOO_CON_WS:
+	if (NULL == pm->ws) {
+	    pm->ws = pub_framed(pm->pub->msg, agoo_ws_expand);
+	}
+	t = pm->ws;
+	break;
+    case AGOO_CON_SSE:
+	if (NULL == pm->sse) {
+	    pm->sse = pub_framed(pm->pub->msg, agoo_sse_expand);
+	}
+	t = pm->sse;
+	break;
+    default:
+	t = NULL;
+	break;
+    }
+    if (NULL != (res = pub_res(c, pm->ready))) {
+	res->con_kind = AGOO_CON_ANY;
+	if (NULL == t) {
+	    agoo_res_set_message(res, agoo_text_dup(pm->pub->msg));
+	} else {
+	    if (agoo_push_cat.on) {
+		agoo_log_cat(&agoo_push_cat, "%llu: %s", (unsigned long long)c->id, pm->pub->msg->text);
 	    }
+	    res->framed = true;
+	    agoo_res_set_message(res, t);
 	}
     }
 }
 
+// Only the subscriptions that match are visited. The loop subscriptions
+// are kept in a trie keyed on the subject tokens. The framing for each
+// kind of connection is added once and every subscriber of that kind
+// writes from the same text.
+static void
+publish_pub(agooPub pub, agooConLoop loop, agooReady ready) {
+    struct _pubMatch	pm = { .pub = pub, .loop = loop, .ready = ready, .ws = NULL, .sse = NULL };
+
+    loop->pub_seq++;
+    agoo_subtrie_match(loop->subs, pub->subject->pattern, publish_match, &pm);
+    if (NULL != pm.ws) {
+	agoo_text_release(pm.ws);
+    }
+    if (NULL != pm.sse) {
+	agoo_text_release(pm.sse);
+    }
+}
+
 static void
-unsubscribe_pub(agooPub pub) {
+unsubscribe_pub(agooPub pub, agooConLoop loop) {
     if (NULL == pub->up) {
 	agooUpgraded	up;
 
 	for (up = agoo_server.up_list; NULL != up; up = up->next) {
-	    agoo_upgraded_del_subject(up, pub->subject);
+	    if (NULL != up->con && up->con->loop == loop) {
+		agoo_upgraded_del_subject(up, pub->subject);
+	    }
 	}
     } else {
 	agoo_upgraded_del_subject(pub->up, pub->subject);
@@ -880,7 +1760,7 @@ unsubscribe_pub(agooPub pub) {
 }
 
 static void
-process_pub_con(agooPub pub, agooConLoop loop) {
+process_pub_con(agooPub pub, agooConLoop loop, agooReady ready) {
     agooUpgraded	up = pub->up;
 
     if (NULL != up && NULL != up->con && up->con->loop == loop) {
@@ -893,7 +1773,7 @@ process_pub_con(agooPub pub, agooConLoop loop) {
 	    
 		req->up = up;
 		req->method = AGOO_ON_EMPTY;
-		req->hook = agoo_hook_create(AGOO_NONE, NULL, up->ctx, PUSH_HOOK, &agoo_server.eval_queue);
+		req->hook = agoo_hook_push(up->ctx);
 		agoo_upgraded_ref(up);
 		agoo_queue_push(&agoo_server.eval_queue, (void*)req);
 	    }
@@ -905,15 +1785,9 @@ process_pub_con(agooPub pub, agooConLoop loop) {
 	// count on the upgraded so it can be destroyed in the con loop
 	// threads.
 	if (NULL != up->con && up->con->loop == loop) {
-	    agooRes	res = agoo_res_create(up->con);
+	    agooRes	res = pub_res(up->con, ready);
 
 	    if (NULL != res) {
-		if (NULL == up->con->res_tail) {
-		    up->con->res_head = res;
-		} else {
-		    up->con->res_tail->next = res;
-		}
-		up->con->res_tail = res;
 		res->con_kind = up->con->bind->kind;
 		res->close = true;
 	    }
@@ -923,33 +1797,31 @@ process_pub_con(agooPub pub, agooConLoop loop) {
 	if (NULL == up->con) {
 	    agoo_log_cat(&agoo_warn_cat, "Connection already closed. WebSocket write failed.");
 	} else if (up->con->loop == loop) {
-	    agooRes	res = agoo_res_create(up->con);
+	    agooRes	res = pub_res(up->con, ready);
 
 	    if (NULL != res) {
-		if (NULL == up->con->res_tail) {
-		    up->con->res_head = res;
-		} else {
-		    up->con->res_tail->next = res;
-		}
-		up->con->res_tail = res;
 		res->con_kind = AGOO_CON_ANY;
 		agoo_res_set_message(res, pub->msg);
 	    }
 	}
 	break;
     case AGOO_PUB_SUB:
-	if (NULL != up && up->con->loop == loop) {
-	    agoo_upgraded_add_subject(pub->up, pub->subject);
+	if (NULL != up && NULL != up->con && up->con->loop == loop) {
+	    agooSubject	subject = pub->subject;
+
 	    pub->subject = NULL;
+	    if (agoo_upgraded_add_subject(up, subject) && !agoo_subtrie_add(loop->subs, subject, up)) {
+		agoo_log_cat(&agoo_error_cat, "Failed to allocate memory for a subscription to %s.", subject->pattern);
+	    }
 	}
 	break;
     case AGOO_PUB_UN:
-	if (NULL != up && up->con->loop == loop) {
-	    unsubscribe_pub(pub);
+	if (NULL != up && NULL != up->con && up->con->loop == loop) {
+	    unsubscribe_pub(pub, loop);
 	}
 	break;
     case AGOO_PUB_MSG:
-	publish_pub(pub, loop);
+	publish_pub(pub, loop, ready);
 	break;
     }
     default:
@@ -962,8 +1834,10 @@ short
 agoo_con_http_events(agooCon c) {
     short	events = 0;
     
+    // A closing connection only waits to write what is pending. Reading
+    // would only find the end of the stream or requests that are dropped.
     if (NULL != c->res_head && NULL != agoo_res_message(c->res_head)) {
-	events = POLLIN | POLLOUT;
+	events = c->closing ? POLLOUT : POLLIN | POLLOUT;
     } else if (!c->closing) {
 	events = POLLIN;
     }
@@ -974,7 +1848,8 @@ static short
 con_ws_events(agooCon c) {
     short	events = 0;
 
-    if (NULL != c->res_head && (c->res_head->close || c->res_head->ping || NULL != agoo_res_message(c->res_head))) {
+    if (NULL != c->res_head &&
+	(c->res_head->close || c->res_head->ping || c->res_head->pong || NULL != agoo_res_message(c->res_head))) {
 	events = POLLIN | POLLOUT;
     } else if (!c->closing) {
 	events = POLLIN;
@@ -997,7 +1872,7 @@ remove_dead_res(agooCon c) {
     agooRes	res;
 
     while (NULL != (res = c->res_head)) {
-	if (NULL == agoo_res_message(c->res_head) && !c->res_head->close && !c->res_head->ping) {
+	if (NULL == agoo_res_message(c->res_head) && !c->res_head->close && !c->res_head->ping && !c->res_head->pong) {
 	    break;
 	}
 	c->res_head = res->next;
@@ -1052,12 +1927,46 @@ con_ready_check(void *ctx, double now) {
     return true;
 }
 
+// Moves a TLS handshake along. Returns false if the handshake is not done
+// yet or failed, in which case c->dead is set.
+static bool
+con_tls_accept(agooCon c) {
+    struct _agooErr	err = AGOO_ERR_INIT;
+
+    switch (agoo_tls_accept(c->tls, c->id)) {
+    case AGOO_TLS_DONE:
+	break;
+    case AGOO_TLS_AGAIN:
+	return false;
+    case AGOO_TLS_FAIL:
+    default:
+	c->dead = true;
+	return false;
+    }
+    c->tls_done = true;
+    if (agoo_tls_h2(c->tls)) {
+	if (NULL == (c->h2 = agoo_h2_create(&err, c))) {
+	    agoo_log_cat(&agoo_error_cat, "%s", err.msg);
+	    c->dead = true;
+	    return false;
+	}
+	c->bind = &h2_bind;
+    }
+    return true;
+}
+
 static bool
 con_ready_read(agooReady ready, void *ctx) {
     agooCon	c = (agooCon)ctx;
 
+    if (NULL != c->tls && !c->tls_done && !con_tls_accept(c)) {
+	return !c->dead;
+    }
     if (NULL != c->bind->read) {
 	if (!c->bind->read(c)) {
+	    if (c->more) {
+		agoo_ready_more(ready);
+	    }
 	    return true;
 	}
     } else {
@@ -1066,38 +1975,157 @@ con_ready_read(agooReady ready, void *ctx) {
     return false;
 }
 
+// Called after a response has been written to switch to the bind for the
+// kind of connection the response upgraded to, if any.
+static void
+con_switch_kind(agooCon c, agooConKind kind) {
+    //if (kind != c->kind && AGOO_CON_ANY != kind) {
+    if (AGOO_CON_ANY != kind) {
+	switch (kind) {
+	case AGOO_CON_WS:
+	    c->bind = &ws_bind;
+	    break;
+	case AGOO_CON_SSE:
+	    c->bind = &sse_bind;
+	    break;
+	case AGOO_CON_H2:
+	    c->bind = &h2_bind;
+	    // The client may not have waited for the switch.
+	    if (0 < c->bcnt && agoo_h2_start(c)) {
+		c->closing = true;
+	    }
+	    break;
+	default:
+	    break;
+	}
+    }
+}
+
+// Writes as many responses as are ready or until the socket would block.
 static bool
 con_ready_write(void *ctx) {
     agooCon	c = (agooCon)ctx;
 
-    if (NULL != c->res_head) {
-	agooConKind	kind = c->res_head->con_kind;
-
-	if (NULL != c->bind->write) {
-	    if (c->bind->write(c)) {
-		//if (kind != c->kind && AGOO_CON_ANY != kind) {
-		if (AGOO_CON_ANY != kind) {
-		    switch (kind) {
-		    case AGOO_CON_WS:
-			c->bind = &ws_bind;
-			break;
-		    case AGOO_CON_SSE:
-			c->bind = &sse_bind;
-			break;
-		    default:
-			break;
-		    }
-		}
-		return true;
+    if (AGOO_CON_H2 == c->bind->kind) {
+	return c->bind->write(c);
+    }
+    if (NULL == c->res_head) {
+	return false;
+    }
+    while (NULL != c->res_head) {
+	agooRes		res = c->res_head;
+	agooConKind	kind = res->con_kind;
+	ssize_t		wcnt = c->wcnt;
+
+	if (NULL == c->bind->write || !c->bind->write(c)) {
+	    return false;
+	}
+	if (res != c->res_head) {
+	    con_switch_kind(c, kind);
+	    if (AGOO_CON_H2 == c->bind->kind) {
+		return c->bind->write(c);
 	    }
 	}
+	// Stop if nothing was written or only part of a message was written
+	// since either implies the socket buffer is full.
+	if ((res == c->res_head && wcnt == c->wcnt) || 0 < c->wcnt) {
+	    break;
+	}
+	if (0 == (c->bind->events(c) & POLLOUT)) {
+	    break;
+	}
     }
-    return false;
+    return true;
+}
+
+static size_t
+con_ready_rbuf(void *ctx, char **bufp) {
+    agooCon	c = (agooCon)ctx;
+
+    // TLS reads go through the read function once the socket is ready.
+    if (NULL == c->bind->received || c->dead || 0 == c->sock || c->closing || NULL != c->tls) {
+	return 0;
+    }
+    return con_read_buf(c, bufp);
+}
+
+static bool
+con_ready_received(agooReady ready, void *ctx, ssize_t cnt) {
+    agooCon	c = (agooCon)ctx;
+
+    if (0 > cnt) {
+	errno = (int)-cnt;
+	cnt = -1;
+    }
+    // The receive may have been started before an upgrade changed the bind.
+    if (NULL == c->bind->received) {
+	return 0 < cnt;
+    }
+    return !c->bind->received(c, cnt);
+}
+
+static size_t
+con_ready_wbuf(void *ctx, const char **bufp) {
+    agooCon	c = (agooCon)ctx;
+    agooText	message;
+
+    if ((NULL == c->res_head && AGOO_CON_H2 != c->bind->kind) || NULL != c->tls ||
+	NULL == c->bind->prep || NULL == (message = c->bind->prep(c))) {
+	return 0;
+    }
+    // The file part of a message is written by the write function.
+    if (message->len <= c->wcnt) {
+	return 0;
+    }
+    *bufp = message->text + c->wcnt;
+
+    return message->len - c->wcnt;
+}
+
+static int
+con_ready_wvec(void *ctx, struct iovec *iov, int max) {
+    agooCon	c = (agooCon)ctx;
+
+    if (NULL == c->res_head || NULL == c->bind->gather || NULL != c->tls) {
+	return 0;
+    }
+    return c->bind->gather(c, iov, max);
+}
+
+static bool
+con_ready_sent(void *ctx, ssize_t cnt) {
+    agooCon	c = (agooCon)ctx;
+    agooConKind	kind = (NULL == c->res_head) ? AGOO_CON_ANY : c->res_head->con_kind;
+
+    if (0 > cnt) {
+	errno = (int)-cnt;
+	cnt = -1;
+    }
+    if (!c->bind->sent(c, cnt)) {
+	return false;
+    }
+    if (0 == c->wcnt) {
+	con_switch_kind(c, kind);
+    }
+    return true;
 }
 
 static void
 con_ready_destroy(void *ctx) {
-    agoo_con_destroy((agooCon)ctx);
+    agooCon	c = (agooCon)ctx;
+
+    c->link = NULL;
+    // A worker thread may still be building a response so close the socket
+    // but keep the connection until the response is handed back.
+    if (agoo_server.active && !remove_dead_res(c)) {
+	if (0 < c->sock) {
+	    close(c->sock);
+	    c->sock = 0;
+	}
+	c->dead = true;
+	return;
+    }
+    agoo_con_destroy(c);
 }
 
 static struct _agooHandler	con_handler = {
@@ -1107,6 +2135,11 @@ static struct _agooHandler	con_handler = {
     .write = con_ready_write,
     .error = NULL,
     .destroy = con_ready_destroy, 
+    .rbuf = con_ready_rbuf,
+    .received = con_ready_received,
+    .wbuf = con_ready_wbuf,
+    .wvec = con_ready_wvec,
+    .sent = con_ready_sent,
 };
 
 static agooReadyIO
@@ -1123,9 +2156,10 @@ con_queue_ready_read(agooReady ready, void *ctx) {
     agoo_queue_release(&agoo_server.con_queue);
     while (NULL != (c = (agooCon)agoo_queue_pop(&agoo_server.con_queue, 0.0))) {
 	c->loop = loop;
-	if (AGOO_ERR_OK != agoo_ready_add(&err, ready, c->sock, &con_handler, c)) {
+	if (NULL == (c->link = agoo_ready_add(&err, ready, c->sock, &con_handler, c))) {
 	    agoo_log_cat(&agoo_error_cat, "Failed to add connection to manager. %s", err.msg);
 	    agoo_err_clear(&err);
+	    agoo_con_destroy(c);
 	}
     }
     return true;
@@ -1147,11 +2181,86 @@ pub_queue_ready_read(agooReady ready, void *ctx) {
 
     agoo_queue_release(&loop->pub_queue);
     while (NULL != (pub = (agooPub)agoo_queue_pop(&loop->pub_queue, 0.0))) {
-	process_pub_con(pub, loop);
+	process_pub_con(pub, loop, ready);
+    }
+    return true;
+}
+
+// Only the connections with a newly finished response are activated.
+static void
+process_res_queue(agooConLoop loop, agooReady ready) {
+    agooRes	res;
+    agooCon	c;
+
+    while (NULL != (res = (agooRes)agoo_queue_pop(&loop->res_queue, 0.0))) {
+	// If the response was already written and recycled then the con is
+	// NULL or the open connection the res was reused for.
+	if (NULL == (c = res->con)) {
+	    continue;
+	}
+	if (NULL != c->link) {
+	    agoo_ready_activate(ready, c->link);
+	} else if (remove_dead_res(c)) {
+	    // Closed while a worker was building the response.
+	    agoo_con_destroy(c);
+	}
+    }
+}
+
+static bool
+res_queue_ready_read(agooReady ready, void *ctx) {
+    agooConLoop	loop = (agooConLoop)ctx;
+
+    agoo_queue_release(&loop->res_queue);
+    process_res_queue(loop, ready);
+
+    return true;
+}
+
+// Accepts until there are no more pending connections so it works with edge
+// triggered polling.
+static bool
+listen_ready_read(agooReady ready, void *ctx) {
+    agooConListen	cl = (agooConListen)ctx;
+    struct _agooErr	err = AGOO_ERR_INIT;
+    agooCon		c;
+    int			sock;
+
+    while (0 <= (sock = accept(cl->fd, NULL, NULL))) {
+	if (NULL == (c = agoo_server_accepted(cl->bind, sock))) {
+	    continue;
+	}
+	c->loop = cl->loop;
+	if (NULL == (c->link = agoo_ready_add(&err, ready, c->sock, &con_handler, c))) {
+	    agoo_log_cat(&agoo_error_cat, "Failed to add connection to manager. %s", err.msg);
+	    agoo_err_clear(&err);
+	    agoo_con_destroy(c);
+	}
+    }
+    switch (errno) {
+    case EAGAIN:
+#if EAGAIN != EWOULDBLOCK
+    case EWOULDBLOCK:
+#endif
+    case EINTR:
+    case ECONNABORTED:
+	break;
+    default:
+	agoo_log_cat(&agoo_error_cat, "Server with pid %d accept connection failed. %s.", getpid(), strerror(errno));
+	break;
     }
     return true;
 }
 
+static struct _agooHandler	listen_handler = {
+    .io = queue_ready_io,
+    .check = NULL,
+    .read = listen_ready_read,
+    .write = NULL,
+    .error = NULL, 
+    .destroy = NULL, 
+};
+
 static struct _agooHandler	pub_queue_handler = {
     .io = queue_ready_io,
     .check = NULL,
@@ -1161,52 +2270,127 @@ static struct _agooHandler	pub_queue_handler = {
     .destroy = NULL, 
 };
 
+static struct _agooHandler	res_queue_handler = {
+    .io = queue_ready_io,
+    .check = NULL,
+    .read = res_queue_ready_read,
+    .write = NULL,
+    .error = NULL, 
+    .destroy = NULL, 
+};
+
 void*
 agoo_con_loop(void *x) {
     agooConLoop		loop = (agooConLoop)x;
     struct _agooErr	err = AGOO_ERR_INIT;
-    agooReady		ready = agoo_ready_create(&err);
+    agooReady		ready;
     agooPub		pub;
     agooCon		c;
+    int			i;
     int			con_queue_fd = agoo_queue_listen(&agoo_server.con_queue);
     int			pub_queue_fd = agoo_queue_listen(&loop->pub_queue);
-    
-    if (NULL == ready) {
+    int			res_queue_fd = agoo_queue_listen(&loop->res_queue);
+
+    // Everything this thread allocates for connections comes from the loop
+    // pools, including the ready links.
+    agoo_pools = loop->pools;
+    if (NULL == (ready = agoo_ready_create(&err))) {
 	agoo_log_cat(&agoo_error_cat, "Failed to create connection manager. %s", err.msg);
 	exit(EXIT_FAILURE);
 	return NULL;
     }
-    if (AGOO_ERR_OK != agoo_ready_add(&err, ready, con_queue_fd, &con_queue_handler, loop) ||
-	AGOO_ERR_OK != agoo_ready_add(&err, ready, pub_queue_fd, &pub_queue_handler, loop)) {
+    if (NULL == agoo_ready_add(&err, ready, con_queue_fd, &con_queue_handler, loop) ||
+	NULL == agoo_ready_add(&err, ready, pub_queue_fd, &pub_queue_handler, loop) ||
+	NULL == agoo_ready_add(&err, ready, res_queue_fd, &res_queue_handler, loop)) {
 	agoo_log_cat(&agoo_error_cat, "Failed to add queue connection to manager. %s", err.msg);
 	exit(EXIT_FAILURE);
 
 	return NULL;
     }
+    for (i = 0; i < loop->lcnt; i++) {
+	if (NULL == agoo_ready_add(&err, ready, loop->listens[i].fd, &listen_handler, &loop->listens[i])) {
+	    agoo_log_cat(&agoo_error_cat, "Failed to add listener to manager. %s", err.msg);
+	    exit(EXIT_FAILURE);
+
+	    return NULL;
+	}
+    }
+#if HAVE_PTHREAD_SETAFFINITY_NP
+    if (0 <= loop->cpu) {
+	cpu_set_t	cpus;
+
+	CPU_ZERO(&cpus);
+	CPU_SET(loop->cpu, &cpus);
+	pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+    }
+#endif
     atomic_fetch_add(&agoo_server.running, 1);
     
     while (agoo_server.active) {
 	while (NULL != (c = (agooCon)agoo_queue_pop(&agoo_server.con_queue, 0.0))) {
 	    c->loop = loop;
-	    if (AGOO_ERR_OK != agoo_ready_add(&err, ready, c->sock, &con_handler, c)) {
+	    if (NULL == (c->link = agoo_ready_add(&err, ready, c->sock, &con_handler, c))) {
 		agoo_log_cat(&agoo_error_cat, "Failed to add connection to manager. %s", err.msg);
 		agoo_err_clear(&err);
+		agoo_con_destroy(c);
 	    }
 	}
 	while (NULL != (pub = (agooPub)agoo_queue_pop(&loop->pub_queue, 0.0))) {
-	    process_pub_con(pub, loop);
+	    process_pub_con(pub, loop, ready);
 	}
+	process_res_queue(loop, ready);
 	if (AGOO_ERR_OK != agoo_ready_go(&err, ready)) {
 	    agoo_log_cat(&agoo_error_cat, "IO error. %s", err.msg);
 	    agoo_err_clear(&err);
 	}
     }
     agoo_ready_destroy(ready);
+    agoo_pools = NULL;
+    for (i = 0; i < loop->lcnt; i++) {
+	close(loop->listens[i].fd);
+	loop->listens[i].fd = 0;
+    }
     atomic_fetch_sub(&agoo_server.running, 1);
 
     return NULL;
 }
 
+// Opens a listener for each bind that is accepted on by the con loops. The
+// listeners are opened in the creating thread so they join the port group in
+// the same order as the loops are created.
+static int
+conloop_listen(agooErr err, agooConLoop loop) {
+    agooBind	b;
+    int		cnt = 0;
+
+    for (b = agoo_server.binds; NULL != b; b = b->next) {
+	if (b->per_loop) {
+	    cnt++;
+	}
+    }
+    if (0 == cnt) {
+	return AGOO_ERR_OK;
+    }
+    if (NULL == (loop->listens = (agooConListen)AGOO_MALLOC(sizeof(struct _agooConListen) * cnt))) {
+	return agoo_err_set(err, AGOO_ERR_MEMORY, "Failed to allocate memory for connection loop listeners.");
+    }
+    for (b = agoo_server.binds; NULL != b; b = b->next) {
+	agooConListen	cl;
+
+	if (!b->per_loop) {
+	    continue;
+	}
+	cl = &loop->listens[loop->lcnt];
+	cl->loop = loop;
+	cl->bind = b;
+	if (0 > (cl->fd = agoo_bind_listen_loop(err, b, loop->cpu))) {
+	    return err->code;
+	}
+	loop->lcnt++;
+    }
+    return AGOO_ERR_OK;
+}
+
 agooConLoop
 agoo_conloop_create(agooErr err, int id) {
      agooConLoop	loop;
@@ -1218,26 +2402,53 @@ agoo_conloop_create(agooErr err, int id) {
 	
 	loop->next = NULL;
 	agoo_queue_multi_init(&loop->pub_queue, 256, true, false);
+	agoo_queue_multi_init(&loop->res_queue, 1024, true, false);
 	loop->id = id;
-	loop->res_head = NULL;
-	loop->res_tail = NULL;
+	loop->pools = NULL;
+	loop->subs = NULL;
+	loop->pub_seq = 0;
+	loop->listens = NULL;
+	loop->lcnt = 0;
+	loop->cpu = -1;
+	if (agoo_server.incoming_cpu) {
+	    long	ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+
+	    if (0 < ncpu) {
+		loop->cpu = id % (int)ncpu;
+	    }
+	}
+	if (NULL == (loop->pools = agoo_pools_create(err))) {
+	    agoo_conloop_destroy(loop);
+	    return NULL;
+	}
+	if (NULL == (loop->subs = agoo_subtrie_create())) {
+	    agoo_err_set(err, AGOO_ERR_MEMORY, "Failed to allocate memory for connection thread subscriptions.");
+	    agoo_conloop_destroy(loop);
+	    return NULL;
+	}
+	if (agoo_server.reuse_port && AGOO_ERR_OK != conloop_listen(err, loop)) {
+	    agoo_conloop_destroy(loop);
+	    return NULL;
+	}
 	if (0 != (stat = pthread_create(&loop->thread, NULL, agoo_con_loop, loop))) {
 	    agoo_err_set(err, stat, "Failed to create connection loop. %s", strerror(stat));
 	    return NULL;
 	}
-	pthread_mutex_init(&loop->lock, 0);
     }
     return loop;
 }
 
 void
 agoo_conloop_destroy(agooConLoop loop) {
-    agooRes	res;
-    
     agoo_queue_cleanup(&loop->pub_queue);
-    while (NULL != (res = loop->res_head)) {
-	loop->res_head = res->next;
-	AGOO_FREE(res);
+    agoo_queue_cleanup(&loop->res_queue);
+    agoo_pools_destroy(loop->pools);
+    agoo_subtrie_destroy(loop->subs);
+    for (int i = 0; i < loop->lcnt; i++) {
+	if (0 < loop->listens[i].fd) {
+	    close(loop->listens[i].fd);
+	}
     }
+    AGOO_FREE(loop->listens);
     AGOO_FREE(loop);
 }
@@ -7,6 +7,7 @@
 #include <pthread.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include <sys/uio.h>
 
 #include "err.h"
 #include "req.h"
@@ -15,24 +16,43 @@
 #include "kinds.h"
 
 #define MAX_HEADER_SIZE	8192
+#define BODY_FILE_MIN	1048576
+#define WS_MAX_MESSAGE	16777216
+#define WS_STREAM_MIN	1048576
+#define CON_TIMEOUT	10.0
 
 struct _agooUpgraded;
 struct _agooReq;
 struct _agooRes;
 struct _agooBind;
 struct _agooQueue;
+struct _agooLink;
+struct _agooH2;
+struct _agooWsRead;
+struct _agooSubTrie;
+struct ssl_st;
+
+// A listener owned by a con loop when each loop accepts its own
+// connections.
+typedef struct _agooConListen {
+    struct _agooConLoop	*loop;
+    struct _agooBind	*bind;
+    int			fd;
+} *agooConListen;
 
 typedef struct _agooConLoop {
     struct _agooConLoop	*next;
     struct _agooQueue	pub_queue;
+    struct _agooQueue	res_queue; // responses finished by other threads
     pthread_t		thread;
     int			id;
-    // TBD use mutex for head and tail, volatile also
-    struct _agooRes	*res_head;
-    struct _agooRes	*res_tail;
+    struct _agooPools	*pools; // used by the loop thread
+    struct _agooSubTrie	*subs;  // subscriptions of the loop connections
+    uint64_t		pub_seq;
 
-    pthread_mutex_t	lock;
-    
+    agooConListen	listens;
+    int			lcnt;
+    int			cpu; // -1 if not pinned
 } *agooConLoop;
     
 typedef struct _agooCon {
@@ -41,8 +61,10 @@ typedef struct _agooCon {
     struct _agooBind		*bind;
     struct pollfd		*pp;
     uint64_t			id;
-    char			buf[MAX_HEADER_SIZE];
+    agooRBuf			rbuf;
+    char			*buf;  // start of what has not been used yet in rbuf
     size_t			bcnt;
+    size_t			hscan; // where the search for the end of the head resumes
 
     ssize_t			mcnt;  // how much has been read so far
     ssize_t			wcnt;  // how much has been written
@@ -50,24 +72,44 @@ typedef struct _agooCon {
     double			timeout;
     bool			closing;
     bool			dead;
+    bool			more;  // last read filled the buffer
     volatile bool		hijacked;
     struct _agooReq		*req;
+    bool			req_close; // set from the head of req
+    agooConKind			up_kind; // set from the head of req
     struct _agooRes		*res_head;
     struct _agooRes		*res_tail;
 
+    struct ssl_st		*tls; // only set for TLS connections
+    bool			tls_done; // handshake finished
+
+    struct _agooH2		*h2; // only set for HTTP/2 connections
+    uint32_t			sid; // HTTP/2 stream new responses are for
+
+    struct _agooWsRead		*ws; // only set for WebSocket connections
+
     struct _agooUpgraded	*up; // only set for push connections
     agooConLoop			loop;
+    struct _agooLink		*link; // NULL once removed from the loop
 } *agooCon;
 
 extern agooCon		agoo_con_create(agooErr err, int sock, uint64_t id, struct _agooBind *b);
 extern void		agoo_con_destroy(agooCon c);
-extern const char*	agoo_con_header_value(const char *header, int hlen, const char *key, int *vlen);
 
 extern agooConLoop	agoo_conloop_create(agooErr err, int id);
 extern void		agoo_conloop_destroy(agooConLoop loop);
 
 extern bool		agoo_con_http_read(agooCon c);
+extern bool		agoo_con_http_received(agooCon c, ssize_t cnt);
 extern bool		agoo_con_http_write(agooCon c);
+extern struct _agooText	*agoo_con_http_prep(agooCon c);
+extern int		agoo_con_http_gather(agooCon c, struct iovec *iov, int max);
+extern bool		agoo_con_http_sent(agooCon c, ssize_t cnt);
 extern short		agoo_con_http_events(agooCon c);
 
+extern ssize_t		agoo_con_send(agooCon c, const char *buf, size_t len);
+
+extern struct _agooReq	*agoo_con_stream_req(agooCon c, agooRBuf rb, long hlen);
+extern bool		agoo_con_stream_queue(agooCon c, struct _agooReq *req);
+
 #endif // AGOO_CON_H
@@ -11,7 +11,15 @@ $CFLAGS += " -DPLATFORM_LINUX" if 'x86_64-linux' == RUBY_PLATFORM
 CONFIG['warnflags'].slice!(/ -Wsuggest-attribute=format/)
 
 have_header('stdatomic.h')
-#have_header('sys/epoll.h')
+have_header('sys/epoll.h')
+have_header('linux/io_uring.h')
+have_header('linux/futex.h')
+have_header('sys/eventfd.h')
+have_header('sys/sendfile.h')
+have_header('sys/inotify.h')
+have_library('z', 'deflate', 'zlib.h') && have_header('zlib.h')
+have_library('crypto', 'ERR_get_error', 'openssl/err.h') && have_library('ssl', 'SSL_CTX_new', 'openssl/ssl.h') && have_header('openssl/ssl.h')
+have_func('pthread_setaffinity_np', 'pthread.h')
 
 create_makefile(File.join(extension_name, extension_name))
 
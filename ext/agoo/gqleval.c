@@ -399,6 +399,9 @@ eval_post(agooErr err, agooReq req) {
     int			len;
     gqlValue		result = NULL;
     gqlValue		j = NULL;
+    // The body is not NUL terminated and the parsers take a zero length to
+    // mean strlen() so an empty body is passed as an empty string.
+    const char		*body = (0 < req->body.len) ? req->body.start : "";
 
     // TBD handle query parameter and concatenate with body query if present
 
@@ -415,13 +418,13 @@ eval_post(agooErr err, agooReq req) {
 	return NULL;
     }
     if (0 == strncmp(graphql_content_type, s, sizeof(graphql_content_type) - 1)) {
-	if (NULL == (doc = sdl_parse_doc(err, req->body.start, req->body.len, vars))) {
+	if (NULL == (doc = sdl_parse_doc(err, body, req->body.len, vars))) {
 	    return NULL;
 	}
     } else if (0 == strncmp(json_content_type, s, sizeof(json_content_type) - 1)) {
 	gqlLink	m;
 	
-	if (NULL != (j = gql_json_parse(err, req->body.start, req->body.len))) {
+	if (NULL != (j = gql_json_parse(err, body, req->body.len))) {
 	    if (GQL_SCALAR_OBJECT != j->type->scalar_kind) {
 		agoo_err_set(err, AGOO_ERR_TYPE, "JSON request must be an object");
 		goto DONE;
@@ -0,0 +1,416 @@
+// Copyright (c) 2019, Peter Ohler, All rights reserved.
+
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#define HEAD_AVX2	1
+#endif
+
+#include "head.h"
+
+// Characters allowed in a method or header name (tchar in RFC7230).
+static const char	token_chars[256] = "\
+................................\
+.t.ttttt..tt.tt.tttttttttt......\
+.tttttttttttttttttttttttttt...tt\
+ttttttttttttttttttttttttttt.t.t.\
+................................\
+................................\
+................................\
+................................";
+
+#define ID_SLOTS	64
+#define ID_MASK		63
+
+const char	*agoo_header_names[AGOO_HDR_CNT] = {
+    "",
+    "Accept",
+    "Accept-Encoding",
+    "Accept-Language",
+    "Authorization",
+    "Cache-Control",
+    "Connection",
+    "Content-Length",
+    "Content-Type",
+    "Cookie",
+    "Expect",
+    "Host",
+    "If-Modified-Since",
+    "If-None-Match",
+    "If-Range",
+    "Origin",
+    "Range",
+    "Referer",
+    "Sec-WebSocket-Key",
+    "Sec-WebSocket-Protocol",
+    "Sec-WebSocket-Version",
+    "Transfer-Encoding",
+    "Upgrade",
+    "User-Agent",
+    "X-Forwarded-For",
+    "X-Forwarded-Proto",
+    "X-Request-Id",
+};
+
+static uint8_t	name_lens[AGOO_HDR_CNT];
+static uint32_t	name_hashes[AGOO_HDR_CNT];
+static char	name_lows[AGOO_HDR_CNT][24];
+// Open addressed on the name hash. Zero is an empty slot.
+static uint8_t	id_slots[ID_SLOTS];
+
+#if HEAD_AVX2
+static bool	use_avx2 = false;
+#endif
+
+// Case insensitive and the same as the one in agoo_head_parse().
+static uint32_t
+name_hash(const char *name, int nlen) {
+    const char	*end = name + nlen;
+    uint32_t	h = 0;
+
+    for (; name < end; name++) {
+	h = h * 31 + (uint8_t)(*name | 0x20);
+    }
+    return h;
+}
+
+static int
+id_slot(uint32_t h) {
+    return (int)((h ^ (h >> 7)) & ID_MASK);
+}
+
+void
+agoo_head_init() {
+    int		id;
+    int		i;
+
+    memset(id_slots, 0, sizeof(id_slots));
+    for (id = 1; id < AGOO_HDR_CNT; id++) {
+	name_lens[id] = (uint8_t)strlen(agoo_header_names[id]);
+	name_hashes[id] = name_hash(agoo_header_names[id], name_lens[id]);
+	for (i = 0; i < name_lens[id]; i++) {
+	    name_lows[id][i] = agoo_header_names[id][i] | 0x20;
+	}
+	for (i = id_slot(name_hashes[id]); 0 != id_slots[i]; i = (i + 1) & ID_MASK) {
+	}
+	id_slots[i] = (uint8_t)id;
+    }
+#if HEAD_AVX2
+    __builtin_cpu_init();
+    use_avx2 = __builtin_cpu_supports("avx2");
+#endif
+}
+
+// The known names are all letters and '-' so folding with 0x20 only matches
+// the same letter in either case or a '-' when the name is made of token
+// characters.
+static bool
+name_eq(const char *name, const char *low, int nlen) {
+    const char	*end = name + nlen;
+
+    for (; name < end; name++, low++) {
+	if ((*name | 0x20) != *low) {
+	    return false;
+	}
+    }
+    return true;
+}
+
+static agooHeaderId
+hash_id(const char *name, int nlen, uint32_t h) {
+    int	i = id_slot(h);
+    int	id;
+
+    for (; 0 != (id = id_slots[i]); i = (i + 1) & ID_MASK) {
+	if (h == name_hashes[id] && nlen == name_lens[id] && name_eq(name, name_lows[id], nlen)) {
+	    return (agooHeaderId)id;
+	}
+    }
+    return AGOO_HDR_OTHER;
+}
+
+agooHeaderId
+agoo_header_id(const char *name, int nlen) {
+    return hash_id(name, nlen, name_hash(name, nlen));
+}
+
+// The end of the head is found by looking back from each \n so a scan can
+// stop at any point and pick up from there after the next read.
+static long
+end_scalar(const char *buf, const char *p, const char *end) {
+    for (; p < end; p++) {
+	if ('\n' == *p && buf + 3 <= p && 0 == memcmp(p - 3, "\r\n\r\n", 4)) {
+	    return (long)(p - buf + 1);
+	}
+    }
+    return -1;
+}
+
+#if HEAD_AVX2
+__attribute__((target("avx2")))
+static long
+end_avx2(const char *buf, const char **pp, const char *end) {
+    const char	*p = *pp;
+    __m256i	nl = _mm256_set1_epi8('\n');
+    uint32_t	mask;
+    int		i;
+
+    for (; p + 32 <= end; p += 32) {
+	mask = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)p), nl));
+	while (0 != mask) {
+	    i = __builtin_ctz(mask);
+	    if (buf + 3 <= p + i && 0 == memcmp(p + i - 3, "\r\n\r\n", 4)) {
+		return (long)(p + i - buf + 1);
+	    }
+	    mask &= mask - 1;
+	}
+    }
+    *pp = p;
+
+    return -1;
+}
+#endif
+
+// Returns the length of the head including the blank line that ends it or
+// -1 if the end has not been read yet. *scanp is where the next call picks
+// up.
+long
+agoo_head_end(const char *buf, size_t len, size_t *scanp) {
+    const char	*p = buf + *scanp;
+    const char	*end = buf + len;
+    long	hlen;
+
+#if HEAD_AVX2
+    if (use_avx2 && 0 <= (hlen = end_avx2(buf, &p, end))) {
+	return hlen;
+    }
+#endif
+#if defined(__SSE2__)
+    {
+	__m128i		nl = _mm_set1_epi8('\n');
+	uint32_t	mask;
+	int		i;
+
+	for (; p + 16 <= end; p += 16) {
+	    mask = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)p), nl));
+	    while (0 != mask) {
+		i = __builtin_ctz(mask);
+		if (buf + 3 <= p + i && 0 == memcmp(p + i - 3, "\r\n\r\n", 4)) {
+		    return (long)(p + i - buf + 1);
+		}
+		mask &= mask - 1;
+	    }
+	}
+    }
+#endif
+    if (0 > (hlen = end_scalar(buf, p, end))) {
+	*scanp = len;
+    }
+    return hlen;
+}
+
+// Returns the first character that is a control character, below lim, or
+// DEL. The caller makes sure there is one before end.
+#if HEAD_AVX2
+__attribute__((target("avx2")))
+static const char*
+ctl_avx2(const char *p, const char *end, uint8_t lim) {
+    __m256i	below = _mm256_set1_epi8((char)(lim - 1));
+    __m256i	del = _mm256_set1_epi8(0x7F);
+    __m256i	v;
+    uint32_t	mask;
+
+    for (; p + 32 <= end; p += 32) {
+	v = _mm256_loadu_si256((const __m256i*)p);
+	mask = (uint32_t)_mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(_mm256_min_epu8(v, below), v),
+							      _mm256_cmpeq_epi8(v, del)));
+	if (0 != mask) {
+	    return p + __builtin_ctz(mask);
+	}
+    }
+    return p;
+}
+#endif
+
+static const char*
+find_ctl(const char *p, const char *end, uint8_t lim) {
+#if HEAD_AVX2
+    if (use_avx2) {
+	p = ctl_avx2(p, end, lim);
+	if (p + 32 <= end) {
+	    return p;
+	}
+    }
+#endif
+#if defined(__SSE2__)
+    {
+	__m128i		below = _mm_set1_epi8((char)(lim - 1));
+	__m128i		del = _mm_set1_epi8(0x7F);
+	__m128i		v;
+	uint32_t	mask;
+
+	for (; p + 16 <= end; p += 16) {
+	    v = _mm_loadu_si128((const __m128i*)p);
+	    mask = (uint32_t)_mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(_mm_min_epu8(v, below), v),
+							    _mm_cmpeq_epi8(v, del)));
+	    if (0 != mask) {
+		return p + __builtin_ctz(mask);
+	    }
+	}
+    }
+#endif
+    for (; p < end; p++) {
+	if ((uint8_t)*p < lim || 0x7F == *p) {
+	    break;
+	}
+    }
+    return p;
+}
+
+// Parses the head that ends at end, just past the blank line found by
+// agoo_head_end(). Returns 0 or the HTTP status for a bad head.
+int
+agoo_head_parse(agooHead h, const char *buf, const char *end) {
+    const char		*p = buf;
+    const char		*v;
+    agooHeadField	f;
+    uint32_t		hash;
+
+    for (; 't' == token_chars[(uint8_t)*p]; p++) {
+    }
+    if (p == buf || ' ' != *p) {
+	return 400;
+    }
+    h->method = buf;
+    h->mlen = (int)(p - buf);
+    h->target = ++p;
+    p = find_ctl(p, end, 0x21);
+    if (p == h->target || ' ' != *p) {
+	return 400;
+    }
+    h->tlen = (int)(p - h->target);
+    p++;
+    if (end - p < 10 || 0 != strncmp("HTTP/", p, 5)) {
+	return 400;
+    }
+    if ('1' != p[5] || '.' != p[6] || p[7] < '0' || '9' < p[7]) {
+	return 505;
+    }
+    if ('\r' != p[8] || '\n' != p[9]) {
+	return 400;
+    }
+    h->minor = p[7] - '0';
+    p += 10;
+    h->fields = p;
+    h->flen = 0;
+    h->fcnt = 0;
+    memset(h->known, 0, sizeof(h->known));
+    while ('\r' != *p) {
+	if (AGOO_HEAD_MAX_FIELDS <= h->fcnt) {
+	    return 431;
+	}
+	f = h->fa + h->fcnt;
+	f->name = p;
+	for (hash = 0; 't' == token_chars[(uint8_t)*p]; p++) {
+	    hash = hash * 31 + (uint8_t)(*p | 0x20);
+	}
+	if (p == f->name || ':' != *p) {
+	    return 400;
+	}
+	f->nlen = (int)(p - f->name);
+	if (AGOO_HDR_OTHER != (f->id = hash_id(f->name, f->nlen, hash)) && 0 == h->known[f->id]) {
+	    h->known[f->id] = (uint8_t)(h->fcnt + 1);
+	}
+	for (p++; ' ' == *p || '\t' == *p; p++) {
+	}
+	f->value = p;
+	while ('\t' == *(p = find_ctl(p, end, 0x20))) {
+	    p++;
+	}
+	if ('\r' != *p || '\n' != p[1]) {
+	    return 400;
+	}
+	for (v = p; f->value < v && (' ' == v[-1] || '\t' == v[-1]); v--) {
+	}
+	f->vlen = (int)(v - f->value);
+	h->flen = (int)(p - h->fields);
+	h->fcnt++;
+	p += 2;
+    }
+    if ('\n' != p[1]) {
+	return 400;
+    }
+    return 0;
+}
+
+// Points the head at a copy of the buffer it was parsed from that starts at
+// buf.
+void
+agoo_head_move(agooHead h, const char *buf) {
+    intptr_t		shift = (intptr_t)buf - (intptr_t)h->method;
+    agooHeadField	f = h->fa;
+    agooHeadField	fend = f + h->fcnt;
+
+    h->method = buf;
+    h->target += shift;
+    h->fields += shift;
+    for (; f < fend; f++) {
+	f->name += shift;
+	f->value += shift;
+    }
+}
+
+const char*
+agoo_head_value(agooHead h, const char *key, int klen, int *vlenp) {
+    agooHeadField	f = h->fa;
+    agooHeadField	fend = f + h->fcnt;
+
+    for (; f < fend; f++) {
+	if (klen == f->nlen && 0 == strncasecmp(key, f->name, klen)) {
+	    *vlenp = f->vlen;
+	    return f->value;
+	}
+    }
+    return NULL;
+}
+
+const char*
+agoo_head_get(agooHead h, agooHeaderId id, int *vlenp) {
+    agooHeadField	f;
+
+    if (0 == h->known[id]) {
+	return NULL;
+    }
+    f = h->fa + h->known[id] - 1;
+    *vlenp = f->vlen;
+
+    return f->value;
+}
+
+// Checks a comma separated value such as a Connection header for a token.
+bool
+agoo_head_has_token(const char *value, int vlen, const char *token, int tlen) {
+    const char	*end = value + vlen;
+    const char	*t;
+
+    while (value < end) {
+	for (; value < end && (' ' == *value || '\t' == *value || ',' == *value); value++) {
+	}
+	for (t = value; value < end && ',' != *value; value++) {
+	}
+	for (; t < value && (' ' == value[-1] || '\t' == value[-1]); value--) {
+	}
+	if (tlen == value - t && 0 == strncasecmp(token, t, tlen)) {
+	    return true;
+	}
+	for (; value < end && ',' != *value; value++) {
+	}
+    }
+    return false;
+}
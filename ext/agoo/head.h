@@ -0,0 +1,79 @@
+// Copyright (c) 2019, Peter Ohler, All rights reserved.
+
+#ifndef AGOO_HEAD_H
+#define AGOO_HEAD_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define AGOO_HEAD_MAX_FIELDS	100
+
+// Headers that are looked up by the server or are common enough to be worth
+// a precomputed Rack key. The names are in agoo_header_names.
+typedef enum {
+    AGOO_HDR_OTHER		= 0,
+    AGOO_HDR_ACCEPT,
+    AGOO_HDR_ACCEPT_ENCODING,
+    AGOO_HDR_ACCEPT_LANGUAGE,
+    AGOO_HDR_AUTHORIZATION,
+    AGOO_HDR_CACHE_CONTROL,
+    AGOO_HDR_CONNECTION,
+    AGOO_HDR_CONTENT_LENGTH,
+    AGOO_HDR_CONTENT_TYPE,
+    AGOO_HDR_COOKIE,
+    AGOO_HDR_EXPECT,
+    AGOO_HDR_HOST,
+    AGOO_HDR_IF_MODIFIED_SINCE,
+    AGOO_HDR_IF_NONE_MATCH,
+    AGOO_HDR_IF_RANGE,
+    AGOO_HDR_ORIGIN,
+    AGOO_HDR_RANGE,
+    AGOO_HDR_REFERER,
+    AGOO_HDR_SEC_WEBSOCKET_KEY,
+    AGOO_HDR_SEC_WEBSOCKET_PROTOCOL,
+    AGOO_HDR_SEC_WEBSOCKET_VERSION,
+    AGOO_HDR_TRANSFER_ENCODING,
+    AGOO_HDR_UPGRADE,
+    AGOO_HDR_USER_AGENT,
+    AGOO_HDR_X_FORWARDED_FOR,
+    AGOO_HDR_X_FORWARDED_PROTO,
+    AGOO_HDR_X_REQUEST_ID,
+    AGOO_HDR_CNT
+} agooHeaderId;
+
+typedef struct _agooHeadField {
+    const char		*name;
+    const char		*value;
+    int			nlen;
+    int			vlen;
+    agooHeaderId	id;
+} *agooHeadField;
+
+// The request line and header fields of an HTTP/1.x request. All pointers
+// are into the buffer that was parsed.
+typedef struct _agooHead {
+    const char			*method;
+    int				mlen;
+    const char			*target; // path and query
+    int				tlen;
+    int				minor; // the x in HTTP/1.x
+    const char			*fields; // first header line
+    int				flen; // through the last value, no trailing \r\n
+    int				fcnt;
+    uint8_t			known[AGOO_HDR_CNT]; // index + 1 of the first field with the id
+    struct _agooHeadField	fa[AGOO_HEAD_MAX_FIELDS];
+} *agooHead;
+
+extern const char	*agoo_header_names[AGOO_HDR_CNT];
+
+extern void		agoo_head_init();
+extern long		agoo_head_end(const char *buf, size_t len, size_t *scanp);
+extern int		agoo_head_parse(agooHead h, const char *buf, const char *end);
+extern void		agoo_head_move(agooHead h, const char *buf);
+extern const char*	agoo_head_value(agooHead h, const char *key, int klen, int *vlenp);
+extern const char*	agoo_head_get(agooHead h, agooHeaderId id, int *vlenp);
+extern agooHeaderId	agoo_header_id(const char *name, int nlen);
+extern bool		agoo_head_has_token(const char *value, int vlen, const char *token, int tlen);
+
+#endif // AGOO_HEAD_H
@@ -1,11 +1,13 @@
 // Copyright (c) 2018, Peter Ohler, All rights reserved.
 
+#include <limits.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include "con.h"
 #include "debug.h"
 #include "hook.h"
+#include "pool.h"
 #include "req.h"
 
 agooHook
@@ -58,6 +60,24 @@ agoo_hook_func_create(agooMethod method, const char *pattern, void (*func)(agooR
     return hook;
 }
 
+// A hook for a push event such as a WebSocket message. One is created for
+// each event so they come from a pool and are freed with the request.
+agooHook
+agoo_hook_push(void *handler) {
+    agooHook	hook = (agooHook)agoo_pool_alloc(AGOO_POOL_HOOK, sizeof(struct _agooHook));
+
+    if (NULL != hook) {
+	hook->pattern = NULL;
+	hook->next = NULL;
+	hook->method = AGOO_NONE;
+	hook->handler = handler;
+	hook->type = PUSH_HOOK;
+	hook->queue = &agoo_server.eval_queue;
+	hook->no_queue = false;
+    }
+    return hook;
+}
+
 void
 agoo_hook_destroy(agooHook hook) {
     if (NULL != hook->pattern) {
@@ -103,3 +123,330 @@ agoo_hook_find(agooHook hook, agooMethod method, const agooSeg path) {
     }
     return NULL;
 }
+
+// The trie has a node per path segment. A pattern segment of '*' follows
+// the star child and one starting with '**' ends the pattern and matches
+// whatever is left of the path. Every hook keeps its position in the hook
+// list and the lowest position of all matches wins, which is the same hook
+// the list walk would find. Patterns with a '*' inside a segment and paths
+// with a '*' in them are matched with agoo_hook_match() as before.
+
+typedef struct _hookRef {
+    agooHook	hook;
+    int		index;
+} *HookRef;
+
+typedef struct _hookRefs {
+    HookRef	refs;
+    int		cnt;
+} *HookRefs;
+
+typedef struct _hookNode {
+    struct _hookNode	**kids; // sorted by key
+    int			kcnt;
+    struct _hookNode	*star;
+    struct _hookRefs	ends; // patterns that end at this node
+    struct _hookRefs	rest; // '**' patterns
+    int			min; // lowest hook index in this node and below
+    int			klen;
+    char		key[1];
+} *HookNode;
+
+struct _agooHookTrie {
+    HookNode		root;
+    struct _hookRefs	slow;
+    agooHook		last; // hooks added after the compile are walked
+};
+
+static HookNode
+node_create(const char *key, int klen) {
+    HookNode	node = (HookNode)AGOO_MALLOC(sizeof(struct _hookNode) + klen);
+
+    if (NULL != node) {
+	memset(node, 0, sizeof(struct _hookNode));
+	node->min = INT_MAX;
+	node->klen = klen;
+	memcpy(node->key, key, klen);
+	node->key[klen] = '\0';
+    }
+    return node;
+}
+
+static void
+node_destroy(HookNode node) {
+    int	i;
+
+    for (i = 0; i < node->kcnt; i++) {
+	node_destroy(node->kids[i]);
+    }
+    if (NULL != node->star) {
+	node_destroy(node->star);
+    }
+    AGOO_FREE(node->kids);
+    AGOO_FREE(node->ends.refs);
+    AGOO_FREE(node->rest.refs);
+    AGOO_FREE(node);
+}
+
+static int
+key_cmp(HookNode node, const char *key, int klen) {
+    if (node->klen != klen) {
+	return node->klen - klen;
+    }
+    return memcmp(node->key, key, klen);
+}
+
+// Returns the position of the kid with the key or the position it should be
+// inserted at as -(pos + 1).
+static int
+kid_search(HookNode node, const char *key, int klen) {
+    int	lo = 0;
+    int	hi = node->kcnt - 1;
+    int	mid;
+    int	cmp;
+
+    while (lo <= hi) {
+	mid = (lo + hi) / 2;
+	if (0 == (cmp = key_cmp(node->kids[mid], key, klen))) {
+	    return mid;
+	}
+	if (cmp < 0) {
+	    lo = mid + 1;
+	} else {
+	    hi = mid - 1;
+	}
+    }
+    return -(lo + 1);
+}
+
+static HookNode
+kid_get(HookNode node, const char *key, int klen) {
+    int		pos = kid_search(node, key, klen);
+    HookNode	kid;
+    HookNode	*kids;
+
+    if (0 <= pos) {
+	return node->kids[pos];
+    }
+    pos = -pos - 1;
+    if (NULL == (kid = node_create(key, klen))) {
+	return NULL;
+    }
+    if (NULL == (kids = (HookNode*)AGOO_REALLOC(node->kids, sizeof(HookNode) * (node->kcnt + 1)))) {
+	AGOO_FREE(kid);
+	return NULL;
+    }
+    node->kids = kids;
+    memmove(kids + pos + 1, kids + pos, sizeof(HookNode) * (node->kcnt - pos));
+    kids[pos] = kid;
+    node->kcnt++;
+
+    return kid;
+}
+
+static bool
+refs_add(HookRefs refs, agooHook hook, int index) {
+    HookRef	r = (HookRef)AGOO_REALLOC(refs->refs, sizeof(struct _hookRef) * (refs->cnt + 1));
+
+    if (NULL == r) {
+	return false;
+    }
+    refs->refs = r;
+    r += refs->cnt;
+    r->hook = hook;
+    r->index = index;
+    refs->cnt++;
+
+    return true;
+}
+
+// Only patterns made of whole segments go in the trie.
+static bool
+trie_pattern(const char *pat) {
+    const char	*s;
+
+    if ('/' != *pat) {
+	return false;
+    }
+    for (s = pat + 1; '\0' != *s; s++) {
+	if ('*' != *s) {
+	    continue;
+	}
+	if ('/' != *(s - 1)) {
+	    return false;
+	}
+	if ('*' == *(s + 1)) {
+	    break;
+	}
+	if ('/' != *(s + 1) && '\0' != *(s + 1)) {
+	    return false;
+	}
+    }
+    return true;
+}
+
+static bool
+trie_add(HookNode node, agooHook hook, int index) {
+    const char	*s = hook->pattern + 1;
+    const char	*e;
+
+    while (true) {
+	if (index < node->min) {
+	    node->min = index;
+	}
+	if ('*' == *s && '*' == *(s + 1)) {
+	    return refs_add(&node->rest, hook, index);
+	}
+	if (NULL == (e = strchr(s, '/'))) {
+	    e = s + strlen(s);
+	}
+	if ('*' == *s) {
+	    if (NULL == node->star && NULL == (node->star = node_create(s, 1))) {
+		return false;
+	    }
+	    node = node->star;
+	} else if (NULL == (node = kid_get(node, s, (int)(e - s)))) {
+	    return false;
+	}
+	if ('\0' == *e) {
+	    if (index < node->min) {
+		node->min = index;
+	    }
+	    return refs_add(&node->ends, hook, index);
+	}
+	s = e + 1;
+    }
+}
+
+agooHookTrie
+agoo_hook_compile(agooErr err, agooHook hooks) {
+    agooHookTrie	trie = (agooHookTrie)AGOO_MALLOC(sizeof(struct _agooHookTrie));
+    agooHook		h;
+    int			index = 0;
+    bool		ok;
+
+    if (NULL == trie) {
+	agoo_err_set(err, AGOO_ERR_MEMORY, "Failed to allocate memory for a hook trie.");
+	return NULL;
+    }
+    memset(trie, 0, sizeof(struct _agooHookTrie));
+    if (NULL == (trie->root = node_create("", 0))) {
+	AGOO_FREE(trie);
+	agoo_err_set(err, AGOO_ERR_MEMORY, "Failed to allocate memory for a hook trie.");
+	return NULL;
+    }
+    for (h = hooks; NULL != h; h = h->next, index++) {
+	trie->last = h;
+	if (NULL == h->pattern) {
+	    continue;
+	}
+	if (trie_pattern(h->pattern)) {
+	    ok = trie_add(trie->root, h, index);
+	} else {
+	    ok = refs_add(&trie->slow, h, index);
+	}
+	if (!ok) {
+	    agoo_hook_trie_destroy(trie);
+	    agoo_err_set(err, AGOO_ERR_MEMORY, "Failed to allocate memory for a hook trie.");
+	    return NULL;
+	}
+    }
+    return trie;
+}
+
+void
+agoo_hook_trie_destroy(agooHookTrie trie) {
+    if (NULL != trie) {
+	node_destroy(trie->root);
+	AGOO_FREE(trie->slow.refs);
+	AGOO_FREE(trie);
+    }
+}
+
+static void
+refs_check(HookRefs refs, agooMethod method, HookRef *best) {
+    HookRef	r = refs->refs;
+    HookRef	end = r + refs->cnt;
+
+    for (; r < end; r++) {
+	if (NULL != *best && (*best)->index <= r->index) {
+	    break;
+	}
+	if (method == r->hook->method || AGOO_ALL == r->hook->method) {
+	    *best = r;
+	    break;
+	}
+    }
+}
+
+// The segment at s has not been matched yet. A NULL s means the whole path
+// has been matched.
+static void
+node_find(HookNode node, agooMethod method, const char *s, const char *end, HookRef *best) {
+    const char	*e;
+    const char	*next;
+    int		pos;
+
+    if (NULL != *best && (*best)->index <= node->min) {
+	return;
+    }
+    if (NULL == s) {
+	refs_check(&node->ends, method, best);
+	return;
+    }
+    // Like agoo_hook_match(), '**' needs at least one more character.
+    if (s < end) {
+	refs_check(&node->rest, method, best);
+    }
+    if (NULL == (e = memchr(s, '/', end - s))) {
+	e = end;
+	next = NULL;
+    } else {
+	next = e + 1;
+    }
+    if (0 <= (pos = kid_search(node, s, (int)(e - s)))) {
+	node_find(node->kids[pos], method, next, end, best);
+    }
+    // An empty last segment is not matched by a '*'.
+    if (NULL != node->star && (s < e || NULL != next)) {
+	node_find(node->star, method, next, end, best);
+    }
+}
+
+agooHook
+agoo_hook_trie_find(agooHookTrie trie, agooHook hooks, agooMethod method, const agooSeg path) {
+    const char	*start = path->start;
+    const char	*end = path->end;
+    HookRef	best = NULL;
+    HookRef	r;
+    HookRef	rend;
+
+    if (NULL == trie) {
+	return agoo_hook_find(hooks, method, path);
+    }
+    if (start == end || '/' != *start || NULL != memchr(start, '*', end - start)) {
+	return agoo_hook_find(hooks, method, path);
+    }
+    if (1 < end - start && '/' == *(end - 1)) {
+	end--;
+    }
+    node_find(trie->root, method, start + 1, end, &best);
+
+    rend = trie->slow.refs + trie->slow.cnt;
+    for (r = trie->slow.refs; r < rend; r++) {
+	if (NULL != best && best->index <= r->index) {
+	    break;
+	}
+	if (agoo_hook_match(r->hook, method, path)) {
+	    best = r;
+	    break;
+	}
+    }
+    if (NULL != best) {
+	return best->hook;
+    }
+    if (NULL != trie->last) {
+	return agoo_hook_find(trie->last->next, method, path);
+    }
+    return agoo_hook_find(hooks, method, path);
+}
@@ -5,6 +5,7 @@
 
 #include <stdbool.h>
 
+#include "err.h"
 #include "method.h"
 #include "queue.h"
 #include "seg.h"
@@ -35,14 +36,22 @@ typedef struct _agooHook {
     bool		no_queue;
 } *agooHook;
 
+// Hooks compiled into a trie keyed by path segment. See hook.c.
+typedef struct _agooHookTrie	*agooHookTrie;
+
 extern agooHook	agoo_hook_create(agooMethod method, const char *pattern, void *handler, agooHookType type, agooQueue q);
 extern agooHook	agoo_hook_func_create(agooMethod	method,
 				      const char	*pattern,
 				      void 		(*func)(struct _agooReq *req),
 				      agooQueue		q);
+extern agooHook	agoo_hook_push(void *handler);
 extern void	agoo_hook_destroy(agooHook hook);
 
 extern bool	agoo_hook_match(agooHook hook, agooMethod method, const agooSeg seg);
 extern agooHook	agoo_hook_find(agooHook hook, agooMethod method, const agooSeg seg);
 
+extern agooHookTrie	agoo_hook_compile(agooErr err, agooHook hooks);
+extern void		agoo_hook_trie_destroy(agooHookTrie trie);
+extern agooHook		agoo_hook_trie_find(agooHookTrie trie, agooHook hooks, agooMethod method, const agooSeg seg);
+
 #endif // AGOO_HOOK_H
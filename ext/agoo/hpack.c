@@ -0,0 +1,476 @@
+// Copyright (c) 2019, Peter Ohler, All rights reserved.
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "debug.h"
+#include "hpack.h"
+
+#define ENTRY_OVERHEAD	32
+#define STATIC_CNT	61
+#define MAX_INT		0xFFFFFFFFUL
+
+typedef struct _agooHpackEntry {
+    size_t	nlen;
+    size_t	vlen;
+    char	data[]; // name followed by value
+} *agooHpackEntry;
+
+typedef struct _staticEntry {
+    const char	*name;
+    const char	*value;
+} *StaticEntry;
+
+// RFC 7541 Appendix A, indexed from 1.
+static struct _staticEntry	static_table[STATIC_CNT + 1] = {
+    { NULL, NULL },
+    { ":authority", "" },
+    { ":method", "GET" },
+    { ":method", "POST" },
+    { ":path", "/" },
+    { ":path", "/index.html" },
+    { ":scheme", "http" },
+    { ":scheme", "https" },
+    { ":status", "200" },
+    { ":status", "204" },
+    { ":status", "206" },
+    { ":status", "304" },
+    { ":status", "400" },
+    { ":status", "404" },
+    { ":status", "500" },
+    { "accept-charset", "" },
+    { "accept-encoding", "gzip, deflate" },
+    { "accept-language", "" },
+    { "accept-ranges", "" },
+    { "accept", "" },
+    { "access-control-allow-origin", "" },
+    { "age", "" },
+    { "allow", "" },
+    { "authorization", "" },
+    { "cache-control", "" },
+    { "content-disposition", "" },
+    { "content-encoding", "" },
+    { "content-language", "" },
+    { "content-length", "" },
+    { "content-location", "" },
+    { "content-range", "" },
+    { "content-type", "" },
+    { "cookie", "" },
+    { "date", "" },
+    { "etag", "" },
+    { "expect", "" },
+    { "expires", "" },
+    { "from", "" },
+    { "host", "" },
+    { "if-match", "" },
+    { "if-modified-since", "" },
+    { "if-none-match", "" },
+    { "if-range", "" },
+    { "if-unmodified-since", "" },
+    { "last-modified", "" },
+    { "link", "" },
+    { "location", "" },
+    { "max-forwards", "" },
+    { "proxy-authenticate", "" },
+    { "proxy-authorization", "" },
+    { "range", "" },
+    { "referer", "" },
+    { "refresh", "" },
+    { "retry-after", "" },
+    { "server", "" },
+    { "set-cookie", "" },
+    { "strict-transport-security", "" },
+    { "transfer-encoding", "" },
+    { "user-agent", "" },
+    { "vary", "" },
+    { "via", "" },
+    { "www-authenticate", "" },
+};
+
+// The HPACK Huffman code is canonical so the number of codes of each length
+// and the symbols in code order are enough to decode it.
+static const uint8_t	huff_cnt[31] = {
+    0, 0, 0, 0, 0, 10, 26, 32, 6, 0, 5, 3, 2, 6, 2, 3, 0, 0, 0, 3, 8, 13, 26, 29, 12, 4, 15, 19, 29, 0, 4,
+};
+
+static const uint16_t	huff_syms[257] = {
+    48, 49, 50, 97, 99, 101, 105, 111, 115, 116, 32, 37,
+    45, 46, 47, 51, 52, 53, 54, 55, 56, 57, 61, 65,
+    95, 98, 100, 102, 103, 104, 108, 109, 110, 112, 114, 117,
+    58, 66, 67, 68, 69, 70, 71, 72, 73, 74, 75, 76,
+    77, 78, 79, 80, 81, 82, 83, 84, 85, 86, 87, 89,
+    106, 107, 113, 118, 119, 120, 121, 122, 38, 42, 44, 59,
+    88, 90, 33, 34, 40, 41, 63, 39, 43, 124, 35, 62,
+    0, 36, 64, 91, 93, 126, 94, 125, 60, 96, 123, 92,
+    195, 208, 128, 130, 131, 162, 184, 194, 224, 226, 153, 161,
+    167, 172, 176, 177, 179, 209, 216, 217, 227, 229, 230, 129,
+    132, 133, 134, 136, 146, 154, 156, 160, 163, 164, 169, 170,
+    173, 178, 181, 185, 186, 187, 189, 190, 196, 198, 228, 232,
+    233, 1, 135, 137, 138, 139, 140, 141, 143, 147, 149, 150,
+    151, 152, 155, 157, 158, 165, 166, 168, 174, 175, 180, 182,
+    183, 188, 191, 197, 231, 239, 9, 142, 144, 145, 148, 159,
+    171, 206, 215, 225, 236, 237, 199, 207, 234, 235, 192, 193,
+    200, 201, 202, 205, 210, 213, 218, 219, 238, 240, 242, 243,
+    255, 203, 204, 211, 212, 214, 221, 222, 223, 241, 244, 245,
+    246, 247, 248, 250, 251, 252, 253, 254, 2, 3, 4, 5,
+    6, 7, 8, 11, 12, 14, 15, 16, 17, 18, 19, 20,
+    21, 23, 24, 25, 26, 27, 28, 29, 30, 31, 127, 220,
+    249, 10, 13, 22, 256,
+};
+
+void
+agoo_hpack_init(agooHpack hp, size_t limit) {
+    memset(hp, 0, sizeof(struct _agooHpack));
+    hp->max = limit;
+    hp->limit = limit;
+}
+
+void
+agoo_hpack_cleanup(agooHpack hp) {
+    for (; 0 < hp->cnt; hp->cnt--) {
+	AGOO_FREE(hp->entries[hp->head]);
+	hp->head = (hp->head + 1) % hp->cap;
+    }
+    AGOO_FREE(hp->entries);
+    AGOO_FREE(hp->tmp);
+    hp->entries = NULL;
+    hp->tmp = NULL;
+}
+
+// The oldest entry is at head and the newest at head + cnt - 1.
+static void
+table_evict(agooHpack hp, size_t room) {
+    agooHpackEntry	e;
+
+    while (0 < hp->cnt && hp->max < hp->size + room) {
+	e = hp->entries[hp->head];
+	hp->size -= ENTRY_OVERHEAD + e->nlen + e->vlen;
+	AGOO_FREE(e);
+	hp->head = (hp->head + 1) % hp->cap;
+	hp->cnt--;
+    }
+}
+
+static int
+table_add(agooErr err, agooHpack hp, const char *name, size_t nlen, const char *value, size_t vlen) {
+    size_t		size = ENTRY_OVERHEAD + nlen + vlen;
+    agooHpackEntry	e;
+
+    // An entry bigger than the table empties it and is not added.
+    if (hp->max < size) {
+	table_evict(hp, hp->max + 1);
+	return AGOO_ERR_OK;
+    }
+    // The name can be from an entry that is about to be evicted so copy it
+    // first.
+    if (NULL == (e = (agooHpackEntry)AGOO_MALLOC(sizeof(struct _agooHpackEntry) + nlen + vlen))) {
+	return agoo_err_set(err, AGOO_ERR_MEMORY, "Failed to allocate memory for a header table entry.");
+    }
+    e->nlen = nlen;
+    e->vlen = vlen;
+    memcpy(e->data, name, nlen);
+    memcpy(e->data + nlen, value, vlen);
+    table_evict(hp, size);
+    if (hp->cnt == hp->cap) {
+	int		cap = (0 == hp->cap) ? 16 : hp->cap * 2;
+	agooHpackEntry	*entries = (agooHpackEntry*)AGOO_MALLOC(sizeof(agooHpackEntry) * cap);
+	int		i;
+
+	if (NULL == entries) {
+	    AGOO_FREE(e);
+	    return agoo_err_set(err, AGOO_ERR_MEMORY, "Failed to allocate memory for a header table.");
+	}
+	for (i = 0; i < hp->cnt; i++) {
+	    entries[i] = hp->entries[(hp->head + i) % hp->cap];
+	}
+	AGOO_FREE(hp->entries);
+	hp->entries = entries;
+	hp->cap = cap;
+	hp->head = 0;
+    }
+    hp->entries[(hp->head + hp->cnt) % hp->cap] = e;
+    hp->cnt++;
+    hp->size += size;
+
+    return AGOO_ERR_OK;
+}
+
+static bool
+table_get(agooHpack hp, uint64_t index, const char **name, size_t *nlen, const char **value, size_t *vlen) {
+    if (0 == index) {
+	return false;
+    }
+    if (index <= STATIC_CNT) {
+	*name = static_table[index].name;
+	*nlen = strlen(*name);
+	*value = static_table[index].value;
+	*vlen = strlen(*value);
+    } else if ((index -= STATIC_CNT) <= (uint64_t)hp->cnt) {
+	agooHpackEntry	e = hp->entries[(hp->head + hp->cnt - index) % hp->cap];
+
+	*name = e->data;
+	*nlen = e->nlen;
+	*value = e->data + e->nlen;
+	*vlen = e->vlen;
+    } else {
+	return false;
+    }
+    return true;
+}
+
+static bool
+read_int(const uint8_t **pp, const uint8_t *end, int prefix, uint64_t *vp) {
+    const uint8_t	*p = *pp;
+    uint64_t		mask = (1 << prefix) - 1;
+    uint64_t		v = *p++ & mask;
+    int			shift = 0;
+
+    if (v == mask) {
+	do {
+	    if (end <= p || 28 < shift) {
+		return false;
+	    }
+	    v += (uint64_t)(*p & 0x7F) << shift;
+	    shift += 7;
+	} while (0 != (*p++ & 0x80));
+    }
+    if (MAX_INT < v) {
+	return false;
+    }
+    *pp = p;
+    *vp = v;
+
+    return true;
+}
+
+// Codes are matched a bit at a time. The padding at the end must be the
+// high bits of EOS, all ones, and shorter than a byte.
+static long
+huff_decode(const uint8_t *src, size_t len, char *out) {
+    const uint8_t	*end = src + len;
+    char		*o = out;
+    int			code = 0;
+    int			first = 0;
+    int			index = 0;
+    int			bits = 0;
+    bool		ones = true;
+    int			count;
+    int			i;
+    int			bit;
+
+    for (; src < end; src++) {
+	for (i = 7; 0 <= i; i--) {
+	    bit = (*src >> i) & 1;
+	    code |= bit;
+	    ones = ones && bit;
+	    count = huff_cnt[++bits];
+	    if (code - first < count) {
+		int	sym = huff_syms[index + code - first];
+
+		if (256 == sym) {
+		    return -1;
+		}
+		*o++ = (char)sym;
+		code = 0;
+		first = 0;
+		index = 0;
+		bits = 0;
+		ones = true;
+	    } else {
+		if (30 <= bits) {
+		    return -1;
+		}
+		index += count;
+		first += count;
+		first <<= 1;
+		code <<= 1;
+	    }
+	}
+    }
+    if (7 < bits || !ones) {
+	return -1;
+    }
+    return (long)(o - out);
+}
+
+// Decodes a string into the scratch buffer at off.
+static int
+read_str(agooErr err, agooHpack hp, const uint8_t **pp, const uint8_t *end, size_t off, size_t *lenp) {
+    bool	huff = (0 != (**pp & 0x80));
+    uint64_t	len;
+    size_t	need;
+
+    if (!read_int(pp, end, 7, &len) || (uint64_t)(end - *pp) < len) {
+	return agoo_err_set(err, AGOO_ERR_PARSE, "Invalid header string length.");
+    }
+    need = off + (huff ? len * 8 / 5 + 1 : len);
+    if (hp->tcap < need) {
+	size_t	cap = (0 == hp->tcap) ? 256 : hp->tcap;
+	char	*tmp;
+
+	for (; cap < need; cap *= 2) {
+	}
+	if (NULL == (tmp = (char*)AGOO_REALLOC(hp->tmp, cap))) {
+	    return agoo_err_set(err, AGOO_ERR_MEMORY, "Failed to allocate memory for a header.");
+	}
+	hp->tmp = tmp;
+	hp->tcap = cap;
+    }
+    if (huff) {
+	long	cnt = huff_decode(*pp, (size_t)len, hp->tmp + off);
+
+	if (0 > cnt) {
+	    return agoo_err_set(err, AGOO_ERR_PARSE, "Invalid Huffman encoded header.");
+	}
+	*lenp = (size_t)cnt;
+    } else {
+	memcpy(hp->tmp + off, *pp, (size_t)len);
+	*lenp = (size_t)len;
+    }
+    *pp += len;
+
+    return AGOO_ERR_OK;
+}
+
+// Decodes a complete header block and calls cb for each field in
+// order. Any error is a connection error since the table may no longer
+// match the peer's. Returns AGOO_ERR_PARSE for a bad block and
+// AGOO_ERR_EVAL if the callback returns false.
+int
+agoo_hpack_decode(agooErr err, agooHpack hp, const uint8_t *block, size_t len, agooHpackCb cb, void *ctx) {
+    const uint8_t	*p = block;
+    const uint8_t	*end = block + len;
+    const char		*name;
+    const char		*value;
+    size_t		nlen;
+    size_t		vlen;
+    uint64_t		index;
+    bool		fields = false;
+
+    while (p < end) {
+	if (0 != (*p & 0x80)) {
+	    if (!read_int(&p, end, 7, &index) || !table_get(hp, index, &name, &nlen, &value, &vlen)) {
+		return agoo_err_set(err, AGOO_ERR_PARSE, "Invalid header index.");
+	    }
+	} else if (0x20 == (*p & 0xE0)) {
+	    // A dynamic table size update is only allowed at the start.
+	    if (fields || !read_int(&p, end, 5, &index) || hp->limit < index) {
+		return agoo_err_set(err, AGOO_ERR_PARSE, "Invalid header table size update.");
+	    }
+	    hp->max = (size_t)index;
+	    table_evict(hp, 0);
+	    continue;
+	} else {
+	    bool	add = (0 != (*p & 0x40));
+	    bool	tmp_name = false;
+
+	    if (!read_int(&p, end, add ? 6 : 4, &index) || end <= p) {
+		return agoo_err_set(err, AGOO_ERR_PARSE, "Invalid header field.");
+	    }
+	    if (0 == index) {
+		if (AGOO_ERR_OK != read_str(err, hp, &p, end, 0, &nlen)) {
+		    return err->code;
+		}
+		tmp_name = true;
+	    } else if (!table_get(hp, index, &name, &nlen, &value, &vlen)) {
+		return agoo_err_set(err, AGOO_ERR_PARSE, "Invalid header index.");
+	    }
+	    if (end <= p || AGOO_ERR_OK != read_str(err, hp, &p, end, tmp_name ? nlen : 0, &vlen)) {
+		return (AGOO_ERR_OK == err->code) ? agoo_err_set(err, AGOO_ERR_PARSE, "Invalid header field.") : err->code;
+	    }
+	    // The scratch buffer may have moved while the value was read.
+	    if (tmp_name) {
+		name = hp->tmp;
+		value = hp->tmp + nlen;
+	    } else {
+		value = hp->tmp;
+	    }
+	    // The field is used before it is added since adding can evict the
+	    // entry the name came from.
+	    if (!cb(ctx, name, nlen, value, vlen)) {
+		return agoo_err_set(err, AGOO_ERR_EVAL, "Header rejected.");
+	    }
+	    if (add && AGOO_ERR_OK != table_add(err, hp, name, nlen, value, vlen)) {
+		return err->code;
+	    }
+	    fields = true;
+	    continue;
+	}
+	fields = true;
+	if (!cb(ctx, name, nlen, value, vlen)) {
+	    return agoo_err_set(err, AGOO_ERR_EVAL, "Header rejected.");
+	}
+    }
+    return AGOO_ERR_OK;
+}
+
+static agooText
+append_int(agooText t, uint8_t first, int prefix, uint64_t v) {
+    uint8_t	buf[16];
+    int		cnt = 0;
+    uint64_t	mask = (1 << prefix) - 1;
+
+    if (v < mask) {
+	buf[cnt++] = first | (uint8_t)v;
+    } else {
+	buf[cnt++] = first | (uint8_t)mask;
+	for (v -= mask; 0x80 <= v; v >>= 7) {
+	    buf[cnt++] = (uint8_t)(0x80 | (v & 0x7F));
+	}
+	buf[cnt++] = (uint8_t)v;
+    }
+    return agoo_text_append(t, (char*)buf, cnt);
+}
+
+static agooText
+append_str(agooText t, const char *s, int len) {
+    if (NULL != (t = append_int(t, 0x00, 7, (uint64_t)len)) && 0 < len) {
+	t = agoo_text_append(t, s, len);
+    }
+    return t;
+}
+
+agooText
+agoo_hpack_encode_status(agooText t, int status) {
+    char	buf[8];
+    int		i;
+
+    for (i = 8; i <= 14; i++) {
+	if (status == atoi(static_table[i].value)) {
+	    return append_int(t, 0x80, 7, (uint64_t)i);
+	}
+    }
+    snprintf(buf, sizeof(buf), "%03d", status);
+    if (NULL != (t = append_int(t, 0x00, 4, 8))) {
+	t = append_str(t, buf, 3);
+    }
+    return t;
+}
+
+// Fields are written as literals without indexing so the peer's table is
+// never used. The name is lowercased as HTTP/2 requires and the static table
+// index of the name is used when there is one.
+agooText
+agoo_hpack_encode_field(agooText t, const char *name, int nlen, const char *value, int vlen) {
+    int		i;
+    char	*s;
+
+    for (i = 15; i <= STATIC_CNT; i++) {
+	if (0 == strncasecmp(name, static_table[i].name, nlen) && '\0' == static_table[i].name[nlen]) {
+	    if (NULL != (t = append_int(t, 0x00, 4, (uint64_t)i))) {
+		t = append_str(t, value, vlen);
+	    }
+	    return t;
+	}
+    }
+    if (NULL == (t = agoo_text_append(t, "\x00", 1)) || NULL == (t = append_str(t, name, nlen))) {
+	return NULL;
+    }
+    for (s = t->text + t->len - nlen; s < t->text + t->len; s++) {
+	*s = tolower(*s);
+    }
+    return append_str(t, value, vlen);
+}
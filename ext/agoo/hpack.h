@@ -0,0 +1,42 @@
+// Copyright (c) 2019, Peter Ohler, All rights reserved.
+
+#ifndef AGOO_HPACK_H
+#define AGOO_HPACK_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "err.h"
+#include "text.h"
+
+#define AGOO_HPACK_TABLE_SIZE	4096
+
+struct _agooHpackEntry;
+
+// The decoding side of HPACK header compression for one connection. Only
+// the dynamic table and a scratch buffer for decoded strings are kept. The
+// encoder does not add to the peer's dynamic table so there is nothing to
+// keep for it.
+typedef struct _agooHpack {
+    struct _agooHpackEntry	**entries; // ring with the oldest at head
+    int				cap;
+    int				cnt;
+    int				head;
+    size_t			size;
+    size_t			max;   // set by a dynamic table size update
+    size_t			limit; // the most max can be set to
+    char			*tmp;
+    size_t			tcap;
+} *agooHpack;
+
+typedef bool	(*agooHpackCb)(void *ctx, const char *name, size_t nlen, const char *value, size_t vlen);
+
+extern void	agoo_hpack_init(agooHpack hp, size_t limit);
+extern void	agoo_hpack_cleanup(agooHpack hp);
+extern int	agoo_hpack_decode(agooErr err, agooHpack hp, const uint8_t *block, size_t len, agooHpackCb cb, void *ctx);
+
+extern agooText	agoo_hpack_encode_status(agooText t, int status);
+extern agooText	agoo_hpack_encode_field(agooText t, const char *name, int nlen, const char *value, int vlen);
+
+#endif // AGOO_HPACK_H
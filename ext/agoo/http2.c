@@ -0,0 +1,1250 @@
+// Copyright (c) 2019, Peter Ohler, All rights reserved.
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "base64.h"
+#include "body.h"
+#include "con.h"
+#include "debug.h"
+#include "dtime.h"
+#include "hook.h"
+#include "http2.h"
+#include "log.h"
+#include "req.h"
+#include "res.h"
+#include "server.h"
+
+#define DEFAULT_WINDOW	65535
+#define MAX_WINDOW	0x7FFFFFFF
+#define OUT_MAX		65536
+
+typedef enum {
+    FRAME_DATA		= 0x0,
+    FRAME_HEADERS	= 0x1,
+    FRAME_PRIORITY	= 0x2,
+    FRAME_RST_STREAM	= 0x3,
+    FRAME_SETTINGS	= 0x4,
+    FRAME_PUSH_PROMISE	= 0x5,
+    FRAME_PING		= 0x6,
+    FRAME_GOAWAY	= 0x7,
+    FRAME_WINDOW_UPDATE	= 0x8,
+    FRAME_CONTINUATION	= 0x9,
+} FrameType;
+
+typedef enum {
+    FLAG_END_STREAM	= 0x01,
+    FLAG_ACK		= 0x01,
+    FLAG_END_HEADERS	= 0x04,
+    FLAG_PADDED		= 0x08,
+    FLAG_PRIORITY	= 0x20,
+} FrameFlag;
+
+typedef enum {
+    NO_ERROR		= 0x0,
+    PROTOCOL_ERROR	= 0x1,
+    INTERNAL_ERROR	= 0x2,
+    FLOW_CONTROL_ERROR	= 0x3,
+    STREAM_CLOSED	= 0x5,
+    FRAME_SIZE_ERROR	= 0x6,
+    REFUSED_STREAM	= 0x7,
+    COMPRESSION_ERROR	= 0x9,
+} H2Error;
+
+typedef enum {
+    RES_WAIT	= 'W',
+    RES_MORE	= 'M',
+    RES_DONE	= 'D',
+} ResState;
+
+// Collects the fields of a request header block into an HTTP/1.1 head. The
+// pseudo-header values are at the start of head and the regular fields follow
+// as header lines.
+typedef struct _reqBuild {
+    agooText	head;
+    agooText	cookies;
+    long	method;
+    long	mlen;
+    long	path;
+    long	plen;
+    long	auth;
+    long	alen;
+    long	fields; // where the regular fields start
+    bool	host;
+    bool	bad;
+} *ReqBuild;
+
+static const char	preface[] = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+
+static uint32_t
+read_u32(const uint8_t *b) {
+    return ((uint32_t)b[0] << 24) | ((uint32_t)b[1] << 16) | ((uint32_t)b[2] << 8) | (uint32_t)b[3];
+}
+
+static void
+write_u32(uint8_t *b, uint32_t v) {
+    b[0] = (uint8_t)(v >> 24);
+    b[1] = (uint8_t)(v >> 16);
+    b[2] = (uint8_t)(v >> 8);
+    b[3] = (uint8_t)v;
+}
+
+static bool
+frame_head(agooText *tp, uint8_t type, uint8_t flags, uint32_t sid, uint32_t len) {
+    uint8_t	head[9];
+    agooText	t;
+
+    head[0] = (uint8_t)(len >> 16);
+    head[1] = (uint8_t)(len >> 8);
+    head[2] = (uint8_t)len;
+    head[3] = type;
+    head[4] = flags;
+    write_u32(head + 5, sid & MAX_WINDOW);
+    if (NULL == (t = agoo_text_append(*tp, (char*)head, sizeof(head)))) {
+	return false;
+    }
+    *tp = t;
+
+    return true;
+}
+
+// Appends a frame. The text is updated after each append so it is never
+// lost if an append fails.
+static bool
+frame_add(agooText *tp, uint8_t type, uint8_t flags, uint32_t sid, const char *payload, uint32_t len) {
+    agooText	t;
+
+    if (!frame_head(tp, type, flags, sid, len)) {
+	return false;
+    }
+    if (0 < len) {
+	if (NULL == (t = agoo_text_append(*tp, payload, (int)len))) {
+	    return false;
+	}
+	*tp = t;
+    }
+    return true;
+}
+
+static bool
+ctl_u32(agooH2 h2, uint8_t type, uint32_t sid, uint32_t v) {
+    uint8_t	b[4];
+
+    write_u32(b, v);
+
+    return frame_add(&h2->ctl, type, 0, sid, (char*)b, sizeof(b));
+}
+
+// Queues a GOAWAY and stops reading. The connection closes once what is
+// pending has been written.
+static void
+conn_error(agooCon c, uint32_t code) {
+    agooH2	h2 = c->h2;
+    uint8_t	b[8];
+
+    agoo_log_cat(&agoo_warn_cat, "HTTP/2 error 0x%x on connection %llu.", code, (unsigned long long)c->id);
+    write_u32(b, h2->last_sid);
+    write_u32(b + 4, code);
+    frame_add(&h2->ctl, FRAME_GOAWAY, 0, 0, (char*)b, sizeof(b));
+    c->closing = true;
+    c->bcnt = 0;
+}
+
+static agooH2Stream
+stream_get(agooH2 h2, uint32_t sid) {
+    agooH2Stream	s;
+    agooH2Stream	end = h2->streams + AGOO_H2_MAX_STREAMS;
+
+    if (0 == sid) {
+	return NULL;
+    }
+    for (s = h2->streams; s < end; s++) {
+	if (sid == s->sid) {
+	    return s;
+	}
+    }
+    return NULL;
+}
+
+static agooH2Stream
+stream_open(agooH2 h2, uint32_t sid) {
+    agooH2Stream	s;
+    agooH2Stream	end = h2->streams + AGOO_H2_MAX_STREAMS;
+
+    for (s = h2->streams; s < end; s++) {
+	if (0 == s->sid) {
+	    memset(s, 0, sizeof(struct _agooH2Stream));
+	    s->sid = sid;
+	    s->win = h2->init_win;
+	    s->boff = -1;
+	    h2->scnt++;
+	    if (h2->last_sid < sid) {
+		h2->last_sid = sid;
+	    }
+	    return s;
+	}
+    }
+    return NULL;
+}
+
+// A request that was not queued yet is dropped with the stream. One that was
+// belongs to a worker and its response is dropped when it is ready since the
+// stream can no longer be found.
+static void
+stream_free(agooH2 h2, agooH2Stream s) {
+    if (NULL != s->req) {
+	agoo_req_destroy(s->req);
+    }
+    agoo_body_destroy(s->body);
+    memset(s, 0, sizeof(struct _agooH2Stream));
+    h2->scnt--;
+}
+
+static void
+stream_reset(agooH2 h2, agooH2Stream s, uint32_t code) {
+    ctl_u32(h2, FRAME_RST_STREAM, s->sid, code);
+    stream_free(h2, s);
+}
+
+agooH2
+agoo_h2_create(agooErr err, agooCon c) {
+    agooH2	h2 = (agooH2)AGOO_MALLOC(sizeof(struct _agooH2));
+    uint8_t	settings[12];
+
+    if (NULL == h2) {
+	agoo_err_set(err, AGOO_ERR_MEMORY, "Failed to allocate memory for an HTTP/2 connection.");
+	return NULL;
+    }
+    memset(h2, 0, sizeof(struct _agooH2));
+    agoo_hpack_init(&h2->hpack, AGOO_HPACK_TABLE_SIZE);
+    h2->win = DEFAULT_WINDOW;
+    h2->init_win = DEFAULT_WINDOW;
+    h2->max_frame = AGOO_H2_FRAME_MAX;
+    if (NULL == (h2->block = agoo_text_allocate(1024)) ||
+	NULL == (h2->head = agoo_text_allocate(1024)) ||
+	NULL == (h2->out = agoo_text_allocate(OUT_MAX)) ||
+	NULL == (h2->ctl = agoo_text_allocate(1024))) {
+	agoo_h2_destroy(h2);
+	agoo_err_set(err, AGOO_ERR_MEMORY, "Failed to allocate memory for an HTTP/2 connection.");
+	return NULL;
+    }
+    // The server preface. SETTINGS_MAX_CONCURRENT_STREAMS and
+    // SETTINGS_MAX_HEADER_LIST_SIZE.
+    settings[0] = 0;
+    settings[1] = 0x3;
+    write_u32(settings + 2, AGOO_H2_MAX_STREAMS);
+    settings[6] = 0;
+    settings[7] = 0x6;
+    write_u32(settings + 8, (uint32_t)agoo_server.max_header);
+    frame_add(&h2->ctl, FRAME_SETTINGS, 0, 0, (char*)settings, sizeof(settings));
+
+    return h2;
+}
+
+void
+agoo_h2_destroy(agooH2 h2) {
+    agooH2Stream	s;
+
+    if (NULL == h2) {
+	return;
+    }
+    for (s = h2->streams; s < h2->streams + AGOO_H2_MAX_STREAMS; s++) {
+	if (0 != s->sid) {
+	    stream_free(h2, s);
+	}
+    }
+    agoo_hpack_cleanup(&h2->hpack);
+    if (NULL != h2->block) {
+	agoo_text_release(h2->block);
+    }
+    if (NULL != h2->head) {
+	agoo_text_release(h2->head);
+    }
+    if (NULL != h2->out) {
+	agoo_text_release(h2->out);
+    }
+    if (NULL != h2->ctl) {
+	agoo_text_release(h2->ctl);
+    }
+    AGOO_FREE(h2);
+}
+
+static uint32_t
+apply_settings(agooH2 h2, const uint8_t *p, uint32_t len) {
+    const uint8_t	*end = p + len;
+    uint32_t		v;
+    agooH2Stream	s;
+
+    if (0 != len % 6) {
+	return FRAME_SIZE_ERROR;
+    }
+    for (; p < end; p += 6) {
+	v = read_u32(p + 2);
+	switch (((uint32_t)p[0] << 8) | p[1]) {
+	case 0x2: // SETTINGS_ENABLE_PUSH, never used
+	    if (1 < v) {
+		return PROTOCOL_ERROR;
+	    }
+	    break;
+	case 0x4: // SETTINGS_INITIAL_WINDOW_SIZE
+	    if (MAX_WINDOW < v) {
+		return FLOW_CONTROL_ERROR;
+	    }
+	    for (s = h2->streams; s < h2->streams + AGOO_H2_MAX_STREAMS; s++) {
+		if (0 != s->sid) {
+		    s->win += (int64_t)v - (int64_t)h2->init_win;
+		}
+	    }
+	    h2->init_win = v;
+	    break;
+	case 0x5: // SETTINGS_MAX_FRAME_SIZE
+	    if (v < AGOO_H2_FRAME_MAX || 0xFFFFFF < v) {
+		return PROTOCOL_ERROR;
+	    }
+	    h2->max_frame = v;
+	    break;
+	default:
+	    // The encoder never uses the dynamic table so the table size does
+	    // not matter and the others are only advice.
+	    break;
+	}
+    }
+    return NO_ERROR;
+}
+
+// Called for an HTTP/1.1 request with an Upgrade to h2c before the 101
+// response is queued. The request becomes stream 1, already ended, and its
+// response is sent on that stream.
+int
+agoo_h2_upgrade(agooErr err, agooCon c, const char *settings, int slen, bool head) {
+    char		b64[256];
+    uint8_t		buf[200];
+    agooH2		h2;
+    agooH2Stream	s;
+    int			len;
+    int			i;
+
+    // The settings are base64url encoded and the padding is optional.
+    for (; 0 < slen && '=' == settings[slen - 1]; slen--) {
+    }
+    if ((int)sizeof(b64) <= slen || 1 == slen % 4) {
+	return agoo_err_set(err, AGOO_ERR_PARSE, "Invalid HTTP2-Settings.");
+    }
+    for (i = 0; i < slen; i++) {
+	switch (settings[i]) {
+	case '-':	b64[i] = '+';		break;
+	case '_':	b64[i] = '/';		break;
+	case '+':
+	case '/':
+	case '=':
+	    return agoo_err_set(err, AGOO_ERR_PARSE, "Invalid HTTP2-Settings.");
+	default:	b64[i] = settings[i];	break;
+	}
+    }
+    b64[slen] = '\0';
+    memset(buf, 0, sizeof(buf));
+    b64_from(b64, buf);
+    len = slen / 4 * 3 + ((2 == slen % 4) ? 1 : (3 == slen % 4) ? 2 : 0);
+    if (NULL == (h2 = agoo_h2_create(err, c))) {
+	return err->code;
+    }
+    if (NO_ERROR != apply_settings(h2, buf, (uint32_t)len)) {
+	agoo_h2_destroy(h2);
+	return agoo_err_set(err, AGOO_ERR_PARSE, "Invalid HTTP2-Settings.");
+    }
+    s = stream_open(h2, 1);
+    s->ended = true;
+    s->head = head;
+    c->h2 = h2;
+
+    return AGOO_ERR_OK;
+}
+
+static bool
+build_append(ReqBuild rb, const char *s, size_t len) {
+    agooText	t;
+
+    if (0 == len) {
+	return true;
+    }
+    if (NULL == (t = agoo_text_append(rb->head, s, (int)len))) {
+	rb->bad = true;
+	return false;
+    }
+    rb->head = t;
+
+    return true;
+}
+
+static bool
+build_field(void *ctx, const char *name, size_t nlen, const char *value, size_t vlen) {
+    ReqBuild	rb = (ReqBuild)ctx;
+    long	off = rb->head->len;
+
+    if (rb->bad) {
+	return true;
+    }
+    // The head is parsed again as HTTP/1.1 so anything that would change
+    // how it is split up makes the request malformed.
+    if (0 == nlen || NULL != memchr(value, '\r', vlen) || NULL != memchr(value, '\n', vlen) ||
+	NULL != memchr(value, '\0', vlen) || NULL != memchr(name + 1, ':', nlen - 1) ||
+	NULL != memchr(name, '\r', nlen) || NULL != memchr(name, '\n', nlen) || NULL != memchr(name, ' ', nlen)) {
+	rb->bad = true;
+	return true;
+    }
+    if (':' == *name) {
+	if (0 <= rb->fields) {
+	    rb->bad = true;
+	} else if (7 == nlen && 0 == memcmp(":method", name, 7) && 0 > rb->method) {
+	    rb->method = off;
+	    rb->mlen = (long)vlen;
+	    build_append(rb, value, vlen);
+	} else if (5 == nlen && 0 == memcmp(":path", name, 5) && 0 > rb->path) {
+	    rb->path = off;
+	    rb->plen = (long)vlen;
+	    build_append(rb, value, vlen);
+	} else if (10 == nlen && 0 == memcmp(":authority", name, 10) && 0 > rb->auth) {
+	    rb->auth = off;
+	    rb->alen = (long)vlen;
+	    build_append(rb, value, vlen);
+	} else if (!(7 == nlen && 0 == memcmp(":scheme", name, 7))) {
+	    rb->bad = true;
+	}
+	return true;
+    }
+    if (0 > rb->fields) {
+	rb->fields = off;
+    }
+    // Cookies can be split into separate fields and are put back together
+    // for HTTP/1.1.
+    if (6 == nlen && 0 == strncasecmp("cookie", name, 6)) {
+	agooText	t;
+
+	if (NULL == rb->cookies) {
+	    if (NULL == (rb->cookies = agoo_text_allocate((int)vlen + 64))) {
+		rb->bad = true;
+		return true;
+	    }
+	} else if (NULL == (t = agoo_text_append(rb->cookies, "; ", 2))) {
+	    rb->bad = true;
+	    return true;
+	} else {
+	    rb->cookies = t;
+	}
+	if (0 < vlen) {
+	    if (NULL == (t = agoo_text_append(rb->cookies, value, (int)vlen))) {
+		rb->bad = true;
+	    } else {
+		rb->cookies = t;
+	    }
+	}
+	return true;
+    }
+    if (4 == nlen && 0 == strncasecmp("host", name, 4)) {
+	rb->host = true;
+    }
+    if (build_append(rb, name, nlen) && build_append(rb, ": ", 2) &&
+	build_append(rb, value, vlen)) {
+	build_append(rb, "\r\n", 2);
+    }
+    return true;
+}
+
+// Copies the collected head into a read buffer of its own for the request.
+static agooRBuf
+build_rbuf(ReqBuild rb, long *hlenp) {
+    agooText	t = rb->head;
+    long	flen = (0 > rb->fields) ? 0 : t->len - rb->fields;
+    size_t	size = rb->mlen + rb->plen + flen + 64;
+    agooRBuf	rbuf;
+    char	*p;
+
+    if (!rb->host && 0 <= rb->auth) {
+	size += rb->alen;
+    }
+    if (NULL != rb->cookies) {
+	size += rb->cookies->len + 10;
+    }
+    if (NULL == (rbuf = agoo_rbuf_create(size))) {
+	return NULL;
+    }
+    p = rbuf->buf;
+    memcpy(p, t->text + rb->method, rb->mlen);
+    p += rb->mlen;
+    *p++ = ' ';
+    memcpy(p, t->text + rb->path, rb->plen);
+    p += rb->plen;
+    memcpy(p, " HTTP/1.1\r\n", 11);
+    p += 11;
+    if (!rb->host && 0 <= rb->auth) {
+	memcpy(p, "Host: ", 6);
+	p += 6;
+	memcpy(p, t->text + rb->auth, rb->alen);
+	p += rb->alen;
+	*p++ = '\r';
+	*p++ = '\n';
+    }
+    if (0 < flen) {
+	memcpy(p, t->text + rb->fields, flen);
+	p += flen;
+    }
+    if (NULL != rb->cookies) {
+	memcpy(p, "Cookie: ", 8);
+	p += 8;
+	memcpy(p, rb->cookies->text, rb->cookies->len);
+	p += rb->cookies->len;
+	*p++ = '\r';
+	*p++ = '\n';
+    }
+    *p++ = '\r';
+    *p++ = '\n';
+    *p = '\0';
+    *hlenp = (long)(p - rbuf->buf);
+
+    return rbuf;
+}
+
+// The request is queued once it has ended, which is when the body, if any,
+// is complete.
+static void
+stream_end(agooCon c, agooH2Stream s) {
+    agooReq	req = s->req;
+    agooBody	body = s->body;
+
+    s->ended = true;
+    if (NULL == req) {
+	return;
+    }
+    s->req = NULL;
+    if (NULL != body) {
+	s->body = NULL;
+	body->done = true;
+	req->stream = body;
+	req->body.start = (0 <= body->fd) ? NULL : body->buf;
+	req->body.len = (unsigned int)body->len;
+    }
+    c->sid = s->sid;
+    agoo_con_stream_queue(c, req);
+    c->sid = 0;
+}
+
+static uint32_t
+header_block(agooCon c, agooH2 h2, uint8_t flags, uint32_t sid) {
+    struct _reqBuild	rb;
+    struct _agooErr	err = AGOO_ERR_INIT;
+    agooH2Stream	s = stream_get(h2, sid);
+    agooRBuf		rbuf;
+    agooReq		req;
+    long		hlen;
+
+    h2->cont_sid = 0;
+    memset(&rb, 0, sizeof(rb));
+    rb.head = h2->head;
+    rb.head->len = 0;
+    rb.method = -1;
+    rb.path = -1;
+    rb.auth = -1;
+    rb.fields = -1;
+    // The block must be decoded even if the stream is refused to keep the
+    // table in step with the client.
+    if (AGOO_ERR_OK != agoo_hpack_decode(&err, &h2->hpack, (uint8_t*)h2->block->text, h2->block->len, build_field, &rb)) {
+	h2->head = rb.head;
+	if (NULL != rb.cookies) {
+	    agoo_text_release(rb.cookies);
+	}
+	agoo_log_cat(&agoo_warn_cat, "%s on connection %llu.", err.msg, (unsigned long long)c->id);
+	return COMPRESSION_ERROR;
+    }
+    h2->head = rb.head;
+    if (NULL != s) {
+	// Trailers, which are dropped.
+	if (NULL != rb.cookies) {
+	    agoo_text_release(rb.cookies);
+	}
+	if (s->ended || 0 == (FLAG_END_STREAM & flags)) {
+	    return PROTOCOL_ERROR;
+	}
+	stream_end(c, s);
+	return NO_ERROR;
+    }
+    if (sid <= h2->last_sid) {
+	if (NULL != rb.cookies) {
+	    agoo_text_release(rb.cookies);
+	}
+	return STREAM_CLOSED;
+    }
+    if (AGOO_H2_MAX_STREAMS <= h2->scnt) {
+	h2->last_sid = sid;
+	if (NULL != rb.cookies) {
+	    agoo_text_release(rb.cookies);
+	}
+	return ctl_u32(h2, FRAME_RST_STREAM, sid, REFUSED_STREAM) ? NO_ERROR : INTERNAL_ERROR;
+    }
+    s = stream_open(h2, sid);
+    if (rb.bad || 0 > rb.method || 0 > rb.path || 0 == rb.plen) {
+	if (NULL != rb.cookies) {
+	    agoo_text_release(rb.cookies);
+	}
+	stream_reset(h2, s, PROTOCOL_ERROR);
+	return NO_ERROR;
+    }
+    s->head = (4 == rb.mlen && 0 == memcmp("HEAD", rb.head->text + rb.method, 4));
+    rbuf = build_rbuf(&rb, &hlen);
+    if (NULL != rb.cookies) {
+	agoo_text_release(rb.cookies);
+    }
+    if (NULL == rbuf) {
+	stream_reset(h2, s, INTERNAL_ERROR);
+	return NO_ERROR;
+    }
+    // The request or the response to a request that was answered right
+    // away goes out on the stream.
+    c->sid = sid;
+    req = agoo_con_stream_req(c, rbuf, hlen);
+    c->sid = 0;
+    agoo_rbuf_release(rbuf);
+    s->req = req;
+    if (0 != (FLAG_END_STREAM & flags)) {
+	stream_end(c, s);
+    }
+    return NO_ERROR;
+}
+
+static uint32_t
+frame_headers(agooCon c, agooH2 h2, uint8_t flags, uint32_t sid, const uint8_t *p, uint32_t len) {
+    agooText	t;
+
+    if (0 == sid || 0 == (sid & 1)) {
+	return PROTOCOL_ERROR;
+    }
+    if (0 != (FLAG_PADDED & flags)) {
+	if (len < 1 || len - 1 < *p) {
+	    return PROTOCOL_ERROR;
+	}
+	len -= *p + 1;
+	p++;
+    }
+    if (0 != (FLAG_PRIORITY & flags)) {
+	if (len < 5) {
+	    return FRAME_SIZE_ERROR;
+	}
+	p += 5;
+	len -= 5;
+    }
+    h2->block->len = 0;
+    if (0 < len) {
+	if (NULL == (t = agoo_text_append(h2->block, (char*)p, (int)len))) {
+	    return INTERNAL_ERROR;
+	}
+	h2->block = t;
+    }
+    if (0 != (FLAG_END_HEADERS & flags)) {
+	return header_block(c, h2, flags, sid);
+    }
+    h2->cont_sid = sid;
+    h2->cont_flags = flags;
+
+    return NO_ERROR;
+}
+
+static uint32_t
+frame_continuation(agooCon c, agooH2 h2, uint8_t flags, uint32_t sid, const uint8_t *p, uint32_t len) {
+    agooText	t;
+
+    if (sid != h2->cont_sid) {
+	return PROTOCOL_ERROR;
+    }
+    // A header block is limited to a few times the largest head allowed
+    // since the decoded head is checked after.
+    if (agoo_server.max_header * 4 < h2->block->len + (long)len) {
+	return PROTOCOL_ERROR;
+    }
+    if (0 < len) {
+	if (NULL == (t = agoo_text_append(h2->block, (char*)p, (int)len))) {
+	    return INTERNAL_ERROR;
+	}
+	h2->block = t;
+    }
+    if (0 != (FLAG_END_HEADERS & flags)) {
+	return header_block(c, h2, h2->cont_flags, sid);
+    }
+    return NO_ERROR;
+}
+
+static uint32_t
+frame_data(agooCon c, agooH2 h2, uint8_t flags, uint32_t sid, const uint8_t *p, uint32_t len) {
+    struct _agooErr	err = AGOO_ERR_INIT;
+    agooH2Stream	s;
+    uint32_t		flen = len;
+
+    if (0 == sid) {
+	return PROTOCOL_ERROR;
+    }
+    if (0 != (FLAG_PADDED & flags)) {
+	if (len < 1 || len - 1 < *p) {
+	    return PROTOCOL_ERROR;
+	}
+	len -= *p + 1;
+	p++;
+    }
+    // The whole frame counts against the windows which are opened up again
+    // right away. The body goes to a file if it gets big.
+    h2->recv += flen;
+    if (NULL == (s = stream_get(h2, sid)) || s->ended) {
+	return (h2->last_sid < sid) ? PROTOCOL_ERROR : NO_ERROR;
+    }
+    if (NULL != s->req && 0 < len) {
+	if (NULL == s->body) {
+	    agooHook	hook = s->req->hook;
+	    long	file_min = 0;
+
+	    if (RACK_HOOK == hook->type || BASE_HOOK == hook->type || WAB_HOOK == hook->type) {
+		file_min = agoo_server.body_file_min;
+	    }
+	    s->body = agoo_body_create(&err, false, 0, file_min);
+	}
+	if (NULL == s->body || AGOO_ERR_OK != agoo_body_append(&err, s->body, (char*)p, len)) {
+	    agoo_log_cat(&agoo_error_cat, "%s on connection %llu.", err.msg, (unsigned long long)c->id);
+	    stream_reset(h2, s, INTERNAL_ERROR);
+	    return NO_ERROR;
+	}
+    }
+    if (0 != (FLAG_END_STREAM & flags)) {
+	stream_end(c, s);
+    } else if (0 < flen && !ctl_u32(h2, FRAME_WINDOW_UPDATE, sid, flen)) {
+	return INTERNAL_ERROR;
+    }
+    return NO_ERROR;
+}
+
+static uint32_t
+frame_window_update(agooH2 h2, uint32_t sid, const uint8_t *p, uint32_t len) {
+    uint32_t		inc;
+    agooH2Stream	s;
+
+    if (4 != len) {
+	return FRAME_SIZE_ERROR;
+    }
+    inc = read_u32(p) & MAX_WINDOW;
+    if (0 == sid) {
+	if (0 == inc) {
+	    return PROTOCOL_ERROR;
+	}
+	if (MAX_WINDOW < h2->win + inc) {
+	    return FLOW_CONTROL_ERROR;
+	}
+	h2->win += inc;
+    } else if (NULL != (s = stream_get(h2, sid))) {
+	if (0 == inc) {
+	    stream_reset(h2, s, PROTOCOL_ERROR);
+	} else if (MAX_WINDOW < s->win + inc) {
+	    stream_reset(h2, s, FLOW_CONTROL_ERROR);
+	} else {
+	    s->win += inc;
+	}
+    }
+    return NO_ERROR;
+}
+
+static uint32_t
+frame(agooCon c, uint8_t type, uint8_t flags, uint32_t sid, const uint8_t *p, uint32_t len) {
+    agooH2		h2 = c->h2;
+    agooH2Stream	s;
+
+    if (0 != h2->cont_sid && FRAME_CONTINUATION != type) {
+	return PROTOCOL_ERROR;
+    }
+    switch (type) {
+    case FRAME_DATA:
+	return frame_data(c, h2, flags, sid, p, len);
+    case FRAME_HEADERS:
+	return frame_headers(c, h2, flags, sid, p, len);
+    case FRAME_PRIORITY:
+	// Streams are not prioritized.
+	if (0 == sid) {
+	    return PROTOCOL_ERROR;
+	}
+	return (5 == len) ? NO_ERROR : FRAME_SIZE_ERROR;
+    case FRAME_RST_STREAM:
+	if (0 == sid) {
+	    return PROTOCOL_ERROR;
+	}
+	if (4 != len) {
+	    return FRAME_SIZE_ERROR;
+	}
+	if (NULL != (s = stream_get(h2, sid))) {
+	    stream_free(h2, s);
+	} else if (h2->last_sid < sid) {
+	    return PROTOCOL_ERROR;
+	}
+	break;
+    case FRAME_SETTINGS: {
+	uint32_t	code;
+
+	if (0 != sid) {
+	    return PROTOCOL_ERROR;
+	}
+	if (0 != (FLAG_ACK & flags)) {
+	    return (0 == len) ? NO_ERROR : FRAME_SIZE_ERROR;
+	}
+	if (NO_ERROR != (code = apply_settings(h2, p, len))) {
+	    return code;
+	}
+	if (!frame_add(&h2->ctl, FRAME_SETTINGS, FLAG_ACK, 0, NULL, 0)) {
+	    return INTERNAL_ERROR;
+	}
+	break;
+    }
+    case FRAME_PUSH_PROMISE:
+	return PROTOCOL_ERROR;
+    case FRAME_PING:
+	if (0 != sid) {
+	    return PROTOCOL_ERROR;
+	}
+	if (8 != len) {
+	    return FRAME_SIZE_ERROR;
+	}
+	if (0 == (FLAG_ACK & flags) && !frame_add(&h2->ctl, FRAME_PING, FLAG_ACK, 0, (char*)p, len)) {
+	    return INTERNAL_ERROR;
+	}
+	break;
+    case FRAME_GOAWAY:
+	// Streams already started are finished and then the connection is
+	// closed.
+	c->closing = true;
+	c->bcnt = 0;
+	break;
+    case FRAME_WINDOW_UPDATE:
+	return frame_window_update(h2, sid, p, len);
+    case FRAME_CONTINUATION:
+	return frame_continuation(c, h2, flags, sid, p, len);
+    default:
+	// Unknown frame types are ignored.
+	break;
+    }
+    return NO_ERROR;
+}
+
+// Handles the complete frames in the read buffer. Returns true if the
+// connection should be closed.
+static bool
+h2_process(agooCon c) {
+    agooH2	h2 = c->h2;
+    uint8_t	*b;
+    uint32_t	len;
+    uint32_t	code;
+
+    if (!h2->preface) {
+	size_t	plen = sizeof(preface) - 1;
+
+	if (c->bcnt < plen) {
+	    return 0 != memcmp(preface, c->buf, c->bcnt);
+	}
+	if (0 != memcmp(preface, c->buf, plen)) {
+	    agoo_log_cat(&agoo_warn_cat, "Invalid HTTP/2 preface on connection %llu.", (unsigned long long)c->id);
+	    return true;
+	}
+	h2->preface = true;
+	c->buf += plen;
+	c->bcnt -= plen;
+    }
+    while (9 <= c->bcnt && !c->closing) {
+	b = (uint8_t*)c->buf;
+	len = ((uint32_t)b[0] << 16) | ((uint32_t)b[1] << 8) | (uint32_t)b[2];
+	if (AGOO_H2_FRAME_MAX < len) {
+	    conn_error(c, FRAME_SIZE_ERROR);
+	    break;
+	}
+	if (c->bcnt < 9 + len) {
+	    break;
+	}
+	if (NO_ERROR != (code = frame(c, b[3], b[4], read_u32(b + 5) & MAX_WINDOW, b + 9, len))) {
+	    conn_error(c, code);
+	    break;
+	}
+	if (!c->closing) {
+	    c->buf += 9 + len;
+	    c->bcnt -= 9 + len;
+	}
+    }
+    if (0 < h2->recv && !c->closing) {
+	ctl_u32(h2, FRAME_WINDOW_UPDATE, 0, h2->recv);
+	h2->recv = 0;
+    }
+    // After a GOAWAY from the client with nothing left to do.
+    if (c->closing && NULL == c->res_head && 0 == h2->ctl->len && h2->out->len <= c->wcnt) {
+	return true;
+    }
+    return false;
+}
+
+// Called once a connection is known to be HTTP/2 and the bind switched
+// with the client preface at the start of the read buffer.
+bool
+agoo_h2_start(agooCon c) {
+    struct _agooErr	err = AGOO_ERR_INIT;
+
+    if (NULL == c->h2 && NULL == (c->h2 = agoo_h2_create(&err, c))) {
+	agoo_log_cat(&agoo_error_cat, "%s", err.msg);
+	return true;
+    }
+    c->hscan = 0;
+
+    return h2_process(c);
+}
+
+bool
+agoo_h2_received(agooCon c, ssize_t cnt) {
+    if (c->dead || 0 == c->sock) {
+	return true;
+    }
+    c->timeout = dtime() + CON_TIMEOUT;
+    if (0 >= cnt) {
+	// Clients often reset instead of closing once they have what they want.
+	if (0 > cnt && ECONNRESET != errno) {
+	    agoo_log_cat(&agoo_warn_cat, "Failed to read HTTP/2 frame. %s.", strerror(errno));
+	}
+	return true;
+    }
+    c->bcnt += cnt;
+
+    return h2_process(c);
+}
+
+// Adds the HEADERS and any CONTINUATION frames for a response. The status
+// and fields are taken from the HTTP/1.1 head of the message and the fields
+// that only apply to an HTTP/1.1 connection are dropped.
+static bool
+res_headers(agooCon c, agooH2 h2, agooH2Stream s, agooText message) {
+    const char	*text = message->text;
+    const char	*end = text + message->len;
+    const char	*hend = NULL;
+    const char	*line;
+    const char	*eol;
+    const char	*colon;
+    const char	*value;
+    agooText	t = h2->head;
+    long	blen;
+    long	off;
+    long	size;
+    int		status = 500;
+    bool	first = true;
+
+    if (12 <= message->len && 0 == strncmp("HTTP/1.", text, 7)) {
+	status = atoi(text + 9);
+    }
+    if (agoo_resp_cat.on) {
+	const char	*lend = strstr(text, "\r\n\r\n");
+
+	agoo_log_cat(&agoo_resp_cat, "%llu/%u: %.*s", (unsigned long long)c->id, s->sid,
+		     (int)((NULL == lend) ? message->len : lend - text), text);
+    }
+    t->len = 0;
+    t = agoo_hpack_encode_status(t, status);
+    line = memchr(text, '\n', message->len);
+    for (line = (NULL == line) ? end : line + 1; NULL != t && line < end; line = eol + 2) {
+	if (NULL == (eol = memchr(line, '\r', end - line)) || end <= eol + 1) {
+	    eol = end;
+	}
+	if (line == eol) {
+	    hend = eol + 2;
+	    break;
+	}
+	if (NULL == (colon = memchr(line, ':', eol - line)) || colon == line) {
+	    continue;
+	}
+	for (value = colon + 1; value < eol && (' ' == *value || '\t' == *value); value++) {
+	}
+	switch (colon - line) {
+	case 7:
+	    if (0 == strncasecmp("Upgrade", line, 7)) {
+		continue;
+	    }
+	    break;
+	case 10:
+	    if (0 == strncasecmp("Connection", line, 10) || 0 == strncasecmp("Keep-Alive", line, 10)) {
+		continue;
+	    }
+	    break;
+	case 17:
+	    if (0 == strncasecmp("Transfer-Encoding", line, 17)) {
+		continue;
+	    }
+	    break;
+	default:
+	    break;
+	}
+	t = agoo_hpack_encode_field(t, line, (int)(colon - line), value, (int)(eol - value));
+    }
+    if (NULL == t) {
+	h2->head = agoo_text_allocate(1024);
+	return false;
+    }
+    h2->head = t;
+    s->boff = (NULL == hend) ? message->len : hend - text;
+    if (message->len < s->boff) {
+	s->boff = message->len;
+    }
+    blen = (s->head) ? 0 : message->len - s->boff + message->flen;
+    s->pos = 0;
+    s->blen = blen;
+    for (off = 0; first || off < t->len; off += size, first = false) {
+	uint8_t	flags = 0;
+
+	if ((long)h2->max_frame < (size = t->len - off)) {
+	    size = h2->max_frame;
+	} else {
+	    flags = FLAG_END_HEADERS;
+	}
+	if (first && 0 == blen) {
+	    flags |= FLAG_END_STREAM;
+	}
+	if (!frame_add(&h2->out, first ? FRAME_HEADERS : FRAME_CONTINUATION, flags, s->sid, t->text + off, (uint32_t)size)) {
+	    return false;
+	}
+    }
+    return true;
+}
+
+// Frees the stream once the response has been sent. If the client was still
+// sending the request it is told to stop.
+static void
+stream_done(agooH2 h2, agooH2Stream s) {
+    if (!s->ended) {
+	ctl_u32(h2, FRAME_RST_STREAM, s->sid, NO_ERROR);
+    }
+    stream_free(h2, s);
+}
+
+static ResState
+res_frame(agooCon c, agooH2 h2, agooRes res) {
+    agooText		message = agoo_res_message(res);
+    agooH2Stream	s;
+    char		buf[AGOO_H2_FRAME_MAX];
+    long		tlen;
+    long		size;
+    long		cnt;
+
+    if (NULL == message) {
+	return RES_WAIT;
+    }
+    // A reset stream is gone and the response is dropped.
+    if (NULL == (s = stream_get(h2, res->sid))) {
+	return RES_DONE;
+    }
+    if (0 > s->boff) {
+	if (!res_headers(c, h2, s, message)) {
+	    agoo_log_cat(&agoo_error_cat, "Failed to allocate memory for a response on connection %llu.", (unsigned long long)c->id);
+	    stream_reset(h2, s, INTERNAL_ERROR);
+	    return RES_DONE;
+	}
+	if (0 == s->blen) {
+	    stream_done(h2, s);
+	    return RES_DONE;
+	}
+	return RES_MORE;
+    }
+    size = s->blen - s->pos;
+    if (AGOO_H2_FRAME_MAX < size) {
+	size = AGOO_H2_FRAME_MAX;
+    }
+    if (s->win < size) {
+	size = (long)s->win;
+    }
+    if (h2->win < size) {
+	size = (long)h2->win;
+    }
+    if (0 >= size) {
+	return RES_WAIT;
+    }
+    // The frame can be part text and part file.
+    tlen = message->len - s->boff - s->pos;
+    if (tlen < 0) {
+	tlen = 0;
+    } else if (size < tlen) {
+	tlen = size;
+    }
+    if (tlen < size) {
+	long	foff = s->pos + tlen - (message->len - s->boff);
+	long	done = 0;
+
+	while (done < size - tlen) {
+	    if (0 >= (cnt = pread(message->fd, buf + done, size - tlen - done, message->foff + foff + done))) {
+		if (0 > cnt && EINTR == errno) {
+		    continue;
+		}
+		agoo_log_cat(&agoo_error_cat, "File for response on %llu was truncated.", (unsigned long long)c->id);
+		stream_reset(h2, s, INTERNAL_ERROR);
+		return RES_DONE;
+	    }
+	    done += cnt;
+	}
+    }
+    if (!frame_head(&h2->out, FRAME_DATA, (s->pos + size == s->blen) ? FLAG_END_STREAM : 0, s->sid, (uint32_t)size)) {
+	stream_reset(h2, s, INTERNAL_ERROR);
+	return RES_DONE;
+    }
+    if (0 < tlen) {
+	agooText	t;
+
+	if (NULL == (t = agoo_text_append(h2->out, message->text + s->boff + s->pos, (int)tlen))) {
+	    stream_reset(h2, s, INTERNAL_ERROR);
+	    return RES_DONE;
+	}
+	h2->out = t;
+    }
+    if (tlen < size) {
+	agooText	t;
+
+	if (NULL == (t = agoo_text_append(h2->out, buf, (int)(size - tlen)))) {
+	    stream_reset(h2, s, INTERNAL_ERROR);
+	    return RES_DONE;
+	}
+	h2->out = t;
+    }
+    s->pos += size;
+    s->win -= size;
+    h2->win -= size;
+    if (s->pos == s->blen) {
+	stream_done(h2, s);
+	return RES_DONE;
+    }
+    return RES_MORE;
+}
+
+// Adds frames for the ready responses. Each pass gives every response at
+// most one frame so the streams share the connection.
+static void
+h2_responses(agooCon c, agooH2 h2) {
+    agooRes	res;
+    agooRes	prev;
+    agooRes	next;
+    bool	more = true;
+
+    while (more && h2->out->len < OUT_MAX) {
+	more = false;
+	for (prev = NULL, res = c->res_head; NULL != res && h2->out->len < OUT_MAX; res = next) {
+	    next = res->next;
+	    switch (res_frame(c, h2, res)) {
+	    case RES_MORE:
+		more = true;
+		prev = res;
+		break;
+	    case RES_DONE:
+		if (NULL == prev) {
+		    c->res_head = next;
+		} else {
+		    prev->next = next;
+		}
+		if (res == c->res_tail) {
+		    c->res_tail = prev;
+		}
+		agoo_res_destroy(res);
+		break;
+	    case RES_WAIT:
+	    default:
+		prev = res;
+		break;
+	    }
+	}
+    }
+}
+
+// Returns the frames to write next or NULL if there are none. The frames
+// are only added to once the last ones have been written since the buffer
+// may be in use by a completion style send.
+agooText
+agoo_h2_prep(agooCon c) {
+    agooH2	h2 = c->h2;
+
+    if (c->wcnt < h2->out->len) {
+	return h2->out;
+    }
+    c->wcnt = 0;
+    h2->out->len = 0;
+    if (0 < h2->ctl->len) {
+	agooText	t = h2->out;
+
+	h2->out = h2->ctl;
+	h2->ctl = t;
+    }
+    h2_responses(c, h2);
+    if (0 == h2->out->len) {
+	return NULL;
+    }
+    c->timeout = dtime() + CON_TIMEOUT;
+
+    return h2->out;
+}
+
+bool
+agoo_h2_sent(agooCon c, ssize_t cnt) {
+    agooH2	h2 = c->h2;
+
+    if (0 > cnt) {
+	agoo_log_cat(&agoo_error_cat, "Socket error @ %llu.", (unsigned long long)c->id);
+	return false;
+    }
+    c->wcnt += cnt;
+    // Once closing the connection is done when everything pending has been
+    // written.
+    if (c->closing && h2->out->len <= c->wcnt && 0 == h2->ctl->len && NULL == c->res_head) {
+	return false;
+    }
+    return true;
+}
+
+bool
+agoo_h2_write(agooCon c) {
+    agooText	t;
+    ssize_t	cnt;
+
+    while (NULL != (t = agoo_h2_prep(c))) {
+	if (0 > (cnt = agoo_con_send(c, t->text + c->wcnt, t->len - c->wcnt)) && EAGAIN == errno) {
+	    return true;
+	}
+	if (!agoo_h2_sent(c, cnt)) {
+	    return false;
+	}
+	if (c->wcnt < t->len) {
+	    break;
+	}
+    }
+    return true;
+}
+
+// True if a response can add a frame.
+static bool
+h2_ready(agooCon c, agooH2 h2) {
+    agooRes		res;
+    agooH2Stream	s;
+
+    for (res = c->res_head; NULL != res; res = res->next) {
+	if (NULL == agoo_res_message(res)) {
+	    continue;
+	}
+	if (NULL == (s = stream_get(h2, res->sid)) || 0 > s->boff || (0 < s->win && 0 < h2->win)) {
+	    return true;
+	}
+    }
+    return false;
+}
+
+short
+agoo_h2_events(agooCon c) {
+    agooH2	h2 = c->h2;
+    short	events = 0;
+
+    if (c->wcnt < h2->out->len || 0 < h2->ctl->len || h2_ready(c, h2)) {
+	events = POLLOUT;
+    }
+    if (!c->closing) {
+	events |= POLLIN;
+    }
+    return events;
+}
@@ -0,0 +1,67 @@
+// Copyright (c) 2019, Peter Ohler, All rights reserved.
+
+#ifndef AGOO_HTTP2_H
+#define AGOO_HTTP2_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "err.h"
+#include "hpack.h"
+#include "text.h"
+
+#define AGOO_H2_MAX_STREAMS	100
+#define AGOO_H2_FRAME_MAX	16384
+// A whole frame of the largest size allowed fits in the read buffer.
+#define AGOO_H2_READ_MIN	(9 + AGOO_H2_FRAME_MAX)
+
+struct _agooCon;
+struct _agooReq;
+struct _agooBody;
+
+typedef struct _agooH2Stream {
+    uint32_t		sid;	 // 0 if the slot is free
+    int64_t		win;	 // send window, can go negative after a settings change
+    struct _agooReq	*req;	 // until the request has ended and is queued
+    struct _agooBody	*body;
+    long		boff;	 // of the response body in the message, -1 until the headers are sent
+    long		pos;	 // of the response body sent so far
+    long		blen;	 // of the response body
+    bool		head;	 // a HEAD request so no response body
+    bool		ended;	 // the request has ended
+} *agooH2Stream;
+
+// The HTTP/2 state of a connection. Requests are multiplexed as streams and
+// each is handed to the workers on its own as a regular request. Responses
+// are framed as they become ready in whatever order that is.
+typedef struct _agooH2 {
+    struct _agooHpack		hpack;
+    struct _agooH2Stream	streams[AGOO_H2_MAX_STREAMS];
+    int				scnt;
+    uint32_t			last_sid; // highest stream opened by the client
+    uint32_t			cont_sid; // waiting for a CONTINUATION on this stream
+    uint8_t			cont_flags;
+    bool			preface;  // the client preface has been read
+    agooText			block;	  // header block being collected
+    agooText			head;	  // scratch for building requests and responses
+    agooText			out;	  // being written, c->wcnt is how much
+    agooText			ctl;	  // frames waiting for out to be written
+    int64_t			win;	  // connection send window
+    uint32_t			recv;	  // read since the connection window was last opened up
+    uint32_t			init_win; // initial stream send window
+    uint32_t			max_frame;
+} *agooH2;
+
+extern agooH2		agoo_h2_create(agooErr err, struct _agooCon *c);
+extern void		agoo_h2_destroy(agooH2 h2);
+extern int		agoo_h2_upgrade(agooErr err, struct _agooCon *c, const char *settings, int slen, bool head);
+
+extern bool		agoo_h2_start(struct _agooCon *c);
+extern bool		agoo_h2_received(struct _agooCon *c, ssize_t cnt);
+extern bool		agoo_h2_write(struct _agooCon *c);
+extern agooText		agoo_h2_prep(struct _agooCon *c);
+extern bool		agoo_h2_sent(struct _agooCon *c, ssize_t cnt);
+extern short		agoo_h2_events(struct _agooCon *c);
+
+#endif // AGOO_HTTP2_H
@@ -8,6 +8,7 @@ typedef enum {
     AGOO_CON_HTTP	= 'H',
     AGOO_CON_WS		= 'W',
     AGOO_CON_SSE	= 'S',
+    AGOO_CON_H2		= '2',
 } agooConKind;
 
 #endif // AGOO_KINDS_H
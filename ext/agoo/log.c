@@ -3,6 +3,7 @@
 #include <dirent.h>
 #include <fcntl.h>
 #include <poll.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -12,6 +13,10 @@
 #include <time.h>
 #include <unistd.h>
 
+#if HAVE_SYS_EVENTFD_H
+#include <sys/eventfd.h>
+#endif
+
 #include "debug.h"
 #include "dtime.h"
 #include "log.h"
@@ -88,6 +93,14 @@ agoo_log_queue_empty() {
 static int
 agoo_log_listen() {
     if (0 == agoo_log.rsock) {
+#if HAVE_SYS_EVENTFD_H
+	int	fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+	if (0 <= fd) {
+	    agoo_log.rsock = fd;
+	    agoo_log.wsock = fd;
+	}
+#else
 	int	fd[2];
 
 	if (0 == pipe(fd)) {
@@ -96,20 +109,45 @@ agoo_log_listen() {
 	    agoo_log.rsock = fd[0];
 	    agoo_log.wsock = fd[1];
 	}
+#endif
     }
-    atomic_store(&agoo_log.wait_state, WAITING);
+    __atomic_store_n(&agoo_log.wait_state, WAITING, __ATOMIC_SEQ_CST);
     
     return agoo_log.rsock;
 }
 
 static void
 agoo_log_release() {
+#if HAVE_SYS_EVENTFD_H
+    uint64_t	cnt;
+
+    if (read(agoo_log.rsock, &cnt, sizeof(cnt))) {}
+#else
     char	buf[8];
 
     // clear pipe
     while (0 < read(agoo_log.rsock, buf, sizeof(buf))) {
     }
-    atomic_store(&agoo_log.wait_state, NOT_WAITING);
+#endif
+    __atomic_store_n(&agoo_log.wait_state, NOT_WAITING, __ATOMIC_SEQ_CST);
+}
+
+// Only the first entry pushed while the log thread waits writes to the file
+// descriptor.
+static void
+agoo_log_notify() {
+    int	expect = WAITING;
+
+    if (0 != agoo_log.wsock &&
+	__atomic_compare_exchange_n(&agoo_log.wait_state, &expect, NOTIFIED, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+#if HAVE_SYS_EVENTFD_H
+	uint64_t	one = 1;
+
+	if (write(agoo_log.wsock, &one, sizeof(one))) {}
+#else
+	if (write(agoo_log.wsock, ".", 1)) {}
+#endif
+    }
 }
 
 static agooLogEntry
@@ -132,6 +170,11 @@ agoo_log_queue_pop(double timeout) {
 	    return NULL;
 	}
 	pa.fd = agoo_log_listen();
+	if (atomic_load(&agoo_log.tail) != next) {
+	    // Appended before the listen so don't wait.
+	    agoo_log_release();
+	    break;
+	}
 	pa.events = POLLIN;
 	pa.revents = 0;
 	if (0 < poll(&pa, 1, WAIT_MSECS)) {
@@ -396,10 +439,10 @@ agoo_log_close() {
 	agoo_log.q = NULL;
 	agoo_log.end = NULL;
     }
-    if (0 < agoo_log.wsock) {
+    if (0 < agoo_log.wsock && agoo_log.wsock != agoo_log.rsock) {
 	close(agoo_log.wsock);
-	agoo_log.wsock = 0;
     }
+    agoo_log.wsock = 0;
     if (0 < agoo_log.rsock) {
 	close(agoo_log.rsock);
 	agoo_log.rsock = 0;
@@ -536,10 +579,7 @@ agoo_log_catv(agooLogCat cat, const char *tid, const char *fmt, va_list ap) {
 	atomic_store(&agoo_log.tail, tail);
 	atomic_flag_clear(&agoo_log.push_lock);
 
-	if (0 != agoo_log.wsock && WAITING == (int)(long)atomic_load(&agoo_log.wait_state)) {
-	    if (write(agoo_log.wsock, ".", 1)) {}
-	    atomic_store(&agoo_log.wait_state, NOTIFIED);
-	}
+	agoo_log_notify();
     }
 }
 
@@ -622,7 +662,7 @@ agoo_log_init(const char *app) {
     atomic_init(&agoo_log.tail, agoo_log.q + 1);
 
     agoo_atomic_flag_init(&agoo_log.push_lock);
-    atomic_init(&agoo_log.wait_state, NOT_WAITING);
+    agoo_log.wait_state = NOT_WAITING;
     // Create when/if needed.
     agoo_log.rsock = 0;
     agoo_log.wsock = 0;
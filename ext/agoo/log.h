@@ -86,9 +86,9 @@ struct _agooLog {
     _Atomic(agooLogEntry)	head;
     _Atomic(agooLogEntry)	tail;
     atomic_flag			push_lock;
-    atomic_int			wait_state;
-    int				rsock;
-    int				wsock;
+    int				wait_state;
+    int				rsock; // eventfd or pipe read end
+    int				wsock; // same as rsock for an eventfd
 
     void			(*on_error)(agooErr err);
 };
@@ -1,34 +1,70 @@
 // Copyright 2016, 2018 by Peter Ohler, All Rights Reserved
 
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/stat.h>
 #include <unistd.h>
+#if HAVE_SYS_INOTIFY_H
+#include <sys/inotify.h>
+#endif
+#if HAVE_ZLIB_H
+#include <zlib.h>
+#endif
 
 #include "debug.h"
 #include "dtime.h"
+#include "log.h"
 #include "page.h"
+#include "sectime.h"
 
 #define PAGE_RECHECK_TIME	5.0
+#define SENDFILE_MIN		262144
+#define MAX_RANGES		16
+#define COMPRESS_MIN		256
+#define COMPRESS_MAX		1048576
+#define CHANGE_RING		1024
+#define CHANGE_MASK		1023
+#define WATCH_DEPTH		32
+#define WATCH_MASK		(IN_CLOSE_WRITE | IN_MODIFY | IN_ATTRIB | IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF)
+#define BOUNDARY		"agoo-byte-range-boundary"
 
 #define MAX_KEY_UNIQ		9
-#define MAX_KEY_LEN		1024
-#define PAGE_BUCKET_SIZE	1024
-#define PAGE_BUCKET_MASK	1023
+#define SHARD_CNT		16
+#define SHARD_MASK		15
+#define SHARD_BUCKETS		64
+#define CACHE_MAX		268435456
 
 #define MAX_MIME_KEY_LEN	15
 #define MIME_BUCKET_SIZE	64
 #define MIME_BUCKET_MASK	63
 
+// The key is allocated with the slot so it only takes the space needed.
 typedef struct _slot {
     struct _slot	*next;
-    char		key[MAX_KEY_LEN + 1];
     agooPage		value;
     uint64_t		hash;
     int			klen;
+    bool		used; // set on a hit, cleared by the clock hand
+    char		key[1];
 } *Slot;
 
+// The page cache is split into shards, each with its own lock and buckets
+// that grow as pages are added.
+typedef struct _shard {
+    pthread_mutex_t	lock;
+    Slot		*buckets;
+    size_t		mask;
+    size_t		cnt;
+    size_t		hand; // bucket the clock hand is on
+} *Shard;
+
 typedef struct _mimeSlot {
     struct _mimeSlot	*next;
     char		key[MAX_MIME_KEY_LEN + 1];
@@ -37,11 +73,39 @@ typedef struct _mimeSlot {
     int			klen;
 } *MimeSlot;
 
+typedef struct _watch {
+    struct _watch	*next;
+    char		*path;
+    int			wd;
+} *Watch;
+
 typedef struct _cache {
-    Slot		buckets[PAGE_BUCKET_SIZE];
+    struct _shard	shards[SHARD_CNT];
     MimeSlot		muckets[MIME_BUCKET_SIZE];
     char		*root;
     agooGroup		groups;
+    long		sendfile_min; // files this size or larger are not read in
+
+    // Bytes are counted from when a page is cached until the last
+    // reference is released.
+    long		max_bytes;
+    long		bytes;
+    long		count;
+    uint64_t		hits;
+    uint64_t		misses;
+    uint64_t		evictions;
+
+    // When watching, the watcher thread records the name hash of each
+    // changed file in a ring and bumps the generation. Pages compare their
+    // generation to find out if they should be reloaded instead of calling
+    // stat. A zero hash matches all pages.
+    bool		watching;
+    bool		watch_done;
+    int			watch_fd;
+    pthread_t		watch_thread;
+    Watch		watches;
+    uint64_t		change_gen;
+    uint64_t		changes[CHANGE_RING];
 } *Cache;
 
 typedef struct _mime {
@@ -97,13 +161,30 @@ static struct _mime	mime_map[] = {
     { NULL, NULL }
 };
 
-static const char	page_fmt[] = "HTTP/1.1 200 OK\r\nContent-Type: %s\r\nContent-Length: %ld\r\n\r\n";
+static const char	page_fmt[] = "HTTP/1.1 200 OK\r\nContent-Type: %s\r\nContent-Length: %ld\r\nAccept-Ranges: bytes\r\nETag: %s\r\nLast-Modified: %s\r\n%s\r\n";
+static const char	encoded_fmt[] = "HTTP/1.1 200 OK\r\nContent-Type: %.*s\r\nContent-Length: %ld\r\nContent-Encoding: %s\r\nVary: Accept-Encoding\r\nETag: %.*s-%s\"\r\nLast-Modified: %s\r\n\r\n";
+static const char	vary_header[] = "Vary: Accept-Encoding\r\n";
+static const char	not_modified_fmt[] = "HTTP/1.1 304 Not Modified\r\nETag: %s\r\nLast-Modified: %s\r\n\r\n";
+static const char	range_fmt[] = "HTTP/1.1 206 Partial Content\r\nContent-Type: %.*s\r\nContent-Length: %ld\r\nContent-Range: bytes %ld-%ld/%ld\r\nETag: %s\r\nLast-Modified: %s\r\n\r\n";
+static const char	multi_fmt[] = "HTTP/1.1 206 Partial Content\r\nContent-Type: multipart/byteranges; boundary=" BOUNDARY "\r\nContent-Length: %ld\r\nETag: %s\r\nLast-Modified: %s\r\n\r\n";
+static const char	part_fmt[] = "\r\n--" BOUNDARY "\r\nContent-Type: %.*s\r\nContent-Range: bytes %ld-%ld/%ld\r\n\r\n";
+static const char	multi_end[] = "\r\n--" BOUNDARY "--\r\n";
+static const char	unsatisfiable_fmt[] = "HTTP/1.1 416 Range Not Satisfiable\r\nContent-Range: bytes */%ld\r\nContent-Length: 0\r\n\r\n";
+
+typedef struct _range {
+    long	start;
+    long	end; // inclusive
+} *Range;
 
 static struct _cache	cache = {
-    .buckets = {0},
     .muckets = {0},
     .root = NULL,
     .groups = NULL,
+    .sendfile_min = SENDFILE_MIN,
+    .max_bytes = CACHE_MAX,
+    .watching = false,
+    .watch_done = true,
+    .watch_fd = -1,
 };
 
 static uint64_t
@@ -132,10 +213,46 @@ calc_hash(const char *key, int *lenp) {
     return h;
 }
 
+// Compressed siblings share the hash of the file they are a variant of.
+static uint64_t
+name_hash(const char *name) {
+    int		len = (int)strlen(name);
+    uint64_t	h;
+
+    if (3 < len && (0 == strcmp(".gz", name + len - 3) || 0 == strcmp(".br", name + len - 3))) {
+	len -= 3;
+    }
+    if (0 == (h = calc_hash(name, &len))) {
+	h = 1;
+    }
+    return h;
+}
+
+// Formats a time as an HTTP date such as "Sun, 06 Nov 1994 08:49:37 GMT".
+static void
+http_date(char *buf, size_t size, time_t t) {
+    static const char	*days[] = { "Thu", "Fri", "Sat", "Sun", "Mon", "Tue", "Wed" };
+    static const char	*months[] = { "Jan", "Feb", "Mar", "Apr", "May", "Jun", "Jul", "Aug", "Sep", "Oct", "Nov", "Dec" };
+    struct _agooTime	at;
+    long		day = (long)(t / 86400) % 7;
+
+    if (day < 0) {
+	day += 7;
+    }
+    agoo_sectime((int64_t)t, &at);
+    snprintf(buf, size, "%s, %02d %s %04d %02d:%02d:%02d GMT",
+	     days[day], at.day, months[at.mon - 1], at.year, at.hour, at.min, at.sec);
+}
+
+static Shard
+get_shard(uint64_t h) {
+    return cache.shards + (SHARD_MASK & ((h >> 11) ^ (h >> 23)));
+}
+
 // Buckets are a twist on the hash to mix it up a bit. Odd shifts and XORs.
 static Slot*
-get_bucketp(uint64_t h) {
-    return cache.buckets + (PAGE_BUCKET_MASK & (h ^ (h << 5) ^ (h >> 7)));
+get_bucketp(Shard sh, uint64_t h) {
+    return sh->buckets + (sh->mask & (h ^ (h << 5) ^ (h >> 7)));
 }
 
 static MimeSlot*
@@ -162,21 +279,55 @@ mime_get(const char *key) {
     return v;
 }
 
-agooPage
-cache_get(const char *key, int klen) {
-    int		len = klen;
-    int64_t	h = calc_hash(key, &len);
-    Slot	*bucket = get_bucketp(h);
+static void	agoo_page_destroy(agooPage p);
+
+static void
+page_ref(agooPage p) {
+    __atomic_fetch_add(&p->refs, 1, __ATOMIC_RELAXED);
+}
+
+void
+agoo_page_release(agooPage p) {
+    if (1 == __atomic_fetch_sub(&p->refs, 1, __ATOMIC_ACQ_REL)) {
+	agoo_page_destroy(p);
+    }
+}
+
+static Slot
+shard_find(Shard sh, uint64_t h, const char *key, int klen, int len, Slot **prevp) {
+    Slot	*bp = get_bucketp(sh, h);
     Slot	s;
-    agooPage	v = NULL;
 
-    for (s = *bucket; NULL != s; s = s->next) {
-	if (h == (int64_t)s->hash && len == (int)s->klen &&
+    for (; NULL != (s = *bp); bp = &s->next) {
+	if (h == s->hash && len == s->klen &&
 	    ((0 <= len && len <= MAX_KEY_UNIQ) || 0 == strncmp(s->key, key, klen))) {
-	    v = s->value;
 	    break;
 	}
     }
+    if (NULL != prevp) {
+	*prevp = bp;
+    }
+    return s;
+}
+
+// Returns the cached page with a reference the caller must release or NULL
+// if not cached.
+static agooPage
+cache_get(const char *key, int klen) {
+    int		len = klen;
+    uint64_t	h = calc_hash(key, &len);
+    Shard	sh = get_shard(h);
+    Slot	s;
+    agooPage	v = NULL;
+
+    pthread_mutex_lock(&sh->lock);
+    if (NULL != (s = shard_find(sh, h, key, klen, len, NULL))) {
+	s->used = true;
+	v = s->value;
+	page_ref(v);
+    }
+    pthread_mutex_unlock(&sh->lock);
+
     return v;
 }
 
@@ -217,44 +368,144 @@ mime_set(agooErr err, const char *key, const char *value) {
     return AGOO_ERR_OK;
 }
 
-static agooPage
-cache_set(const char *key, int klen, agooPage value) {
-    int		len = klen;
-    int64_t	h = calc_hash(key, &len);
-    Slot	*bucket = get_bucketp(h);
+static void
+shard_grow(Shard sh) {
+    size_t	size = (sh->mask + 1) * 2;
+    Slot	*old = sh->buckets;
+    Slot	*end = old + sh->mask + 1;
+    Slot	*bp;
+    Slot	*nb;
     Slot	s;
-    agooPage	old = NULL;
-    
-    if (MAX_KEY_LEN < len) {
-	return value;
+    Slot	n;
+
+    if (NULL == (sh->buckets = (Slot*)AGOO_MALLOC(size * sizeof(Slot)))) {
+	sh->buckets = old;
+	return;
     }
-    for (s = *bucket; NULL != s; s = s->next) {
-	if (h == (int64_t)s->hash && len == s->klen &&
-	    ((0 <= len && len <= MAX_KEY_UNIQ) || 0 == strncmp(s->key, key, len))) {
+    memset(sh->buckets, 0, size * sizeof(Slot));
+    sh->mask = size - 1;
+    sh->hand = 0;
+    for (bp = old; bp < end; bp++) {
+	for (s = *bp; NULL != s; s = n) {
+	    n = s->next;
+	    nb = get_bucketp(sh, s->hash);
+	    s->next = *nb;
+	    *nb = s;
+	}
+    }
+    AGOO_FREE(old);
+}
 
-	    old = s->value;
-	    // replace
-	    s->value = value;
+// Moves the clock hand around the shard evicting pages that have not been
+// used since the hand last passed until the cache is under budget. Pages
+// that can not be reloaded are never evicted.
+static void
+shard_evict(Shard sh) {
+    size_t	checked = 0;
+    size_t	limit = sh->cnt * 2;
+    Slot	*bp;
+    Slot	s;
 
-	    return old;
+    while (checked < limit && cache.max_bytes < __atomic_load_n(&cache.bytes, __ATOMIC_RELAXED)) {
+	bp = sh->buckets + sh->hand;
+	while (NULL != (s = *bp)) {
+	    checked++;
+	    if (s->value->immutable) {
+		bp = &s->next;
+	    } else if (s->used) {
+		s->used = false;
+		bp = &s->next;
+	    } else {
+		*bp = s->next;
+		sh->cnt--;
+		__atomic_fetch_sub(&cache.count, 1, __ATOMIC_RELAXED);
+		__atomic_fetch_add(&cache.evictions, 1, __ATOMIC_RELAXED);
+		agoo_page_release(s->value);
+		AGOO_FREE(s);
+	    }
 	}
+	sh->hand = (sh->hand + 1) & sh->mask;
     }
-    if (NULL == (s = (Slot)AGOO_MALLOC(sizeof(struct _slot)))) {
-	return value;
+}
+
+static long
+text_bytes(agooText t) {
+    return (NULL == t) ? 0 : (long)sizeof(struct _agooText) + t->alen;
+}
+
+// Adds the page to the cache, replacing any page with the same key, unless
+// expect is not NULL and is not the page currently cached. The cache takes
+// its own reference to the page.
+static bool
+cache_put(const char *key, int klen, agooPage page, agooPage expect) {
+    int		len = klen;
+    uint64_t	h = calc_hash(key, &len);
+    Shard	sh = get_shard(h);
+    Slot	*bp;
+    Slot	s;
+    agooPage	old = NULL;
+
+    if (0 == page->bytes) {
+	page->bytes = (long)sizeof(struct _agooPage) + klen + (long)strlen(page->path) +
+	    text_bytes(page->resp) + text_bytes(page->gzip) + text_bytes(page->br);
+	__atomic_fetch_add(&cache.bytes, page->bytes, __ATOMIC_RELAXED);
     }
-    s->hash = h;
-    s->klen = len;
-    if (NULL == key) {
-	*s->key = '\0';
+    pthread_mutex_lock(&sh->lock);
+    if (NULL != (s = shard_find(sh, h, key, klen, len, &bp))) {
+	if (NULL != expect && expect != s->value) {
+	    pthread_mutex_unlock(&sh->lock);
+	    return false;
+	}
+	old = s->value;
     } else {
-	strncpy(s->key, key, len);
-	s->key[len] = '\0';
+	if (NULL == (s = (Slot)AGOO_MALLOC(sizeof(struct _slot) + klen))) {
+	    pthread_mutex_unlock(&sh->lock);
+	    return false;
+	}
+	s->hash = h;
+	s->klen = len;
+	memcpy(s->key, key, klen);
+	s->key[klen] = '\0';
+	s->next = *bp;
+	*bp = s;
+	sh->cnt++;
+	__atomic_fetch_add(&cache.count, 1, __ATOMIC_RELAXED);
+	if (sh->mask * 2 < sh->cnt) {
+	    shard_grow(sh);
+	}
     }
-    s->value = value;
-    s->next = *bucket;
-    *bucket = s;
+    page_ref(page);
+    s->value = page;
+    s->used = true;
+    if (NULL != old) {
+	agoo_page_release(old);
+    }
+    if (0 < cache.max_bytes && cache.max_bytes < __atomic_load_n(&cache.bytes, __ATOMIC_RELAXED)) {
+	shard_evict(sh);
+    }
+    pthread_mutex_unlock(&sh->lock);
+
+    return true;
+}
 
-    return old;
+// Removes the page from the cache if it is still the one cached for the key.
+static void
+cache_remove(const char *key, int klen, agooPage page) {
+    int		len = klen;
+    uint64_t	h = calc_hash(key, &len);
+    Shard	sh = get_shard(h);
+    Slot	*bp;
+    Slot	s;
+
+    pthread_mutex_lock(&sh->lock);
+    if (NULL != (s = shard_find(sh, h, key, klen, len, &bp)) && page == s->value) {
+	*bp = s->next;
+	sh->cnt--;
+	__atomic_fetch_sub(&cache.count, 1, __ATOMIC_RELAXED);
+	agoo_page_release(page);
+	AGOO_FREE(s);
+    }
+    pthread_mutex_unlock(&sh->lock);
 }
 
 void
@@ -262,8 +513,21 @@ agoo_pages_init() {
     Mime	m;
     struct _agooErr	err = AGOO_ERR_INIT;
     
+    Shard	sh;
+    
     memset(&cache, 0, sizeof(struct _cache));
+    for (sh = cache.shards; sh < cache.shards + SHARD_CNT; sh++) {
+	pthread_mutex_init(&sh->lock, 0);
+	if (NULL != (sh->buckets = (Slot*)AGOO_MALLOC(SHARD_BUCKETS * sizeof(Slot)))) {
+	    memset(sh->buckets, 0, SHARD_BUCKETS * sizeof(Slot));
+	}
+	sh->mask = SHARD_BUCKETS - 1;
+    }
     cache.root = AGOO_STRDUP(".");
+    cache.sendfile_min = SENDFILE_MIN;
+    cache.max_bytes = CACHE_MAX;
+    cache.watch_done = true;
+    cache.watch_fd = -1;
     for (m = mime_map; NULL != m->suffix; m++) {
 	mime_set(&err, m->suffix, m->type);
     }
@@ -279,33 +543,80 @@ agoo_pages_set_root(const char *root) {
     }
 }
 
+// Files of at least size bytes are left on disk and written with sendfile
+// instead of being read into memory. Zero or less turns that off.
+void
+agoo_pages_set_sendfile_min(long size) {
+    cache.sendfile_min = size;
+}
+
+// Sets the number of bytes the page cache tries to stay under by evicting
+// the least recently used pages. Zero or less is no limit.
+void
+agoo_pages_set_max_bytes(long max) {
+    cache.max_bytes = max;
+}
+
+void
+agoo_pages_stats(agooPageStats stats) {
+    stats->hits = __atomic_load_n(&cache.hits, __ATOMIC_RELAXED);
+    stats->misses = __atomic_load_n(&cache.misses, __ATOMIC_RELAXED);
+    stats->evictions = __atomic_load_n(&cache.evictions, __ATOMIC_RELAXED);
+    stats->bytes = __atomic_load_n(&cache.bytes, __ATOMIC_RELAXED);
+    stats->count = __atomic_load_n(&cache.count, __ATOMIC_RELAXED);
+}
+
 static void
 agoo_page_destroy(agooPage p) {
     if (NULL != p->resp) {
 	agoo_text_release(p->resp);
 	p->resp = NULL;
     }
+    if (NULL != p->gzip) {
+	agoo_text_release(p->gzip);
+	p->gzip = NULL;
+    }
+    if (NULL != p->br) {
+	agoo_text_release(p->br);
+	p->br = NULL;
+    }
+    if (0 < p->bytes) {
+	__atomic_fetch_sub(&cache.bytes, p->bytes, __ATOMIC_RELAXED);
+    }
     AGOO_FREE(p->path);
     AGOO_FREE(p);
 }
 
+static void	watch_stop();
+
 void
 agoo_pages_cleanup() {
-    Slot	*sp = cache.buckets;
+    Shard	sh;
+    Slot	*sp;
     Slot	s;
     Slot	n;
     MimeSlot	*mp = cache.muckets;
     MimeSlot	sm;
     MimeSlot	m;
+    size_t	j;
     int		i;
 
-    for (i = PAGE_BUCKET_SIZE; 0 < i; i--, sp++) {
-	for (s = *sp; NULL != s; s = n) {
-	    n = s->next;
-	    agoo_page_destroy(s->value);
-	    AGOO_FREE(s);
+    watch_stop();
+    for (sh = cache.shards; sh < cache.shards + SHARD_CNT; sh++) {
+	if (NULL == sh->buckets) {
+	    continue;
 	}
-	*sp = NULL;
+	for (j = 0, sp = sh->buckets; j <= sh->mask; j++, sp++) {
+	    for (s = *sp; NULL != s; s = n) {
+		n = s->next;
+		agoo_page_release(s->value);
+		AGOO_FREE(s);
+	    }
+	}
+	AGOO_FREE(sh->buckets);
+	sh->buckets = NULL;
+	sh->cnt = 0;
+	pthread_mutex_destroy(&sh->lock);
     }
     for (i = MIME_BUCKET_SIZE; 0 < i; i--, mp++) {
 	for (sm = *mp; NULL != sm; sm = m) {
@@ -339,6 +650,23 @@ path_mime(const char *path) {
     return mime;
 }
 
+// Text types are worth compressing, images and video already are. Pages are
+// compressed on the connection loop so only those kept in memory and not too
+// large are. Files sent from disk have to have a precompressed sibling.
+static bool
+compressible(const char *mime, long size) {
+#if HAVE_ZLIB_H
+    return COMPRESS_MIN <= size && size <= COMPRESS_MAX &&
+	(0 >= cache.sendfile_min || size < cache.sendfile_min) &&
+	(0 == strncmp("text/", mime, 5) ||
+	 NULL != strstr(mime, "javascript") ||
+	 NULL != strstr(mime, "json") ||
+	 NULL != strstr(mime, "xml"));
+#else
+    return false;
+#endif
+}
+
 // The page resp points to the page resp msg to save memory and reduce
 // allocations.
 agooPage
@@ -355,6 +683,17 @@ agoo_page_create(const char *path) {
 	p->mtime = 0;
 	p->last_check = 0.0;
 	p->immutable = false;
+	p->hlen = 0;
+	*p->etag = '\0';
+	*p->last_mod = '\0';
+	p->gzip = NULL;
+	p->br = NULL;
+	p->vary = false;
+	p->compress = false;
+	p->name_hash = 0;
+	p->gen = __atomic_load_n(&cache.change_gen, __ATOMIC_ACQUIRE);
+	p->refs = 1;
+	p->bytes = 0;
     }
     return p;
 }
@@ -366,6 +705,9 @@ agoo_page_immutable(agooErr err, const char *path, const char *content, int clen
     long	msize;
     int		cnt;
     int		plen = 0;
+    uint64_t	h = 14695981039346656037ULL;
+    const char	*c;
+    const char	*end;
     
     if (NULL == p) {
 	agoo_err_set(err, AGOO_ERR_MEMORY, "Failed to allocate memory for page.");
@@ -380,6 +722,12 @@ agoo_page_immutable(agooErr err, const char *path, const char *content, int clen
     p->mtime = 0;
     p->last_check = 0.0;
     p->immutable = true;
+    p->gzip = NULL;
+    p->br = NULL;
+    p->name_hash = 0;
+    p->gen = 0;
+    p->refs = 1;
+    p->bytes = 0;
 
     if (NULL == mime) {
 	mime = "text/html";
@@ -387,22 +735,35 @@ agoo_page_immutable(agooErr err, const char *path, const char *content, int clen
     if (0 == clen) {
 	clen = (int)strlen(content);
     }
+    // There is no file time so the entity tag is a hash of the content and
+    // the page was last modified when it was created.
+    for (c = content, end = content + clen; c < end; c++) {
+	h = (h ^ (uint8_t)*c) * 1099511628211ULL;
+    }
+    snprintf(p->etag, sizeof(p->etag), "\"%016llx\"", (unsigned long long)h);
+    http_date(p->last_mod, sizeof(p->last_mod), time(NULL));
+    p->compress = compressible(mime, clen);
+    p->vary = p->compress;
+
     // Format size plus space for the length, the mime type, and some
     // padding. Then add the content length.
-    msize = sizeof(page_fmt) + 60 + clen;
+    msize = sizeof(page_fmt) + 60 + sizeof(p->etag) + sizeof(p->last_mod) + sizeof(vary_header) + clen;
     if (NULL == (p->resp = agoo_text_allocate((int)msize))) {
 	AGOO_FREE(p);
 	agoo_err_set(err, AGOO_ERR_MEMORY, "Failed to allocate memory for page content.");
 	return NULL;
     }
-    cnt = sprintf(p->resp->text, page_fmt, mime, (long)clen);
+    cnt = sprintf(p->resp->text, page_fmt, mime, (long)clen, p->etag, p->last_mod, p->vary ? vary_header : "");
+    p->hlen = cnt;
     msize = cnt + clen;
     memcpy(p->resp->text + cnt, content, clen);
     p->resp->text[msize] = '\0';
     p->resp->len = msize;
     agoo_text_ref(p->resp);
 
-    cache_set(path, plen, p);
+    // The cache keeps the page so the returned page need not be released.
+    cache_put(path, plen, p, NULL);
+    agoo_page_release(p);
 
     return p;
 }
@@ -413,16 +774,93 @@ close_return_false(FILE *f) {
     return false;
 }
 
+// Returns a response for the open file with the header already formatted.
+// Large files are left on disk and sent with sendfile. The file stays open
+// as long as the text is referenced.
+static agooText
+file_text(FILE *f, long size, const char *head, int hlen) {
+    agooText	t;
+
+    if (0 < cache.sendfile_min && cache.sendfile_min <= size) {
+	if (NULL == (t = agoo_text_create(head, hlen))) {
+	    return NULL;
+	}
+	if (0 > (t->fd = dup(fileno(f)))) {
+	    t->fd = 0;
+	    agoo_text_release(t);
+	    return NULL;
+	}
+	fcntl(t->fd, F_SETFD, FD_CLOEXEC);
+	t->flen = size;
+
+	return t;
+    }
+    if (NULL == (t = agoo_text_allocate((int)(hlen + size)))) {
+	return NULL;
+    }
+    memcpy(t->text, head, hlen);
+    if (0 < size && size != (long)fread(t->text + hlen, 1, size, f)) {
+	agoo_text_release(t);
+	return NULL;
+    }
+    t->len = hlen + size;
+    t->text[t->len] = '\0';
+
+    return t;
+}
+
+// Loads a precompressed sibling of a file such as app.js.gz for app.js.
+static agooText
+load_encoded(agooPage p, const char *path, const char *mime, const char *suffix, const char *encoding) {
+    char	epath[1100];
+    char	head[1024];
+    struct stat	fs;
+    agooText	t = NULL;
+    FILE	*f;
+    int		cnt;
+
+    if ((int)sizeof(epath) <= snprintf(epath, sizeof(epath), "%s%s", path, suffix) ||
+	NULL == (f = fopen(epath, "rb"))) {
+	return NULL;
+    }
+    if (0 == fstat(fileno(f), &fs) && S_ISREG(fs.st_mode)) {
+	cnt = snprintf(head, sizeof(head), encoded_fmt, (int)strlen(mime), mime, (long)fs.st_size, encoding,
+		       (int)strlen(p->etag) - 1, p->etag, encoding, p->last_mod);
+	if (cnt < (int)sizeof(head)) {
+	    t = file_text(f, (long)fs.st_size, head, cnt);
+	}
+    }
+    fclose(f);
+
+    return t;
+}
+
+static void
+replace_text(agooText *tp, agooText t) {
+    if (NULL != *tp) {
+	agoo_text_release(*tp);
+    }
+    if (NULL != t) {
+	agoo_text_ref(t);
+    }
+    *tp = t;
+}
+
 static bool
 update_contents(agooPage p) {
     const char	*mime = path_mime(p->path);
+    const char	*fpath = p->path;
+    const char	*name;
+    char	ipath[1024];
     int		plen = (int)strlen(p->path);
     long	size;
     struct stat	fattr;
-    long	msize;
+    char	head[1024];
     int		cnt;
     struct stat	fs;
     agooText	t;
+    agooText	gzip;
+    agooText	br;
     FILE	*f = fopen(p->path, "rb");
     
     // On linux a directory is opened by fopen (sometimes? all the time?) so
@@ -441,20 +879,18 @@ update_contents(agooPage p) {
     if (NULL == f) {
 	// If not found how about with a /index.html added?
 	if (NULL == mime) {
-	    char	path[1024];
-	    int		cnt;
-
 	    if ('/' == p->path[plen - 1]) {
-		cnt = snprintf(path, sizeof(path), "%sindex.html", p->path);
+		cnt = snprintf(ipath, sizeof(ipath), "%sindex.html", p->path);
 	    } else {
-		cnt = snprintf(path, sizeof(path), "%s/index.html", p->path);
+		cnt = snprintf(ipath, sizeof(ipath), "%s/index.html", p->path);
 	    }
-	    if ((int)sizeof(path) < cnt) {
+	    if ((int)sizeof(ipath) < cnt) {
 		return false;
 	    }
-	    if (NULL == (f = fopen(path, "rb"))) {
+	    if (NULL == (f = fopen(ipath, "rb"))) {
 		return false;
 	    }
+	    fpath = ipath;
 	    mime = "text/html";
 	} else {
 	    return false;
@@ -470,88 +906,144 @@ update_contents(agooPage p) {
 	return close_return_false(f);
     }
     rewind(f);
-
-    // Format size plus space for the length, the mime type, and some
-    // padding. Then add the content length.
-    msize = sizeof(page_fmt) + 60 + size;
-    if (NULL == (t = agoo_text_allocate((int)msize))) {
+    if (0 != fstat(fileno(f), &fs)) {
 	return close_return_false(f);
     }
-    cnt = sprintf(t->text, page_fmt, mime, size);
-    msize = cnt + size;
-    if (0 < size) {
-	if (size != (long)fread(t->text + cnt, 1, size, f)) {
-	    agoo_text_release(t);
-	    return close_return_false(f);
+    // The modified time and size make a strong enough entity tag without
+    // having to hash the whole file.
+    snprintf(p->etag, sizeof(p->etag), "\"%lx-%lx\"", (long)fs.st_mtime, size);
+    http_date(p->last_mod, sizeof(p->last_mod), fs.st_mtime);
+
+    gzip = load_encoded(p, fpath, mime, ".gz", "gzip");
+    br = load_encoded(p, fpath, mime, ".br", "br");
+    p->compress = (NULL == gzip && compressible(mime, size));
+    if (NULL == (name = strrchr(fpath, '/'))) {
+	name = fpath;
+    } else {
+	name++;
+    }
+    p->name_hash = name_hash(name);
+    p->vary = (NULL != gzip || NULL != br || p->compress);
+
+    cnt = snprintf(head, sizeof(head), page_fmt, mime, size, p->etag, p->last_mod, p->vary ? vary_header : "");
+    if ((int)sizeof(head) <= cnt || NULL == (t = file_text(f, size, head, cnt))) {
+	if (NULL != gzip) {
+	    agoo_text_release(gzip);
+	}
+	if (NULL != br) {
+	    agoo_text_release(br);
 	}
+	return close_return_false(f);
     }
     fclose(f);
-    t->text[msize] = '\0';
-    t->len = msize;
+    p->hlen = cnt;
     if (0 == stat(p->path, &fattr)) {
 	p->mtime = fattr.st_mtime;
     } else {
 	p->mtime = 0;
     }
-    if (NULL != p->resp) {
-	agoo_text_release(p->resp);
-	p->resp = NULL;
-    }
-    p->resp = t;
-    agoo_text_ref(p->resp);
+    replace_text(&p->resp, t);
+    replace_text(&p->gzip, gzip);
+    replace_text(&p->br, br);
     p->last_check = dtime();
 
     return true;
 }
 
-static void
-agoo_page_remove(agooPage p) {
-    int		len = (int)strlen(p->path);
-    int64_t	h = calc_hash(p->path, &len);
-    Slot	*bucket = get_bucketp(h);
-    Slot	s;
-    Slot	prev = NULL;
+// Pages are not changed once cached. A fresh page is loaded and replaces
+// the old one so requests still using the old page are not affected. The
+// reference to the old page is released.
+static agooPage
+page_reload(agooErr err, const char *key, int klen, agooPage old) {
+    agooPage	page;
 
-    for (s = *bucket; NULL != s; s = s->next) {
-	if (h == (int64_t)s->hash && len == (int)s->klen &&
-	    ((0 <= len && len <= MAX_KEY_UNIQ) || 0 == strncmp(s->key, p->path, len))) {
+    if (NULL == (page = agoo_page_create(old->path))) {
+	return old;
+    }
+    if (!update_contents(page)) {
+	agoo_page_release(page);
+	cache_remove(key, klen, old);
+	agoo_page_release(old);
+	agoo_err_set(err, AGOO_ERR_NOT_FOUND, "not found.");
+	return NULL;
+    }
+    cache_put(key, klen, page, old);
+    agoo_page_release(old);
 
-	    if (NULL == prev) {
-		*bucket = s->next;
-	    } else {
-		prev->next = s->next;
-	    }
-	    agoo_page_destroy(s->value);
-	    AGOO_FREE(s);
+    return page;
+}
 
-	    break;
+// Looks for the page in the changes made since the page generation.
+static bool
+page_changed(agooPage page, uint64_t pgen, uint64_t gen) {
+    uint64_t	g = pgen;
+    uint64_t	h;
+
+    if (CHANGE_RING <= gen - g) {
+	return true;
+    }
+    for (; g < gen; g++) {
+	h = cache.changes[g & CHANGE_MASK];
+	if (0 == h || page->name_hash == h) {
+	    return true;
 	}
-	prev = s;
     }
+    // The ring may have been lapped while it was being read.
+    return CHANGE_RING <= __atomic_load_n(&cache.change_gen, __ATOMIC_ACQUIRE) - pgen;
 }
 
+// Takes a referenced page and returns the current page for the key which
+// may be a reloaded one or NULL if the file is gone.
 static agooPage
-page_check(agooErr err, agooPage page) {
+page_check(agooErr err, const char *key, int klen, agooPage page) {
     if (!page->immutable) {
-	double	now = dtime();
+	if (__atomic_load_n(&cache.watching, __ATOMIC_ACQUIRE)) {
+	    uint64_t	gen = __atomic_load_n(&cache.change_gen, __ATOMIC_ACQUIRE);
+	    uint64_t	pgen = __atomic_load_n(&page->gen, __ATOMIC_ACQUIRE);
+
+	    if (gen != pgen) {
+		if (page_changed(page, pgen, gen)) {
+		    return page_reload(err, key, klen, page);
+		}
+		__atomic_store_n(&page->gen, gen, __ATOMIC_RELEASE);
+	    }
+	} else {
+	    double	now = dtime();
 
-	if (page->last_check + PAGE_RECHECK_TIME < now) {
-	    struct stat	fattr;
+	    if (page->last_check + PAGE_RECHECK_TIME < now) {
+		struct stat	fattr;
 
-	    if (0 == stat(page->path, &fattr) && page->mtime != fattr.st_mtime) {
-		update_contents(page);
-		if (NULL == page->resp) {
-		    agoo_page_remove(page);
-		    agoo_err_set(err, AGOO_ERR_NOT_FOUND, "not found.");
-		    return NULL;
+		page->last_check = now;
+		if (0 == stat(page->path, &fattr) && page->mtime != fattr.st_mtime) {
+		    return page_reload(err, key, klen, page);
 		}
 	    }
-	    page->last_check = now;
 	}
     }
     return page;
 }
 
+// Loads a page that is not cached yet and caches it.
+static agooPage
+page_load(agooErr err, const char *key, int klen, const char *path) {
+    agooPage	page;
+
+    __atomic_fetch_add(&cache.misses, 1, __ATOMIC_RELAXED);
+    if (NULL == (page = agoo_page_create(path))) {
+	agoo_err_set(err, AGOO_ERR_MEMORY, "Failed to allocate memory for agooPage.");
+	return NULL;
+    }
+    if (!update_contents(page) || NULL == page->resp) {
+	agoo_page_release(page);
+	agoo_err_set(err, AGOO_ERR_NOT_FOUND, "not found.");
+	return NULL;
+    }
+    cache_put(key, klen, page, NULL);
+
+    return page;
+}
+
+// Returns a page the caller must release with agoo_page_release().
 agooPage
 agoo_page_get(agooErr err, const char *path, int plen) {
     agooPage	page;
@@ -561,7 +1053,6 @@ agoo_page_get(agooErr err, const char *path, int plen) {
     }
     if (NULL == (page = cache_get(path, plen))) {
 	if (NULL != cache.root) {
-	    agooPage	old;
 	    char	full_path[2048];
 	    char	*s = stpcpy(full_path, cache.root);
 
@@ -574,25 +1065,437 @@ agoo_page_get(agooErr err, const char *path, int plen) {
 	    }
 	    strncpy(s, path, plen);
 	    s[plen] = '\0';
-	    if (NULL == (page = agoo_page_create(full_path))) {
-		agoo_err_set(err, AGOO_ERR_MEMORY, "Failed to allocate memory for agooPage.");
-		return NULL;
+	    page = page_load(err, path, plen, full_path);
+	}
+    } else {
+	__atomic_fetch_add(&cache.hits, 1, __ATOMIC_RELAXED);
+	page = page_check(err, path, plen, page);
+    }
+    return page;
+}
+
+// The mime type is taken from the cached header since the mime map entry
+// may have been replaced since the page was loaded.
+static const char*
+page_mime(agooPage p, int *lenp) {
+    const char	*mime = p->resp->text + sizeof("HTTP/1.1 200 OK\r\nContent-Type: ") - 1;
+    const char	*end = strstr(mime, "\r\n");
+
+    *lenp = (int)(end - mime);
+
+    return mime;
+}
+
+static bool
+page_read(agooPage p, char *buf, long off, long len) {
+    if (0 < p->resp->fd) {
+	return len == (long)pread(p->resp->fd, buf, len, off);
+    }
+    memcpy(buf, p->resp->text + p->hlen + off, len);
+
+    return true;
+}
+
+static const char*
+read_num(const char *s, const char *end, long *np) {
+    const char	*start = s;
+    long	n = 0;
+
+    for (; s < end && '0' <= *s && *s <= '9'; s++) {
+	if ((LONG_MAX - 9) / 10 < n) {
+	    return NULL;
+	}
+	n = n * 10 + (*s - '0');
+    }
+    if (start == s) {
+	return NULL;
+    }
+    *np = n;
+
+    return s;
+}
+
+// Returns the number of satisfiable ranges or -1 if the Range header should
+// be ignored and the whole page returned. That includes too many ranges or
+// ranges that add up to more than the page, which are not worth serving.
+static int
+parse_ranges(const char *s, int len, long size, Range ranges) {
+    const char	*end = s + len;
+    long	total = 0;
+    long	start;
+    long	stop;
+    int		specs = 0;
+    int		cnt = 0;
+
+    if (len < 6 || 0 != strncasecmp("bytes=", s, 6)) {
+	return -1;
+    }
+    for (s += 6; s < end; specs++) {
+	for (; s < end && (' ' == *s || '\t' == *s || ',' == *s); s++) {
+	}
+	if (end <= s) {
+	    break;
+	}
+	if ('-' == *s) {
+	    if (NULL == (s = read_num(s + 1, end, &stop))) {
+		return -1;
 	    }
-	    if (!update_contents(page) || NULL == page->resp) {
-		agoo_page_destroy(page);
-		agoo_err_set(err, AGOO_ERR_NOT_FOUND, "not found.");
-		return NULL;
+	    if (0 == stop || 0 == size) {
+		continue;
+	    }
+	    start = (size < stop) ? 0 : size - stop;
+	    stop = size - 1;
+	} else {
+	    if (NULL == (s = read_num(s, end, &start)) || end <= s || '-' != *s) {
+		return -1;
 	    }
-	    if (NULL != (old = cache_set(path, plen, page))) {
-		agoo_page_destroy(old);
+	    s++;
+	    if (s < end && '0' <= *s && *s <= '9') {
+		if (NULL == (s = read_num(s, end, &stop)) || stop < start) {
+		    return -1;
+		}
+		if (size <= stop) {
+		    stop = size - 1;
+		}
+	    } else {
+		stop = size - 1;
+	    }
+	    if (size <= start) {
+		continue;
 	    }
 	}
-    } else {
-	page = page_check(err, page);
+	if (s < end && ' ' != *s && '\t' != *s && ',' != *s) {
+	    return -1;
+	}
+	if (MAX_RANGES <= cnt) {
+	    return -1;
+	}
+	total += stop - start + 1;
+	ranges[cnt].start = start;
+	ranges[cnt].end = stop;
+	cnt++;
     }
-    return page;
+    if (0 == specs || size < total) {
+	return -1;
+    }
+    return cnt;
+}
+
+// If-None-Match uses the weak comparison so a W/ prefix is ignored.
+static bool
+etag_match(const char *etag, const char *s, int len) {
+    const char	*end = s + len;
+    int		elen = (int)strlen(etag);
+
+    while (s < end) {
+	for (; s < end && (' ' == *s || '\t' == *s || ',' == *s); s++) {
+	}
+	if (s < end && '*' == *s) {
+	    return true;
+	}
+	if (s + 2 <= end && 'W' == *s && '/' == s[1]) {
+	    s += 2;
+	}
+	if (elen <= end - s && 0 == strncmp(s, etag, elen)) {
+	    return true;
+	}
+	for (; s < end && ',' != *s; s++) {
+	}
+    }
+    return false;
+}
+
+static bool
+value_equals(const char *v, int vlen, const char *s) {
+    return (int)strlen(s) == vlen && 0 == strncmp(s, v, vlen);
+}
+
+static agooText
+single_range(agooPage p, Range r, long size) {
+    long	len = r->end - r->start + 1;
+    int		mlen;
+    const char	*mime = page_mime(p, &mlen);
+    int		hlen = snprintf(NULL, 0, range_fmt, mlen, mime, len, r->start, r->end, size, p->etag, p->last_mod);
+    agooText	t;
+
+    if (0 < p->resp->fd) {
+	// Large files stay on disk and the range is sent from a duplicate of
+	// the page file descriptor.
+	if (NULL == (t = agoo_text_allocate(hlen))) {
+	    return NULL;
+	}
+	if (0 > (t->fd = dup(p->resp->fd))) {
+	    t->fd = 0;
+	    agoo_text_release(t);
+	    return NULL;
+	}
+	fcntl(t->fd, F_SETFD, FD_CLOEXEC);
+	t->flen = len;
+	t->foff = r->start;
+	t->len = snprintf(t->text, t->alen + 1, range_fmt, mlen, mime, len, r->start, r->end, size, p->etag, p->last_mod);
+
+	return t;
+    }
+    if (INT_MAX < hlen + len) {
+	return p->resp;
+    }
+    if (NULL == (t = agoo_text_allocate((int)(hlen + len)))) {
+	return NULL;
+    }
+    t->len = snprintf(t->text, t->alen + 1, range_fmt, mlen, mime, len, r->start, r->end, size, p->etag, p->last_mod);
+    page_read(p, t->text + t->len, r->start, len);
+    t->len += len;
+    t->text[t->len] = '\0';
+
+    return t;
+}
+
+// A page that stays on disk gets the whole page instead of having all of
+// the ranges copied into memory. So does a response too big for a text.
+static agooText
+multi_range(agooPage p, Range ranges, int cnt, long size) {
+    int		mlen;
+    const char	*mime = page_mime(p, &mlen);
+    long	blen = sizeof(multi_end) - 1;
+    long	len;
+    agooText	t;
+    Range	r;
+    Range	end = ranges + cnt;
+    char	*s;
+    char	*tend;
+
+    if (0 < p->resp->fd) {
+	return p->resp;
+    }
+    for (r = ranges; r < end; r++) {
+	blen += snprintf(NULL, 0, part_fmt, mlen, mime, r->start, r->end, size) + r->end - r->start + 1;
+    }
+    len = snprintf(NULL, 0, multi_fmt, blen, p->etag, p->last_mod) + blen;
+    if (INT_MAX < len) {
+	return p->resp;
+    }
+    if (NULL == (t = agoo_text_allocate((int)len))) {
+	return NULL;
+    }
+    tend = t->text + t->alen + 1;
+    s = t->text + snprintf(t->text, t->alen + 1, multi_fmt, blen, p->etag, p->last_mod);
+    for (r = ranges; r < end; r++) {
+	s += snprintf(s, tend - s, part_fmt, mlen, mime, r->start, r->end, size);
+	if (!page_read(p, s, r->start, r->end - r->start + 1)) {
+	    agoo_text_release(t);
+	    return NULL;
+	}
+	s += r->end - r->start + 1;
+    }
+    s = stpcpy(s, multi_end);
+    t->len = s - t->text;
+
+    return t;
+}
+
+#if HAVE_ZLIB_H
+static agooText
+gzip_page(agooPage p) {
+    const char	*body = p->resp->text + p->hlen;
+    long	size = p->resp->len - p->hlen;
+    char	head[1024];
+    z_stream	zs;
+    char	*buf;
+    long	zlen;
+    int		mlen;
+    const char	*mime;
+    agooText	t = NULL;
+    int		cnt;
+
+    if (0 < p->resp->fd) {
+	return NULL;
+    }
+    memset(&zs, 0, sizeof(zs));
+    // A window of 15 plus 16 asks for a gzip wrapper. The default level is
+    // close to the best for text at a fraction of the time.
+    if (Z_OK != deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY)) {
+	return NULL;
+    }
+    zlen = (long)deflateBound(&zs, (uLong)size);
+    if (NULL == (buf = (char*)AGOO_MALLOC(zlen))) {
+	deflateEnd(&zs);
+	return NULL;
+    }
+    zs.next_in = (Bytef*)body;
+    zs.avail_in = (uInt)size;
+    zs.next_out = (Bytef*)buf;
+    zs.avail_out = (uInt)zlen;
+    if (Z_STREAM_END == deflate(&zs, Z_FINISH)) {
+	zlen = (long)zs.total_out;
+	// Not worth it unless at least a tenth smaller.
+	if (zlen < size - size / 10) {
+	    mime = page_mime(p, &mlen);
+	    cnt = snprintf(head, sizeof(head), encoded_fmt, mlen, mime, zlen, "gzip",
+			   (int)strlen(p->etag) - 1, p->etag, "gzip", p->last_mod);
+	    if (cnt < (int)sizeof(head) && NULL != (t = agoo_text_allocate((int)(cnt + zlen)))) {
+		memcpy(t->text, head, cnt);
+		memcpy(t->text + cnt, buf, zlen);
+		t->len = cnt + zlen;
+		t->text[t->len] = '\0';
+	    }
+	}
+    }
+    deflateEnd(&zs);
+    AGOO_FREE(buf);
+
+    return t;
+}
+#endif
+
+// Picks the encoded variant of the page the client accepts, if any. Brotli
+// is preferred. The quality values only matter when they are zero since the
+// choice is between variants of the same content. The variant entity tag is
+// placed in tag.
+static agooText
+page_encoded(agooPage p, const char *s, int len, char *tag, int tsize) {
+    const char	*end = s + len;
+    const char	*start;
+    bool	gzip = false;
+    bool	br = false;
+    bool	ok;
+    int		clen;
+    int		elen = (int)strlen(p->etag) - 1;
+    agooText	t;
+
+    while (s < end) {
+	for (; s < end && (' ' == *s || '\t' == *s || ',' == *s); s++) {
+	}
+	start = s;
+	for (; s < end && ',' != *s && ';' != *s && ' ' != *s && '\t' != *s; s++) {
+	}
+	clen = (int)(s - start);
+	ok = true;
+	while (s < end && ',' != *s) {
+	    if ('=' == *s) {
+		ok = false;
+		for (s++; s < end && ',' != *s && ';' != *s; s++) {
+		    if ('1' <= *s && *s <= '9') {
+			ok = true;
+		    }
+		}
+	    } else {
+		s++;
+	    }
+	}
+	if (!ok) {
+	    continue;
+	}
+	if (1 == clen && '*' == *start) {
+	    gzip = true;
+	    br = true;
+	} else if (4 == clen && 0 == strncasecmp("gzip", start, 4)) {
+	    gzip = true;
+	} else if (2 == clen && 0 == strncasecmp("br", start, 2)) {
+	    br = true;
+	}
+    }
+    if (br && NULL != p->br) {
+	snprintf(tag, tsize, "%.*s-br\"", elen, p->etag);
+	return p->br;
+    }
+    if (!gzip) {
+	return p->resp;
+    }
+    t = __atomic_load_n(&p->gzip, __ATOMIC_ACQUIRE);
+#if HAVE_ZLIB_H
+    // The first request to clear compress does the compression. Others get
+    // the identity response until the variant is in place.
+    if (NULL == t && __atomic_exchange_n(&p->compress, false, __ATOMIC_ACQ_REL)) {
+	if (NULL != (t = gzip_page(p))) {
+	    agoo_text_ref(t);
+	    if (0 < p->bytes) {
+		__atomic_fetch_add(&p->bytes, text_bytes(t), __ATOMIC_RELAXED);
+		__atomic_fetch_add(&cache.bytes, text_bytes(t), __ATOMIC_RELAXED);
+	    }
+	    __atomic_store_n(&p->gzip, t, __ATOMIC_RELEASE);
+	}
+    }
+#endif
+    if (NULL == t) {
+	return p->resp;
+    }
+    snprintf(tag, tsize, "%.*s-gzip\"", elen, p->etag);
+
+    return t;
 }
 
+// Returns the response to a GET of the page given the parsed request head. A
+// conditional request for an unchanged page gets a 304 and a Range request
+// gets a 206 made from the cached page. A compressed variant is returned
+// if the client accepts it. Otherwise the cached response is returned. NULL
+// is returned if a response could not be allocated.
+agooText
+agoo_page_response(agooPage p, agooHead h) {
+    struct _range	ranges[MAX_RANGES];
+    agooText		resp = p->resp;
+    const char		*etag = p->etag;
+    char		tag[sizeof(p->etag) + 8];
+    const char		*range;
+    int			rlen;
+    const char		*v;
+    int			vlen;
+    long		size;
+    int			cnt;
+
+    range = agoo_head_get(h, AGOO_HDR_RANGE, &rlen);
+    // Ranges are always of the unencoded content.
+    if (p->vary && NULL == range &&
+	NULL != (v = agoo_head_get(h, AGOO_HDR_ACCEPT_ENCODING, &vlen)) &&
+	p->resp != (resp = page_encoded(p, v, vlen, tag, (int)sizeof(tag)))) {
+	etag = tag;
+    }
+    if (NULL != (v = agoo_head_get(h, AGOO_HDR_IF_NONE_MATCH, &vlen))) {
+	if (etag_match(etag, v, vlen)) {
+	    char	buf[256];
+
+	    cnt = snprintf(buf, sizeof(buf), not_modified_fmt, etag, p->last_mod);
+
+	    return agoo_text_create(buf, cnt);
+	}
+    } else if (NULL != (v = agoo_head_get(h, AGOO_HDR_IF_MODIFIED_SINCE, &vlen))) {
+	// Clients send back the Last-Modified value so an exact match is
+	// enough and avoids parsing dates.
+	if (value_equals(v, vlen, p->last_mod)) {
+	    char	buf[256];
+
+	    cnt = snprintf(buf, sizeof(buf), not_modified_fmt, etag, p->last_mod);
+
+	    return agoo_text_create(buf, cnt);
+	}
+    }
+    if (NULL == range) {
+	return resp;
+    }
+    v = range;
+    vlen = rlen;
+    size = p->resp->len - p->hlen + p->resp->flen;
+    if (0 > (cnt = parse_ranges(v, vlen, size, ranges))) {
+	return p->resp;
+    }
+    // A range is only for the same version of the page the client has.
+    if (NULL != (v = agoo_head_get(h, AGOO_HDR_IF_RANGE, &vlen)) &&
+	!value_equals(v, vlen, p->etag) && !value_equals(v, vlen, p->last_mod)) {
+	return p->resp;
+    }
+    if (0 == cnt) {
+	char	buf[128];
+
+	cnt = snprintf(buf, sizeof(buf), unsatisfiable_fmt, size);
+
+	return agoo_text_create(buf, cnt);
+    }
+    if (1 == cnt) {
+	return single_range(p, ranges, size);
+    }
+    return multi_range(p, ranges, cnt, size);
+}
+
+// Returns a page the caller must release with agoo_page_release().
 agooPage
 group_get(agooErr err, const char *path, int plen) {
     agooPage	page = NULL;
@@ -624,43 +1527,26 @@ group_get(agooErr err, const char *path, int plen) {
 	    break;
 	}
     }
-    if (NULL == page) {
-	for (d = g->dirs; NULL != d; d = d->next) {
-	    if ((int)sizeof(full_path) <= d->plen + plen) {
-		continue;
-	    }
-	    s = stpcpy(full_path, d->path);
-	    strncpy(s, path + g->plen, plen - g->plen);
-	    s += plen - g->plen;
-	    *s = '\0';
-	    if (0 == access(full_path, R_OK)) {
-		break;
-	    }
-	}
-	if (NULL == d) {
-	    return NULL;
+    if (NULL != page) {
+	__atomic_fetch_add(&cache.hits, 1, __ATOMIC_RELAXED);
+	return page_check(err, full_path, (int)(s - full_path), page);
+    }
+    for (d = g->dirs; NULL != d; d = d->next) {
+	if ((int)sizeof(full_path) <= d->plen + plen) {
+	    continue;
 	}
-	plen = (int)(s - full_path);
-	path = full_path;
-	if (NULL == (page = cache_get(path, plen))) {
-	    agooPage	old;
-
-	    if (NULL == (page = agoo_page_create(path))) {
-		agoo_err_set(err, AGOO_ERR_MEMORY, "Failed to allocate memory for agooPage.");
-		return NULL;
-	    }
-	    if (!update_contents(page) || NULL == page->resp) {
-		agoo_page_destroy(page);
-		agoo_err_set(err, AGOO_ERR_NOT_FOUND, "not found.");
-		return NULL;
-	    }
-	    if (NULL != (old = cache_set(path, plen, page))) {
-		agoo_page_destroy(old);
-	    }
+	s = stpcpy(full_path, d->path);
+	strncpy(s, path + g->plen, plen - g->plen);
+	s += plen - g->plen;
+	*s = '\0';
+	if (0 == access(full_path, R_OK)) {
+	    break;
 	}
-	return page;
     }
-    return page_check(err, page);
+    if (NULL == d) {
+	return NULL;
+    }
+    return page_load(err, full_path, (int)(s - full_path), full_path);
 }
 
 agooGroup
@@ -688,3 +1574,192 @@ group_add(agooGroup g, const char *dir) {
 	d->plen = (int)strlen(dir);
     }
 }
+
+#if HAVE_SYS_INOTIFY_H
+
+static void
+note_change(const char *name) {
+    uint64_t	gen = cache.change_gen;
+
+    cache.changes[gen & CHANGE_MASK] = (NULL == name) ? 0 : name_hash(name);
+    __atomic_store_n(&cache.change_gen, gen + 1, __ATOMIC_RELEASE);
+}
+
+// Watches a directory and the directories under it. Returns false if a
+// directory could not be watched.
+static bool
+watch_dir(const char *path, int depth) {
+    struct dirent	*de;
+    struct stat		fs;
+    char		sub[1024];
+    DIR			*dir;
+    Watch		w;
+    int			wd;
+    bool		ok = true;
+
+    if (WATCH_DEPTH < depth) {
+	return true;
+    }
+    if (0 > (wd = inotify_add_watch(cache.watch_fd, path, WATCH_MASK))) {
+	agoo_log_cat(&agoo_warn_cat, "Failed to watch %s for changes, checking files instead. %s", path, strerror(errno));
+	return false;
+    }
+    if (NULL == (w = (Watch)AGOO_MALLOC(sizeof(struct _watch)))) {
+	return false;
+    }
+    w->wd = wd;
+    w->path = AGOO_STRDUP(path);
+    w->next = cache.watches;
+    cache.watches = w;
+
+    if (NULL == (dir = opendir(path))) {
+	return true;
+    }
+    while (ok && NULL != (de = readdir(dir))) {
+	if (0 == strcmp(".", de->d_name) || 0 == strcmp("..", de->d_name)) {
+	    continue;
+	}
+	if ((int)sizeof(sub) <= snprintf(sub, sizeof(sub), "%s/%s", path, de->d_name)) {
+	    continue;
+	}
+	// Symlinked directories are followed so the type must be checked.
+	if (DT_DIR == de->d_type ||
+	    ((DT_LNK == de->d_type || DT_UNKNOWN == de->d_type) && 0 == stat(sub, &fs) && S_ISDIR(fs.st_mode))) {
+	    ok = watch_dir(sub, depth + 1);
+	}
+    }
+    closedir(dir);
+
+    return ok;
+}
+
+static void
+watch_event(struct inotify_event *ev) {
+    Watch	w;
+    Watch	prev = NULL;
+    char	sub[1024];
+
+    if (IN_Q_OVERFLOW & ev->mask) {
+	note_change(NULL);
+	return;
+    }
+    for (w = cache.watches; NULL != w; w = w->next) {
+	if (w->wd == ev->wd) {
+	    break;
+	}
+	prev = w;
+    }
+    if (NULL == w) {
+	return;
+    }
+    if (IN_IGNORED & ev->mask) {
+	if (NULL == prev) {
+	    cache.watches = w->next;
+	} else {
+	    prev->next = w->next;
+	}
+	AGOO_FREE(w->path);
+	AGOO_FREE(w);
+	return;
+    }
+    if ((IN_ISDIR & ev->mask) || (IN_DELETE_SELF & ev->mask)) {
+	// Files under a directory that is moved or removed are not reported
+	// one at a time so all pages are checked.
+	if (0 != ((IN_CREATE | IN_MOVED_TO) & ev->mask) &&
+	    (int)sizeof(sub) > snprintf(sub, sizeof(sub), "%s/%s", w->path, ev->name) &&
+	    !watch_dir(sub, 0)) {
+	    __atomic_store_n(&cache.watching, false, __ATOMIC_RELEASE);
+	}
+	note_change(NULL);
+	return;
+    }
+    if (0 < ev->len) {
+	note_change(ev->name);
+    }
+}
+
+static void*
+watch_loop(void *ctx) {
+    char		buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+    struct pollfd	pa;
+    ssize_t		cnt;
+    char		*b;
+    char		*end;
+
+    pa.fd = cache.watch_fd;
+    pa.events = POLLIN;
+    while (!__atomic_load_n(&cache.watch_done, __ATOMIC_ACQUIRE)) {
+	pa.revents = 0;
+	if (0 >= poll(&pa, 1, 100) || 0 >= (cnt = read(cache.watch_fd, buf, sizeof(buf)))) {
+	    continue;
+	}
+	for (b = buf, end = buf + cnt; b < end; b += sizeof(struct inotify_event) + ((struct inotify_event*)b)->len) {
+	    watch_event((struct inotify_event*)b);
+	}
+    }
+    return NULL;
+}
+
+// Starts a thread that watches the root and group directories so cached
+// pages do not have to be checked with stat. If the directories can not be
+// watched the pages are checked as before.
+void
+agoo_pages_watch() {
+    agooGroup	g;
+    agooDir	d;
+    bool	ok = true;
+
+    if (0 <= cache.watch_fd) {
+	return;
+    }
+    if (0 > (cache.watch_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC))) {
+	return;
+    }
+    if (NULL != cache.root) {
+	ok = watch_dir(cache.root, 0);
+    }
+    for (g = cache.groups; ok && NULL != g; g = g->next) {
+	for (d = g->dirs; ok && NULL != d; d = d->next) {
+	    ok = watch_dir(d->path, 0);
+	}
+    }
+    cache.watch_done = false;
+    if (!ok || 0 != pthread_create(&cache.watch_thread, NULL, watch_loop, NULL)) {
+	cache.watch_done = true;
+	watch_stop();
+	return;
+    }
+    __atomic_store_n(&cache.watching, true, __ATOMIC_RELEASE);
+}
+
+static void
+watch_stop() {
+    Watch	w;
+
+    __atomic_store_n(&cache.watching, false, __ATOMIC_RELEASE);
+    if (!cache.watch_done) {
+	__atomic_store_n(&cache.watch_done, true, __ATOMIC_RELEASE);
+	pthread_join(cache.watch_thread, NULL);
+    }
+    if (0 <= cache.watch_fd) {
+	close(cache.watch_fd);
+	cache.watch_fd = -1;
+    }
+    while (NULL != (w = cache.watches)) {
+	cache.watches = w->next;
+	AGOO_FREE(w->path);
+	AGOO_FREE(w);
+    }
+}
+
+#else
+
+void
+agoo_pages_watch() {
+}
+
+static void
+watch_stop() {
+}
+
+#endif
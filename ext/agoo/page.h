@@ -7,6 +7,7 @@
 #include <time.h>
 
 #include "err.h"
+#include "head.h"
 #include "text.h"
 
 typedef struct _agooPage {
@@ -15,8 +16,27 @@ typedef struct _agooPage {
     time_t		mtime;
     double		last_check;
     bool		immutable;
+    int			hlen; // length of the header in resp
+    char		etag[40];
+    char		last_mod[32];
+    agooText		gzip; // encoded variants of resp or NULL
+    agooText		br;
+    bool		vary; // true if the response depends on Accept-Encoding
+    bool		compress; // gzip on the first request that accepts it
+    uint64_t		name_hash; // hash of the file name for change checks
+    uint64_t		gen; // change generation last checked against
+    long		bytes; // counted against the cache budget
+    int			refs;
 } *agooPage;
 
+typedef struct _agooPageStats {
+    uint64_t		hits;
+    uint64_t		misses;
+    uint64_t		evictions;
+    long		bytes;
+    long		count;
+} *agooPageStats;
+
 typedef struct _agooDir {
     struct _agooDir	*next;
     char		*path;
@@ -32,6 +52,10 @@ typedef struct _agooGroup {
 
 extern void		agoo_pages_init();
 extern void		agoo_pages_set_root(const char *root);
+extern void		agoo_pages_set_sendfile_min(long size);
+extern void		agoo_pages_set_max_bytes(long max);
+extern void		agoo_pages_stats(agooPageStats stats);
+extern void		agoo_pages_watch();
 extern void		agoo_pages_cleanup();
 
 extern agooGroup	group_create(const char *path);
@@ -41,6 +65,8 @@ extern agooPage		group_get(agooErr err, const char *path, int plen);
 extern agooPage		agoo_page_create(const char *path);
 extern agooPage		agoo_page_immutable(agooErr err, const char *path, const char *content, int clen);
 extern agooPage		agoo_page_get(agooErr err, const char *path, int plen);
+extern void		agoo_page_release(agooPage p);
+extern agooText		agoo_page_response(agooPage p, agooHead h);
 extern int		mime_set(agooErr err, const char *key, const char *value);
 
 #endif // AGOO_PAGE_H
@@ -0,0 +1,199 @@
+// Copyright (c) 2019, Peter Ohler, All rights reserved.
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "debug.h"
+#include "pool.h"
+
+#define SLAB_SIZE	65536
+#define MIN_PER_SLAB	8
+
+// Every block starts with the pool it came from so it can be given back
+// without the caller knowing. The free list link is also in the prefix so
+// the contents of a freed block are left alone. A response in particular is
+// checked after it has been recycled.
+typedef struct _agooPoolBlock {
+    struct _agooPool		*pool; // NULL if allocated directly
+    struct _agooPoolBlock	*next;
+} *agooPoolBlock;
+
+typedef struct _agooPoolSlab {
+    struct _agooPoolSlab	*next;
+    size_t			size;
+} *agooPoolSlab;
+
+__thread agooPools	agoo_pools = NULL;
+
+static agooPools	all_pools = NULL;
+static pthread_mutex_t	all_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t		direct_mallocs = 0;
+
+agooPools
+agoo_pools_create(agooErr err) {
+    agooPools	pools = (agooPools)AGOO_MALLOC(sizeof(struct _agooPools));
+    int		i;
+
+    if (NULL == pools) {
+	agoo_err_set(err, AGOO_ERR_MEMORY, "Failed to allocate memory for a pool set.");
+	return NULL;
+    }
+    memset(pools, 0, sizeof(struct _agooPools));
+    for (i = 0; i < AGOO_POOL_CNT; i++) {
+	pools->pools[i].owner = pools;
+    }
+    pthread_mutex_lock(&all_lock);
+    pools->next = all_pools;
+    all_pools = pools;
+    pthread_mutex_unlock(&all_lock);
+
+    return pools;
+}
+
+void
+agoo_pools_destroy(agooPools pools) {
+    agooPools		*pp;
+    agooPoolSlab	slab;
+    int			i;
+
+    if (NULL == pools) {
+	return;
+    }
+    pthread_mutex_lock(&all_lock);
+    for (pp = &all_pools; NULL != *pp; pp = &(*pp)->next) {
+	if (pools == *pp) {
+	    *pp = pools->next;
+	    break;
+	}
+    }
+    pthread_mutex_unlock(&all_lock);
+    for (i = 0; i < AGOO_POOL_CNT; i++) {
+	while (NULL != (slab = pools->pools[i].slabs)) {
+	    pools->pools[i].slabs = slab->next;
+	    AGOO_FREE(slab);
+	}
+    }
+    AGOO_FREE(pools);
+}
+
+static bool
+pool_fill(agooPool pool) {
+    size_t		size = sizeof(struct _agooPoolSlab) + pool->bsize * pool->per_slab;
+    agooPoolSlab	slab = (agooPoolSlab)AGOO_MALLOC(size);
+    char		*b;
+    int			i;
+
+    if (NULL == slab) {
+	return false;
+    }
+    slab->size = size;
+    slab->next = pool->slabs;
+    pool->slabs = slab;
+    pool->mallocs++;
+    b = (char*)(slab + 1);
+    for (i = pool->per_slab; 0 < i; i--, b += pool->bsize) {
+	((agooPoolBlock)b)->pool = pool;
+	((agooPoolBlock)b)->next = pool->free;
+	pool->free = (agooPoolBlock)b;
+    }
+    return true;
+}
+
+static void*
+direct_alloc(size_t size) {
+    agooPoolBlock	b = (agooPoolBlock)AGOO_MALLOC(sizeof(struct _agooPoolBlock) + size);
+
+    if (NULL == b) {
+	return NULL;
+    }
+    __atomic_fetch_add(&direct_mallocs, 1, __ATOMIC_RELAXED);
+    b->pool = NULL;
+
+    return b + 1;
+}
+
+// Returns a block of at least size bytes from a pool of the current thread
+// if it has pools and one fits. Each kind other than a request always asks
+// for the same size.
+void*
+agoo_pool_alloc(agooPoolKind kind, size_t size) {
+    agooPool		pool;
+    agooPoolBlock	b;
+    size_t		csize = size;
+
+    if (NULL == agoo_pools) {
+	return direct_alloc(size);
+    }
+    if (AGOO_POOL_REQ == kind) {
+	for (csize = AGOO_POOL_REQ_MIN; csize < size; csize *= 2, kind++) {
+	    if (AGOO_POOL_CNT - 1 <= kind) {
+		return direct_alloc(size);
+	    }
+	}
+    }
+    pool = &agoo_pools->pools[kind];
+    if (NULL == pool->free) {
+	if (0 == pool->bsize) {
+	    pool->bsize = (sizeof(struct _agooPoolBlock) + csize + 15) & ~(size_t)15;
+	    if (MIN_PER_SLAB > (pool->per_slab = (int)(SLAB_SIZE / pool->bsize))) {
+		pool->per_slab = MIN_PER_SLAB;
+	    }
+	}
+	// Take everything other threads gave back at once. Since only the
+	// owner takes from the remote list there is no ABA problem.
+	if (NULL == (pool->free = __atomic_exchange_n(&pool->remote, NULL, __ATOMIC_ACQUIRE)) && !pool_fill(pool)) {
+	    return NULL;
+	}
+    }
+    b = pool->free;
+    pool->free = b->next;
+    pool->gets++;
+
+    return b + 1;
+}
+
+void
+agoo_pool_free(void *ptr) {
+    agooPoolBlock	b;
+    agooPool		pool;
+
+    if (NULL == ptr) {
+	return;
+    }
+    b = (agooPoolBlock)ptr - 1;
+    if (NULL == (pool = b->pool)) {
+	AGOO_FREE(b);
+    } else if (agoo_pools == pool->owner) {
+	b->next = pool->free;
+	pool->free = b;
+    } else {
+	b->next = __atomic_load_n(&pool->remote, __ATOMIC_RELAXED);
+	while (!__atomic_compare_exchange_n(&pool->remote, &b->next, b, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+	}
+    }
+}
+
+// The counts are written by the owners without locking so they can be a
+// little behind.
+void
+agoo_pool_stats(agooPoolStats stats) {
+    agooPools		pools;
+    agooPool		pool;
+    agooPoolSlab	slab;
+
+    memset(stats, 0, sizeof(struct _agooPoolStats));
+    stats->mallocs = __atomic_load_n(&direct_mallocs, __ATOMIC_RELAXED);
+    pthread_mutex_lock(&all_lock);
+    for (pools = all_pools; NULL != pools; pools = pools->next) {
+	for (pool = pools->pools; pool < pools->pools + AGOO_POOL_CNT; pool++) {
+	    stats->gets += pool->gets;
+	    stats->mallocs += pool->mallocs;
+	    for (slab = pool->slabs; NULL != slab; slab = slab->next) {
+		stats->bytes += slab->size;
+	    }
+	}
+    }
+    pthread_mutex_unlock(&all_lock);
+}
@@ -0,0 +1,63 @@
+// Copyright (c) 2019, Peter Ohler, All rights reserved.
+
+#ifndef AGOO_POOL_H
+#define AGOO_POOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "err.h"
+
+// Request sizes are rounded up to one of the classes starting at
+// AGOO_POOL_REQ_MIN and doubling. Bigger requests are allocated directly.
+#define AGOO_POOL_REQ_MIN	512
+#define AGOO_POOL_REQ_CLASSES	6
+
+typedef enum {
+    AGOO_POOL_CON	= 0,
+    AGOO_POOL_RES,
+    AGOO_POOL_LINK,
+    AGOO_POOL_HOOK,
+    AGOO_POOL_REQ, // first of the request size classes
+    AGOO_POOL_CNT	= AGOO_POOL_REQ + AGOO_POOL_REQ_CLASSES
+} agooPoolKind;
+
+struct _agooPools;
+
+// Blocks of one size carved from slabs that are kept until the pool is
+// destroyed. Only the thread that owns the pool takes blocks from it. Any
+// thread can give them back.
+typedef struct _agooPool {
+    struct _agooPoolBlock	*free;   // owner only
+    struct _agooPoolBlock	*remote; // given back by other threads
+    struct _agooPoolSlab	*slabs;
+    struct _agooPools		*owner;
+    size_t			bsize;   // block size including the prefix
+    int				per_slab;
+    uint64_t			gets;
+    uint64_t			mallocs;
+} *agooPool;
+
+// The pools of one thread, a connection loop or the listener.
+typedef struct _agooPools {
+    struct _agooPools	*next;
+    struct _agooPool	pools[AGOO_POOL_CNT];
+} *agooPools;
+
+typedef struct _agooPoolStats {
+    uint64_t	gets;	 // blocks taken from a pool
+    uint64_t	mallocs; // calls to malloc for slabs or blocks not from a pool
+    uint64_t	bytes;	 // held in slabs
+} *agooPoolStats;
+
+// The pools of the current thread, NULL if it has none.
+extern __thread agooPools	agoo_pools;
+
+extern agooPools	agoo_pools_create(agooErr err);
+extern void		agoo_pools_destroy(agooPools pools);
+
+extern void*		agoo_pool_alloc(agooPoolKind kind, size_t size);
+extern void		agoo_pool_free(void *ptr);
+extern void		agoo_pool_stats(agooPoolStats stats);
+
+#endif // AGOO_POOL_H
@@ -1,7 +1,7 @@
 // Copyright 2015, 2016, 2018 by Peter Ohler, All Rights Reserved
 
 #include <fcntl.h>
-#include <poll.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -9,22 +9,36 @@
 #include <unistd.h>
 #include <pthread.h>
 
+#if HAVE_SYS_EVENTFD_H
+#include <sys/eventfd.h>
+#endif
+#if HAVE_LINUX_FUTEX_H
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <time.h>
+#endif
+
 #include "debug.h"
 #include "dtime.h"
 #include "queue.h"
 
-// lower gives faster response but burns more CPU. This is a reasonable compromise.
+// Only used when futexes are not available.
 #define RETRY_SECS	0.0001
-#define WAIT_MSECS	100
+// A blocked pusher rechecks at least this often.
+#define WAIT_SECS	0.1
 
 #define NOT_WAITING	0
 #define WAITING		1
 #define NOTIFIED	2
 
-// head and tail both increment and wrap.
-// tail points to next open space.
-// When head == tail the queue is full. This happens when tail catches up with head.
-// 
+// A bounded multi-producer, multi-consumer ring. Head and tail are
+// positions that only increase and are masked to find the slot. A slot with
+// a seq equal to the position is free for the pusher that claims that
+// position. After the push the seq is position + 1 which marks it as ready
+// for the popper of the same position. The popper then sets the seq to
+// position + size, the position of the next lap around the ring. Pushers
+// and poppers claim positions with a compare and swap so there are no locks
+// and no sleeping while another thread holds a lock.
 
 void
 agoo_queue_init(agooQueue q, size_t qsize) {
@@ -33,18 +47,21 @@ agoo_queue_init(agooQueue q, size_t qsize) {
 
 void
 agoo_queue_multi_init(agooQueue q, size_t qsize, bool multi_push, bool multi_pop) {
-    if (qsize < 4) {
-	qsize = 4;
-    }
-    q->q = (agooQItem*)AGOO_MALLOC(sizeof(agooQItem) * qsize);
-    q->end = q->q + qsize;
-
-    memset(q->q, 0, sizeof(agooQItem) * qsize);
-    atomic_init(&q->head, q->q);
-    atomic_init(&q->tail, q->q + 1);
-    agoo_atomic_flag_init(&q->push_lock);
-    agoo_atomic_flag_init(&q->pop_lock);
-    atomic_init(&q->wait_state, 0);
+    size_t	size = 4;
+    size_t	i;
+
+    // The size must be a power of 2 for the mask to work.
+    while (size < qsize) {
+	size <<= 1;
+    }
+    memset(q, 0, sizeof(struct _agooQueue));
+    q->q = (agooQSlot)AGOO_MALLOC(sizeof(struct _agooQSlot) * size);
+    q->mask = size - 1;
+    for (i = 0; i < size; i++) {
+	q->q[i].seq = i;
+	q->q[i].item = NULL;
+    }
+    q->wait_state = NOT_WAITING;
     q->multi_push = multi_push;
     q->multi_pop = multi_pop;
     // Create when/if needed.
@@ -56,8 +73,7 @@ void
 agoo_queue_cleanup(agooQueue q) {
     AGOO_FREE(q->q);
     q->q = NULL;
-    q->end = NULL;
-    if (0 < q->wsock) {
+    if (0 < q->wsock && q->wsock != q->rsock) {
 	close(q->wsock);
     }
     if (0 < q->rsock) {
@@ -65,88 +81,163 @@ agoo_queue_cleanup(agooQueue q) {
     }
 }
 
-void
-agoo_queue_push(agooQueue q, agooQItem item) {
-    agooQItem	*tail;
+#if HAVE_LINUX_FUTEX_H
 
-    if (q->multi_push) {
-	while (atomic_flag_test_and_set(&q->push_lock)) {
-	    dsleep(RETRY_SECS);
-	}
+static void
+wait_for_change(agooQWait w, unsigned int seq, double timeout) {
+    struct timespec	ts;
+
+    ts.tv_sec = (time_t)timeout;
+    ts.tv_nsec = (long)((timeout - (double)ts.tv_sec) * 1000000000.0);
+    syscall(SYS_futex, &w->seq, FUTEX_WAIT_PRIVATE, seq, &ts, NULL, 0);
+}
+
+static void
+notify(agooQWait w) {
+    __atomic_fetch_add(&w->seq, 1, __ATOMIC_SEQ_CST);
+    if (0 < __atomic_load_n(&w->waiters, __ATOMIC_SEQ_CST)) {
+	syscall(SYS_futex, &w->seq, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
     }
-    // Wait for head to move on.
-    while (atomic_load(&q->head) == atomic_load(&q->tail)) {
+}
+
+#else
+
+static void
+wait_for_change(agooQWait w, unsigned int seq, double timeout) {
+    double	giveup = dtime() + timeout;
+
+    while (seq == __atomic_load_n(&w->seq, __ATOMIC_SEQ_CST) && dtime() < giveup) {
 	dsleep(RETRY_SECS);
     }
-    *(agooQItem*)atomic_load(&q->tail) = item;
-    tail = (agooQItem*)atomic_load(&q->tail) + 1;
+}
 
-    if (q->end <= tail) {
-	tail = q->q;
+static void
+notify(agooQWait w) {
+    __atomic_fetch_add(&w->seq, 1, __ATOMIC_SEQ_CST);
+}
+
+#endif
+
+static bool
+try_push(agooQueue q, agooQItem item) {
+    size_t	pos = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+    agooQSlot	slot;
+    intptr_t	diff;
+
+    while (true) {
+	slot = &q->q[pos & q->mask];
+	diff = (intptr_t)__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) - (intptr_t)pos;
+	if (0 == diff) {
+	    if (__atomic_compare_exchange_n(&q->tail, &pos, pos + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+		break;
+	    }
+	} else if (diff < 0) { // full
+	    return false;
+	} else {
+	    pos = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+	}
     }
-    atomic_store(&q->tail, tail);
-    if (q->multi_push) {
-	atomic_flag_clear(&q->push_lock);
+    slot->item = item;
+    __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+
+    return true;
+}
+
+static agooQItem
+try_pop(agooQueue q) {
+    size_t	pos = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+    agooQSlot	slot;
+    agooQItem	item;
+    intptr_t	diff;
+
+    while (true) {
+	slot = &q->q[pos & q->mask];
+	diff = (intptr_t)__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) - (intptr_t)(pos + 1);
+	if (0 == diff) {
+	    if (__atomic_compare_exchange_n(&q->head, &pos, pos + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+		break;
+	    }
+	} else if (diff < 0) { // empty
+	    return NULL;
+	} else {
+	    pos = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+	}
     }
-    if (0 != q->wsock && WAITING == (long)atomic_load(&q->wait_state)) {
-	if (write(q->wsock, ".", 1)) {}
-	atomic_store(&q->wait_state, NOTIFIED);
+    item = slot->item;
+    slot->item = NULL;
+    __atomic_store_n(&slot->seq, pos + q->mask + 1, __ATOMIC_RELEASE);
+
+    return item;
+}
+
+void
+agoo_queue_push(agooQueue q, agooQItem item) {
+    unsigned int	seq;
+
+    while (!try_push(q, item)) {
+	// Full so wait for a popper to make room. The waiter count is bumped
+	// before the seq is read so a pop after the failed push is never
+	// missed.
+	__atomic_fetch_add(&q->not_full.waiters, 1, __ATOMIC_SEQ_CST);
+	seq = __atomic_load_n(&q->not_full.seq, __ATOMIC_SEQ_CST);
+	if (try_push(q, item)) {
+	    __atomic_fetch_sub(&q->not_full.waiters, 1, __ATOMIC_SEQ_CST);
+	    break;
+	}
+	wait_for_change(&q->not_full, seq, WAIT_SECS);
+	__atomic_fetch_sub(&q->not_full.waiters, 1, __ATOMIC_SEQ_CST);
     }
+    notify(&q->not_empty);
+    agoo_queue_wakeup(q);
 }
 
+// Only the first wakeup after the listener releases writes to the file
+// descriptor so a burst of pushes or wakeups costs a single system call.
 void
 agoo_queue_wakeup(agooQueue q) {
-    if (0 != q->wsock) {
+    int	expect = WAITING;
+
+    if (0 != q->wsock &&
+	__atomic_compare_exchange_n(&q->wait_state, &expect, NOTIFIED, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+#if HAVE_SYS_EVENTFD_H
+	uint64_t	one = 1;
+
+	if (write(q->wsock, &one, sizeof(one))) {}
+#else
 	if (write(q->wsock, ".", 1)) {}
+#endif
     }
 }
 
 agooQItem
 agoo_queue_pop(agooQueue q, double timeout) {
-    agooQItem	item;
-    agooQItem	*next;
-    
-    if (q->multi_pop) {
-	while (atomic_flag_test_and_set(&q->pop_lock)) {
-	    dsleep(RETRY_SECS);
-	}
-    }
-    item = *(agooQItem*)atomic_load(&q->head);
+    agooQItem		item;
+    unsigned int	seq;
+    double		giveup;
+    double		now;
 
-    if (NULL != item) {
-	*(agooQItem*)atomic_load(&q->head) = NULL;
-	if (q->multi_pop) {
-	    atomic_flag_clear(&q->pop_lock);
-	}
+    if (NULL != (item = try_pop(q))) {
+	notify(&q->not_full);
 	return item;
     }
-    next = (agooQItem*)atomic_load(&q->head) + 1;
-
-    if (q->end <= next) {
-	next = q->q;
+    if (0.0 >= timeout) {
+	return NULL;
     }
-    // If the next is the tail then wait for something to be appended.
-    for (int cnt = (int)(timeout / (double)WAIT_MSECS * 1000.0); atomic_load(&q->tail) == next; cnt--) {
-	struct pollfd	pa;
-
-	if (cnt <= 0) {
-	    if (q->multi_pop) {
-		atomic_flag_clear(&q->pop_lock);
-	    }
-	    return NULL;
+    giveup = dtime() + timeout;
+    __atomic_fetch_add(&q->not_empty.waiters, 1, __ATOMIC_SEQ_CST);
+    while (true) {
+	seq = __atomic_load_n(&q->not_empty.seq, __ATOMIC_SEQ_CST);
+	if (NULL != (item = try_pop(q))) {
+	    break;
 	}
-	pa.fd = agoo_queue_listen(q);
-	pa.events = POLLIN;
-	pa.revents = 0;
-	if (0 < poll(&pa, 1, WAIT_MSECS)) {
-	    agoo_queue_release(q);
+	if (giveup <= (now = dtime())) {
+	    break;
 	}
+	wait_for_change(&q->not_empty, seq, giveup - now);
     }
-    atomic_store(&q->head, next);
-    item = *next;
-    *next = NULL;
-    if (q->multi_pop) {
-	atomic_flag_clear(&q->pop_lock);
+    __atomic_fetch_sub(&q->not_empty.waiters, 1, __ATOMIC_SEQ_CST);
+    if (NULL != item) {
+	notify(&q->not_full);
     }
     return item;
 }
@@ -154,21 +245,25 @@ agoo_queue_pop(agooQueue q, double timeout) {
 // Called by the popper usually.
 bool
 agoo_queue_empty(agooQueue q) {
-    agooQItem	*head = atomic_load(&q->head);
-    agooQItem	*next = head + 1;
+    size_t	pos = __atomic_load_n(&q->head, __ATOMIC_ACQUIRE);
+    agooQSlot	slot = &q->q[pos & q->mask];
 
-    if (q->end <= next) {
-	next = q->q;
-    }
-    if (NULL == *head && atomic_load(&q->tail) == next) {
-	return true;
-    }
-    return false;
+    return __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != pos + 1;
 }
 
+// Returns a file descriptor that becomes readable when the queue is pushed
+// to or woken up. An eventfd is used where available, otherwise a pipe.
 int
 agoo_queue_listen(agooQueue q) {
     if (0 == q->rsock) {
+#if HAVE_SYS_EVENTFD_H
+	int	fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+	if (0 <= fd) {
+	    q->rsock = fd;
+	    q->wsock = fd;
+	}
+#else
 	int	fd[2];
 
 	if (0 == pipe(fd)) {
@@ -177,26 +272,35 @@ agoo_queue_listen(agooQueue q) {
 	    q->rsock = fd[0];
 	    q->wsock = fd[1];
 	}
+#endif
     }
-    atomic_store(&q->wait_state, WAITING);
-    
+    __atomic_store_n(&q->wait_state, WAITING, __ATOMIC_SEQ_CST);
+
     return q->rsock;
 }
 
+// Clears the notification and rearms it. The listener must check the queue
+// after the release so nothing pushed before the rearm is missed.
 void
 agoo_queue_release(agooQueue q) {
+#if HAVE_SYS_EVENTFD_H
+    uint64_t	cnt;
+
+    if (read(q->rsock, &cnt, sizeof(cnt))) {}
+#else
     char	buf[8];
 
     // clear pipe
     while (0 < read(q->rsock, buf, sizeof(buf))) {
     }
-    atomic_store(&q->wait_state, NOT_WAITING);
+#endif
+    __atomic_store_n(&q->wait_state, WAITING, __ATOMIC_SEQ_CST);
 }
 
 int
 agoo_queue_count(agooQueue q) {
-    int	size = (int)(q->end - q->q);
-    
-    return ((agooQItem*)atomic_load(&q->tail) - (agooQItem*)atomic_load(&q->head) + size) % size;
-}
+    size_t	head = __atomic_load_n(&q->head, __ATOMIC_ACQUIRE);
+    size_t	tail = __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE);
 
+    return (int)(tail - head);
+}
@@ -8,20 +8,40 @@
 
 #include "atomic.h"
 
+#define AGOO_CACHE_LINE	64
+
 typedef void	*agooQItem;
 
+// Each slot carries a sequence number that tells pushers and poppers whose
+// turn it is to use the slot. The __atomic builtins are used on the plain
+// fields so the ring works even without stdatomic.h.
+typedef struct _agooQSlot {
+    size_t		seq;
+    agooQItem		item;
+} *agooQSlot;
+
+// A counter that blocked threads wait on for a change. Waiters are counted
+// so the notifier can skip the system call when no one is waiting.
+typedef struct _agooQWait {
+    unsigned int	seq;
+    int			waiters;
+} *agooQWait;
+
 typedef struct _agooQueue {
-    agooQItem		*q;
-    agooQItem		*end;
-    _Atomic(agooQItem*)	head;
-    _Atomic(agooQItem*)	tail;
-    bool		multi_push;
+    agooQSlot		q;
+    size_t		mask;
+    bool		multi_push; // no longer needed but kept for callers
     bool		multi_pop;
-    atomic_flag		push_lock; // set to true when push in progress
-    atomic_flag		pop_lock; // set to true when push in progress
-    atomic_int		wait_state;
-    int			rsock;
-    int			wsock;
+    int			wait_state;
+    int			rsock; // eventfd or pipe read end
+    int			wsock; // same as rsock for an eventfd
+    char		pad0[AGOO_CACHE_LINE];
+    size_t		head; // next slot to pop
+    char		pad1[AGOO_CACHE_LINE - sizeof(size_t)];
+    size_t		tail; // next slot to push
+    char		pad2[AGOO_CACHE_LINE - sizeof(size_t)];
+    struct _agooQWait	not_empty;
+    struct _agooQWait	not_full;
 } *agooQueue;
 
 extern void		agoo_queue_init(agooQueue q, size_t qsize);
@@ -1,69 +1,161 @@
 // Copyright (c) 2018, Peter Ohler, All rights reserved.
 
+#include <ctype.h>
+#include <errno.h>
+#include <netdb.h>
+#include <poll.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/socket.h>
 #include <unistd.h>
 
 #if HAVE_SYS_EPOLL_H
 #include <sys/epoll.h>
-#else
-#include <ctype.h>
-#include <netdb.h>
-#include <poll.h>
 #endif
 
 #include "debug.h"
 #include "dtime.h"
 #include "log.h"
+#include "pool.h"
 #include "ready.h"
+#include "uring.h"
 
 #define CHECK_FREQ		0.5
 // milliseconds
 #define MAX_WAIT		10
+#define INITIAL_POLL_SIZE	1024
 
 #if HAVE_SYS_EPOLL_H
 #define EPOLL_SIZE		100
+#define DEFAULT_MODE		AGOO_READY_EPOLL
 #else
-#define INITIAL_POLL_SIZE	1024
+#define DEFAULT_MODE		AGOO_READY_POLL
+#endif
+
+#if HAVE_LINUX_IO_URING_H
+#define URING_SIZE		4096
+// Submission user data is the link pointer with the side in the low bits.
+#define URING_READ		1
+#define URING_WRITE		2
+#define URING_SIDE_MASK		3
+#define LINK_IOV		16
 #endif
 
-typedef struct _link {
-    struct _link	*next;
-    struct _link	*prev;
+typedef struct _agooLink {
+    struct _agooLink	*next;
+    struct _agooLink	*prev;
     int			fd;
     void		*ctx;
     agooHandler		handler;
-#if HAVE_SYS_EPOLL_H
-    uint32_t		events; // last events set
-#else
     struct pollfd	*pp;
+    struct _agooLink	*anext; // next on the active list
+    bool		active;
+    bool		more;	// the handler has more to read without waiting
+#if HAVE_SYS_EPOLL_H
+    // The epoll mode is edge triggered so the link remembers what the last
+    // edges were until the handler has consumed them.
+    uint32_t		revents;
+    bool		readable;
+    bool		writable;
+#endif
+#if HAVE_LINUX_IO_URING_H
+    int			ops;	// submissions not yet completed
+    bool		rsub;	// read side submitted
+    bool		wsub;	// write side submitted
+    bool		rpoll;	// read side submission is a poll
+    bool		wpoll;	// write side submission is a poll
+    bool		rwait;	// poll before the next receive
+    bool		wwait;	// poll before the next send
+    bool		dying;	// removed but submissions are outstanding
+    // A gathered send must stay put until it completes.
+    struct msghdr	wmsg;
+    struct iovec	wiov[LINK_IOV];
 #endif
 } *Link;
 
 struct _agooReady {
-    Link	links;
-    int		lcnt;
-    double	next_check;
-#if HAVE_SYS_EPOLL_H
-    int		epoll_fd;
-#else
+    Link		links;
+    int			lcnt;
+    double		next_check;
+    agooReadyMode	mode;
     struct pollfd	*pa;
     struct pollfd	*pend;
+    Link		active;  // links with work not yet handled
+    bool		rescan;  // check all links for output on next go
+    Link		current; // link being read
+#if HAVE_SYS_EPOLL_H
+    int			epoll_fd;
+#endif
+#if HAVE_LINUX_IO_URING_H
+    struct _agooUring	ring;
+    Link		dying;
 #endif
 };
 
+static agooReadyMode	ready_mode = DEFAULT_MODE;
+
+int
+agoo_ready_set_mode(agooErr err, agooReadyMode mode) {
+    switch (mode) {
+    case AGOO_READY_POLL:
+	break;
+    case AGOO_READY_EPOLL:
+#if HAVE_SYS_EPOLL_H
+	break;
+#else
+	return agoo_err_set(err, AGOO_ERR_IMPL, "epoll is not supported on this platform.");
+#endif
+    case AGOO_READY_URING:
+#if HAVE_LINUX_IO_URING_H
+	if (!agoo_uring_available(err)) {
+	    return err->code;
+	}
+	break;
+#else
+	return agoo_err_set(err, AGOO_ERR_IMPL, "io_uring is not supported on this platform.");
+#endif
+    default:
+	return agoo_err_set(err, AGOO_ERR_ARG, "invalid poller mode.");
+    }
+    ready_mode = mode;
+
+    return AGOO_ERR_OK;
+}
+
+agooReadyMode
+agoo_ready_mode() {
+    return ready_mode;
+}
+
+static void
+activate(agooReady ready, Link link) {
+    if (!link->active) {
+	link->active = true;
+	link->anext = ready->active;
+	ready->active = link;
+    }
+}
+
+static bool
+wants_in(agooReadyIO io) {
+    return AGOO_READY_IN == io || AGOO_READY_BOTH == io;
+}
+
+static bool
+wants_out(agooReadyIO io) {
+    return AGOO_READY_OUT == io || AGOO_READY_BOTH == io;
+}
+
 static Link
 link_create(agooErr err, int fd, void *ctx, agooHandler handler) {
-    // TBD use block allocator
-    Link	link = (Link)AGOO_MALLOC(sizeof(struct _link));
+    Link	link = (Link)agoo_pool_alloc(AGOO_POOL_LINK, sizeof(struct _agooLink));
 
     if (NULL == link) {
 	agoo_err_set(err, AGOO_ERR_MEMORY, "Failed to allocate memory for a connection link.");
     } else {
 	//DEBUG_ALLOC(mem_???, c);
-	link->next = NULL;
-	link->prev = NULL;
+	memset(link, 0, sizeof(struct _agooLink));
 	link->fd = fd;
 	link->ctx = ctx;
 	link->handler = handler;
@@ -79,15 +171,30 @@ agoo_ready_create(agooErr err) {
 	agoo_err_set(err, AGOO_ERR_MEMORY, "Failed to allocate memory for a connection manager.");
     } else {
 	//DEBUG_ALLOC(mem_???, c);
-	ready->links = NULL;
-	ready->lcnt = 0;
+	memset(ready, 0, sizeof(struct _agooReady));
 	ready->next_check = dtime() + CHECK_FREQ;
+	ready->mode = ready_mode;
+#if HAVE_LINUX_IO_URING_H
+	if (AGOO_READY_URING == ready->mode) {
+	    if (AGOO_ERR_OK == agoo_uring_init(err, &ready->ring, URING_SIZE)) {
+		return ready;
+	    }
+	    // Usually a locked memory limit. Not fatal, just slower.
+	    agoo_log_cat(&agoo_warn_cat, "%s Using %s instead.", err->msg, AGOO_READY_EPOLL == DEFAULT_MODE ? "epoll" : "poll");
+	    agoo_err_clear(err);
+	    ready->mode = DEFAULT_MODE;
+	}
+#endif
 #if HAVE_SYS_EPOLL_H
-	if (0 > (ready->epoll_fd = epoll_create(1))) {
-	    agoo_err_no(err, "epoll create failed");
-	    return NULL;
+	if (AGOO_READY_EPOLL == ready->mode) {
+	    if (0 > (ready->epoll_fd = epoll_create(1))) {
+		agoo_err_no(err, "epoll create failed");
+		AGOO_FREE(ready);
+		return NULL;
+	    }
+	    return ready;
 	}
-#else
+#endif
 	{
 	    size_t	size = sizeof(struct pollfd) * INITIAL_POLL_SIZE;
 
@@ -95,7 +202,6 @@ agoo_ready_create(agooErr err) {
 	    ready->pend = ready->pa + INITIAL_POLL_SIZE;
 	    memset(ready->pa, 0, size);
 	}
-#endif
     }
     return ready;
 }
@@ -104,31 +210,45 @@ void
 agoo_ready_destroy(agooReady ready) {
     Link	link;
 
+#if HAVE_LINUX_IO_URING_H
+    if (AGOO_READY_URING == ready->mode) {
+	// Closing the ring cancels anything outstanding.
+	agoo_uring_cleanup(&ready->ring);
+	while (NULL != (link = ready->dying)) {
+	    ready->dying = link->next;
+	    if (NULL != link->handler->destroy) {
+		link->handler->destroy(link->ctx);
+	    }
+	    agoo_pool_free(link);
+	}
+    }
+#endif
     while (NULL != (link = ready->links)) {
 	ready->links = link->next;
 	if (NULL != link->handler->destroy) {
 	    link->handler->destroy(link->ctx);
 	}
-	AGOO_FREE(link);
+	agoo_pool_free(link);
     }
 #if HAVE_SYS_EPOLL_H
-    close(ready->epoll_fd);
-#else
-    AGOO_FREE(ready->pa);
+    if (AGOO_READY_EPOLL == ready->mode) {
+	close(ready->epoll_fd);
+    }
 #endif
+    AGOO_FREE(ready->pa);
     AGOO_FREE(ready);
 }
 
-int
+agooLink
 agoo_ready_add(agooErr		err,
 	       agooReady	ready,
 	       int		fd,
 	       agooHandler	handler,
 	       void		*ctx) {
     Link	link;
-    
+
     if (NULL == (link = link_create(err, fd, ctx, handler))) {
-	return err->code;
+	return NULL;
     }
     link->next = ready->links;
     if (NULL != ready->links) {
@@ -138,38 +258,64 @@ agoo_ready_add(agooErr		err,
     ready->lcnt++;
 
 #if HAVE_SYS_EPOLL_H
-    link->events = EPOLLIN;
-    {
+    if (AGOO_READY_EPOLL == ready->mode) {
+	// The interest set never changes after the add. Edges are tracked on
+	// the link so there is no need to modify the registration each time
+	// the handler wants to write or stops wanting to write.
 	struct epoll_event	event = {
-	    .events = link->events,
+	    .events = EPOLLIN | EPOLLOUT | EPOLLET,
 	    .data = {
 		.ptr = link,
 	    },
 	};
 	if (0 > epoll_ctl(ready->epoll_fd, EPOLL_CTL_ADD, fd, &event)) {
 	    agoo_err_no(err, "epoll add failed");
-	    return err->code;
+	    ready->links = link->next;
+	    if (NULL != link->next) {
+		link->next->prev = NULL;
+	    }
+	    ready->lcnt--;
+	    agoo_pool_free(link);
+	    return NULL;
 	}
+	return link;
     }
-#else
-    if (ready->pend - ready->pa <= ready->lcnt) {
-	size_t	cnt = (ready->pend - ready->pa) * 2;
-	size_t	size = cnt * sizeof(struct pollfd);
-	
-	if (NULL == (ready->pa = (struct pollfd*)AGOO_REALLOC(ready->pa, size))) {
-	    agoo_err_set(err, AGOO_ERR_MEMORY, "Failed to allocate memory for a connection pool.");
-	    agoo_log_cat(&agoo_error_cat, "Out of memory.");
-	    agoo_log_close();
-	    exit(EXIT_FAILURE);
+#endif
+#if HAVE_LINUX_IO_URING_H
+    if (AGOO_READY_URING == ready->mode) {
+	// Picked up and submitted on the next go.
+	activate(ready, link);
+	return link;
+    }
+#endif
+    // The poll array is grown by the next poll_go() since a link can be
+    // added while the links are pointing into it.
+    return link;
+}
 
-	    return err->code;
+#if HAVE_LINUX_IO_URING_H
+static void
+uring_cancel(agooReady ready, Link link) {
+    struct _agooErr	err = AGOO_ERR_INIT;
+    struct io_uring_sqe	*sqe;
+    int			side;
+
+    for (side = URING_READ; side <= URING_WRITE; side++) {
+	if ((URING_READ == side && !link->rsub) || (URING_WRITE == side && !link->wsub)) {
+	    continue;
 	}
-	ready->pend = ready->pa + cnt;
-	memset(ready->pa, 0, size);
+	if (NULL == (sqe = agoo_uring_sqe(&err, &ready->ring))) {
+	    agoo_log_cat(&agoo_error_cat, "io_uring cancel failed. %s", err.msg);
+	    agoo_err_clear(&err);
+	    return;
+	}
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->fd = -1;
+	sqe->addr = (uint64_t)(uintptr_t)link | side;
+	sqe->user_data = 0;
     }
-#endif
-    return AGOO_ERR_OK;
 }
+#endif
 
 static void
 ready_remove(agooReady ready, Link link) {
@@ -182,7 +328,7 @@ ready_remove(agooReady ready, Link link) {
 	link->next->prev = link->prev;
     }
 #if HAVE_SYS_EPOLL_H
-    {
+    if (AGOO_READY_EPOLL == ready->mode) {
 	struct epoll_event	event = {
 	    .events = 0,
 	    .data = {
@@ -192,88 +338,391 @@ ready_remove(agooReady ready, Link link) {
 	if (0 > epoll_ctl(ready->epoll_fd, EPOLL_CTL_DEL, link->fd, &event)) {
 	    agoo_log_cat(&agoo_error_cat, "epoll delete failed. %s", strerror(errno));
 	}
+	if (ready->current == link) {
+	    ready->current = NULL;
+	}
+    }
+#endif
+    if (link->active) {
+	Link	prev = NULL;
+	Link	a;
+
+	for (a = ready->active; NULL != a; a = a->anext) {
+	    if (a == link) {
+		if (NULL == prev) {
+		    ready->active = a->anext;
+		} else {
+		    prev->anext = a->anext;
+		}
+		break;
+	    }
+	    prev = a;
+	}
+	link->active = false;
+    }
+#if HAVE_LINUX_IO_URING_H
+    if (AGOO_READY_URING == ready->mode && 0 < link->ops) {
+	// The kernel may still be using the handler buffers so the destroy
+	// has to wait until the outstanding submissions complete.
+	uring_cancel(ready, link);
+	link->dying = true;
+	link->prev = NULL;
+	link->next = ready->dying;
+	if (NULL != ready->dying) {
+	    ready->dying->prev = link;
+	}
+	ready->dying = link;
+	ready->lcnt--;
+	return;
     }
 #endif
     if (NULL != link->handler->destroy) {
 	link->handler->destroy(link->ctx);
     }
-    AGOO_FREE(link);
+    agoo_pool_free(link);
     ready->lcnt--;
 }
 
-int
-agoo_ready_go(agooErr err, agooReady ready) {
-    double	now;
-    Link	link;
-    Link	next;
-    
 #if HAVE_SYS_EPOLL_H
+// Returns false if the link was removed.
+static bool
+handle_link(agooReady ready, Link link) {
+    uint32_t	revents = link->revents;
+    agooReadyIO	io = link->handler->io(link->ctx);
+
+    link->revents = 0;
+    if (link->readable && wants_in(io) && NULL != link->handler->read) {
+	bool	ok;
+
+	// The handler calls agoo_ready_more() if it did not drain the socket.
+	link->readable = false;
+	ready->current = link;
+	ok = link->handler->read(ready, link->ctx);
+	ready->current = NULL;
+	if (!ok) {
+	    ready_remove(ready, link);
+	    return false;
+	}
+	io = link->handler->io(link->ctx);
+    }
+    if (link->writable && wants_out(io) && NULL != link->handler->write) {
+	errno = 0;
+	if (!link->handler->write(link->ctx)) {
+	    ready_remove(ready, link);
+	    return false;
+	}
+	// The write handler writes until there is nothing left or the socket
+	// would block. Only if it blocked is the next edge waited for. Output
+	// that a worker finished while the handler was writing is still
+	// pending but the socket has room for it and no edge would come.
+	if ((EAGAIN == errno || EWOULDBLOCK == errno) && wants_out(link->handler->io(link->ctx))) {
+	    link->writable = false;
+	}
+    }
+    if (0 != (revents & (EPOLLERR | EPOLLRDHUP | EPOLLHUP | EPOLLPRI))) {
+	if (NULL != link->handler->error) {
+	    link->handler->error(link->ctx);
+	}
+	ready_remove(ready, link);
+	return false;
+    }
+    return true;
+}
+
+static int
+epoll_go(agooErr err, agooReady ready) {
     struct epoll_event	events[EPOLL_SIZE];
     struct epoll_event	*ep;
+    Link		link;
+    Link		next;
     int			cnt;
+    int			wait = MAX_WAIT;
 
-    for (link = ready->links; NULL != link; link = link->next) {
-	struct epoll_event	event = {
-	    .events = 0,
-	    .data = {
-		.ptr = link,
-	    },
-	};
-	switch (link->handler->io(link->ctx)) {
-	case AGOO_READY_IN:
-	    event.events = EPOLLIN;
-	    break;
-	case AGOO_READY_OUT:
-	    event.events = EPOLLOUT;
-	    break;
-	case AGOO_READY_BOTH:
-	    event.events = EPOLLIN | EPOLLOUT;
-	    break;
-	case AGOO_READY_NONE:
-	default:
-	    // ignore, either dead or closing
-	    break;
-	}
-	if (event.events != link->events) {
-	    if (0 > epoll_ctl(ready->epoll_fd, EPOLL_CTL_MOD, link->fd, &event)) {
-		agoo_err_no(err, "epoll modifiy failed");
+    // Links with output from other threads are activated directly. A rescan
+    // is only needed when output may have been queued for many links.
+    if (ready->rescan) {
+	ready->rescan = false;
+	for (link = ready->links; NULL != link; link = link->next) {
+	    if (link->writable && wants_out(link->handler->io(link->ctx))) {
+		activate(ready, link);
 	    }
-	    link->events = event.events;
 	}
     }
-    if (0 > (cnt = epoll_wait(ready->epoll_fd, events, sizeof(events) / sizeof(*events), MAX_WAIT))) {
+    if (NULL != ready->active) {
+	wait = 0;
+    }
+    if (0 > (cnt = epoll_wait(ready->epoll_fd, events, sizeof(events) / sizeof(*events), wait))) {
+	if (EINTR == errno) {
+	    return AGOO_ERR_OK;
+	}
 	agoo_err_no(err, "Polling error.");
 	agoo_log_cat(&agoo_error_cat, "%s", err->msg);
 	return err->code;
     }
     for (ep = events; 0 < cnt; ep++, cnt--) {
 	link = (Link)ep->data.ptr;
-	if (0 != (ep->events & EPOLLIN) && NULL != link->handler->read) {
-	    if (!link->handler->read(ready, link->ctx)) {
-		ready_remove(ready, link);
-		continue;
+	if (0 != (ep->events & EPOLLIN)) {
+	    link->readable = true;
+	}
+	if (0 != (ep->events & EPOLLOUT)) {
+	    link->writable = true;
+	}
+	link->revents |= ep->events;
+	activate(ready, link);
+    }
+    // Detach the active list so links activated while handling are picked
+    // up on the next pass.
+    link = ready->active;
+    ready->active = NULL;
+    for (; NULL != link; link = next) {
+	next = link->anext;
+	link->anext = NULL;
+	link->active = false;
+	handle_link(ready, link);
+    }
+    return AGOO_ERR_OK;
+}
+#endif
+
+#if HAVE_LINUX_IO_URING_H
+static int
+uring_arm(agooErr err, agooReady ready, Link link) {
+    agooHandler		h = link->handler;
+    agooReadyIO		io = h->io(link->ctx);
+    struct io_uring_sqe	*sqe;
+    size_t		size;
+
+    // A link with more to read is read directly on the next pass instead.
+    if (!link->rsub && !link->more && wants_in(io) && NULL != h->read) {
+	char	*buf;
+
+	if (NULL == (sqe = agoo_uring_sqe(err, &ready->ring))) {
+	    return err->code;
+	}
+	sqe->fd = link->fd;
+	if (!link->rwait && NULL != h->rbuf && 0 < (size = h->rbuf(link->ctx, &buf))) {
+	    // The kernel receives directly into the handler buffer.
+	    sqe->opcode = IORING_OP_RECV;
+	    sqe->addr = (uint64_t)(uintptr_t)buf;
+	    sqe->len = (uint32_t)size;
+	    link->rpoll = false;
+	} else {
+	    sqe->opcode = IORING_OP_POLL_ADD;
+	    sqe->poll32_events = POLLIN;
+	    link->rpoll = true;
+	}
+	sqe->user_data = (uint64_t)(uintptr_t)link | URING_READ;
+	link->rsub = true;
+	link->ops++;
+    }
+    if (!link->wsub && wants_out(io) && NULL != h->write) {
+	const char	*buf;
+	int		icnt;
+
+	if (NULL == (sqe = agoo_uring_sqe(err, &ready->ring))) {
+	    return err->code;
+	}
+	sqe->fd = link->fd;
+	if (!link->wwait && NULL != h->wvec && 0 < (icnt = h->wvec(link->ctx, link->wiov, LINK_IOV))) {
+	    memset(&link->wmsg, 0, sizeof(link->wmsg));
+	    link->wmsg.msg_iov = link->wiov;
+	    link->wmsg.msg_iovlen = icnt;
+	    sqe->opcode = IORING_OP_SENDMSG;
+	    sqe->addr = (uint64_t)(uintptr_t)&link->wmsg;
+	    sqe->len = 1;
+	    sqe->msg_flags = MSG_NOSIGNAL;
+	    link->wpoll = false;
+	} else if (!link->wwait && NULL != h->wbuf && 0 < (size = h->wbuf(link->ctx, &buf))) {
+	    sqe->opcode = IORING_OP_SEND;
+	    sqe->addr = (uint64_t)(uintptr_t)buf;
+	    sqe->len = (uint32_t)size;
+	    sqe->msg_flags = MSG_NOSIGNAL;
+	    link->wpoll = false;
+	} else {
+	    sqe->opcode = IORING_OP_POLL_ADD;
+	    sqe->poll32_events = POLLOUT;
+	    link->wpoll = true;
+	}
+	sqe->user_data = (uint64_t)(uintptr_t)link | URING_WRITE;
+	link->wsub = true;
+	link->ops++;
+    }
+    return AGOO_ERR_OK;
+}
+
+// Returns false if the link should be removed.
+static bool
+uring_polled(agooReady ready, Link link, int res, bool in) {
+    if (0 > res) {
+	if (NULL != link->handler->error) {
+	    link->handler->error(link->ctx);
+	}
+	return false;
+    }
+    if (in) {
+	bool	ok = true;
+
+	link->rwait = false;
+	if (0 != (res & POLLIN)) {
+	    ready->current = link;
+	    ok = link->handler->read(ready, link->ctx);
+	    ready->current = NULL;
+	}
+	if (!ok) {
+	    return false;
+	}
+    } else {
+	link->wwait = false;
+	if (0 != (res & POLLOUT) && !link->handler->write(link->ctx)) {
+	    return false;
+	}
+    }
+    if (0 != (res & (POLLERR | POLLHUP | POLLNVAL))) {
+	if (NULL != link->handler->error) {
+	    link->handler->error(link->ctx);
+	}
+	return false;
+    }
+    return true;
+}
+
+static void
+uring_complete(agooReady ready, uint64_t user_data, int res) {
+    Link	link = (Link)(uintptr_t)(user_data & ~(uint64_t)URING_SIDE_MASK);
+    bool	ok;
+
+    if (NULL == link) { // a cancel
+	return;
+    }
+    link->ops--;
+    if (URING_READ == (user_data & URING_SIDE_MASK)) {
+	link->rsub = false;
+    } else {
+	link->wsub = false;
+    }
+    if (link->dying) {
+	if (0 == link->ops) {
+	    if (NULL == link->prev) {
+		ready->dying = link->next;
+	    } else {
+		link->prev->next = link->next;
+	    }
+	    if (NULL != link->next) {
+		link->next->prev = link->prev;
+	    }
+	    if (NULL != link->handler->destroy) {
+		link->handler->destroy(link->ctx);
 	    }
+	    agoo_pool_free(link);
+	}
+	return;
+    }
+    if (URING_READ == (user_data & URING_SIDE_MASK)) {
+	if (link->rpoll) {
+	    ok = uring_polled(ready, link, res, true);
+	} else if (-EAGAIN == res) {
+	    link->rwait = true;
+	    ok = true;
+	} else {
+	    ok = link->handler->received(ready, link->ctx, res);
+	}
+    } else {
+	if (link->wpoll) {
+	    ok = uring_polled(ready, link, res, false);
+	} else if (-EAGAIN == res) {
+	    link->wwait = true;
+	    ok = true;
+	} else {
+	    ok = link->handler->sent(link->ctx, res);
+	}
+    }
+    if (ok) {
+	activate(ready, link);
+    } else {
+	ready_remove(ready, link);
+    }
+}
+
+static int
+uring_go(agooErr err, agooReady ready) {
+    struct io_uring_cqe	*cqe;
+    Link		link;
+    Link		next;
+
+    if (ready->rescan) {
+	ready->rescan = false;
+	for (link = ready->links; NULL != link; link = link->next) {
+	    activate(ready, link);
 	}
-	if (0 != (ep->events & EPOLLOUT && NULL != link->handler->write)) {
-	    if (!link->handler->write(link->ctx)) {
+    }
+    // Submit whatever the touched links want next. The submissions go to the
+    // kernel along with the wait so there is usually only one system call
+    // per pass.
+    link = ready->active;
+    ready->active = NULL;
+    for (; NULL != link; link = next) {
+	next = link->anext;
+	link->anext = NULL;
+	link->active = false;
+	if (link->more && !link->rsub && wants_in(link->handler->io(link->ctx))) {
+	    link->more = false;
+	    ready->current = link;
+	    if (!link->handler->read(ready, link->ctx)) {
+		ready->current = NULL;
 		ready_remove(ready, link);
 		continue;
 	    }
+	    ready->current = NULL;
 	}
-	if (0 != (ep->events & (EPOLLERR | EPOLLRDHUP | EPOLLHUP | EPOLLPRI))) {
-	    if (NULL != link->handler->error) {
-		link->handler->error(link->ctx);
-	    }
-	    ready_remove(ready, link);
-	    continue;
+	if (AGOO_ERR_OK != uring_arm(err, ready, link)) {
+	    agoo_log_cat(&agoo_error_cat, "%s", err->msg);
+	    agoo_err_clear(err);
+	    ready->rescan = true;
 	}
     }
-#else
+    if (AGOO_ERR_OK != agoo_uring_enter(err, &ready->ring, (NULL == ready->active) ? MAX_WAIT : 0)) {
+	agoo_log_cat(&agoo_error_cat, "%s", err->msg);
+	return err->code;
+    }
+    while (NULL != (cqe = agoo_uring_peek(&ready->ring))) {
+	uint64_t	user_data = cqe->user_data;
+	int		res = cqe->res;
+
+	// Release the entry first as the handlers may add submissions.
+	agoo_uring_seen(&ready->ring);
+	uring_complete(ready, user_data, res);
+    }
+    return AGOO_ERR_OK;
+}
+#endif
+
+static int
+poll_go(agooErr err, agooReady ready) {
+    Link		link;
+    Link		next;
     struct pollfd	*pp;
     int			i;
-    
+    int			wait = MAX_WAIT;
+
+    if (ready->pend - ready->pa < ready->lcnt) {
+	size_t	cnt = ready->pend - ready->pa;
+	size_t	size;
+
+	for (; cnt < (size_t)ready->lcnt; cnt *= 2) {
+	}
+	size = cnt * sizeof(struct pollfd);
+	if (NULL == (pp = (struct pollfd*)AGOO_REALLOC(ready->pa, size))) {
+	    return agoo_err_set(err, AGOO_ERR_MEMORY, "Failed to allocate memory for a connection pool.");
+	}
+	ready->pa = pp;
+	ready->pend = ready->pa + cnt;
+	memset(ready->pa, 0, size);
+    }
     // Setup the poll events.
     for (link = ready->links, pp = ready->pa; NULL != link; link = link->next, pp++) {
+	if (link->more) {
+	    wait = 0;
+	}
 	pp->fd = link->fd;
 	pp->revents = 0;
 	link->pp = pp;
@@ -290,27 +739,36 @@ agoo_ready_go(agooErr err, agooReady ready) {
 	case AGOO_READY_NONE:
 	default:
 	    // ignore, either dead or closing
+	    link->pp = NULL;
 	    pp--;
 	    break;
 	}
     }
-    if (0 > (i = poll(ready->pa, (nfds_t)(pp - ready->pa), MAX_WAIT))) {
-	if (EAGAIN == errno) {
+    if (0 > (i = poll(ready->pa, (nfds_t)(pp - ready->pa), wait))) {
+	if (EAGAIN == errno || EINTR == errno) {
 	    return AGOO_ERR_OK;
 	}
 	agoo_err_no(err, "Polling error.");
 	agoo_log_cat(&agoo_error_cat, "%s", err->msg);
 	return err->code;
     }
-    if (0 < i) {
+    if (0 < i || 0 == wait) {
 	for (link = ready->links; NULL != link; link = next) {
+	    bool	more = link->more;
+
 	    next = link->next;
+	    link->more = false;
 	    if (NULL == link->pp) {
 		continue;
 	    }
 	    pp = link->pp;
-	    if (0 != (pp->revents & POLLIN) && NULL != link->handler->read) {
-		if (!link->handler->read(ready, link->ctx)) {
+	    if ((0 != (pp->revents & POLLIN) || (more && 0 != (pp->events & POLLIN))) && NULL != link->handler->read) {
+		bool	ok;
+
+		ready->current = link;
+		ok = link->handler->read(ready, link->ctx);
+		ready->current = NULL;
+		if (!ok) {
 		    ready_remove(ready, link);
 		    continue;
 		}
@@ -330,7 +788,34 @@ agoo_ready_go(agooErr err, agooReady ready) {
 	    }
 	}
     }
+    return AGOO_ERR_OK;
+}
+
+int
+agoo_ready_go(agooErr err, agooReady ready) {
+    double	now;
+    Link	link;
+    Link	next;
+    int		code;
+
+    switch (ready->mode) {
+#if HAVE_SYS_EPOLL_H
+    case AGOO_READY_EPOLL:
+	code = epoll_go(err, ready);
+	break;
 #endif
+#if HAVE_LINUX_IO_URING_H
+    case AGOO_READY_URING:
+	code = uring_go(err, ready);
+	break;
+#endif
+    default:
+	code = poll_go(err, ready);
+	break;
+    }
+    if (AGOO_ERR_OK != code) {
+	return code;
+    }
     // Periodically check the connections to see if they are dead or not.
     now = dtime();
     if (ready->next_check <= now) {
@@ -343,10 +828,70 @@ agoo_ready_go(agooErr err, agooReady ready) {
 	    }
 	}
 	ready->next_check = dtime() + CHECK_FREQ;
+	// The check may have queued pings or closes.
+	ready->rescan = true;
     }
     return AGOO_ERR_OK;
 }
 
+// Called from a read handler when the socket was not drained or the handler
+// has read ahead of what it has handed back, as TLS does. Level triggered
+// polling reports a socket that was not drained again anyway but not what
+// was read ahead so the read is retried on the next pass.
+void
+agoo_ready_more(agooReady ready) {
+    if (NULL == ready->current) {
+	return;
+    }
+    switch (ready->mode) {
+#if HAVE_SYS_EPOLL_H
+    case AGOO_READY_EPOLL:
+	ready->current->readable = true;
+	activate(ready, ready->current);
+	break;
+#endif
+#if HAVE_LINUX_IO_URING_H
+    case AGOO_READY_URING:
+	ready->current->more = true;
+	activate(ready, ready->current);
+	break;
+#endif
+    default:
+	ready->current->more = true;
+	break;
+    }
+}
+
+// Called when output may have been queued for any of the links by something
+// other than the link handlers.
+void
+agoo_ready_rescan(agooReady ready) {
+    ready->rescan = true;
+}
+
+// Called when output has been queued for a specific link by something other
+// than the link handler. The link is handled on the next go.
+void
+agoo_ready_activate(agooReady ready, agooLink link) {
+    switch (ready->mode) {
+#if HAVE_SYS_EPOLL_H
+    case AGOO_READY_EPOLL:
+	activate(ready, link);
+	break;
+#endif
+#if HAVE_LINUX_IO_URING_H
+    case AGOO_READY_URING:
+	if (!link->dying) {
+	    activate(ready, link);
+	}
+	break;
+#endif
+    default:
+	// Poll asks every link what it wants on each pass.
+	break;
+    }
+}
+
 void
 agoo_ready_iterate(agooReady ready, void (*cb)(void *ctx, void *arg), void *arg) {
     Link	link;
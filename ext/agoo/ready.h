@@ -6,6 +6,7 @@
 #include <stdbool.h>
 #include <stdint.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 
 #include "err.h"
 
@@ -16,7 +17,14 @@ typedef enum {
     AGOO_READY_BOTH	= 'b',
 } agooReadyIO;
 
+typedef enum {
+    AGOO_READY_POLL	= 'p',
+    AGOO_READY_EPOLL	= 'e',
+    AGOO_READY_URING	= 'u',
+} agooReadyMode;
+
 typedef struct _agooReady	*agooReady;
+typedef struct _agooLink	*agooLink;
 
 typedef struct _agooHandler {
     agooReadyIO	(*io)(void *ctx);
@@ -26,16 +34,32 @@ typedef struct _agooHandler {
     bool	(*write)(void *ctx);
     void	(*error)(void *ctx);
     void	(*destroy)(void *ctx);
+    // Optional completion style I/O used by the io_uring backend. The buffer
+    // functions return 0 if the read and write functions should be used
+    // instead. A negative count is a negated errno.
+    size_t	(*rbuf)(void *ctx, char **bufp);
+    bool	(*received)(agooReady ready, void *ctx, ssize_t cnt);
+    size_t	(*wbuf)(void *ctx, const char **bufp);
+    // Like wbuf but may fill several buffers for one send. Returns the number
+    // filled or 0 to fall back to wbuf.
+    int		(*wvec)(void *ctx, struct iovec *iov, int max);
+    bool	(*sent)(void *ctx, ssize_t cnt);
 } *agooHandler;
 
+extern int		agoo_ready_set_mode(agooErr err, agooReadyMode mode);
+extern agooReadyMode	agoo_ready_mode();
+
 extern agooReady	agoo_ready_create(agooErr err);
 extern void		agoo_ready_destroy(agooReady ready);
-extern int		agoo_ready_add(agooErr		err,
+extern agooLink		agoo_ready_add(agooErr		err,
 				       agooReady	ready,
 				       int		fd,
 				       agooHandler	handler,
 				       void		*ctx);
+extern void		agoo_ready_activate(agooReady ready, agooLink link);
 extern int		agoo_ready_go(agooErr err, agooReady ready);
+extern void		agoo_ready_more(agooReady ready);
+extern void		agoo_ready_rescan(agooReady ready);
 extern void		agoo_ready_iterate(agooReady ready, void (*cb)(void *ctx, void *arg), void *arg);
 
 #endif // AGOO_READY_H
@@ -3,23 +3,114 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <ctype.h>
 
+#include "body.h"
 #include "con.h"
 #include "debug.h"
+#include "pool.h"
 #include "server.h"
 #include "req.h"
 
+// The read buffers fill the biggest request size class unless a larger one
+// is needed for a big body.
+#define RBUF_BLOCK	(AGOO_POOL_REQ_MIN << (AGOO_POOL_REQ_CLASSES - 1))
+
+agooRBuf
+agoo_rbuf_create(size_t size) {
+    agooRBuf	rb;
+
+    if (size < RBUF_BLOCK - sizeof(struct _agooRBuf)) {
+	size = RBUF_BLOCK - sizeof(struct _agooRBuf);
+    }
+    if (NULL != (rb = (agooRBuf)agoo_pool_alloc(AGOO_POOL_REQ, sizeof(struct _agooRBuf) + size))) {
+	rb->ref = 1;
+	rb->size = size;
+    }
+    return rb;
+}
+
+void
+agoo_rbuf_release(agooRBuf rb) {
+    if (NULL != rb && 1 == __atomic_fetch_sub(&rb->ref, 1, __ATOMIC_ACQ_REL)) {
+	agoo_pool_free(rb);
+    }
+}
+
+// If msize is not zero the message is kept in the same allocation and is
+// followed by the headers.
+static agooReq
+req_alloc(size_t msize, int hcnt) {
+    size_t	size = sizeof(struct _agooReq) + msize;
+    size_t	hoff = (size + 7) & ~(size_t)7;
+    agooReq	req;
+
+    if (0 < hcnt) {
+	size = hoff + sizeof(struct _agooReqHeader) * hcnt;
+    }
+    if (NULL != (req = (agooReq)agoo_pool_alloc(AGOO_POOL_REQ, size))) {
+	memset(req, 0, size);
+	req->env = agoo_server.env_nil_value;
+	req->hook = NULL;
+	if (0 < msize) {
+	    req->msg = (char*)(req + 1);
+	}
+	if (0 < hcnt) {
+	    req->headers = (agooReqHeader)((char*)req + hoff);
+	}
+    }
+    return req;
+}
+
 agooReq
 agoo_req_create(size_t mlen) {
-    size_t	size = mlen + sizeof(struct _agooReq) - 7;
-    agooReq	req = (agooReq)AGOO_MALLOC(size);
-    
+    agooReq	req = req_alloc(mlen + 1, 0);
+
     if (NULL != req) {
-	memset(req, 0, size);
-	req->env = agoo_server.env_nil_value;
 	req->mlen = mlen;
-	req->hook = NULL;
+    }
+    return req;
+}
+
+// Creates a request for a message read into rb. The head was parsed from
+// msg and the rest of the message is read into rb after it.
+agooReq
+agoo_req_create_head(size_t mlen, agooHead head, agooRBuf rb, char *msg) {
+    agooReq		req = req_alloc(0, head->fcnt);
+    agooHeadField	f;
+    agooReqHeader	h;
+    int			i;
+
+    if (NULL != req) {
+	h = req->headers;
+	for (f = head->fa, i = head->fcnt; 0 < i; i--, f++, h++) {
+	    h->name = (uint32_t)(f->name - msg);
+	    h->nlen = (uint16_t)f->nlen;
+	    h->value = (uint32_t)(f->value - msg);
+	    h->vlen = (uint32_t)f->vlen;
+	    h->id = (uint8_t)f->id;
+	}
+	req->hcnt = head->fcnt;
+	memcpy(req->known, head->known, sizeof(req->known));
+	__atomic_fetch_add(&rb->ref, 1, __ATOMIC_RELAXED);
+	req->rbuf = rb;
+	req->msg = msg;
+	req->mlen = mlen;
+    }
+    return req;
+}
+
+// Creates a request for a message that was read into rb without a head.
+agooReq
+agoo_req_create_rbuf(size_t mlen, agooRBuf rb, char *msg) {
+    agooReq	req = req_alloc(0, 0);
+
+    if (NULL != req) {
+	__atomic_fetch_add(&rb->ref, 1, __ATOMIC_RELAXED);
+	req->rbuf = rb;
+	req->msg = msg;
+	req->mlen = mlen;
     }
     return req;
 }
@@ -27,9 +118,11 @@ agoo_req_create(size_t mlen) {
 void
 agoo_req_destroy(agooReq req) {
     if (NULL != req->hook && PUSH_HOOK == req->hook->type) {
-	AGOO_FREE(req->hook);
+	agoo_pool_free(req->hook);
     }
-    AGOO_FREE(req);
+    agoo_body_destroy(req->stream);
+    agoo_rbuf_release(req->rbuf);
+    agoo_pool_free(req);
 }
 
 const char*
@@ -37,7 +130,7 @@ agoo_req_host(agooReq r, int *lenp) {
     const char	*host;
     const char	*colon;
 
-    if (NULL == (host = agoo_con_header_value(r->header.start, r->header.len, "Host", lenp))) {
+    if (NULL == (host = agoo_req_header(r, AGOO_HDR_HOST, lenp))) {
 	return NULL;
     }
     for (colon = host + *lenp - 1; host < colon; colon--) {
@@ -57,7 +150,7 @@ agoo_req_port(agooReq r) {
     const char	*host;
     const char	*colon;
     
-    if (NULL == (host = agoo_con_header_value(r->header.start, r->header.len, "Host", &len))) {
+    if (NULL == (host = agoo_req_header(r, AGOO_HDR_HOST, &len))) {
 	return 0;
     }
     for (colon = host + len - 1; host < colon; colon--) {
@@ -137,34 +230,34 @@ agoo_req_query_decode(char *s, int len) {
     return (int)(sn - s);
 }
 
+const char*
+agoo_req_header(agooReq req, agooHeaderId id, int *vlen) {
+    agooReqHeader	h;
+
+    if (0 == req->known[id]) {
+	return NULL;
+    }
+    h = req->headers + req->known[id] - 1;
+    *vlen = (int)h->vlen;
+
+    return req->msg + h->value;
+}
+
 const char*
 agoo_req_header_value(agooReq req, const char *key, int *vlen) {
-    // Search for \r then check for \n and then the key followed by a :. Keep
-    // trying until the end of the header.
-    const char	*h = req->header.start;
-    const char	*hend = h + req->header.len;
-    const char	*value;
-    int		klen = (int)strlen(key);
-    
-    while (h < hend) {
-	if (0 == strncmp(key, h, klen) && ':' == h[klen]) {
-	    h += klen + 1;
-	    for (; ' ' == *h; h++) {
-	    }
-	    value = h;
-	    for (; '\r' != *h && '\0' != *h; h++) {
-	    }
-	    *vlen = (int)(h - value);
- 
-	    return value;
-	}
-	for (; h < hend; h++) {
-	    if ('\r' == *h && '\n' == *(h + 1)) {
-		h += 2;
-		break;
-	    }
+    int			klen = (int)strlen(key);
+    agooHeaderId	id = agoo_header_id(key, klen);
+    agooReqHeader	h;
+    agooReqHeader	end;
+
+    if (AGOO_HDR_OTHER != id) {
+	return agoo_req_header(req, id, vlen);
+    }
+    for (h = req->headers, end = h + req->hcnt; h < end; h++) {
+	if (klen == h->nlen && 0 == strncasecmp(key, req->msg + h->name, klen)) {
+	    *vlen = (int)h->vlen;
+	    return req->msg + h->value;
 	}
     }
     return NULL;
 }
-
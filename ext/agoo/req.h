@@ -5,11 +5,13 @@
 
 #include <stdint.h>
 
+#include "head.h"
 #include "hook.h"
 #include "kinds.h"
 
 struct _agooUpgraded;
 struct _agooRes;
+struct _agooBody;
 
 typedef enum {
     AGOO_UP_NONE	= '\0',
@@ -22,28 +24,61 @@ typedef struct _agooStr {
     unsigned int	len;
 } *agooStr;
 
+// A buffer a connection reads into. Requests point into it instead of
+// taking a copy so it is freed once the connection and every request that
+// points into it have let go.
+typedef struct _agooRBuf {
+    int		ref;
+    size_t	size; // of buf
+    char	buf[];
+} *agooRBuf;
+
+// A header field of the request. Offsets are from the start of msg.
+typedef struct _agooReqHeader {
+    uint32_t	name;
+    uint32_t	value;
+    uint32_t	vlen;
+    uint16_t	nlen;
+    uint8_t	id; // agooHeaderId
+} *agooReqHeader;
+
 typedef struct _agooReq {
     agooMethod			method;
     struct _agooRes		*res;
 
     agooUpgrade			upgrade;
     struct _agooUpgraded	*up;
+    bool			secure; // arrived over TLS
     struct _agooStr		path;
     struct _agooStr		query;
     struct _agooStr		header;
     struct _agooStr		body;
+    struct _agooBody		*stream; // set if the body is not in msg
+    agooReqHeader		headers; // in the same allocation, after msg
+    int				hcnt;
+    uint8_t			known[AGOO_HDR_CNT]; // index + 1 into headers
     void			*env;
     agooHook			hook;
-    size_t			mlen;   // allocated msg length
-    char			msg[8]; // expanded to be full message
+    agooRBuf			rbuf;   // msg is in rbuf if not NULL
+    bool			part;   // a piece of a WebSocket message given as it arrives
+    bool			last;   // the last piece
+    struct _agooReq		*next;  // next part waiting for the handler
+    size_t			mlen;   // msg length
+    char			*msg;   // full message
 } *agooReq;
 
+extern agooRBuf		agoo_rbuf_create(size_t size);
+extern void		agoo_rbuf_release(agooRBuf rb);
+
 extern agooReq		agoo_req_create(size_t mlen);
+extern agooReq		agoo_req_create_head(size_t mlen, agooHead head, agooRBuf rb, char *msg);
+extern agooReq		agoo_req_create_rbuf(size_t mlen, agooRBuf rb, char *msg);
 extern void		agoo_req_destroy(agooReq req);
 extern const char*	agoo_req_host(agooReq r, int *lenp);
 extern int		agoo_req_port(agooReq r);
 extern const char*	agoo_req_query_value(agooReq r, const char *key, int klen, int *vlenp);
 extern int		agoo_req_query_decode(char *s, int len);
-const char*		agoo_req_header_value(agooReq req, const char *key, int *vlen);
+extern const char*	agoo_req_header_value(agooReq req, const char *key, int *vlen);
+extern const char*	agoo_req_header(agooReq req, agooHeaderId id, int *vlen);
 
 #endif // AGOO_REQ_H
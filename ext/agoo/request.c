@@ -3,7 +3,11 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <ctype.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
 
+#include "body.h"
 #include "debug.h"
 #include "con.h"
 #include "error_stream.h"
@@ -21,6 +25,7 @@ static VALUE	empty_val = Qundef;
 static VALUE	get_val = Qundef;
 static VALUE	head_val = Qundef;
 static VALUE	http_val = Qundef;
+static VALUE	https_val = Qundef;
 static VALUE	options_val = Qundef;
 static VALUE	patch_val = Qundef;
 static VALUE	path_info_val = Qundef;
@@ -46,19 +51,19 @@ static VALUE	server_name_val = Qundef;
 static VALUE	server_port_val = Qundef;
 static VALUE	slash_val = Qundef;
 
+// Rack env keys for the well known headers, indexed by agooHeaderId.
+static VALUE	header_keys[AGOO_HDR_CNT];
+
 static VALUE	sse_sym;
 static VALUE	websocket_sym;
 
 static VALUE	stringio_class = Qundef;
 
 static ID	new_id;
+static ID	for_fd_id;
+static ID	binmode_id;
 
-static const char	content_type[] = "Content-Type";
-static const char	content_length[] = "Content-Length";
-static const char	connection_key[] = "Connection";
-static const char	upgrade_key[] = "Upgrade";
 static const char	websocket_val[] = "websocket";
-static const char	accept_key[] = "Accept";
 static const char	event_stream_val[] = "text/event-stream";
 
 static VALUE
@@ -202,7 +207,7 @@ req_server_port(agooReq r) {
     if (NULL == r) {
 	rb_raise(rb_eArgError, "Request is no longer valid.");
     }
-    if (NULL == (host = agoo_con_header_value(r->header.start, r->header.len, "Host", &len))) {
+    if (NULL == (host = agoo_req_header(r, AGOO_HDR_HOST, &len))) {
 	return Qnil;
     }
     for (colon = host + len - 1; host < colon; colon--) {
@@ -260,7 +265,9 @@ rack_version(VALUE self) {
 
 static VALUE
 req_rack_url_scheme(agooReq r) {
-    // TBD http or https when ssl is supported
+    if (r->secure) {
+	return https_val;
+    }
     return http_val;
 }
 
@@ -275,11 +282,31 @@ rack_url_scheme(VALUE self) {
     return req_rack_url_scheme((agooReq)DATA_PTR(self));
 }
 
+// A body that was written to a temp file is read from a File that has its
+// own descriptor so it can outlive the request.
+static VALUE
+body_file(agooReq r) {
+    int		fd;
+    VALUE	io;
+
+    if (0 > (fd = dup(r->stream->fd))) {
+	rb_raise(rb_eIOError, "Failed to open the request body. %s", strerror(errno));
+    }
+    lseek(fd, 0, SEEK_SET);
+    io = rb_funcall(rb_cFile, for_fd_id, 1, INT2NUM(fd));
+    rb_funcall(io, binmode_id, 0);
+
+    return io;
+}
+
 static VALUE
 req_rack_input(agooReq r) {
     if (NULL == r) {
 	rb_raise(rb_eArgError, "Request is no longer valid.");
     }
+    if (NULL != r->stream && 0 <= r->stream->fd) {
+	return body_file(r);
+    }
     if (NULL == r->body.start) {
 	return Qnil;
     }
@@ -359,108 +386,60 @@ rack_run_once(VALUE self) {
     return Qfalse;
 }
 
-// TBD req.c
 static void
 add_header_value(VALUE hh, const char *key, int klen, const char *val, int vlen) {
-    if (sizeof(content_type) - 1 == klen && 0 == strncasecmp(key, content_type, sizeof(content_type) - 1)) {
-	rb_hash_aset(hh, content_type_val, rb_str_new(val, vlen));
-    } else if (sizeof(content_length) - 1 == klen && 0 == strncasecmp(key, content_length, sizeof(content_length) - 1)) {
-	rb_hash_aset(hh, content_length_val, rb_str_new(val, vlen));
-    } else {
-	char		hkey[1024];
-	char		*k = hkey;
-	volatile VALUE	sval = rb_str_new(val, vlen);
-	
-	strcpy(hkey, "HTTP_");
-	k = hkey + 5;
-	if ((int)(sizeof(hkey) - 5) <= klen) {
-	    klen = sizeof(hkey) - 6;
-	}
-	strncpy(k, key, klen);
-	hkey[klen + 5] = '\0';
-    
-	//rb_hash_aset(hh, rb_str_new(hkey, klen + 5), sval);
-	// Contrary to the Rack spec, Rails expects all upper case keys so add those as well.
-	for (k = hkey + 5; '\0' != *k; k++) {
-	    if ('-' == *k) {
-		*k = '_';
-	    } else {
-		*k = toupper(*k);
-	    }
+    char		hkey[1024];
+    char		*k = hkey;
+    volatile VALUE	sval = rb_str_new(val, vlen);
+
+    strcpy(hkey, "HTTP_");
+    k = hkey + 5;
+    if ((int)(sizeof(hkey) - 5) <= klen) {
+	klen = sizeof(hkey) - 6;
+    }
+    strncpy(k, key, klen);
+    hkey[klen + 5] = '\0';
+
+    // Contrary to the Rack spec, Rails expects all upper case keys so add those as well.
+    for (k = hkey + 5; '\0' != *k; k++) {
+	if ('-' == *k) {
+	    *k = '_';
+	} else {
+	    *k = toupper(*k);
 	}
-	rb_hash_aset(hh, rb_str_new(hkey, klen + 5), sval);
     }
+    rb_hash_aset(hh, rb_str_new(hkey, klen + 5), sval);
 }
 
-// TBD req.c
+// The headers were indexed when the request was read so the well known ones
+// use a precomputed key and nothing is scanned again.
 static void
 fill_headers(agooReq r, VALUE hash) {
-    char	*h = r->header.start;
-    char	*end = h + r->header.len + 1; // +1 for last \r
-    char	*key = h;
-    char	*kend = key;
-    char	*val = NULL;
-    char	*vend;
-    int		klen;
-    bool	upgrade = false;
-    bool	ws = false;
+    agooReqHeader	h;
+    agooReqHeader	end;
+    const char	*v;
+    int		vlen;
 
     if (NULL == r) {
 	rb_raise(rb_eArgError, "Request is no longer valid.");
     }
-    
-    for (; h < end; h++) {
-	switch (*h) {
-	case ':':
-	    if (NULL == val) {
-		kend = h;
-		val = h + 1;
-	    }
-	    break;
-	case '\r':
-	    if (NULL != val) {
-		for (; ' ' == *val; val++) {
-		}
-		vend = h;
-	    }
-	    if (NULL != key) {
-		for (; ' ' == *key; key++) {
-		}
-	    }
-	    if ('\n' == *(h + 1)) {
-		h++;
-	    }
-	    klen = (int)(kend - key);
-	    add_header_value(hash, key, klen, val, (int)(vend - val));
-	    if (sizeof(upgrade_key) - 1 == klen && 0 == strncasecmp(key, upgrade_key, sizeof(upgrade_key) - 1)) {
-		if (sizeof(websocket_val) - 1 == vend - val &&
-		    0 == strncasecmp(val, websocket_val, sizeof(websocket_val) - 1)) {
-		    ws = true;
-		}
-	    } else if (sizeof(connection_key) - 1 == klen && 0 == strncasecmp(key, connection_key, sizeof(connection_key) - 1)) {
-		char	buf[1024];
-
-		strncpy(buf, val, vend - val);
-		buf[sizeof(buf)-1] = '\0';
-		if (NULL != strstr(buf, upgrade_key)) {
-		    upgrade = true;
-		}
-	    } else if (sizeof(accept_key) - 1 == klen && 0 == strncasecmp(key, accept_key, sizeof(accept_key) - 1)) {
-		if (sizeof(event_stream_val) - 1 == vend - val &&
-		    0 == strncasecmp(val, event_stream_val, sizeof(event_stream_val) - 1)) {
-		    r->upgrade = AGOO_UP_SSE;
-		}
-	    }
-	    key = h + 1;
-	    kend = NULL;
-	    val = NULL;
-	    vend = NULL;
-	    break;
-	default:
-	    break;
+    for (h = r->headers, end = h + r->hcnt; h < end; h++) {
+	if (AGOO_HDR_OTHER == h->id) {
+	    add_header_value(hash, r->msg + h->name, h->nlen, r->msg + h->value, (int)h->vlen);
+	} else {
+	    rb_hash_aset(hash, header_keys[h->id], rb_str_new(r->msg + h->value, h->vlen));
 	}
     }
-    if (upgrade && ws) {
+    if (NULL != (v = agoo_req_header(r, AGOO_HDR_ACCEPT, &vlen)) &&
+	sizeof(event_stream_val) - 1 == vlen &&
+	0 == strncasecmp(v, event_stream_val, sizeof(event_stream_val) - 1)) {
+	r->upgrade = AGOO_UP_SSE;
+    }
+    if (NULL != (v = agoo_req_header(r, AGOO_HDR_CONNECTION, &vlen)) &&
+	agoo_head_has_token(v, vlen, "upgrade", 7) &&
+	NULL != (v = agoo_req_header(r, AGOO_HDR_UPGRADE, &vlen)) &&
+	sizeof(websocket_val) - 1 == vlen &&
+	0 == strncasecmp(v, websocket_val, sizeof(websocket_val) - 1)) {
 	r->upgrade = AGOO_UP_WS;
     }
 }
@@ -499,6 +478,20 @@ body(VALUE self) {
     if (NULL == r) {
 	rb_raise(rb_eArgError, "Request is no longer valid.");
     }
+    if (NULL != r->stream && 0 <= r->stream->fd) {
+	volatile VALUE	rstr = rb_str_new(NULL, r->body.len);
+	char		*s = RSTRING_PTR(rstr);
+	size_t		off = 0;
+	ssize_t		cnt;
+
+	while (off < r->body.len) {
+	    if (0 >= (cnt = pread(r->stream->fd, s + off, r->body.len - off, off))) {
+		rb_raise(rb_eIOError, "Failed to read the request body. %s", strerror(errno));
+	    }
+	    off += cnt;
+	}
+	return rstr;
+    }
     if (NULL == r->body.start) {
 	return Qnil;
     }
@@ -554,7 +547,8 @@ request_env(agooReq req, VALUE self) {
 	rb_hash_aset(env, rack_run_once_val, Qfalse);
 	rb_hash_aset(env, rack_logger_val, req_rack_logger(req));
 	rb_hash_aset(env, rack_upgrade_val, req_rack_upgrade(req));
-	rb_hash_aset(env, rack_hijackq_val, Qtrue);
+	// A TLS connection can not be handed over as a plain IO.
+	rb_hash_aset(env, rack_hijackq_val, req->secure ? Qfalse : Qtrue);
 
 	// TBD should return IO on #call and set hijack_io on env object that
 	//  has a call method that wraps the req->res->con->sock then set the
@@ -616,6 +610,9 @@ call(VALUE self) {
     if (NULL == r) {
 	rb_raise(rb_eArgError, "Request is no longer valid.");
     }
+    if (r->secure) {
+	rb_raise(rb_eNotImpError, "A TLS connection can not be hijacked.");
+    }
     r->res->con->hijacked = true;
 
     // TBD try basic IO first. If that fails define a socket class
@@ -643,6 +640,8 @@ request_wrap(agooReq req) {
  */
 void
 request_init(VALUE mod) {
+    int	i;
+
     req_class = rb_define_class_under(mod, "Request", rb_cObject);
 
     rb_define_method(req_class, "to_s", to_s, 0);
@@ -669,6 +668,8 @@ request_init(VALUE mod) {
     rb_define_method(req_class, "call", call, 0);
 
     new_id = rb_intern("new");
+    for_fd_id = rb_intern("for_fd");
+    binmode_id = rb_intern("binmode");
     
     rack_version_val_val = rb_ary_new();
     rb_ary_push(rack_version_val_val, INT2NUM(1));
@@ -685,6 +686,7 @@ request_init(VALUE mod) {
     get_val = rb_str_new_cstr("GET");				rb_gc_register_address(&get_val);
     head_val = rb_str_new_cstr("HEAD");				rb_gc_register_address(&head_val);
     http_val = rb_str_new_cstr("http");				rb_gc_register_address(&http_val);
+    https_val = rb_str_new_cstr("https");			rb_gc_register_address(&https_val);
     options_val = rb_str_new_cstr("OPTIONS");			rb_gc_register_address(&options_val);
     patch_val = rb_str_new_cstr("PATCH");			rb_gc_register_address(&patch_val);
     path_info_val = rb_str_new_cstr("PATH_INFO");		rb_gc_register_address(&path_info_val);
@@ -709,6 +711,27 @@ request_init(VALUE mod) {
     server_port_val = rb_str_new_cstr("SERVER_PORT");		rb_gc_register_address(&server_port_val);
     slash_val = rb_str_new_cstr("/");				rb_gc_register_address(&slash_val);
 
+    header_keys[AGOO_HDR_OTHER] = Qnil;
+    for (i = 1; i < AGOO_HDR_CNT; i++) {
+	char		key[64] = "HTTP_";
+	const char	*n = agoo_header_names[i];
+	char		*k = key + 5;
+
+	if (AGOO_HDR_CONTENT_LENGTH == i) {
+	    header_keys[i] = rb_obj_freeze(content_length_val);
+	    continue;
+	}
+	if (AGOO_HDR_CONTENT_TYPE == i) {
+	    header_keys[i] = rb_obj_freeze(content_type_val);
+	    continue;
+	}
+	for (; '\0' != *n; n++, k++) {
+	    *k = ('-' == *n) ? '_' : toupper(*n);
+	}
+	*k = '\0';
+	header_keys[i] = rb_obj_freeze(rb_str_new_cstr(key));
+	rb_gc_register_address(&header_keys[i]);
+    }
     sse_sym = ID2SYM(rb_intern("sse"));				rb_gc_register_address(&sse_sym);
     websocket_sym = ID2SYM(rb_intern("websocket"));		rb_gc_register_address(&websocket_sym);
 }
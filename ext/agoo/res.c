@@ -5,33 +5,28 @@
 
 #include "con.h"
 #include "debug.h"
+#include "pool.h"
 #include "res.h"
 
+// Responses are created and destroyed by the loop that owns the connection
+// so they come from and go back to that loop's pool.
 agooRes
 agoo_res_create(agooCon con) {
-    agooRes	res = NULL;
-
-    pthread_mutex_lock(&con->loop->lock);
-    if (NULL != (res = con->loop->res_head)) {
-	con->loop->res_head = res->next;
-	if (NULL == con->loop->res_head) {
-	    con->loop->res_tail = NULL;
-	}
-    }
-    pthread_mutex_unlock(&con->loop->lock);
+    agooRes	res = (agooRes)agoo_pool_alloc(AGOO_POOL_RES, sizeof(struct _agooRes));
 
     if (NULL == res) {
-	if (NULL == (res = (agooRes)AGOO_MALLOC(sizeof(struct _agooRes)))) {
-	    return NULL;
-	}
+	return NULL;
     }
     res->next = NULL;
     atomic_init(&res->message, NULL);
     res->con = con;
+    res->loop = con->loop;
     res->con_kind = AGOO_CON_HTTP;
+    res->sid = con->sid;
     res->close = false;
     res->ping = false;
     res->pong = false;
+    res->framed = false;
 
     return res;
 }
@@ -45,14 +40,11 @@ agoo_res_destroy(agooRes res) {
 	    agoo_text_release(message);
 	}
 	res->next = NULL;
-	pthread_mutex_lock(&res->con->loop->lock);
-	if (NULL == res->con->loop->res_tail) {
-	    res->con->loop->res_head = res;
-	} else {
-	    res->con->loop->res_tail->next = res;
-	}
-	res->con->loop->res_tail = res;
-	pthread_mutex_unlock(&res->con->loop->lock);
+	// The res may still be on the loop res_queue. Pool memory is kept
+	// until the loop is destroyed and a freed block is left as is so
+	// clearing the con lets the loop know it has already been handled.
+	res->con = NULL;
+	agoo_pool_free(res);
     }
 }
 
@@ -64,3 +56,10 @@ agoo_res_set_message(agooRes res, agooText t) {
     atomic_store(&res->message, t);
 }
 
+
+// Called by worker threads after the message has been set. The response is
+// handed to the loop that owns the connection and only that loop is woken.
+void
+agoo_res_ready(agooRes res) {
+    agoo_queue_push(&res->loop->res_queue, res);
+}
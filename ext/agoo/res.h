@@ -4,26 +4,32 @@
 #define AGOO_RES_H
 
 #include <stdbool.h>
+#include <stdint.h>
 
 #include "atomic.h"
 #include "con.h"
 #include "text.h"
 
 struct _agooCon;
+struct _agooConLoop;
 
 typedef struct _agooRes {
     struct _agooRes	*next;
-    struct _agooCon	*con;
+    struct _agooCon	*con; // NULL once recycled
+    struct _agooConLoop	*loop;
     _Atomic(agooText)	message;
     agooConKind		con_kind;
+    uint32_t		sid; // HTTP/2 stream or 0
     bool		close;
     bool		ping;
     bool		pong;
+    bool		framed; // message already has the WebSocket or SSE framing
 } *agooRes;
 
 extern agooRes	agoo_res_create(struct _agooCon *con);
 extern void	agoo_res_destroy(agooRes res);
 extern void	agoo_res_set_message(agooRes res, agooText t);
+extern void	agoo_res_ready(agooRes res);
 
 static inline agooText
 agoo_res_message(agooRes res) {
@@ -11,15 +11,19 @@
 #include <ruby/encoding.h>
 
 #include "bind.h"
+#include "bus.h"
 #include "con.h"
 #include "debug.h"
 #include "dtime.h"
 #include "err.h"
 #include "graphql.h"
+#include "head.h"
 #include "http.h"
 #include "log.h"
 #include "page.h"
+#include "pool.h"
 #include "pub.h"
+#include "ready.h"
 #include "request.h"
 #include "res.h"
 #include "response.h"
@@ -53,6 +57,7 @@ static ID	on_close_id;
 static ID	on_drained_id;
 static ID	on_error_id;
 static ID	on_message_id;
+static ID	on_message_part_id;
 static ID	on_request_id;
 static ID	to_i_id;
 
@@ -132,6 +137,65 @@ configure(agooErr err, int port, const char *root, VALUE options) {
 		rb_raise(rb_eArgError, "max_push_pending must be between 0 and 1000.");
 	    }
 	}
+	if (Qnil != (v = rb_hash_lookup(options, ID2SYM(rb_intern("poller"))))) {
+	    const char	*mode;
+	    
+	    if (T_SYMBOL == rb_type(v)) {
+		v = rb_sym2str(v);
+	    }
+	    rb_check_type(v, T_STRING);
+	    mode = StringValuePtr(v);
+	    if (0 == strcmp("epoll", mode)) {
+		if (AGOO_ERR_OK != agoo_ready_set_mode(err, AGOO_READY_EPOLL)) {
+		    rb_raise(rb_eArgError, "%s", err->msg);
+		}
+	    } else if (0 == strcmp("poll", mode)) {
+		agoo_ready_set_mode(err, AGOO_READY_POLL);
+	    } else if (0 == strcmp("uring", mode)) {
+		// Not all kernels allow io_uring so fall back to the default.
+		if (AGOO_ERR_OK != agoo_ready_set_mode(err, AGOO_READY_URING)) {
+		    agoo_log_cat(&agoo_warn_cat, "%s Using the default poller instead.", err->msg);
+		    agoo_err_clear(err);
+		}
+	    } else {
+		rb_raise(rb_eArgError, "poller must be :epoll, :uring, or :poll.");
+	    }
+	}
+	if (Qnil != (v = rb_hash_lookup(options, ID2SYM(rb_intern("reuse_port"))))) {
+	    agoo_server.reuse_port = (Qtrue == v);
+	}
+	if (Qnil != (v = rb_hash_lookup(options, ID2SYM(rb_intern("incoming_cpu"))))) {
+	    agoo_server.incoming_cpu = (Qtrue == v);
+	}
+	if (Qnil != (v = rb_hash_lookup(options, ID2SYM(rb_intern("sendfile_min"))))) {
+	    rb_check_type(v, T_FIXNUM);
+	    agoo_pages_set_sendfile_min(NUM2LONG(v));
+	}
+	if (Qnil != (v = rb_hash_lookup(options, ID2SYM(rb_intern("page_cache_max"))))) {
+	    rb_check_type(v, T_FIXNUM);
+	    agoo_pages_set_max_bytes(NUM2LONG(v));
+	}
+	if (Qnil != (v = rb_hash_lookup(options, ID2SYM(rb_intern("max_header_size"))))) {
+	    long	mhs;
+
+	    rb_check_type(v, T_FIXNUM);
+	    if ((mhs = NUM2LONG(v)) < 1024 || 1048576 < mhs) {
+		rb_raise(rb_eArgError, "max_header_size must be between 1024 and 1048576.");
+	    }
+	    agoo_server.max_header = mhs;
+	}
+	if (Qnil != (v = rb_hash_lookup(options, ID2SYM(rb_intern("body_file_min"))))) {
+	    rb_check_type(v, T_FIXNUM);
+	    agoo_server.body_file_min = NUM2LONG(v);
+	}
+	if (Qnil != (v = rb_hash_lookup(options, ID2SYM(rb_intern("ws_max_message"))))) {
+	    rb_check_type(v, T_FIXNUM);
+	    agoo_server.ws_max_message = NUM2LONG(v);
+	}
+	if (Qnil != (v = rb_hash_lookup(options, ID2SYM(rb_intern("ws_stream_min"))))) {
+	    rb_check_type(v, T_FIXNUM);
+	    agoo_server.ws_stream_min = NUM2LONG(v);
+	}
 	if (Qnil != (v = rb_hash_lookup(options, ID2SYM(rb_intern("pedantic"))))) {
 	    agoo_server.pedantic = (Qtrue == v);
 	}
@@ -246,11 +310,29 @@ configure(agooErr err, int port, const char *root, VALUE options) {
  *
  *   - *:thread_count* [_Integer_] number of ruby worker threads. Defaults to one. If zero then the _start_ function will not return but instead will proess using the thread that called _start_. Usually the default is best unless the workers are making IO calls.
  *
- *   - *:worker_count* [_Integer_] number of workers to fork. Defaults to one which is not to fork.
+ *   - *:worker_count* [_Integer_] number of workers to fork. Defaults to one which is not to fork. Messages published in any worker are relayed to the subscribers of all of them.
  *
- *   - *:bind* [_String_|_Array_] a binding or array of binds. Examples are: "http ://127.0.0.1:6464", "unix:///tmp/agoo.socket", "http ://[::1]:6464, or to not restrict the address "http ://:6464".
+ *   - *:bind* [_String_|_Array_] a binding or array of binds. Examples are: "http ://127.0.0.1:6464", "unix:///tmp/agoo.socket", "http ://[::1]:6464, or to not restrict the address "http ://:6464". TLS is terminated on https and ssl binds such as "https ://:6465?cert=cert.pem&key=key.pem" where _key_ defaults to the _cert_ file and an optional _ca_ file is used to check client certificates. HTTP/2 is offered to TLS clients that ask for it.
  *
  *   - *:graphql* [_String_] path to GraphQL endpoint if support for GraphQL is desired.
+ *
+ *   - *:poller* [_Symbol_] one of :epoll, :uring, or :poll. Defaults to :epoll where available. If :uring is not supported by the kernel the default is used.
+ *
+ *   - *:reuse_port* [_true_|_false_] if true each connection thread accepts connections on its own SO_REUSEPORT socket instead of sharing a single listener thread. Only TCP binds are affected.
+ *
+ *   - *:incoming_cpu* [_true_|_false_] if true and _:reuse_port_ is set, connection threads are pinned to a CPU and the kernel is asked to hand each thread the connections that arrive on that CPU.
+ *
+ *   - *:sendfile_min* [_Integer_] static files of at least this many bytes are sent from disk with sendfile instead of being cached in memory. Defaults to 262144. Zero turns that off.
+ *
+ *   - *:page_cache_max* [_Integer_] the number of bytes the static page cache is kept under by evicting pages that have not been used recently. Defaults to 268435456. Zero is no limit.
+ *
+ *   - *:max_header_size* [_Integer_] the largest request line and headers accepted. Bigger ones get a 431 response. Defaults to 8192.
+ *
+ *   - *:body_file_min* [_Integer_] request bodies of at least this many bytes are written to a temp file as they arrive and _rack.input_ is that file. Defaults to 1048576. Zero keeps all bodies in memory.
+ *
+ *   - *:ws_max_message* [_Integer_] the largest WebSocket message accepted, whole or put back together from its frames. The connection is closed on a bigger one. Defaults to 16777216. Zero is no limit.
+ *
+ *   - *:ws_stream_min* [_Integer_] WebSocket messages of at least this many bytes are given to a handler that has an _on_message_part(client, data, last)_ method in parts as they arrive instead of to _on_message_. There is no limit on the size of those. The parts of a connection are handled one at a time and in order. Defaults to 1048576. Zero turns that off.
  */
 static VALUE
 rserver_init(int argc, VALUE *argv, VALUE self) {
@@ -304,7 +386,7 @@ rescue_error(VALUE x) {
 
 	req->res->close = true;
 	agoo_res_set_message(req->res, message);
-	agoo_queue_wakeup(&agoo_server.con_queue);
+	agoo_res_ready(req->res);
     } else {
 /*
 	volatile VALUE	bt = rb_funcall(info, rb_intern("backtrace"), 0);
@@ -332,7 +414,7 @@ handle_base_inner(void *x) {
     }
     DATA_PTR(rr) = NULL;
     agoo_res_set_message(req->res, response_text(rres));
-    agoo_queue_wakeup(&agoo_server.con_queue);
+    agoo_res_ready(req->res);
 
     return Qfalse;
 }
@@ -404,7 +486,7 @@ handle_rack_inner(void *x) {
     }
     res = rb_funcall((VALUE)req->hook->handler, call_id, 1, env);
     if (req->res->con->hijacked) {
-	agoo_queue_wakeup(&agoo_server.con_queue);
+	agoo_res_ready(req->res);
 	return Qfalse;
     }
     rb_check_type(res, T_ARRAY);
@@ -491,7 +573,7 @@ handle_rack_inner(void *x) {
 		t->len = sizeof(err500) - 1;
 		break;
 	    }
-	    req->hook = agoo_hook_create(AGOO_NONE, NULL, (void*)handler, PUSH_HOOK, &agoo_server.eval_queue);
+	    req->hook = agoo_hook_push((void*)handler);
 	    rupgraded_create(req->res->con, handler, request_env(req, Qnil));
 	    t->len = snprintf(t->text, 1024, "HTTP/1.1 101 %s\r\n", status_msg);
 	    t = agoo_ws_add_headers(req, t);
@@ -503,11 +585,11 @@ handle_rack_inner(void *x) {
 		t->len = sizeof(err500) - 1;
 		break;
 	    }
-	    req->hook = agoo_hook_create(AGOO_NONE, NULL, (void*)handler, PUSH_HOOK, &agoo_server.eval_queue);
+	    req->hook = agoo_hook_push((void*)handler);
 	    rupgraded_create(req->res->con, handler, request_env(req, Qnil));
 	    t = agoo_sse_upgrade(req, t);
 	    agoo_res_set_message(req->res, t);
-	    agoo_queue_wakeup(&agoo_server.con_queue);
+	    agoo_res_ready(req->res);
 	    return Qfalse;
 	default:
 	    break;
@@ -538,7 +620,7 @@ handle_rack_inner(void *x) {
 	}
     }
     agoo_res_set_message(req->res, t);
-    agoo_queue_wakeup(&agoo_server.con_queue);
+    agoo_res_ready(req->res);
 
     return Qfalse;
 }
@@ -564,7 +646,7 @@ handle_wab_inner(void *x) {
     }
     DATA_PTR(rr) = NULL;
     agoo_res_set_message(req->res, response_text(rres));
-    agoo_queue_wakeup(&agoo_server.con_queue);
+    agoo_res_ready(req->res);
 
     return Qfalse;
 }
@@ -582,16 +664,18 @@ handle_push_inner(void *x) {
 
     switch (req->method) {
     case AGOO_ON_MSG:
-	if (req->up->on_msg && NULL != req->hook) {
-	    rb_funcall((VALUE)req->hook->handler, on_message_id, 2, (VALUE)req->up->wrap, rb_str_new(req->msg, req->mlen));
-	}
-	break;
     case AGOO_ON_BIN:
-	if (req->up->on_msg && NULL != req->hook) {
+	if (NULL != req->hook) {
 	    volatile VALUE	rstr = rb_str_new(req->msg, req->mlen);
 
-	    rb_enc_associate(rstr, rb_ascii8bit_encoding());
-	    rb_funcall((VALUE)req->hook->handler, on_message_id, 2, (VALUE)req->up->wrap, rstr);
+	    if (AGOO_ON_BIN == req->method) {
+		rb_enc_associate(rstr, rb_ascii8bit_encoding());
+	    }
+	    if (req->part) {
+		rb_funcall((VALUE)req->hook->handler, on_message_part_id, 3, (VALUE)req->up->wrap, rstr, req->last ? Qtrue : Qfalse);
+	    } else {
+		rb_funcall((VALUE)req->hook->handler, on_message_id, 2, (VALUE)req->up->wrap, rstr);
+	    }
 	}
 	break;
     case AGOO_ON_CLOSE:
@@ -622,8 +706,10 @@ handle_push_inner(void *x) {
     default:
 	break;
     }
-    agoo_upgraded_release(req->up);
-    
+    // Parts are released by agoo_upgraded_part_done() in handle_req().
+    if (!req->part) {
+	agoo_upgraded_release(req->up);
+    }
     return Qfalse;
 }
 
@@ -669,7 +755,7 @@ handle_protected(agooReq req, bool gvi) {
 	break;
     case FUNC_HOOK:
 	req->hook->func(req);
-	agoo_queue_wakeup(&agoo_server.con_queue);
+	agoo_res_ready(req->res);
 	break;
     default: {
 	char	buf[256];
@@ -678,12 +764,25 @@ handle_protected(agooReq req, bool gvi) {
 
 	req->res->close = true;
 	agoo_res_set_message(req->res, message);
-	agoo_queue_wakeup(&agoo_server.con_queue);
+	agoo_res_ready(req->res);
 	break;
     }
     }
 }
 
+// Handles a request and then, if it was a part of a WebSocket message, the
+// parts of the same connection that arrived while it was being handled.
+static void
+handle_req(agooReq req, bool gvi) {
+    agooReq	next;
+
+    for (; NULL != req; req = next) {
+	handle_protected(req, gvi);
+	next = req->part ? agoo_upgraded_part_done(req->up) : NULL;
+	agoo_req_destroy(req);
+    }
+}
+
 static void*
 process_loop(void *ptr) {
     agooReq	req;
@@ -691,8 +790,7 @@ process_loop(void *ptr) {
     atomic_fetch_add(&agoo_server.running, 1);
     while (agoo_server.active) {
 	if (NULL != (req = (agooReq)agoo_queue_pop(&agoo_server.eval_queue, 0.1))) {
-	    handle_protected(req, true);
-	    agoo_req_destroy(req);
+	    handle_req(req, true);
 	}
     }
     atomic_fetch_sub(&agoo_server.running, 1);
@@ -717,6 +815,7 @@ rserver_start(VALUE self) {
     VALUE		*vp;
     int			i;
     int			pid;
+    int			worker;
     double		giveup;
     struct _agooErr	err = AGOO_ERR_INIT;
     VALUE		agoo = rb_const_get_at(rb_cObject, rb_intern("Agoo"));
@@ -735,6 +834,12 @@ rserver_start(VALUE self) {
     if (AGOO_ERR_OK != setup_listen(&err)) {
 	rb_raise(rb_eIOError, "%s", err.msg);
     }
+    // The worker bus sockets are created before forking so every worker
+    // can reach every other one.
+    if (1 < the_rserver.worker_cnt && AGOO_ERR_OK != agoo_bus_create(&err, the_rserver.worker_cnt)) {
+	rb_raise(rb_eIOError, "%s", err.msg);
+    }
+    worker = 0;
     for (i = 1; i < the_rserver.worker_cnt; i++) {
 	VALUE	rpid = rb_funcall(rb_cObject, rb_intern("fork"), 0);
 
@@ -747,6 +852,10 @@ rserver_start(VALUE self) {
 	    agoo_log_cat(&agoo_error_cat, "Failed to fork. %s.", strerror(errno));
 	    break;
 	} else if (0 == pid) {
+	    // Give each worker its own range of loop ids so CPUs are spread
+	    // across workers.
+	    agoo_server.loop_base = i * agoo_server.loop_max;
+	    worker = i;
 	    if (AGOO_ERR_OK != agoo_log_start(&err, true)) {
 		rb_raise(rb_eStandardError, "%s", err.msg);
 	    }
@@ -755,7 +864,9 @@ rserver_start(VALUE self) {
 	    the_rserver.worker_pids[i] = pid;
 	}
     }
-    if (AGOO_ERR_OK != agoo_server_start(&err, "Agoo", StringValuePtr(v))) {
+    agoo_bus_open(worker);
+    if (AGOO_ERR_OK != agoo_server_start(&err, "Agoo", StringValuePtr(v)) ||
+	AGOO_ERR_OK != agoo_bus_start(&err)) {
 	rb_raise(rb_eStandardError, "%s", err.msg);
     }
     if (0 >= agoo_server.thread_cnt) {
@@ -763,8 +874,7 @@ rserver_start(VALUE self) {
 
 	while (agoo_server.active) {
 	    if (NULL != (req = (agooReq)agoo_queue_pop(&agoo_server.eval_queue, 0.01))) { // TBD 0.1
-		handle_protected(req, false);
-		agoo_req_destroy(req);
+		handle_req(req, false);
 	    } else {
 		rb_thread_schedule();
 	    }
@@ -988,6 +1098,49 @@ add_mime(VALUE self, VALUE suffix, VALUE type) {
     return Qnil;
 }
 
+/* Document-method: page_cache_stats
+ *
+ * call-seq: page_cache_stats()
+ *
+ * Returns a Hash of static page cache statistics with the keys :hits,
+ * :misses, :evictions, :bytes, and :count.
+ */
+static VALUE
+page_cache_stats(VALUE self) {
+    struct _agooPageStats	stats;
+    volatile VALUE		h = rb_hash_new();
+
+    agoo_pages_stats(&stats);
+    rb_hash_aset(h, ID2SYM(rb_intern("hits")), ULL2NUM(stats.hits));
+    rb_hash_aset(h, ID2SYM(rb_intern("misses")), ULL2NUM(stats.misses));
+    rb_hash_aset(h, ID2SYM(rb_intern("evictions")), ULL2NUM(stats.evictions));
+    rb_hash_aset(h, ID2SYM(rb_intern("bytes")), LONG2NUM(stats.bytes));
+    rb_hash_aset(h, ID2SYM(rb_intern("count")), LONG2NUM(stats.count));
+
+    return h;
+}
+
+/* Document-method: pool_stats
+ *
+ * call-seq: pool_stats()
+ *
+ * Returns a Hash of the connection, request, and response pool statistics
+ * with the keys :gets, :mallocs, and :bytes. Once the pools have grown to
+ * fit the load :mallocs stays the same as requests are handled.
+ */
+static VALUE
+pool_stats(VALUE self) {
+    struct _agooPoolStats	stats;
+    volatile VALUE		h = rb_hash_new();
+
+    agoo_pool_stats(&stats);
+    rb_hash_aset(h, ID2SYM(rb_intern("gets")), ULL2NUM(stats.gets));
+    rb_hash_aset(h, ID2SYM(rb_intern("mallocs")), ULL2NUM(stats.mallocs));
+    rb_hash_aset(h, ID2SYM(rb_intern("bytes")), ULL2NUM(stats.bytes));
+
+    return h;
+}
+
 /* Document-method: path_group
  *
  * call-seq: path_group(path, dirs)
@@ -1036,6 +1189,8 @@ server_init(VALUE mod) {
     rb_define_module_function(server_mod, "handle_not_found", handle_not_found, 1);
     rb_define_module_function(server_mod, "add_mime", add_mime, 2);
     rb_define_module_function(server_mod, "path_group", path_group, 2);
+    rb_define_module_function(server_mod, "page_cache_stats", page_cache_stats, 0);
+    rb_define_module_function(server_mod, "pool_stats", pool_stats, 0);
 
     call_id = rb_intern("call");
     each_id = rb_intern("each");
@@ -1043,6 +1198,7 @@ server_init(VALUE mod) {
     on_drained_id = rb_intern("on_drained");
     on_error_id = rb_intern("on_error");
     on_message_id = rb_intern("on_message");
+    on_message_part_id = rb_intern("on_message_part");
     on_request_id = rb_intern("on_request");
     to_i_id = rb_intern("to_i");
     
@@ -1060,4 +1216,5 @@ server_init(VALUE mod) {
     rb_gc_register_address(&rserver);
 
     agoo_http_init();
+    agoo_head_init();
 }
@@ -97,8 +97,9 @@ rup_write(VALUE self, VALUE msg) {
  *
  * Subscribes to messages published on the specified subject. The subject is a
  * dot delimited string that can include a '*' character as a wild card that
- * matches any set of characters. The '>' character matches all remaining
- * characters. Examples: people.fred.log, people.*.log, people.fred.>
+ * matches any set of characters up to the next dot. The '>' character matches
+ * all remaining characters. Examples: people.fred.log, people.*.log,
+ * people.fred.>
  *
  * Symbols can also be used as can any other object that responds to #to_s.
  */
@@ -243,6 +244,7 @@ rupgraded_create(agooCon c, VALUE obj, VALUE env) {
 	up->on_close = rb_respond_to(obj, rb_intern("on_close"));
 	up->on_shut = rb_respond_to(obj, rb_intern("on_shutdown"));
 	up->on_msg = rb_respond_to(obj, rb_intern("on_message"));
+	up->on_part = rb_respond_to(obj, rb_intern("on_message_part"));
 	up->on_error = rb_respond_to(obj, rb_intern("on_error"));
 	up->on_destroy = on_destroy;
 
@@ -9,12 +9,14 @@
 #include <sys/types.h>
 #include <unistd.h>
 
+#include "bus.h"
 #include "con.h"
 #include "dtime.h"
 #include "http.h"
 #include "hook.h"
 #include "log.h"
 #include "page.h"
+#include "pool.h"
 #include "pub.h"
 #include "upgraded.h"
 
@@ -32,6 +34,10 @@ agoo_server_setup() {
     pthread_mutex_init(&agoo_server.up_lock, 0);
     agoo_server.up_list = NULL;
     agoo_server.max_push_pending = 32;
+    agoo_server.max_header = MAX_HEADER_SIZE;
+    agoo_server.body_file_min = BODY_FILE_MIN;
+    agoo_server.ws_max_message = WS_MAX_MESSAGE;
+    agoo_server.ws_stream_min = WS_STREAM_MIN;
     agoo_pages_init();
     agoo_queue_multi_init(&agoo_server.con_queue, 1024, false, true);
     agoo_queue_multi_init(&agoo_server.eval_queue, 1024, true, true);
@@ -48,7 +54,7 @@ agoo_server_setup() {
 static void
 add_con_loop() {
     struct _agooErr	err = AGOO_ERR_INIT;
-    agooConLoop		loop = agoo_conloop_create(&err, 0);
+    agooConLoop		loop = agoo_conloop_create(&err, agoo_server.loop_base + agoo_server.loop_cnt);
 
     if (NULL != loop) {
 	loop->next = agoo_server.con_loops;
@@ -57,27 +63,62 @@ add_con_loop() {
     }
 }
 
+// Sets up a newly accepted socket and creates a connection for it. The socket
+// is closed if the connection can not be created.
+agooCon
+agoo_server_accepted(agooBind b, int client_sock) {
+    struct _agooErr	err = AGOO_ERR_INIT;
+    int			optval = 1;
+    uint64_t		id = (uint64_t)atomic_fetch_add(&agoo_server.con_id, 1) + 1;
+    agooCon		con;
+
+    if (NULL == (con = agoo_con_create(&err, client_sock, id, b))) {
+	agoo_log_cat(&agoo_error_cat, "Server with pid %d accept connection failed. %s.", getpid(), err.msg);
+	close(client_sock);
+
+	return NULL;
+    }
+#ifdef OSX_OS
+    setsockopt(client_sock, SOL_SOCKET, SO_NOSIGPIPE, &optval, sizeof(optval));
+#endif
+#ifdef PLATFORM_LINUX
+    setsockopt(client_sock, IPPROTO_TCP, TCP_QUICKACK, &optval, sizeof(optval));
+#endif
+    fcntl(client_sock, F_SETFL, O_NONBLOCK);
+    //fcntl(client_sock, F_SETFL, FNDELAY);
+    setsockopt(client_sock, SOL_SOCKET, SO_KEEPALIVE, &optval, sizeof(optval));
+    setsockopt(client_sock, IPPROTO_TCP, TCP_NODELAY, &optval, sizeof(optval));
+    agoo_log_cat(&agoo_con_cat, "Server with pid %d accepted connection %llu on %s [%d]",
+		 getpid(), (unsigned long long)id, b->id, con->sock);
+    atomic_fetch_add(&agoo_server.con_cnt, 1);
+
+    return con;
+}
+
 static void*
 listen_loop(void *x) {
-    int			optval = 1;
     struct pollfd	pa[100];
     struct pollfd	*p;
-    struct _agooErr	err = AGOO_ERR_INIT;
     struct sockaddr_in	client_addr;
     int			client_sock;
     int			pcnt = 0;
     socklen_t		alen = 0;
     agooCon		con;
     int			i;
-    uint64_t		cnt = 0;
     agooBind		b;
 
-    for (b = agoo_server.binds, p = pa; NULL != b; b = b->next, p++, pcnt++) {
+    for (b = agoo_server.binds, p = pa; NULL != b; b = b->next) {
+	if (b->per_loop) {
+	    continue;
+	}
 	p->fd = b->fd;
 	p->events = POLLIN;
 	p->revents = 0;
+	p++;
+	pcnt++;
     }
     memset(&client_addr, 0, sizeof(client_addr));
+    agoo_pools = agoo_server.listen_pools;
     atomic_fetch_add(&agoo_server.running, 1);
     while (agoo_server.active) {
 	if (0 > (i = poll(pa, pcnt, 200))) {
@@ -91,31 +132,16 @@ listen_loop(void *x) {
 	if (0 == i) { // nothing to read
 	    continue;
 	}
-	for (b = agoo_server.binds, p = pa; NULL != b; b = b->next, p++) {
+	for (b = agoo_server.binds, p = pa; NULL != b; b = b->next) {
+	    if (b->per_loop) {
+		continue;
+	    }
 	    if (0 != (p->revents & POLLIN)) {
 		if (0 > (client_sock = accept(p->fd, (struct sockaddr*)&client_addr, &alen))) {
 		    agoo_log_cat(&agoo_error_cat, "Server with pid %d accept connection failed. %s.", getpid(), strerror(errno));
-		} else if (NULL == (con = agoo_con_create(&err, client_sock, ++cnt, b))) {
-		    agoo_log_cat(&agoo_error_cat, "Server with pid %d accept connection failed. %s.", getpid(), err.msg);
-		    close(client_sock);
-		    cnt--;
-		    agoo_err_clear(&err);
-		} else {
-		    int	con_cnt;
-#ifdef OSX_OS
-		    setsockopt(client_sock, SOL_SOCKET, SO_NOSIGPIPE, &optval, sizeof(optval));
-#endif
-#ifdef PLATFORM_LINUX
-		    setsockopt(client_sock, IPPROTO_TCP, TCP_QUICKACK, &optval, sizeof(optval));
-#endif
-		    fcntl(client_sock, F_SETFL, O_NONBLOCK);
-		    //fcntl(client_sock, F_SETFL, FNDELAY);
-		    setsockopt(client_sock, SOL_SOCKET, SO_KEEPALIVE, &optval, sizeof(optval));
-		    setsockopt(client_sock, IPPROTO_TCP, TCP_NODELAY, &optval, sizeof(optval));
-		    agoo_log_cat(&agoo_con_cat, "Server with pid %d accepted connection %llu on %s [%d]",
-				 getpid(), (unsigned long long)cnt, b->id, con->sock);
-
-		    con_cnt = atomic_fetch_add(&agoo_server.con_cnt, 1);
+		} else if (NULL != (con = agoo_server_accepted(b, client_sock))) {
+		    int	con_cnt = (int)atomic_load(&agoo_server.con_cnt);
+
 		    if (agoo_server.loop_max > agoo_server.loop_cnt && agoo_server.loop_cnt * LOOP_UP < con_cnt) {
 			add_con_loop();
 		    }
@@ -131,6 +157,7 @@ listen_loop(void *x) {
 		agoo_server.active = false;
 	    }
 	    p->revents = 0;
+	    p++;
 	}
     }
     for (b = agoo_server.binds; NULL != b; b = b->next) {
@@ -146,19 +173,39 @@ agoo_server_start(agooErr err, const char *app_name, const char *version) {
     double	giveup;
     int		xcnt = 0;
     int		stat;
-    
-    if (0 != (stat = pthread_create(&agoo_server.listen_thread, NULL, listen_loop, NULL))) {
-	return agoo_err_set(err, stat, "Failed to create server listener thread. %s", strerror(stat));
+    agooBind	b;
+
+    if (NULL == (agoo_server.hook_trie = agoo_hook_compile(err, agoo_server.hooks))) {
+	return err->code;
+    }
+    agoo_pages_watch();
+    // The listener thread is only needed for binds the con loops do not
+    // accept on themselves.
+    for (b = agoo_server.binds; NULL != b; b = b->next) {
+	if (!b->per_loop) {
+	    break;
+	}
+    }
+    if (NULL != b) {
+	if (NULL == agoo_server.listen_pools && NULL == (agoo_server.listen_pools = agoo_pools_create(err))) {
+	    return err->code;
+	}
+	if (0 != (stat = pthread_create(&agoo_server.listen_thread, NULL, listen_loop, NULL))) {
+	    return agoo_err_set(err, stat, "Failed to create server listener thread. %s", strerror(stat));
+	}
+	xcnt++;
+    }
+    if (NULL == (agoo_server.con_loops = agoo_conloop_create(err, agoo_server.loop_base))) {
+	return err->code;
     }
-    xcnt++;
-    agoo_server.con_loops = agoo_conloop_create(err, 0);
     agoo_server.loop_cnt = 1;
     xcnt++;
 
     // If the eval thread count is 1 that implies the eval load is low so
     // might as well create the maximum number of con threads as is
-    // reasonable.
-    if (1 >= agoo_server.thread_cnt) {
+    // reasonable. Con loops that accept their own connections are never
+    // added by the listener so they are all created up front.
+    if (1 >= agoo_server.thread_cnt || agoo_server.reuse_port) {
 	while (agoo_server.loop_cnt < agoo_server.loop_max) {
 	    add_con_loop();
 	    xcnt++;
@@ -186,6 +233,7 @@ setup_listen(agooErr err) {
     agooBind	b;
 
     for (b = agoo_server.binds; NULL != b; b = b->next) {
+	b->per_loop = agoo_server.reuse_port && NULL == b->name;
 	if (AGOO_ERR_OK != agoo_bind_listen(err, b)) {
 	    return err->code;
 	}
@@ -206,7 +254,9 @@ agoo_server_shutdown(const char *app_name, void (*stop)()) {
 	    double	giveup = dtime() + 1.0;
 	    
 	    agoo_server.active = false;
-	    pthread_detach(agoo_server.listen_thread);
+	    if (0 != agoo_server.listen_thread) {
+		pthread_detach(agoo_server.listen_thread);
+	    }
 	    for (loop = agoo_server.con_loops; NULL != loop; loop = loop->next) {
 		pthread_detach(loop->thread);
 	    }
@@ -216,9 +266,12 @@ agoo_server_shutdown(const char *app_name, void (*stop)()) {
 		    break;
 		}
 	    }
+	    agoo_bus_shutdown();
 	    if (NULL != stop) {
 		stop();
 	    }
+	    agoo_hook_trie_destroy(agoo_server.hook_trie);
+	    agoo_server.hook_trie = NULL;
 	    while (NULL != agoo_server.hooks) {
 		agooHook	h = agoo_server.hooks;
 
@@ -230,6 +283,7 @@ agoo_server_shutdown(const char *app_name, void (*stop)()) {
 	    agooBind	b = agoo_server.binds;
 
 	    agoo_server.binds = b->next;
+	    agoo_bind_close(b);
 	    agoo_bind_destroy(b);
 	}
 	agoo_queue_cleanup(&agoo_server.con_queue);
@@ -237,6 +291,9 @@ agoo_server_shutdown(const char *app_name, void (*stop)()) {
 	    agoo_server.con_loops = loop->next;
 	    agoo_conloop_destroy(loop);
 	}
+	// After the loops since they give back the connections.
+	agoo_pools_destroy(agoo_server.listen_pools);
+	agoo_server.listen_pools = NULL;
 	agoo_queue_cleanup(&agoo_server.eval_queue);
 
 	agoo_pages_cleanup();
@@ -251,9 +308,13 @@ agoo_server_bind(agooBind b) {
 
     if (NULL == b->read) {
 	b->read = agoo_con_http_read;
+	b->received = agoo_con_http_received;
     }
     if (NULL == b->write) {
 	b->write = agoo_con_http_write;
+	b->prep = agoo_con_http_prep;
+	b->gather = agoo_con_http_gather;
+	b->sent = agoo_con_http_sent;
     }
     if (NULL == b->events) {
 	b->events = agoo_con_http_events;
@@ -315,8 +376,18 @@ agoo_server_add_func_hook(agooErr	err,
     return AGOO_ERR_OK;
 }
 
+// Messages are also relayed to the other workers when forked.
 void
 agoo_server_publish(struct _agooPub *pub) {
+    if (NULL != pub && AGOO_PUB_MSG == pub->kind) {
+	agoo_bus_relay(pub);
+    }
+    agoo_server_deliver(pub);
+}
+
+// Hands the pub to each con loop of this process.
+void
+agoo_server_deliver(struct _agooPub *pub) {
     agooConLoop	loop;
 
     for (loop = agoo_server.con_loops; NULL != loop; loop = loop->next) {
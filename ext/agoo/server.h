@@ -25,8 +25,10 @@ typedef struct _agooServer {
     bool			pedantic;
     bool			root_first;
     pthread_t			listen_thread;
+    struct _agooPools		*listen_pools; // connections accepted by the listener
     struct _agooQueue		con_queue;
     agooHook			hooks;
+    agooHookTrie		hook_trie; // compiled from hooks on start
     agooHook			hook404;
     agooBind			binds;
 
@@ -35,11 +37,19 @@ typedef struct _agooServer {
     struct _agooConLoop		*con_loops;
     int				loop_max;
     int				loop_cnt;
+    int				loop_base; // id of the first con loop in this process
+    bool			reuse_port; // each con loop accepts its own connections
+    bool			incoming_cpu; // pin con loops and keep connections on them
     atomic_int			con_cnt;
+    atomic_int			con_id;
     
     struct _agooUpgraded	*up_list;
     pthread_mutex_t		up_lock;
     int				max_push_pending;
+    long			max_header; // largest request head
+    long			body_file_min; // request bodies this size or larger go to a temp file
+    long			ws_max_message; // largest WebSocket message put back together, 0 for no limit
+    long			ws_stream_min; // WebSocket messages this size or larger can be given in parts
     void			*env_nil_value;
     void			*ctx_nil_value;
     
@@ -54,6 +64,7 @@ extern void	agoo_server_shutdown(const char *app_name, void (*stop)());
 extern void	agoo_server_bind(agooBind b);
 
 extern int	setup_listen(agooErr err);
+extern struct _agooCon	*agoo_server_accepted(agooBind b, int sock);
 extern int	agoo_server_start(agooErr err, const char *app_name, const char *version);
 
 extern void	agoo_server_add_upgraded(struct _agooUpgraded *up);
@@ -65,5 +76,6 @@ extern int	agoo_server_add_func_hook(agooErr	err,
 					  bool		quick);
 
 extern void	agoo_server_publish(struct _agooPub *pub);
+extern void	agoo_server_deliver(struct _agooPub *pub);
 
 #endif // AGOO_SERVER_H
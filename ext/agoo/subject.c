@@ -7,12 +7,19 @@
 #include "debug.h"
 #include "subject.h"
 
+#define MIN_KIDS	4
+
 agooSubject
 agoo_subject_create(const char *pattern, int plen) {
     agooSubject	subject = (agooSubject)AGOO_MALLOC(sizeof(struct _agooSubject) - 7 + plen);
 
     if (NULL != subject) {
 	subject->next = NULL;
+	subject->head = NULL;
+	subject->tnext = NULL;
+	subject->tprev = NULL;
+	subject->node = NULL;
+	subject->owner = NULL;
 	memcpy(subject->pattern, pattern, plen);
 	subject->pattern[plen] = '\0';
     }
@@ -21,6 +28,7 @@ agoo_subject_create(const char *pattern, int plen) {
 
 void
 agoo_subject_destroy(agooSubject subject) {
+    agoo_subtrie_remove(subject);
     AGOO_FREE(subject);
 }
 
@@ -28,15 +36,15 @@ bool
 agoo_subject_check(agooSubject subj, const char *subject) {
     const char	*pat = subj->pattern;
 
-    for (; '\0' != *pat && '\0' != *subject; subject++) {
+    while ('\0' != *pat && '\0' != *subject) {
 	if (*subject == *pat) {
 	    pat++;
+	    subject++;
 	} else if ('*' == *pat) {
+	    // The rest of the token is skipped and the '.' after it, if any, is
+	    // matched next.
 	    for (; '\0' != *subject && '.' != *subject; subject++) {
 	    }
-	    if ('\0' == *subject) {
-		return true;
-	    }
 	    pat++;
 	} else if ('>' == *pat) {
 	    return true;
@@ -47,3 +55,306 @@ agoo_subject_check(agooSubject subj, const char *subject) {
     return '\0' == *pat && '\0' == *subject;
 }
 
+// FNV-1a over the token up to the next '.' or the end. The end of the token
+// is returned in endp.
+static uint64_t
+token_hash(const char *token, const char **endp) {
+    uint64_t	h = 14695981039346656037ULL;
+
+    for (; '\0' != *token && '.' != *token; token++) {
+	h ^= (uint8_t)*token;
+	h *= 1099511628211ULL;
+    }
+    *endp = token;
+
+    return h;
+}
+
+static agooSubNode
+node_create(agooSubNode parent, const char *token, int len, uint64_t h) {
+    agooSubNode	node = (agooSubNode)AGOO_MALLOC(sizeof(struct _agooSubNode) + len);
+
+    if (NULL != node) {
+	memset(node, 0, sizeof(struct _agooSubNode));
+	node->parent = parent;
+	node->hash = h;
+	node->len = len;
+	memcpy(node->token, token, len);
+	node->token[len] = '\0';
+    }
+    return node;
+}
+
+static agooSubNode
+kid_get(agooSubNode node, const char *token, int len, uint64_t h) {
+    agooSubNode	kid;
+
+    if (NULL == node->kids) {
+	return NULL;
+    }
+    for (kid = node->kids[h & (node->ksize - 1)]; NULL != kid; kid = kid->next) {
+	if (h == kid->hash && len == kid->len && 0 == memcmp(token, kid->token, len)) {
+	    break;
+	}
+    }
+    return kid;
+}
+
+// The buckets double when there are more kids than buckets so a lookup stays
+// short no matter how many distinct tokens there are.
+static bool
+kid_add(agooSubNode node, agooSubNode kid) {
+    agooSubNode	*bp;
+
+    if (node->ksize <= node->kcnt) {
+	uint32_t	size = (0 == node->ksize) ? MIN_KIDS : node->ksize * 2;
+	agooSubNode	*kids = (agooSubNode*)AGOO_MALLOC(sizeof(agooSubNode) * size);
+	agooSubNode	k;
+	uint32_t	i;
+
+	if (NULL == kids) {
+	    return false;
+	}
+	memset(kids, 0, sizeof(agooSubNode) * size);
+	for (i = 0; i < node->ksize; i++) {
+	    while (NULL != (k = node->kids[i])) {
+		node->kids[i] = k->next;
+		bp = kids + (k->hash & (size - 1));
+		k->next = *bp;
+		*bp = k;
+	    }
+	}
+	AGOO_FREE(node->kids);
+	node->kids = kids;
+	node->ksize = size;
+    }
+    bp = node->kids + (kid->hash & (node->ksize - 1));
+    kid->next = *bp;
+    *bp = kid;
+    node->kcnt++;
+
+    return true;
+}
+
+static void
+kid_del(agooSubNode node, agooSubNode kid) {
+    agooSubNode	*bp;
+
+    if (node->star == kid) {
+	node->star = NULL;
+	return;
+    }
+    for (bp = node->kids + (kid->hash & (node->ksize - 1)); NULL != *bp; bp = &(*bp)->next) {
+	if (kid == *bp) {
+	    *bp = kid->next;
+	    node->kcnt--;
+	    break;
+	}
+    }
+}
+
+static void
+node_free(agooSubNode node) {
+    agooSubject	s;
+    uint32_t	i;
+
+    for (s = node->subs; NULL != s; s = s->tnext) {
+	s->head = NULL;
+	s->node = NULL;
+    }
+    for (s = node->rest; NULL != s; s = s->tnext) {
+	s->head = NULL;
+	s->node = NULL;
+    }
+    for (i = 0; i < node->ksize; i++) {
+	agooSubNode	kid;
+
+	while (NULL != (kid = node->kids[i])) {
+	    node->kids[i] = kid->next;
+	    node_free(kid);
+	}
+    }
+    AGOO_FREE(node->kids);
+    if (NULL != node->star) {
+	node_free(node->star);
+    }
+    if (NULL != node->parent) {
+	AGOO_FREE(node);
+    }
+}
+
+agooSubTrie
+agoo_subtrie_create() {
+    agooSubTrie	trie = (agooSubTrie)AGOO_MALLOC(sizeof(struct _agooSubTrie));
+
+    if (NULL != trie) {
+	memset(trie, 0, sizeof(struct _agooSubTrie));
+    }
+    return trie;
+}
+
+// Subscriptions still in the trie are left in place but no longer linked to
+// it.
+void
+agoo_subtrie_destroy(agooSubTrie trie) {
+    agooSubject	s;
+
+    if (NULL == trie) {
+	return;
+    }
+    for (s = trie->odd; NULL != s; s = s->tnext) {
+	s->head = NULL;
+    }
+    node_free(&trie->root);
+    AGOO_FREE(trie);
+}
+
+// A pattern is odd if a wildcard is only part of a token. Those are matched
+// one at a time with agoo_subject_check().
+static bool
+odd_pattern(const char *pat) {
+    const char	*start = pat;
+
+    for (; '\0' != *pat; pat++) {
+	if ('*' == *pat || '>' == *pat) {
+	    if (start != pat || ('\0' != pat[1] && '.' != pat[1])) {
+		return true;
+	    }
+	} else if ('.' == *pat) {
+	    start = pat + 1;
+	}
+    }
+    return false;
+}
+
+bool
+agoo_subtrie_add(agooSubTrie trie, agooSubject subject, void *owner) {
+    agooSubNode	node = &trie->root;
+    agooSubject	*head;
+    const char	*tok = subject->pattern;
+    const char	*end;
+
+    if (odd_pattern(tok)) {
+	head = &trie->odd;
+	node = NULL;
+    } else {
+	while (true) {
+	    agooSubNode	kid;
+	    uint64_t	h = token_hash(tok, &end);
+	    int		len = (int)(end - tok);
+
+	    if (1 == len && '>' == *tok) {
+		break;
+	    }
+	    if (1 == len && '*' == *tok) {
+		if (NULL == (kid = node->star)) {
+		    if (NULL == (kid = node_create(node, tok, len, h))) {
+			return false;
+		    }
+		    node->star = kid;
+		}
+	    } else if (NULL == (kid = kid_get(node, tok, len, h))) {
+		if (NULL == (kid = node_create(node, tok, len, h))) {
+		    return false;
+		}
+		if (!kid_add(node, kid)) {
+		    AGOO_FREE(kid);
+		    return false;
+		}
+	    }
+	    node = kid;
+	    if ('\0' == *end) {
+		break;
+	    }
+	    tok = end + 1;
+	}
+	head = ('>' == *tok && 1 == end - tok) ? &node->rest : &node->subs;
+    }
+    subject->owner = owner;
+    subject->node = node;
+    subject->head = head;
+    subject->tprev = NULL;
+    subject->tnext = *head;
+    if (NULL != *head) {
+	(*head)->tprev = subject;
+    }
+    *head = subject;
+
+    return true;
+}
+
+// Removes the subscription and any nodes left with nothing under them.
+void
+agoo_subtrie_remove(agooSubject subject) {
+    agooSubNode	node = subject->node;
+
+    if (NULL == subject->head) {
+	return;
+    }
+    if (NULL == subject->tprev) {
+	*subject->head = subject->tnext;
+    } else {
+	subject->tprev->tnext = subject->tnext;
+    }
+    if (NULL != subject->tnext) {
+	subject->tnext->tprev = subject->tprev;
+    }
+    subject->head = NULL;
+    subject->node = NULL;
+    subject->tnext = NULL;
+    subject->tprev = NULL;
+
+    while (NULL != node && NULL != node->parent &&
+	   NULL == node->subs && NULL == node->rest && 0 == node->kcnt && NULL == node->star) {
+	agooSubNode	parent = node->parent;
+
+	kid_del(parent, node);
+	AGOO_FREE(node->kids);
+	AGOO_FREE(node);
+	node = parent;
+    }
+}
+
+static void
+match_node(agooSubNode node, const char *subject, void (*cb)(agooSubject s, void *arg), void *arg) {
+    agooSubNode	kids[2];
+    agooSubject	s;
+    const char	*end;
+    uint64_t	h = token_hash(subject, &end);
+    int		i;
+
+    if ('\0' != *subject) {
+	for (s = node->rest; NULL != s; s = s->tnext) {
+	    cb(s, arg);
+	}
+    }
+    kids[0] = kid_get(node, subject, (int)(end - subject), h);
+    // A '*' does not match an empty last token.
+    kids[1] = (subject != end || '\0' != *end) ? node->star : NULL;
+    for (i = 0; i < 2; i++) {
+	if (NULL == kids[i]) {
+	    continue;
+	}
+	if ('\0' == *end) {
+	    for (s = kids[i]->subs; NULL != s; s = s->tnext) {
+		cb(s, arg);
+	    }
+	} else {
+	    match_node(kids[i], end + 1, cb, arg);
+	}
+    }
+}
+
+// Calls cb for each subscription that matches the subject. An owner with
+// more than one matching pattern is called back for each of them.
+void
+agoo_subtrie_match(agooSubTrie trie, const char *subject, void (*cb)(agooSubject s, void *arg), void *arg) {
+    agooSubject	s;
+
+    match_node(&trie->root, subject, cb, arg);
+    for (s = trie->odd; NULL != s; s = s->tnext) {
+	if (agoo_subject_check(s, subject)) {
+	    cb(s, arg);
+	}
+    }
+}
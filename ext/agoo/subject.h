@@ -4,14 +4,51 @@
 #define AGOO_SUBJECT_H
 
 #include <stdbool.h>
+#include <stdint.h>
+
+struct _agooSubNode;
 
 typedef struct _agooSubject {
     struct _agooSubject	*next;
+    // Only set while the subject is a subscription in a trie.
+    struct _agooSubject	**head; // trie list the subject is on
+    struct _agooSubject	*tnext;
+    struct _agooSubject	*tprev;
+    struct _agooSubNode	*node;
+    void		*owner;
     char		pattern[8];
 } *agooSubject;
 
+// A node for each token of the subscribed patterns. Tokens are separated by
+// a '.'. A '*' token matches any one token and a '>' token matches all the
+// tokens that are left.
+typedef struct _agooSubNode {
+    struct _agooSubNode	*parent;
+    struct _agooSubNode	*next;  // next in the same parent bucket
+    struct _agooSubNode	**kids; // literal tokens hashed into buckets
+    struct _agooSubNode	*star;
+    agooSubject		subs;   // patterns that end at this node
+    agooSubject		rest;   // patterns that end with a '>' after this node
+    uint64_t		hash;
+    uint32_t		kcnt;
+    uint32_t		ksize;  // always a power of 2
+    int			len;
+    char		token[1];
+} *agooSubNode;
+
+typedef struct _agooSubTrie {
+    struct _agooSubNode	root;
+    agooSubject		odd; // patterns with a wildcard inside a token
+} *agooSubTrie;
+
 extern agooSubject	agoo_subject_create(const char *pattern, int plen);
 extern void		agoo_subject_destroy(agooSubject subject);
 extern bool		agoo_subject_check(agooSubject subj, const char *subject);
 
+extern agooSubTrie	agoo_subtrie_create(void);
+extern void		agoo_subtrie_destroy(agooSubTrie trie);
+extern bool		agoo_subtrie_add(agooSubTrie trie, agooSubject subject, void *owner);
+extern void		agoo_subtrie_remove(agooSubject subject);
+extern void		agoo_subtrie_match(agooSubTrie trie, const char *subject, void (*cb)(agooSubject s, void *arg), void *arg);
+
 #endif // AGOO_SUBJECT_H
@@ -4,6 +4,7 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 #include "debug.h"
 #include "text.h"
@@ -49,6 +50,9 @@ agoo_text_create(const char *str, int len) {
     if (NULL != t) {
 	t->len = len;
 	t->alen = len;
+	t->fd = 0;
+	t->flen = 0;
+	t->foff = 0;
 	t->bin = false;
 	atomic_init(&t->ref_cnt, 0);
 	memcpy(t->text, str, len);
@@ -64,6 +68,9 @@ agoo_text_dup(agooText t0) {
     if (NULL != t) {
 	t->len = t0->len;
 	t->alen = t0->alen;
+	t->fd = 0;
+	t->flen = 0;
+	t->foff = 0;
 	t->bin = false;
 	atomic_init(&t->ref_cnt, 0);
 	memcpy(t->text, t0->text, t0->len + 1);
@@ -78,6 +85,9 @@ agoo_text_allocate(int len) {
     if (NULL != t) {
 	t->len = 0;
 	t->alen = len;
+	t->fd = 0;
+	t->flen = 0;
+	t->foff = 0;
 	t->bin = false;
 	atomic_init(&t->ref_cnt, 0);
 	*t->text = '\0';
@@ -93,6 +103,9 @@ agoo_text_ref(agooText t) {
 void
 agoo_text_release(agooText t) {
     if (1 >= atomic_fetch_sub(&t->ref_cnt, 1)) {
+	if (0 < t->fd) {
+	    close(t->fd);
+	}
 	AGOO_FREE(t);
     }
 }
@@ -13,6 +13,9 @@ typedef struct _agooText {
     long	len;  // length of valid text
     long	alen; // size of allocated text
     atomic_int	ref_cnt;
+    int		fd;   // if not zero the text is followed by flen bytes of the file
+    long	flen;
+    long	foff; // file offset of the first byte to send
     bool	bin;
     char	text[AGOO_TEXT_MIN_SIZE];
 } *agooText;
@@ -0,0 +1,329 @@
+// Copyright (c) 2019, Peter Ohler, All rights reserved.
+
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#if HAVE_OPENSSL_SSL_H
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+#endif
+
+#include "bind.h"
+#include "log.h"
+#include "tls.h"
+
+#if HAVE_OPENSSL_SSL_H
+
+#define SESSION_CACHE_SIZE	20480
+
+static const unsigned char	alpn_protos[] = "\x02h2\x08http/1.1";
+static const unsigned char	session_ctx[] = "agoo";
+
+// Sets err from the oldest error on the OpenSSL error queue and clears the
+// queue.
+static int
+ssl_err(agooErr err, const char *what, const char *path) {
+    char	buf[200];
+
+    ERR_error_string_n(ERR_get_error(), buf, sizeof(buf));
+    ERR_clear_error();
+    if (NULL == path) {
+	return agoo_err_set(err, AGOO_ERR_ARG, "%s. %s", what, buf);
+    }
+    return agoo_err_set(err, AGOO_ERR_ARG, "%s %s. %s", what, path, buf);
+}
+
+// Picks h2 if the client offers it and HTTP/1.1 otherwise. A client that
+// offers neither gets no ALPN answer rather than a failed handshake.
+static int
+alpn_select(SSL *ssl, const unsigned char **out, unsigned char *outlen, const unsigned char *in, unsigned int inlen, void *arg) {
+    if (OPENSSL_NPN_NEGOTIATED != SSL_select_next_proto((unsigned char**)out, outlen, alpn_protos, sizeof(alpn_protos) - 1, in, inlen)) {
+	return SSL_TLSEXT_ERR_NOACK;
+    }
+    return SSL_TLSEXT_ERR_OK;
+}
+
+// Sets up the TLS context for a bind from the key, certificate chain and
+// optional client CA files.
+int
+agoo_tls_listen(agooErr err, agooBind b) {
+    SSL_CTX	*ctx;
+
+    if (NULL == b->cert) {
+	return agoo_err_set(err, AGOO_ERR_ARG, "A TLS bind needs a cert. (%s)", b->id);
+    }
+    if (NULL == (ctx = SSL_CTX_new(TLS_server_method()))) {
+	return ssl_err(err, "Failed to create a TLS context", NULL);
+    }
+    SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+    // A write that is cut short by a full socket is retried from where the
+    // unwritten part has moved to.
+    SSL_CTX_set_mode(ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER | SSL_MODE_RELEASE_BUFFERS);
+    SSL_CTX_set_read_ahead(ctx, 1);
+#ifdef SSL_OP_ENABLE_KTLS
+    // The kernel takes over the record layer after the handshake when it
+    // can so files are sent with sendfile even on a TLS connection.
+    SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS);
+#endif
+    SSL_CTX_set_options(ctx, SSL_OP_CIPHER_SERVER_PREFERENCE | SSL_OP_NO_RENEGOTIATION);
+#ifdef SSL_OP_IGNORE_UNEXPECTED_EOF
+    // Most clients close without a close_notify. That is a close and not
+    // an error.
+    SSL_CTX_set_options(ctx, SSL_OP_IGNORE_UNEXPECTED_EOF);
+#endif
+    SSL_CTX_set_session_id_context(ctx, session_ctx, sizeof(session_ctx) - 1);
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER);
+    SSL_CTX_sess_set_cache_size(ctx, SESSION_CACHE_SIZE);
+    SSL_CTX_set_num_tickets(ctx, 1);
+    SSL_CTX_set_alpn_select_cb(ctx, alpn_select, NULL);
+
+    if (1 != SSL_CTX_use_certificate_chain_file(ctx, b->cert)) {
+	SSL_CTX_free(ctx);
+	return ssl_err(err, "Failed to load TLS certificate", b->cert);
+    }
+    if (1 != SSL_CTX_use_PrivateKey_file(ctx, (NULL == b->key) ? b->cert : b->key, SSL_FILETYPE_PEM)) {
+	SSL_CTX_free(ctx);
+	return ssl_err(err, "Failed to load TLS key", (NULL == b->key) ? b->cert : b->key);
+    }
+    if (1 != SSL_CTX_check_private_key(ctx)) {
+	SSL_CTX_free(ctx);
+	return ssl_err(err, "TLS key does not match the certificate", b->cert);
+    }
+    if (NULL != b->ca) {
+	if (1 != SSL_CTX_load_verify_locations(ctx, b->ca, NULL)) {
+	    SSL_CTX_free(ctx);
+	    return ssl_err(err, "Failed to load TLS CA", b->ca);
+	}
+	// Client certificates are asked for and checked if given.
+	SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER, NULL);
+    }
+    b->tls = ctx;
+
+    return AGOO_ERR_OK;
+}
+
+void
+agoo_tls_cleanup(agooBind b) {
+    if (NULL != b->tls) {
+	SSL_CTX_free(b->tls);
+	b->tls = NULL;
+    }
+}
+
+SSL*
+agoo_tls_create(agooErr err, agooBind b, int sock) {
+    SSL	*ssl;
+
+    if (NULL == (ssl = SSL_new(b->tls))) {
+	ssl_err(err, "Failed to create a TLS connection", NULL);
+	return NULL;
+    }
+    if (1 != SSL_set_fd(ssl, sock)) {
+	SSL_free(ssl);
+	ssl_err(err, "Failed to set the TLS socket", NULL);
+	return NULL;
+    }
+    SSL_set_accept_state(ssl);
+
+    return ssl;
+}
+
+// Sends a close_notify if the handshake finished. It is not waited on since
+// the socket is closed right after.
+void
+agoo_tls_destroy(SSL *ssl) {
+    if (NULL != ssl) {
+	if (SSL_is_init_finished(ssl)) {
+	    SSL_set_quiet_shutdown(ssl, 0);
+	    SSL_shutdown(ssl);
+	}
+	ERR_clear_error();
+	SSL_free(ssl);
+    }
+}
+
+agooTlsState
+agoo_tls_accept(SSL *ssl, uint64_t id) {
+    int	rc = SSL_do_handshake(ssl);
+
+    if (1 == rc) {
+	agoo_log_cat(&agoo_con_cat, "TLS %s handshake on connection %llu%s.",
+		     SSL_get_version(ssl), (unsigned long long)id, SSL_session_reused(ssl) ? " resumed" : "");
+	return AGOO_TLS_DONE;
+    }
+    switch (SSL_get_error(ssl, rc)) {
+    case SSL_ERROR_WANT_READ:
+    case SSL_ERROR_WANT_WRITE:
+	return AGOO_TLS_AGAIN;
+    default:
+	if (agoo_con_cat.on) {
+	    char	buf[200];
+
+	    ERR_error_string_n(ERR_peek_error(), buf, sizeof(buf));
+	    agoo_log_cat(&agoo_con_cat, "TLS handshake failed on connection %llu. %s", (unsigned long long)id, buf);
+	}
+	ERR_clear_error();
+	break;
+    }
+    return AGOO_TLS_FAIL;
+}
+
+bool
+agoo_tls_h2(SSL *ssl) {
+    const unsigned char	*proto = NULL;
+    unsigned int	len = 0;
+
+    SSL_get0_alpn_selected(ssl, &proto, &len);
+
+    return 2 == len && 0 == memcmp("h2", proto, 2);
+}
+
+// Maps the result of an SSL read or write to what recv() or send() would
+// return.
+static ssize_t
+io_result(SSL *ssl, int rc) {
+    switch (SSL_get_error(ssl, rc)) {
+    case SSL_ERROR_WANT_READ:
+    case SSL_ERROR_WANT_WRITE:
+	errno = EAGAIN;
+	return -1;
+    case SSL_ERROR_ZERO_RETURN:
+	return 0;
+    case SSL_ERROR_SYSCALL:
+	ERR_clear_error();
+	if (0 == errno) { // closed without a close_notify
+	    return 0;
+	}
+	return -1;
+    default:
+	ERR_clear_error();
+	errno = EPROTO;
+	return -1;
+    }
+}
+
+ssize_t
+agoo_tls_recv(SSL *ssl, char *buf, size_t size) {
+    int	rc;
+
+    errno = 0;
+    if (0 < (rc = SSL_read(ssl, buf, (int)size))) {
+	return rc;
+    }
+    return io_result(ssl, rc);
+}
+
+// Writes a record at a time until everything is written or the socket would
+// block so that a write covers as much as a plain send() would. What was
+// written is returned even if the last record has to be retried.
+ssize_t
+agoo_tls_send(SSL *ssl, const char *buf, size_t len) {
+    size_t	sent = 0;
+    int		rc;
+
+    errno = 0;
+    while (sent < len) {
+	if (0 >= (rc = SSL_write(ssl, buf + sent, (int)(INT_MAX < len - sent ? INT_MAX : len - sent)))) {
+	    if (0 < sent) {
+		break;
+	    }
+	    return io_result(ssl, rc);
+	}
+	sent += rc;
+    }
+    return (ssize_t)sent;
+}
+
+// Sends part of a file. With kernel TLS the file goes straight from the page
+// cache. Otherwise it is read a record at a time until the socket would
+// block and what is not sent is read again on the next call.
+ssize_t
+agoo_tls_sendfile(SSL *ssl, int fd, off_t off, size_t size) {
+    char	buf[AGOO_TLS_RECORD];
+    ssize_t	sent = 0;
+
+#ifdef SSL_OP_ENABLE_KTLS
+    if (BIO_get_ktls_send(SSL_get_wbio(ssl))) {
+	errno = 0;
+	if (0 <= (sent = SSL_sendfile(ssl, fd, off, size, 0))) {
+	    return sent;
+	}
+	return io_result(ssl, (int)sent);
+    }
+#endif
+    while (0 < size) {
+	size_t	len = (sizeof(buf) < size) ? sizeof(buf) : size;
+	ssize_t	rc;
+
+	if (0 >= (rc = pread(fd, buf, len, off))) {
+	    return (0 < sent) ? sent : rc;
+	}
+	if (0 >= (rc = agoo_tls_send(ssl, buf, rc))) {
+	    if (0 < sent) {
+		break;
+	    }
+	    return rc;
+	}
+	sent += rc;
+	if ((size_t)rc < len) {
+	    break;
+	}
+	off += rc;
+	size -= rc;
+    }
+    return sent;
+}
+
+#else
+
+int
+agoo_tls_listen(agooErr err, agooBind b) {
+    return agoo_err_set(err, AGOO_ERR_IMPL, "TLS is not supported. Agoo was built without OpenSSL. (%s)", b->id);
+}
+
+void
+agoo_tls_cleanup(agooBind b) {
+}
+
+struct ssl_st*
+agoo_tls_create(agooErr err, agooBind b, int sock) {
+    agoo_err_set(err, AGOO_ERR_IMPL, "TLS is not supported.");
+    return NULL;
+}
+
+void
+agoo_tls_destroy(struct ssl_st *ssl) {
+}
+
+agooTlsState
+agoo_tls_accept(struct ssl_st *ssl, uint64_t id) {
+    return AGOO_TLS_FAIL;
+}
+
+bool
+agoo_tls_h2(struct ssl_st *ssl) {
+    return false;
+}
+
+ssize_t
+agoo_tls_recv(struct ssl_st *ssl, char *buf, size_t size) {
+    errno = ENOSYS;
+    return -1;
+}
+
+ssize_t
+agoo_tls_send(struct ssl_st *ssl, const char *buf, size_t len) {
+    errno = ENOSYS;
+    return -1;
+}
+
+ssize_t
+agoo_tls_sendfile(struct ssl_st *ssl, int fd, off_t off, size_t size) {
+    errno = ENOSYS;
+    return -1;
+}
+
+#endif
@@ -0,0 +1,37 @@
+// Copyright (c) 2019, Peter Ohler, All rights reserved.
+
+#ifndef AGOO_TLS_H
+#define AGOO_TLS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "err.h"
+
+// Most that is written from a file at a time when the kernel does not do
+// the encryption. Also the size that small writes are coalesced into.
+#define AGOO_TLS_RECORD		16384
+
+struct _agooBind;
+struct ssl_st;
+
+typedef enum {
+    AGOO_TLS_AGAIN	= 'A',
+    AGOO_TLS_DONE	= 'D',
+    AGOO_TLS_FAIL	= 'F',
+} agooTlsState;
+
+extern int		agoo_tls_listen(agooErr err, struct _agooBind *b);
+extern void		agoo_tls_cleanup(struct _agooBind *b);
+
+extern struct ssl_st	*agoo_tls_create(agooErr err, struct _agooBind *b, int sock);
+extern void		agoo_tls_destroy(struct ssl_st *ssl);
+extern agooTlsState	agoo_tls_accept(struct ssl_st *ssl, uint64_t id);
+extern bool		agoo_tls_h2(struct ssl_st *ssl);
+
+extern ssize_t		agoo_tls_recv(struct ssl_st *ssl, char *buf, size_t size);
+extern ssize_t		agoo_tls_send(struct ssl_st *ssl, const char *buf, size_t len);
+extern ssize_t		agoo_tls_sendfile(struct ssl_st *ssl, int fd, off_t off, size_t size);
+
+#endif // AGOO_TLS_H
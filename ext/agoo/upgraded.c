@@ -6,6 +6,7 @@
 #include "con.h"
 #include "debug.h"
 #include "pub.h"
+#include "req.h"
 #include "server.h"
 #include "subject.h"
 #include "upgraded.h"
@@ -55,19 +56,22 @@ agoo_upgraded_release_con(agooUpgraded up) {
 }
 
 // Called from the con_loop thread, no need to lock, this steals the subject
-// so the pub subject should set to NULL
-void
+// so the pub subject should set to NULL. Returns false if the subject was
+// already subscribed to.
+bool
 agoo_upgraded_add_subject(agooUpgraded up, agooSubject subject) {
     agooSubject	s;
 
     for (s = up->subjects; NULL != s; s = s->next) {
 	if (0 == strcmp(subject->pattern, s->pattern)) {
 	    agoo_subject_destroy(subject);
-	    return;
+	    return false;
 	}
     }
     subject->next = up->subjects;
     up->subjects = subject;
+
+    return true;
 }
 
 void
@@ -179,3 +183,50 @@ agoo_upgraded_create(agooCon c, void * ctx, void *env) {
     }
     return up;
 }
+
+// Queues a part of a message for the handler. Only one part of a connection
+// is on the eval queue or being handled at a time so the parts are handled in
+// order no matter how many eval threads there are.
+void
+agoo_upgraded_push_part(agooUpgraded up, agooReq req) {
+    bool	push = false;
+
+    pthread_mutex_lock(&agoo_server.up_lock);
+    if (up->part_busy) {
+	req->next = NULL;
+	if (NULL == up->parts_tail) {
+	    up->parts = req;
+	} else {
+	    up->parts_tail->next = req;
+	}
+	up->parts_tail = req;
+    } else {
+	up->part_busy = true;
+	push = true;
+    }
+    pthread_mutex_unlock(&agoo_server.up_lock);
+    if (push) {
+	agoo_queue_push(&agoo_server.eval_queue, (void*)req);
+    }
+}
+
+// Called by the eval thread once a part has been handled. Releases the
+// reference held for that part and returns the next part to handle, if any.
+agooReq
+agoo_upgraded_part_done(agooUpgraded up) {
+    agooReq	req;
+
+    pthread_mutex_lock(&agoo_server.up_lock);
+    if (NULL != (req = up->parts)) {
+	if (NULL == (up->parts = req->next)) {
+	    up->parts_tail = NULL;
+	}
+	req->next = NULL;
+    } else {
+	up->part_busy = false;
+    }
+    pthread_mutex_unlock(&agoo_server.up_lock);
+    agoo_upgraded_release(up);
+
+    return req;
+}
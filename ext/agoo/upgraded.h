@@ -10,6 +10,7 @@
 #include "atomic.h"
 
 struct _agooCon;
+struct _agooReq;
 struct _agooSubject;
 
 typedef struct _agooUpgraded {
@@ -19,6 +20,10 @@ typedef struct _agooUpgraded {
     atomic_int			pending;
     atomic_int			ref_cnt;
     struct _agooSubject		*subjects;
+    uint64_t			mark; // last publish delivered, only used by the con loop
+    struct _agooReq		*parts; // message parts waiting for the one being handled
+    struct _agooReq		*parts_tail;
+    bool			part_busy;
 
     void			*ctx;
     void			*wrap;
@@ -28,6 +33,7 @@ typedef struct _agooUpgraded {
     bool			on_close;
     bool			on_shut;
     bool			on_msg;
+    bool			on_part;
     bool			on_error;
     void			(*on_destroy)(struct _agooUpgraded *up);
 } *agooUpgraded;
@@ -39,7 +45,7 @@ extern void		agoo_upgraded_release_con(agooUpgraded up);
 
 extern void		agoo_upgraded_ref(agooUpgraded up);
 
-extern void		agoo_upgraded_add_subject(agooUpgraded up, struct _agooSubject *subject);
+extern bool		agoo_upgraded_add_subject(agooUpgraded up, struct _agooSubject *subject);
 extern void		agoo_upgraded_del_subject(agooUpgraded up, struct _agooSubject *subject);
 extern bool		agoo_upgraded_match(agooUpgraded up, const char *subject);
 
@@ -48,5 +54,7 @@ extern void		agoo_upgraded_subscribe(agooUpgraded up, const char *subject, int s
 extern void		agoo_upgraded_unsubscribe(agooUpgraded up, const char *subject, int slen, bool inc_ref);
 extern void		agoo_upgraded_close(agooUpgraded up, bool inc_ref);
 extern int		agoo_upgraded_pending(agooUpgraded up);
+extern void		agoo_upgraded_push_part(agooUpgraded up, struct _agooReq *req);
+extern struct _agooReq*	agoo_upgraded_part_done(agooUpgraded up);
 
 #endif // AGOO_UPGRADED_H
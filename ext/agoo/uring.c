@@ -0,0 +1,226 @@
+// Copyright (c) 2018, Peter Ohler, All rights reserved.
+
+#if HAVE_LINUX_IO_URING_H
+
+#include <errno.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <linux/time_types.h>
+
+#include "debug.h"
+#include "uring.h"
+
+#define REQUIRED_FEATURES	(IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP | IORING_FEAT_EXT_ARG)
+
+static const uint8_t	required_ops[] = {
+    IORING_OP_POLL_ADD,
+    IORING_OP_ASYNC_CANCEL,
+    IORING_OP_SEND,
+    IORING_OP_RECV,
+};
+
+static int
+uring_setup(unsigned entries, struct io_uring_params *p) {
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int
+uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags, void *arg, size_t size) {
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, arg, size);
+}
+
+static bool
+ops_supported(int fd) {
+    size_t			size = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe	*probe = (struct io_uring_probe*)AGOO_MALLOC(size);
+    bool			ok = true;
+    size_t			i;
+
+    if (NULL == probe) {
+	return false;
+    }
+    memset(probe, 0, size);
+    if (0 > syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe, 256)) {
+	ok = false;
+    } else {
+	for (i = 0; i < sizeof(required_ops) / sizeof(*required_ops); i++) {
+	    uint8_t	op = required_ops[i];
+
+	    if (probe->last_op < op || 0 == (probe->ops[op].flags & IO_URING_OP_SUPPORTED)) {
+		ok = false;
+		break;
+	    }
+	}
+    }
+    AGOO_FREE(probe);
+
+    return ok;
+}
+
+// Returns true if the kernel supports everything the ring is used for. The
+// check is made by creating and then closing a small ring.
+bool
+agoo_uring_available(agooErr err) {
+    struct io_uring_params	p;
+    int				fd;
+    bool			ok;
+
+    memset(&p, 0, sizeof(p));
+    if (0 > (fd = uring_setup(2, &p))) {
+	agoo_err_no(err, "io_uring is not available.");
+	return false;
+    }
+    if (REQUIRED_FEATURES != (p.features & REQUIRED_FEATURES)) {
+	agoo_err_set(err, AGOO_ERR_IMPL, "io_uring is missing required features.");
+	ok = false;
+    } else if (!(ok = ops_supported(fd))) {
+	agoo_err_set(err, AGOO_ERR_IMPL, "io_uring is missing required operations.");
+    }
+    close(fd);
+
+    return ok;
+}
+
+int
+agoo_uring_init(agooErr err, agooUring ring, unsigned entries) {
+    struct io_uring_params	p;
+    size_t			sq_size;
+    size_t			cq_size;
+    char			*base;
+
+    memset(ring, 0, sizeof(struct _agooUring));
+    memset(&p, 0, sizeof(p));
+    if (0 > (ring->fd = uring_setup(entries, &p))) {
+	return agoo_err_no(err, "io_uring setup failed.");
+    }
+    if (REQUIRED_FEATURES != (p.features & REQUIRED_FEATURES)) {
+	close(ring->fd);
+	return agoo_err_set(err, AGOO_ERR_IMPL, "io_uring is missing required features.");
+    }
+    sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    ring->ring_size = (sq_size < cq_size) ? cq_size : sq_size;
+    ring->ring = mmap(NULL, ring->ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (MAP_FAILED == ring->ring) {
+	close(ring->fd);
+	return agoo_err_no(err, "io_uring ring map failed.");
+    }
+    ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = (struct io_uring_sqe*)mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (MAP_FAILED == ring->sqes) {
+	munmap(ring->ring, ring->ring_size);
+	close(ring->fd);
+	return agoo_err_no(err, "io_uring entry map failed.");
+    }
+    base = (char*)ring->ring;
+    ring->entries = p.sq_entries;
+    ring->sq_head = (unsigned*)(base + p.sq_off.head);
+    ring->sq_tail = (unsigned*)(base + p.sq_off.tail);
+    ring->sq_mask = (unsigned*)(base + p.sq_off.ring_mask);
+    ring->sq_array = (unsigned*)(base + p.sq_off.array);
+    ring->cq_head = (unsigned*)(base + p.cq_off.head);
+    ring->cq_tail = (unsigned*)(base + p.cq_off.tail);
+    ring->cq_mask = (unsigned*)(base + p.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*)(base + p.cq_off.cqes);
+    ring->sq_local = *ring->sq_tail;
+
+    return AGOO_ERR_OK;
+}
+
+void
+agoo_uring_cleanup(agooUring ring) {
+    if (0 < ring->fd) {
+	munmap(ring->sqes, ring->sqes_size);
+	munmap(ring->ring, ring->ring_size);
+	close(ring->fd);
+	ring->fd = 0;
+    }
+}
+
+// Returns a cleared submission entry. If the submission queue is full the
+// pending entries are submitted first.
+struct io_uring_sqe*
+agoo_uring_sqe(agooErr err, agooUring ring) {
+    struct io_uring_sqe	*sqe;
+    unsigned		index;
+
+    if (ring->entries <= ring->sq_local - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE)) {
+	if (AGOO_ERR_OK != agoo_uring_enter(err, ring, 0)) {
+	    return NULL;
+	}
+	if (ring->entries <= ring->sq_local - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE)) {
+	    agoo_err_set(err, AGOO_ERR_OVERFLOW, "io_uring submission queue is full.");
+	    return NULL;
+	}
+    }
+    index = ring->sq_local & *ring->sq_mask;
+    ring->sq_array[index] = index;
+    sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    ring->sq_local++;
+
+    return sqe;
+}
+
+// Submits pending entries and, if timeout is greater than zero, waits up to
+// timeout milliseconds for at least one completion.
+int
+agoo_uring_enter(agooErr err, agooUring ring, int timeout) {
+    unsigned	to_submit;
+    unsigned	flags = 0;
+    unsigned	min = 0;
+    void	*arg = NULL;
+    size_t	size = 0;
+    struct __kernel_timespec		ts;
+    struct io_uring_getevents_arg	ea;
+
+    __atomic_store_n(ring->sq_tail, ring->sq_local, __ATOMIC_RELEASE);
+    to_submit = ring->sq_local - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    if (0 < timeout && NULL == agoo_uring_peek(ring)) {
+	ts.tv_sec = timeout / 1000;
+	ts.tv_nsec = (timeout % 1000) * 1000000;
+	memset(&ea, 0, sizeof(ea));
+	ea.sigmask_sz = _NSIG / 8;
+	ea.ts = (uint64_t)(uintptr_t)&ts;
+	flags = IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG;
+	min = 1;
+	arg = &ea;
+	size = sizeof(ea);
+    } else if (0 == to_submit) {
+	return AGOO_ERR_OK;
+    }
+    if (0 > uring_enter(ring->fd, to_submit, min, flags, arg, size)) {
+	switch (errno) {
+	case ETIME:
+	case EINTR:
+	case EAGAIN:
+	case EBUSY:
+	    break;
+	default:
+	    return agoo_err_no(err, "io_uring enter failed.");
+	}
+    }
+    return AGOO_ERR_OK;
+}
+
+struct io_uring_cqe*
+agoo_uring_peek(agooUring ring) {
+    unsigned	head = *ring->cq_head;
+
+    if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+	return NULL;
+    }
+    return &ring->cqes[head & *ring->cq_mask];
+}
+
+void
+agoo_uring_seen(agooUring ring) {
+    __atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+#endif
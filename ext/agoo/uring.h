@@ -0,0 +1,44 @@
+// Copyright (c) 2018, Peter Ohler, All rights reserved.
+
+#ifndef AGOO_URING_H
+#define AGOO_URING_H
+
+#if HAVE_LINUX_IO_URING_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <linux/io_uring.h>
+
+#include "err.h"
+
+// A minimal io_uring wrapper that uses the system calls directly so there is
+// no dependency on liburing. Only one thread should use a ring.
+typedef struct _agooUring {
+    int			fd;
+    unsigned		entries;
+    unsigned		*sq_head;
+    unsigned		*sq_tail;
+    unsigned		*sq_mask;
+    unsigned		*sq_array;
+    unsigned		sq_local; // tail not yet published to the kernel
+    unsigned		*cq_head;
+    unsigned		*cq_tail;
+    unsigned		*cq_mask;
+    struct io_uring_sqe	*sqes;
+    struct io_uring_cqe	*cqes;
+    void		*ring;
+    size_t		ring_size;
+    size_t		sqes_size;
+} *agooUring;
+
+extern bool			agoo_uring_available(agooErr err);
+extern int			agoo_uring_init(agooErr err, agooUring ring, unsigned entries);
+extern void			agoo_uring_cleanup(agooUring ring);
+extern struct io_uring_sqe*	agoo_uring_sqe(agooErr err, agooUring ring);
+extern int			agoo_uring_enter(agooErr err, agooUring ring, int timeout);
+extern struct io_uring_cqe*	agoo_uring_peek(agooUring ring);
+extern void			agoo_uring_seen(agooUring ring);
+
+#endif
+
+#endif // AGOO_URING_H
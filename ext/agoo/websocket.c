@@ -3,6 +3,14 @@
 #include <stdint.h>
 #include <string.h>
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+#define WS_AVX2	1
+#endif
+
 #include "base64.h"
 #include "con.h"
 #include "debug.h"
@@ -16,6 +24,7 @@
 #include "websocket.h"
 
 #define MAX_KEY_LEN	1024
+#define WS_MIN_CAP	1024
 
 static const char	up_con[] = "Upgrade: websocket\r\nConnection: Upgrade\r\n";
 static const char	ws_magic[] = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
@@ -30,7 +39,7 @@ agoo_ws_add_headers(agooReq req, agooText t) {
     const char	*key;
     
     t = agoo_text_append(t, up_con, sizeof(up_con) - 1);
-    if (NULL != (key = agoo_con_header_value(req->header.start, req->header.len, "Sec-WebSocket-Key", &klen)) &&
+    if (NULL != (key = agoo_req_header(req, AGOO_HDR_SEC_WEBSOCKET_KEY, &klen)) &&
 	klen + sizeof(ws_magic) < MAX_KEY_LEN) {
 	char		buf[MAX_KEY_LEN];
 	unsigned char	sha[32];
@@ -45,7 +54,7 @@ agoo_ws_add_headers(agooReq req, agooText t) {
 	t = agoo_text_append(t, buf, len);
 	t = agoo_text_append(t, "\r\n", 2);
     }
-    if (NULL != (key = agoo_con_header_value(req->header.start, req->header.len, "Sec-WebSocket-Protocol", &klen))) {
+    if (NULL != (key = agoo_req_header(req, AGOO_HDR_SEC_WEBSOCKET_PROTOCOL, &klen))) {
 	t = agoo_text_append(t, ws_protocol, sizeof(ws_protocol) - 1);
 	t = agoo_text_append(t, key, klen);
 	t = agoo_text_append(t, "\r\n", 2);
@@ -78,122 +87,172 @@ agoo_ws_expand(agooText t) {
     return agoo_text_prepend(t, (const char*)buf, (int)(b - buf));
 }
 
+// Returns the length of the frame head up to the mask or 0 if the head has
+// not been read yet.
 size_t
-agoo_ws_decode(char *buf, size_t mlen) {
-    uint8_t	*b = (uint8_t*)buf;
-    bool	is_masked;
-    uint8_t	*payload;
-    uint64_t	plen;
-    
-    b++; // op
-    is_masked = 0x80 & *b;
+agoo_ws_head(const uint8_t *buf, size_t cnt, uint64_t *plenp, bool *maskedp) {
+    const uint8_t	*b = buf + 1;
+    uint64_t		plen;
+    size_t		hlen = 2;
+    int			i;
+
+    if (cnt < 2) {
+	return 0;
+    }
+    *maskedp = 0x80 & *b;
     plen = 0x7F & *b;
     b++;
     if (126 == plen) {
-	plen = *b++;
-	plen = (plen << 8) | *b++;
+	hlen = 4;
     } else if (127 == plen) {
-	plen = *b++;
-	plen = (plen << 8) | *b++;
-	plen = (plen << 8) | *b++;
-	plen = (plen << 8) | *b++;
-	plen = (plen << 8) | *b++;
-	plen = (plen << 8) | *b++;
-	plen = (plen << 8) | *b++;
-	plen = (plen << 8) | *b++;
-    }
-    if (is_masked) {
-	uint8_t		mask[4];
-	uint64_t	i;
-	
-	for (i = 0; i < 4; i++, b++) {
-	    mask[i] = *b;
-	}
-	payload = b;
-	for (i = 0; i < plen; i++, b++) {
-	    *b = *b ^ mask[i % 4];
+	hlen = 10;
+    }
+    if (cnt < hlen) {
+	return 0;
+    }
+    if (2 < hlen) {
+	for (plen = 0, i = (int)hlen - 2; 0 < i; i--) {
+	    plen = (plen << 8) | *b++;
 	}
-    } else {
-	payload = b;
-	b += plen;
     }
-    memmove(buf, payload, plen);
-    buf[plen] = '\0';
+    *plenp = plen;
 
-    return plen;
+    return hlen;
 }
 
-// if -1 then err, 0 not ready yet, positive is completed length
-long
-agoo_ws_calc_len(agooCon c, uint8_t *buf, size_t cnt) {
-    uint8_t	*b = buf;
-    bool	is_masked;
-    uint64_t	plen;
+#if WS_AVX2
+__attribute__((target("avx2")))
+static size_t
+unmask_avx2(uint8_t *dst, const uint8_t *src, size_t len, uint32_t m32) {
+    __m256i	m = _mm256_set1_epi32((int)m32);
+    size_t	i = 0;
 
-    if (0 == (0x80 & *b)) {
-	agoo_log_cat(&agoo_error_cat, "FIN must be 1. Websocket continuation not implemented on connection %llu.", (unsigned long long)c->id);
-	return -1;
+    for (; i + 32 <= len; i += 32) {
+	_mm256_storeu_si256((__m256i*)(dst + i), _mm256_xor_si256(_mm256_loadu_si256((const __m256i*)(src + i)), m));
     }
-    b++;
-    is_masked = 0x80 & *b;
-    plen = 0x7F & *b;
-    if (cnt < 3) {
-	return 0; // not read yet
+    return i;
+}
+#endif
+
+// Unmasks len bytes of src into dst starting at mask byte off. The dst can
+// be src or before src in the same buffer as each block is loaded before it
+// is stored.
+void
+agoo_ws_unmask(uint8_t *dst, const uint8_t *src, size_t len, const uint8_t *mask, int off) {
+    uint8_t	m[4];
+    uint32_t	m32;
+    uint64_t	m64;
+    uint64_t	w;
+    size_t	i = 0;
+
+    // Rotated so that every block starts with m[0].
+    for (i = 0; i < 4; i++) {
+	m[i] = mask[(i + off) & 3];
     }
-    b++;
-    if (126 == plen) {
-	if (cnt < 5) {
-	    return 0; // not read yet
+    i = 0;
+    memcpy(&m32, m, 4);
+#if WS_AVX2
+    if (256 <= len && __builtin_cpu_supports("avx2")) {
+	i = unmask_avx2(dst, src, len, m32);
+    }
+#endif
+#if defined(__SSE2__)
+    {
+	__m128i	mv = _mm_set1_epi32((int)m32);
+
+	for (; i + 16 <= len; i += 16) {
+	    _mm_storeu_si128((__m128i*)(dst + i), _mm_xor_si128(_mm_loadu_si128((const __m128i*)(src + i)), mv));
 	}
-	plen = *b++;
-	plen = (plen << 8) | *b++;
-    } else if (127 == plen) {
-	if (c->bcnt < 11) {
-	    return 0; // not read yet
+    }
+#endif
+    m64 = (uint64_t)m32 | ((uint64_t)m32 << 32);
+    for (; i + 8 <= len; i += 8) {
+	memcpy(&w, src + i, 8);
+	w ^= m64;
+	memcpy(dst + i, &w, 8);
+    }
+    for (; i < len; i++) {
+	dst[i] = src[i] ^ m[i & 3];
+    }
+}
+
+agooWsRead
+agoo_ws_read_create(void) {
+    agooWsRead	ws = (agooWsRead)AGOO_MALLOC(sizeof(struct _agooWsRead));
+
+    if (NULL != ws) {
+	memset(ws, 0, sizeof(struct _agooWsRead));
+    }
+    return ws;
+}
+
+void
+agoo_ws_read_destroy(agooWsRead ws) {
+    if (NULL != ws) {
+	if (NULL != ws->req) {
+	    agoo_req_destroy(ws->req);
 	}
-	plen = *b++;
-	plen = (plen << 8) | *b++;
-	plen = (plen << 8) | *b++;
-	plen = (plen << 8) | *b++;
-	plen = (plen << 8) | *b++;
-	plen = (plen << 8) | *b++;
-	plen = (plen << 8) | *b++;
-	plen = (plen << 8) | *b++;
-    }
-    return (long)(b - buf) + (is_masked ? 4 : 0) + plen;
+	AGOO_FREE(ws);
+    }
 }
 
-// Return true on error otherwise false.
+// Makes room for len more bytes of a message that is put back together from
+// its frames. The requests come from the pools so the buffer grows through
+// the size classes before it is allocated directly.
 bool
-agoo_ws_create_req(agooCon c, long mlen) {
-    uint8_t	op = 0x0F & *c->buf;
-    
-    if (NULL == (c->req = agoo_req_create(mlen))) {
-	agoo_log_cat(&agoo_error_cat, "Out of memory attempting to allocate request.");
+agoo_ws_reserve(agooWsRead ws, size_t len) {
+    agooReq	req;
+    size_t	cap;
+
+    if (NULL != ws->req && ws->len + len <= ws->cap) {
 	return true;
     }
-    if (NULL == c->up || agoo_server.ctx_nil_value == c->up->ctx) {
-	return true;
+    for (cap = (0 == ws->cap) ? WS_MIN_CAP : ws->cap * 2; cap < ws->len + len; cap *= 2) {
+    }
+    if (NULL == (req = agoo_req_create(cap))) {
+	return false;
+    }
+    if (NULL != ws->req) {
+	memcpy(req->msg, ws->req->msg, ws->len);
+	agoo_req_destroy(ws->req);
     }
-    memset(c->req, 0, sizeof(struct _agooReq));
-    if ((long)c->bcnt <= mlen) {
-	memcpy(c->req->msg, c->buf, c->bcnt);
-	if ((long)c->bcnt < mlen) {
-	    memset(c->req->msg + c->bcnt, 0, mlen - c->bcnt);
+    ws->req = req;
+    ws->cap = cap;
+
+    return true;
+}
+
+// Hands a message or a part of one to the handler. The request is dropped if
+// the handler does not take it.
+void
+agoo_ws_push(agooCon c, agooReq req, size_t mlen, bool part, bool last) {
+    agooWsRead	ws = c->ws;
+
+    if ((part && !c->up->on_part) || (!part && !c->up->on_msg)) {
+	agoo_req_destroy(req);
+	return;
+    }
+    req->mlen = mlen;
+    req->method = (AGOO_WS_OP_BIN == ws->op) ? AGOO_ON_BIN : AGOO_ON_MSG;
+    req->upgrade = AGOO_UP_NONE;
+    req->up = c->up;
+    req->res = NULL;
+    req->part = part;
+    req->last = last;
+    req->hook = agoo_hook_push(c->up->ctx);
+    if (agoo_debug_cat.on) {
+	if (AGOO_ON_MSG == req->method) {
+	    agoo_log_cat(&agoo_debug_cat, "WebSocket message on %llu: %.*s", (unsigned long long)c->id, (int)mlen, req->msg);
+	} else {
+	    agoo_log_cat(&agoo_debug_cat, "WebSocket binary message on %llu", (unsigned long long)c->id);
 	}
+    }
+    agoo_upgraded_ref(c->up);
+    if (part) {
+	agoo_upgraded_push_part(c->up, req);
     } else {
-	memcpy(c->req->msg, c->buf, mlen);
-    }
-    c->req->msg[mlen] = '\0';
-    c->req->mlen = mlen;
-    c->req->method = (AGOO_WS_OP_BIN == op) ? AGOO_ON_BIN : AGOO_ON_MSG;
-    c->req->upgrade = AGOO_UP_NONE;
-    c->req->up = c->up;
-    c->req->res = NULL;
-    if (c->up->on_msg) {
-	c->req->hook = agoo_hook_create(AGOO_NONE, NULL, c->up->ctx, PUSH_HOOK, &agoo_server.eval_queue);
-    }
-    return false;
+	agoo_queue_push(&agoo_server.eval_queue, (void*)req);
+    }
 }
 
 void
@@ -203,7 +262,7 @@ agoo_ws_req_close(agooCon c) {
 	    
 	req->up = c->up;
 	req->method = AGOO_ON_CLOSE;
-	req->hook = agoo_hook_create(AGOO_NONE, NULL, c->up->ctx, PUSH_HOOK, &agoo_server.eval_queue);
+	req->hook = agoo_hook_push(c->up->ctx);
 	atomic_fetch_add(&c->up->ref_cnt, 1);
 	agoo_queue_push(&agoo_server.eval_queue, (void*)req);
     }
@@ -228,8 +287,10 @@ agoo_ws_ping(agooCon c) {
     }
 }
 
+// Queues a pong. A ping with a payload is answered with the same payload
+// which is framed here.
 void
-agoo_ws_pong(agooCon c) {
+agoo_ws_pong(agooCon c, const char *data, size_t len) {
     agooRes	res;
     
     if (NULL == (res = agoo_res_create(c))) {
@@ -244,5 +305,18 @@ agoo_ws_pong(agooCon c) {
 	res->close = false;
 	res->con_kind = AGOO_CON_WS;
 	res->pong = true;
+	if (0 < len) {
+	    agooText	t = agoo_text_allocate((int)len + 2);
+
+	    if (NULL != t) {
+		t->text[0] = (char)(0x80 | AGOO_WS_OP_PONG);
+		t->text[1] = (char)len;
+		memcpy(t->text + 2, data, len);
+		t->len = len + 2;
+		t->text[t->len] = '\0';
+		agoo_res_set_message(res, t);
+		res->framed = true;
+	    }
+	}
     }
 }
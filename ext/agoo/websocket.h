@@ -13,15 +13,36 @@
 struct _agooReq;
 struct _agooText;
 
+// The state of the WebSocket message being read on a connection. A message
+// can be split into frames and control frames can come between them. Each
+// frame can take more than one read.
+typedef struct _agooWsRead {
+    struct _agooReq	*req;   // frames so far if put back together
+    size_t		cap;    // of req
+    uint64_t		len;    // of the message so far
+    uint64_t		left;   // of the current frame payload
+    uint8_t		mask[4];
+    uint8_t		moff;   // mask index of the next payload byte
+    uint8_t		op;     // of the message or 0 between messages
+    bool		masked;
+    bool		fin;    // the current frame is the last of the message
+    bool		in_frame;
+    bool		stream; // given to the handler in parts
+} *agooWsRead;
+
 extern struct _agooText*	agoo_ws_add_headers(struct _agooReq *req, struct _agooText *t);
 extern struct _agooText*	agoo_ws_expand(agooText t);
-extern size_t			agoo_ws_decode(char *buf, size_t mlen);
 
-extern long			agoo_ws_calc_len(agooCon c, uint8_t *buf, size_t cnt);
-extern bool			agoo_ws_create_req(agooCon c, long mlen);
+extern size_t			agoo_ws_head(const uint8_t *buf, size_t cnt, uint64_t *plenp, bool *maskedp);
+extern void			agoo_ws_unmask(uint8_t *dst, const uint8_t *src, size_t len, const uint8_t *mask, int off);
+
+extern agooWsRead		agoo_ws_read_create(void);
+extern void			agoo_ws_read_destroy(agooWsRead ws);
+extern bool			agoo_ws_reserve(agooWsRead ws, size_t len);
+extern void			agoo_ws_push(agooCon c, struct _agooReq *req, size_t mlen, bool part, bool last);
 extern void			agoo_ws_req_close(agooCon c);
 
 extern void			agoo_ws_ping(agooCon c);
-extern void			agoo_ws_pong(agooCon c);
+extern void			agoo_ws_pong(agooCon c, const char *data, size_t len);
 
 #endif // AGOO_WEBSOCKET_H
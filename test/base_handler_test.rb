@@ -9,6 +9,7 @@ end
 require 'minitest'
 require 'minitest/autorun'
 require 'net/http'
+require 'socket'
 
 require 'oj'
 
@@ -66,6 +67,7 @@ class BaseHandlerTest < Minitest::Test
     Agoo::Server.handle(:PUT, "/makeme", handler)
     Agoo::Server.handle(:GET, "/wild/*/one", WildHandler.new('one'))
     Agoo::Server.handle(:GET, "/wild/all/**", WildHandler.new('all'))
+    Agoo::Server.handle(:GET, "/wild/**", WildHandler.new('rest'))
 
     Agoo::Server.start()
 
@@ -173,4 +175,42 @@ class BaseHandlerTest < Minitest::Test
     assert_equal('all - /wild/all/x/y', res.body)
   end
 
+  def test_wild_order
+    %w(/wild/all/one one /wild/all/two all /wild/abc/two rest /wild/x rest).each_slice(2) { |path,name|
+      uri = URI("http://localhost:6470#{path}")
+      res = Net::HTTP.get(uri)
+      assert_equal("#{name} - #{path}", res)
+    }
+  end
+
+  def raw_status(raw)
+    s = TCPSocket.new('localhost', 6470)
+    s.write(raw)
+    line = s.gets
+    s.close
+    line.split(' ')[1]
+  end
+
+  def test_raw_head
+    assert_equal('200', raw_status("GET /tellme HTTP/1.0\r\n\r\n"))
+    assert_equal('204', raw_status("POST /makeme HTTP/1.1\r\ncontent-length: 0\r\nConnection: close\r\n\r\n"))
+    assert_equal('400', raw_status("GET /tellme HTTP/1.1\r\nNo colon here\r\n\r\n"))
+    assert_equal('400', raw_status("GET /tellme HTTP/1.1\r\nX-A: a\x01b\r\n\r\n"))
+    assert_equal('505', raw_status("GET /tellme HTTP/2.0\r\n\r\n"))
+  end
+
+  # All the responses are written even though the client stops sending
+  # before they are ready.
+  def test_pipeline
+    s = TCPSocket.new('localhost', 6470)
+    s.write("GET /wild/x HTTP/1.1\r\n\r\n" +
+	    "POST /makeme HTTP/1.1\r\nContent-Length: 0\r\n\r\n" +
+	    "GET /wild/y HTTP/1.1\r\nConnection: close\r\n\r\n")
+    s.close_write
+    out = s.read
+    s.close
+    assert_equal(%w(200 204 200), out.scan(/HTTP\/1.1 (\d+)/).flatten)
+    assert(out.include?('rest - /wild/x'))
+    assert(out.end_with?('rest - /wild/y'))
+  end
 end
@@ -9,6 +9,7 @@ end
 require 'minitest'
 require 'minitest/autorun'
 require 'net/http'
+require 'openssl'
 require 'socket'
 
 require 'agoo'
@@ -18,6 +19,24 @@ class BindTest < Minitest::Test
   @@addr = '127.0.0.1'
   @@addr6 = '::1'
   @@name = '/tmp/agoo_test.socket'
+  @@cert = '/tmp/agoo_test_cert.pem'
+  @@key = '/tmp/agoo_test_key.pem'
+
+  # A self signed certificate for the TLS bind.
+  def make_cert
+    key = OpenSSL::PKey::RSA.new(2048)
+    cert = OpenSSL::X509::Certificate.new
+    cert.version = 2
+    cert.serial = 1
+    cert.subject = OpenSSL::X509::Name.parse('/CN=localhost')
+    cert.issuer = cert.subject
+    cert.public_key = key.public_key
+    cert.not_before = Time.now - 60
+    cert.not_after = Time.now + 3600
+    cert.sign(key, OpenSSL::Digest::SHA256.new)
+    File.write(@@cert, cert.to_pem)
+    File.write(@@key, key.to_pem)
+  end
 
   def start_server
     Agoo::Log.configure(dir: '',
@@ -39,11 +58,13 @@ class BindTest < Minitest::Test
 	break
       end
     }
+    make_cert
     Agoo::Server.init(6471, 'root', thread_count: 1,
 		      bind: ['http://127.0.0.1:6472',
 			     "http://#{@@addr}:6473",
 			     "http://[#{@@addr6}]:6474",
 			     "unix://#{@@name}",
+			     "https://127.0.0.1:6475?cert=#{@@cert}&key=#{@@key}",
 			    ])
     Agoo::Server.start()
     @@server_started = true
@@ -79,6 +100,11 @@ class BindTest < Minitest::Test
     request(uri)
   end
 
+  def test_https
+    uri = URI('https://127.0.0.1:6475/index.html')
+    request(uri)
+  end
+
   def test_restrict
     return if '127.0.0.1' == @@addr
     uri = URI("http://127.0.0.1:6473/index.html")
@@ -124,7 +150,8 @@ User-Agent: Ruby\r
     req = Net::HTTP::Get.new(uri)
     req['Accept-Encoding'] = '*'
     req['User-Agent'] = 'Ruby'
-    res = Net::HTTP.start(uri.hostname, uri.port) { |h|
+    opts = { use_ssl: 'https' == uri.scheme, verify_mode: OpenSSL::SSL::VERIFY_NONE }
+    res = Net::HTTP.start(uri.hostname, uri.port, opts) { |h|
       h.request(req)
     }
     content = res.body
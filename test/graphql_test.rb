@@ -9,6 +9,7 @@ end
 require 'minitest'
 require 'minitest/autorun'
 require 'net/http'
+require 'socket'
 
 require 'oj'
 require 'agoo'
@@ -408,6 +409,21 @@ directive @ruby(class: String!) on SCHEMA | OBJECT
     post_test(uri, body, 'application/json', expect)
   end
 
+  # An empty body must not be read past into the pipelined request after it.
+  def test_post_empty
+    query = '{artist(name:"Fazerdaze"){name}}'
+    s = TCPSocket.new('localhost', 6472)
+    s.write("POST /graphql HTTP/1.1\r\nContent-Type: application/graphql\r\nContent-Length: 0\r\n\r\n")
+    s.write("POST /graphql HTTP/1.1\r\nContent-Type: application/graphql\r\nContent-Length: #{query.size}\r\n\r\n#{query}")
+    content = ''
+    until content.include?('"data"')
+      content << s.readpartial(4096)
+    end
+    s.close
+    assert_match(/Failed to identify operation/, content)
+    assert_match(/{"data":{"artist":{"name":"Fazerdaze"}}}/, content)
+  end
+
   def test_post_fragment
     uri = URI('http://localhost:6472/graphql?indent=2')
     body = %^
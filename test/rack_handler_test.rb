@@ -41,6 +41,48 @@ class RackHandlerTest < Minitest::Test
     end
   end
 
+  # Echoes WebSocket messages. The parts of a message given to
+  # on_message_part are echoed once the last one arrives, after the number
+  # of parts.
+  class WsHandler
+    @@errors = []
+
+    def self.errors
+      @@errors
+    end
+
+    def initialize
+      @parts = []
+    end
+
+    def call(env)
+      if :websocket == env['rack.upgrade?']
+	env['rack.upgrade'] = self.class.new
+	[ 200, { }, [ ] ]
+      else
+	[ 404, { }, [ ] ]
+      end
+    end
+
+    def on_message(client, data)
+      client.write(data)
+    end
+
+    def on_error(client, msg)
+      @@errors << msg
+    end
+  end
+
+  class WsPartHandler < WsHandler
+    def on_message_part(client, data, last)
+      @parts << data
+      if last
+	client.write("#{@parts.size} #{@parts.join}")
+	@parts = []
+      end
+    end
+  end
+
   def start_server
     Agoo::Log.configure(dir: '',
 			console: true,
@@ -55,12 +97,14 @@ class RackHandlerTest < Minitest::Test
 			  eval: true,
 			})
 
-    Agoo::Server.init(6467, 'root', thread_count: 1)
+    Agoo::Server.init(6467, 'root', thread_count: 1, body_file_min: 16384, ws_max_message: 100000, ws_stream_min: 50000)
 
     handler = TellMeHandler.new
     Agoo::Server.handle(:GET, "/tellme", handler)
     Agoo::Server.handle(:POST, "/makeme", handler)
     Agoo::Server.handle(:PUT, "/makeme", handler)
+    Agoo::Server.handle(:GET, "/ws", WsHandler.new)
+    Agoo::Server.handle(:GET, "/wspart", WsPartHandler.new)
 
     Agoo::Server.start()
 
@@ -86,6 +130,8 @@ class RackHandlerTest < Minitest::Test
     req['Accept'] = 'application/json'
     req['User-Agent'] = 'Ruby'
     req['Host'] = 'localhost:6467'
+    req['X-Request-Id'] = 'abc-123'
+    req['X-Custom-Thing'] = 'yes'
 
     res = Net::HTTP.start(uri.hostname, uri.port) { |h|
       h.request(req)
@@ -97,6 +143,8 @@ class RackHandlerTest < Minitest::Test
       "HTTP_ACCEPT_ENCODING" => "*",
       "HTTP_USER_AGENT" => "Ruby",
       "HTTP_HOST" => "localhost:6467",
+      "HTTP_X_REQUEST_ID" => "abc-123",
+      "HTTP_X_CUSTOM_THING" => "yes",
       "PATH_INFO" => "/tellme",
       "QUERY_STRING" => "a=1",
       "REQUEST_METHOD" => "GET",
@@ -120,6 +168,18 @@ class RackHandlerTest < Minitest::Test
     }
   end
 
+  def test_pool_stats
+    Net::HTTP.start('localhost', 6467) { |h|
+      h.get('/tellme')
+      before = Agoo::Server.pool_stats
+      10.times { h.get('/tellme') }
+      after = Agoo::Server.pool_stats
+      assert(before[:gets] + 20 <= after[:gets])
+      assert_equal(before[:mallocs], after[:mallocs])
+      assert(0 < after[:bytes])
+    }
+  end
+
   def test_post
     uri = URI('http://localhost:6467/makeme')
     req = Net::HTTP::Post.new(uri)
@@ -150,4 +210,200 @@ class RackHandlerTest < Minitest::Test
     assert_equal('hello', res.body)
   end
 
+  # Bodies bigger than the read buffer or big enough to go to a temp file and
+  # requests that straddle the end of the buffer.
+  def test_put_pipeline
+    bodies = ['a' * 10, 'b' * 20000, 'c' * 7000, 'd' * 9000, 'e']
+    s = TCPSocket.new('localhost', 6467)
+    bodies.each_with_index { |b, i|
+      close = (bodies.size - 1 == i) ? "Connection: close\r\n" : ''
+      s.write("PUT /makeme HTTP/1.1\r\n#{close}Content-Length: #{b.size}\r\n\r\n#{b}")
+    }
+    out = s.read
+    s.close
+    assert_equal(%w(201) * bodies.size, out.scan(/HTTP\/1.1 (\d+)/).flatten)
+    assert_equal(bodies, out.split(/HTTP\/1.1 201 Created\r\n/).reject(&:empty?).map { |r| r.split("\r\n\r\n", 2)[1] })
+  end
+
+  def test_put_chunked
+    s = TCPSocket.new('localhost', 6467)
+    s.write("PUT /makeme HTTP/1.1\r\nTransfer-Encoding: chunked\r\nConnection: close\r\n\r\n")
+    s.write("5;x=y\r\nhello\r\n")
+    s.write("4000\r\n#{'w' * 0x4000}\r\n1\r\n!\r\n0\r\nX-Trailer: t\r\n\r\n")
+    out = s.read
+    s.close
+    assert_equal('201', out[9, 3])
+    assert(out.end_with?("\r\n\r\nhello#{'w' * 0x4000}!"))
+  end
+
+  H2_PREFACE = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+
+  def h2_frame(type, flags, sid, payload)
+    [payload.bytesize].pack('N')[1, 3] + [type, flags, sid].pack('CCN') + payload
+  end
+
+  # Literal fields without indexing and with a literal name.
+  def h2_fields(fields)
+    fields.map { |k, v| [0, k.size, k, v.size, v].pack('CCa*Ca*') }.join
+  end
+
+  # Returns the status byte of the HEADERS and the DATA for each stream.
+  def h2_read(s, cnt)
+    res = {}
+    done = 0
+    while done < cnt
+      head = s.read(9)
+      len = ("\0" + head[0, 3]).unpack1('N')
+      type, flags, sid = head[3, 6].unpack('CCN')
+      payload = 0 < len ? s.read(len) : ''
+      next if 0 == sid
+      r = (res[sid] ||= ['', ''])
+      if 1 == type
+	r[0] = payload[0].unpack1('H2')
+      elsif 0 == type
+	r[1] << payload
+      end
+      done += 1 if 0 != (flags & 1)
+    end
+    res
+  end
+
+  def test_http2
+    s = TCPSocket.new('localhost', 6467)
+    s.write(H2_PREFACE + h2_frame(4, 0, 0, ''))
+    get = h2_fields([[':method', 'GET'], [':scheme', 'http'], [':path', '/tellme?a=1'], [':authority', 'localhost:6467']])
+    put = h2_fields([[':method', 'PUT'], [':scheme', 'http'], [':path', '/makeme']])
+    s.write(h2_frame(1, 5, 1, get) + h2_frame(1, 4, 3, put) + h2_frame(0, 0, 3, 'hello ') + h2_frame(0, 1, 3, 'there'))
+    res = h2_read(s, 2)
+    s.close
+    assert_equal('88', res[1][0]) # indexed :status 200
+    obj = Oj.load(res[1][1], mode: :strict)
+    assert_equal('/tellme', obj['PATH_INFO'])
+    assert_equal('a=1', obj['QUERY_STRING'])
+    assert_equal('localhost:6467', obj['HTTP_HOST'])
+    assert_equal('hello there', res[3][1])
+  end
+
+  def test_http2_upgrade
+    s = TCPSocket.new('localhost', 6467)
+    s.write("GET /tellme HTTP/1.1\r\nHost: localhost\r\nConnection: Upgrade, HTTP2-Settings\r\nUpgrade: h2c\r\nHTTP2-Settings: AAMAAABkAARAAAAAAAIAAAAA\r\n\r\n")
+    assert_equal("HTTP/1.1 101 Switching Protocols\r\n", s.gets)
+    while "\r\n" != s.gets
+    end
+    s.write(H2_PREFACE + h2_frame(4, 0, 0, ''))
+    res = h2_read(s, 1)
+    s.close
+    assert_equal('88', res[1][0])
+    assert_equal('/tellme', Oj.load(res[1][1], mode: :strict)['PATH_INFO'])
+  end
+
+  def ws_connect(path)
+    s = TCPSocket.new('localhost', 6467)
+    s.write("GET #{path} HTTP/1.1\r\nHost: localhost\r\nUpgrade: websocket\r\nConnection: Upgrade\r\nSec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\nSec-WebSocket-Version: 13\r\n\r\n")
+    assert_match(/^HTTP\/1.1 101 /, s.gets)
+    while "\r\n" != s.gets
+    end
+    s
+  end
+
+  # A masked frame as a client sends it.
+  def ws_frame(op, data, fin=true)
+    data = data.b
+    mask = [0x12, 0x34, 0x56, 0x78]
+    head = [(fin ? 0x80 : 0) | op].pack('C')
+    if data.bytesize < 126
+      head << [0x80 | data.bytesize].pack('C')
+    elsif data.bytesize < 65536
+      head << [0xFE, data.bytesize].pack('Cn')
+    else
+      head << [0xFF, data.bytesize].pack('CQ>')
+    end
+    i = -1
+    head + mask.pack('C4') + data.bytes.map { |b| b ^ mask[(i += 1) % 4] }.pack('C*')
+  end
+
+  # Returns the opcode and payload of the next frame from the server. Text
+  # messages are echoed as binary since they are given to the handler as
+  # ASCII-8BIT strings.
+  def ws_read(s)
+    head = s.read(2).unpack('CC')
+    len = head[1] & 0x7F
+    if 126 == len
+      len = s.read(2).unpack1('n')
+    elsif 127 == len
+      len = s.read(8).unpack1('Q>')
+    end
+    [head[0] & 0x0F, 0 < len ? s.read(len) : '']
+  end
+
+  def test_ws_continuation
+    s = ws_connect('/ws')
+    s.write(ws_frame(1, 'hello', false) + ws_frame(0, ' ', false) + ws_frame(0, 'there'))
+    assert_equal([2, 'hello there'], ws_read(s))
+    s.write(ws_frame(2, "\x01\x02", false) + ws_frame(0, "\x03"))
+    assert_equal([2, "\x01\x02\x03"], ws_read(s))
+    s.close
+  end
+
+  def test_ws_ping_between_fragments
+    s = ws_connect('/ws')
+    s.write(ws_frame(1, 'one ', false) + ws_frame(9, 'ping') + ws_frame(0, 'two'))
+    assert_equal([10, 'ping'], ws_read(s))
+    assert_equal([2, 'one two'], ws_read(s))
+    s.close
+  end
+
+  # Frames that take more than one read and frames that share a read.
+  def test_ws_split_reads
+    s = ws_connect('/ws')
+    out = ws_frame(1, 'x' * 300) + ws_frame(1, 'short') + ws_frame(1, 'a', false) + ws_frame(0, 'b')
+    out.bytes.each_slice(7) { |b|
+      s.write(b.pack('C*'))
+      s.flush
+      sleep(0.001)
+    }
+    assert_equal([2, 'x' * 300], ws_read(s))
+    assert_equal([2, 'short'], ws_read(s))
+    assert_equal([2, 'ab'], ws_read(s))
+    big = 'y' * 70000
+    s.write(ws_frame(1, big) + ws_frame(1, 'after'))
+    assert_equal([2, big], ws_read(s))
+    assert_equal([2, 'after'], ws_read(s))
+    s.close
+  end
+
+  def test_ws_max_message
+    s = ws_connect('/ws')
+    s.write(ws_frame(1, 'z' * 60000, false) + ws_frame(0, 'z' * 60000))
+    begin
+      assert_nil(s.read(1))
+    rescue Errno::ECONNRESET
+      # closed before the data was read
+    end
+    s.close
+    20.times {
+      break if WsHandler.errors.include?('WebSocket message too large')
+      sleep(0.05)
+    }
+    assert_includes(WsHandler.errors, 'WebSocket message too large')
+  end
+
+  # Messages of at least ws_stream_min bytes are given to on_message_part as
+  # they arrive with no limit on the size while smaller ones still go to
+  # on_message.
+  def test_ws_message_part
+    s = ws_connect('/wspart')
+    data = (0...300000).map { |i| (i % 251).chr }.join
+    s.write(ws_frame(2, data[0, 40000], false))
+    s.write(ws_frame(0, data[40000..-1]))
+    op, got = ws_read(s)
+    cnt, got = got.split(' ', 2)
+    assert_equal(2, op)
+    assert_operator(cnt.to_i, :>, 1)
+    assert_equal(data.b, got.b)
+    s.write(ws_frame(1, 'small'))
+    assert_equal([2, 'small'], ws_read(s))
+    s.close
+  end
+
 end
@@ -9,6 +9,7 @@ end
 require 'minitest'
 require 'minitest/autorun'
 require 'net/http'
+require 'zlib'
 
 require 'agoo'
 
@@ -29,7 +30,8 @@ class StaticTest < Minitest::Test
 			  eval: true,
 			})
 
-    Agoo::Server.init(6469, 'root', thread_count: 1)
+    # index.html is big enough to be sent with sendfile, odd.odd is not.
+    Agoo::Server.init(6469, 'root', thread_count: 1, sendfile_min: 64)
     Agoo::Server.add_mime('odd', 'text/odd')
     Agoo::Server.start()
 
@@ -100,4 +102,121 @@ class StaticTest < Minitest::Test
     assert_equal("404", res.code)
   end
 
+  def test_conditional
+    uri = URI('http://localhost:6469/index.html')
+    res = Net::HTTP.get_response(uri)
+    etag = res['ETag']
+    last_mod = res['Last-Modified']
+    refute_nil(etag)
+    refute_nil(last_mod)
+
+    res = Net::HTTP.get_response(uri, 'If-None-Match' => etag)
+    assert_equal('304', res.code)
+    assert_nil(res.body)
+
+    res = Net::HTTP.get_response(uri, 'If-None-Match' => '"other"')
+    assert_equal('200', res.code)
+
+    res = Net::HTTP.get_response(uri, 'If-Modified-Since' => last_mod)
+    assert_equal('304', res.code)
+  end
+
+  def test_range
+    # index.html is sent from the file and something.txt from memory.
+    uri = URI('http://localhost:6469/index.html')
+    res = Net::HTTP.get_response(uri, 'Range' => 'bytes=0-14')
+    assert_equal('206', res.code)
+    assert_equal('bytes 0-14/91', res['Content-Range'])
+    assert_equal('<!DOCTYPE html>', res.body)
+
+    res = Net::HTTP.get_response(uri, 'Range' => 'bytes=-8')
+    assert_equal('206', res.code)
+    assert_equal("</html>\n", res.body)
+
+    uri = URI('http://localhost:6469/nest/something.txt')
+    res = Net::HTTP.get_response(uri, 'Range' => 'bytes=5-8')
+    assert_equal('206', res.code)
+    assert_equal('some', res.body)
+
+    res = Net::HTTP.get_response(uri, 'Range' => 'bytes=0-3,10-13')
+    assert_equal('206', res.code)
+    assert_match(%r{^multipart/byteranges; boundary=}, res['Content-Type'])
+    assert_match(/Content-Range: bytes 0-3\/16\r\n\r\nJust\r\n/, res.body)
+    assert_match(/Content-Range: bytes 10-13\/16\r\n\r\ntext\r\n/, res.body)
+
+    res = Net::HTTP.get_response(uri, 'Range' => 'bytes=100-')
+    assert_equal('416', res.code)
+    assert_equal('bytes */16', res['Content-Range'])
+
+    res = Net::HTTP.get_response(uri, 'Range' => 'bytes=5-8', 'If-Range' => '"stale"')
+    assert_equal('200', res.code)
+    assert_equal("Just some text.\n", res.body)
+  end
+
+  # Changes are picked up by a watcher on Linux. Elsewhere files are
+  # checked every few seconds.
+  def test_changed
+    skip unless RUBY_PLATFORM.include?('linux')
+    path = 'root/changing.txt'
+    uri = URI('http://localhost:6469/changing.txt')
+    File.write(path, 'first')
+    assert_equal('first', Net::HTTP.get(uri))
+    File.write(path, 'second')
+    content = nil
+    20.times {
+      sleep(0.05)
+      break if 'second' == (content = Net::HTTP.get(uri))
+    }
+    assert_equal('second', content)
+    File.delete(path)
+    res = nil
+    20.times {
+      sleep(0.05)
+      break if '404' == (res = Net::HTTP.get_response(uri)).code
+    }
+    assert_equal('404', res.code)
+  ensure
+    File.delete(path) if File.exist?(path)
+  end
+
+  def test_cache_stats
+    uri = URI('http://localhost:6469/odd.odd')
+    Net::HTTP.get(uri)
+    before = Agoo::Server.page_cache_stats
+    Net::HTTP.get(uri)
+    after = Agoo::Server.page_cache_stats
+    assert_equal(before[:hits] + 1, after[:hits])
+    assert_equal(before[:misses], after[:misses])
+    assert(0 < after[:count])
+    assert(0 < after[:bytes])
+  end
+
+  def test_encoded
+    uri = URI('http://localhost:6469/nest/pre.css')
+    res = Net::HTTP.get_response(uri, 'Accept-Encoding' => 'gzip, deflate')
+    assert_equal('gzip', res['Content-Encoding'])
+    assert_equal('Accept-Encoding', res['Vary'])
+    assert_equal(File.read('root/nest/pre.css'), Zlib.gunzip(res.body))
+    etag = res['ETag']
+
+    res = Net::HTTP.get_response(uri, 'Accept-Encoding' => 'gzip', 'If-None-Match' => etag)
+    assert_equal('304', res.code)
+
+    res = Net::HTTP.get_response(uri, 'Accept-Encoding' => 'identity')
+    assert_nil(res['Content-Encoding'])
+    refute_equal(etag, res['ETag'])
+    assert_equal(File.read('root/nest/pre.css'), res.body)
+
+    # Files sent from disk are not compressed on the connection loop, only
+    # served from a precompressed sibling.
+    uri = URI('http://localhost:6469/nest/long.txt')
+    res = Net::HTTP.get_response(uri, 'Accept-Encoding' => 'br;q=0, gzip;q=0.5')
+    assert_nil(res['Content-Encoding'])
+    assert_equal(File.read('root/nest/long.txt'), res.body)
+
+    res = Net::HTTP.get_response(uri, 'Accept-Encoding' => 'gzip;q=0')
+    assert_nil(res['Content-Encoding'])
+    assert_equal(File.read('root/nest/long.txt'), res.body)
+  end
+
 end